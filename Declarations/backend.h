@@ -8,12 +8,19 @@
 
 void print_cell(Cell *cell);
 void print_dependents(Cell *cell);
-int update_dependencies(Cell *curr_cell, bool need_new_dep, PairOfPair *new_pairs, Spreadsheet *sheet, Cell cellcopy);
-bool detect_cycle_dfs(Cell *cell, Spreadsheet *sheet, Vector *bin);
-bool check_circular_dependencies(Cell *curr_cell, Spreadsheet *sheet);
+int update_dependencies(CellContents *contents, bool need_new_dep, PairOfPair *new_pairs, Spreadsheet *sheet, const CellContents *old);
+bool check_circular_dependencies(const CellContents *cell, Spreadsheet *sheet);
 // void collect_dependents(Cell *curr_cell, Set *affected_cells, Spreadsheet *sheet);
-void update_dependents(Cell *curr_cell, Spreadsheet *sheet);
+void update_dependents(Spreadsheet *sheet, short row, short col);
+void recalc_formulas(Spreadsheet *sheet, const Vector *seeds);
+void batch_begin(Spreadsheet *sheet);
+void batch_record(Spreadsheet *sheet, const CellContents *old, int old_value, bool old_error);
+CalcStatus batch_commit(Spreadsheet *sheet);
+void batch_abort(Spreadsheet *sheet);
+void notify_value_change(Spreadsheet *sheet, short row, short col, int old_value, bool old_error);
 // void editCell(Spreadsheet *sheet);
-int evaluate_cell(Cell *cell, Spreadsheet *sheet);
+int evaluate_cell(Spreadsheet *sheet, short row, short col);
+int sleep_seconds(const Spreadsheet *sheet, short row, short col);
+bool run_expression(Spreadsheet *sheet, const int32_t *code, int code_size, short row, short col, int *result);
 
 #endif
\ No newline at end of file
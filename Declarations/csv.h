@@ -0,0 +1,20 @@
+#ifndef CSV_H
+#define CSV_H
+
+#include "header.h"
+#include "ds.h"
+
+// Bulk import of integer CSV data. Row k, field f of the file lands in cell
+// (row + k, col + f); an empty field leaves its cell alone, and a cell that held a
+// formula becomes a plain constant. Dependents are recalculated once, after the
+// whole block is written, or at commit inside a begin/commit batch.
+//
+// Returns STATUS_OK, ERR_IO if the file cannot be read, ERR_INVALID_RANGE if the
+// block does not fit the sheet, or ERR_SYNTAX if a field is not an integer. The
+// file is validated in full before any cell changes.
+CalcStatus csv_import(Spreadsheet *sheet, const char *path, short row, short col);
+
+// The "import <file> [at <cell>]" command; sets sheet->last_status
+void csv_import_command(Spreadsheet *sheet, char *args);
+
+#endif
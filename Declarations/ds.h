@@ -9,7 +9,9 @@ typedef struct Vector Vector;
 typedef struct Queue Queue;
 typedef struct Stack Stack;
 typedef struct AVLNode AVLNode;
+typedef struct RangeNode RangeNode;
 typedef struct Set Set;
+typedef struct NodePool NodePool;
 typedef struct Spreadsheet Spreadsheet;
 
 // Enums
@@ -23,7 +25,8 @@ typedef enum
     ERR_INVALID_RANGE,
     ERR_SYNTAX,
     ERR_OVERFLOW,
-    ERR_CIRCULAR_REFERENCE
+    ERR_CIRCULAR_REFERENCE,
+    ERR_IO
 } CalcStatus;
 
 typedef enum
@@ -41,6 +44,7 @@ typedef enum
     TYPE_REFERENCE,  // R
     TYPE_ARITHMETIC, // A
     TYPE_FUNCTION,   // F
+    TYPE_EXPRESSION, // X
 } CellType;
 
 typedef enum 
@@ -99,12 +103,158 @@ struct AVLNode {
     unsigned char height;
 };
 
+// Dependents container (16): the first few pairs live inline in the cell, mid-sized
+// sets spill to a sorted array from the node pool, large ones become an AVL tree.
+// The representation is implied by size, so no tag is stored.
+#define DEPSET_INLINE 3
+#define DEPSET_TREE_MIN 64
+#define DEPSET_STACK_DEPTH 48
+
+typedef struct {
+    union {
+        Pair items[DEPSET_INLINE]; // size <= DEPSET_INLINE
+        Pair* array;               // size <= DEPSET_TREE_MIN, sorted
+        AVLNode* tree;             // size > DEPSET_TREE_MIN
+    } u;
+    unsigned int size;
+}__attribute__((packed, aligned(2))) DepSet;
+
 // Pair of Pair structure(8)
 typedef struct {
     Pair first;
     Pair second;
 } PairOfPair;
 
+// Node pool: slabs carved into fixed-size objects, one size class per object size.
+// Released objects go on an intrusive free list and are reused before the slab grows.
+#define POOL_NUM_CLASSES 6
+#define POOL_SLAB_BYTES 65536
+
+typedef struct PoolSlab {
+    struct PoolSlab* next;
+} PoolSlab;
+
+typedef struct {
+    size_t obj_size;
+    void* free_list;     // released objects, linked through their first word
+    PoolSlab* slabs;
+    char* bump;          // next never-used object in the newest slab
+    char* bump_end;
+    size_t capacity;     // objects carved so far across all slabs
+    size_t live;
+} PoolClass;
+
+struct NodePool {
+    PoolClass classes[POOL_NUM_CLASSES];
+    size_t live;         // objects handed out, all classes together
+    size_t peak;         // high-water mark of live
+};
+
+typedef struct {
+    size_t live;         // objects handed out
+    size_t free;         // objects sitting in slabs, ready for reuse
+    size_t peak;         // high-water mark of live
+    size_t bytes;        // slab memory held
+} PoolStats;
+
+// Range index node: interval tree over the top row of each rectangle, augmented
+// with the row/column extent of its subtree so stabbing queries can prune
+struct RangeNode {
+    PairOfPair range;   // rectangle read by the formula
+    Pair owner;         // formula cell reading the rectangle
+    short max_row;      // largest range.second.i in this subtree
+    short min_col;      // smallest range.first.j in this subtree
+    short max_col;      // largest range.second.j in this subtree
+    struct RangeNode* left;
+    struct RangeNode* right;
+    unsigned char height;
+};
+
+// Running aggregate of the rectangle read by one 'F' cell, kept in a side table and
+// updated by value deltas so SUM/AVG/STDEV need not rescan. sum and sum_sq wrap
+// exactly like the int accumulators of a full rescan.
+typedef struct {
+    uint32_t sum;
+    uint32_t sum_sq;
+    int err_count;      // cells in the rectangle with has_error set
+    int next_free;      // free-list link while the slot is unused
+    bool valid;         // false until the owner's next full rescan
+} RangeAggregate;
+
+// Instruction set of the compiled expressions held by 'X' cells. Each instruction
+// is one opcode word followed by its operands; a cell operand is one packed word,
+// see expr_pack, holding the cell's offset from the formula's own cell. The code
+// runs on a stack of int values.
+typedef enum
+{
+    EX_CONST,   // value: push it
+    EX_CELL,    // cell: push its value
+    EX_RANGE,   // function, top-left, bottom-right: push MIN/MAX/AVG/SUM/STDEV of the rectangle
+    EX_LIST,    // function, n: pop n values, push their MIN/MAX/AVG/SUM/STDEV
+    EX_NEG,     // negate the top
+    EX_ADD,     // pop b, pop a, push a op b
+    EX_SUB,
+    EX_MUL,
+    EX_DIV
+} ExprOp;
+
+#define EXPR_MAX_DEPTH 64   // value stack of the interpreter
+
+static inline int32_t expr_pack(short row_offset, short col_offset) {
+    return (int32_t)(((uint32_t)(uint16_t)row_offset << 16) | (uint16_t)col_offset);
+}
+
+static inline Pair expr_unpack(int32_t word) {
+    Pair p = {(short)(uint16_t)((uint32_t)word >> 16), (short)(uint16_t)word};
+    return p;
+}
+
+// Compiled expression of an 'X' cell with the cells and rectangles it reads, each
+// listed once, all as offsets from the cell. Slots are reference counted: the
+// template using it holds one reference, and so does every edit still in flight
+// or that may be rolled back to it.
+typedef struct {
+    int32_t *code;      // NULL while the slot is unused
+    int code_size;      // words
+    Pair *refs;         // single cells read
+    int num_refs;
+    PairOfPair *ranges; // rectangles read by EX_RANGE
+    int num_ranges;
+    int ref_count;
+    int next_free;      // free-list link while the slot is unused
+} Program;
+
+// Absolute cell of an offset, and rectangle of a pair of offsets, for the cell at (row, col)
+static inline Pair offset_at(Pair offset, short row, short col) {
+    Pair p = {(short)(row + offset.i), (short)(col + offset.j)};
+    return p;
+}
+
+static inline PairOfPair rect_at(PairOfPair offsets, short row, short col) {
+    PairOfPair r = {offset_at(offsets.first, row, col), offset_at(offsets.second, row, col)};
+    return r;
+}
+
+// Min/max segment tree over the values of one column, built while at least one
+// MIN/MAX formula reads the column. Leaf for row r is at index rows + r.
+typedef struct {
+    int *min;           // 2 * rows entries, NULL while unused
+    int *max;
+    int refs;           // MIN/MAX formulas whose rectangle covers the column
+    char lock;          // spin lock; parallel recalc may update a column concurrently
+} ColumnExtrema;
+
+// Optional 2D Fenwick trees over cell values, squared values and error flags,
+// 1-based with (rows + 1) x (cols + 1) entries. Any rectangle total is then four
+// prefix lookups, at the price of an O(log rows * log cols) update per change.
+typedef struct {
+    uint32_t *sum;
+    uint32_t *sum_sq;
+    int *errors;
+    char lock;          // spin lock; a query must not see half of a concurrent update
+    bool enabled;
+} RangeSums;
+
 // Cell structure definition(40)void queue_init(Queue* queue, size_t capacity);
 // bool queue_is_full(Queue* queue);
 // bool queue_is_empty(Queue* queue);
@@ -124,60 +274,147 @@ typedef struct {
 // void stack_iterator_init(StackIterator* iterator, Stack* stack);
 // bool stack_iterator_has_next(StackIterator* iterator);
 // Pair* stack_iterator_next(StackIterator* iterator);
+// Operand of an arithmetic cell, or the aggregate of a range function cell
+typedef union {
+    struct {  
+        Operation op; //(3)
+        int constant; //(32)
+    } arithmetic;
+
+    struct {  
+        char func_name; //(4)
+        int agg_slot;   // index into sheet->aggregates
+    } function;
+
+    struct {
+        int program;    // index into sheet->programs
+    } expression;
+} OpData;
+
+// Marks a missing operand in the offsets of a template
+#define REL_NONE SHRT_MIN
+
+// Shape of a formula relative to the cell holding it, R1C1 style: the cells and
+// rectangle it reads are stored as offsets from that cell, so a column filled
+// down with the same formula shares a single template. Interned by content in
+// sheet->templates; the template id also names the family of cells sharing it.
+typedef struct {
+    OpData op_data;          // function.agg_slot unused, see Formula
+    PairOfPair offsets;      // dependencies minus the cell's position, REL_NONE if absent
+    char type;               // 'A', 'R', 'F' or 'X'
+    unsigned int hash;
+    int ref_count;           // formula cells using it
+    int next;                // hash chain while used, free-list link while not
+} FormulaTemplate;
+
+// Per-cell part of a formula, kept in sheet->formulas so constant cells carry none of it
+typedef struct {
+    int template;            // index into sheet->templates; free-list link while the slot is unused
+    int topo_order;          // position in sheet->calc_order, -1 until placed
+    int agg_slot;            // 'F' cells: index into sheet->aggregates
+} Formula;
+
+// Grid cell. The value and error flag live in the value/error planes of its tile
+// (see get_cell_value and friends), the formula in sheet->formulas. An all-zero
+// cell is an empty constant, so zero-filled memory needs no initialisation.
 struct Cell {
-    int value;   //(32)
-    short row;   //(10.5)
-    short col;   //(15.5)
-    int topo_order; //(32)
-    char type;  //(2)
-    char cell_state; //(2) 
-    bool is_sleep; //(1)
-    bool has_error; //(1)
-    union {
-        struct {  
-            Operation op; //(3)
-            int constant; //(32)
-        } arithmetic;
-
-        struct {  
-            char func_name; //(4)
-        } function;
-    } op_data;
-    
-    AVLNode* dependents;  //(64)
-    PairOfPair dependencies; //(52)
-}__attribute__((packed));
-
-
-// Converting it to (32)
-// value, topo_order, node* remains intact - (16 bytes)
-// is-1(1) + row(10)+col(15)+state(2)+type(2)+is_sleep(1)+has_error(1) = 32 bits = (4 bytes)
-// Operation code ko bahar nikal ke dependencies ke sath bitmask kar dete hain
-// 52+3 = 55 -> 64 (8 bytes)
-// andar ke op_data ka size 32 = (4 bytes)
-// jab -1 mark karna hoga to fir saare bits 1 kardenge row ke so that we can identify ki -1 hai ya nahi
-
-typedef struct Cell1{
-    int value;      //(4)
-    int topo_order; //(4)
-    AVLNode* dependents; //(8)
-    union {
-        struct {  
-            int constant; //(4)
-        } arithmetic;
+    DepSet dependents;  // cells reading this one directly
+    int formula;        // index into sheet->formulas, 0 for a constant cell
+    char type;          // 0 reads as 'C', see cell_type
+    bool is_sleep;
+}__attribute__((packed, aligned(2)));
+
+static inline char cell_type(const Cell* cell) {
+    return cell->type ? cell->type : 'C';
+}
+
+// Decoded contents of one cell: what the parser produces and what the engine
+// checks for cycles before anything is written back to the sheet
+typedef struct {
+    short row;
+    short col;
+    char type;
+    bool is_sleep;
+    OpData op_data;
+    PairOfPair dependencies;
+} CellContents;
+
+// One edit made inside a begin/commit batch: what the cell held before it
+typedef struct {
+    CellContents contents;
+    int value;
+    bool has_error;
+} BatchUndo;
 
-        struct {  
-            char func_name; //(1)
-        } function;
-    } op_data;
-    u_int32_t nrctsle; //(4)
-    uint64_t nrcnrco;  //(8)
-}__attribute__((packed)) Cell1;
+// Edits between "begin" and "commit" change cells and dependency sets right away,
+// but cycle checks, calc_order and recalculation wait for the outermost commit
+typedef struct {
+    int depth;          // nesting of open begins, 0 outside a batch
+    BatchUndo *undo;    // oldest first; a failed commit replays it backwards
+    size_t undo_size;
+    size_t undo_capacity;
+    Vector dirty;       // cells edited in the batch, possibly repeated
+} Batch;
+
+// The grid is cut into TILE_SIZE x TILE_SIZE tiles. In the default GRID_TILED mode
+// they are allocated on first write, and a missing tile reads as empty constants
+// with value 0 and no error. GRID_FLAT lays every tile out in one anonymous
+// mapping, addressed by arithmetic; pages nobody writes stay uncommitted zeros.
+#define TILE_SHIFT 6
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_MASK (TILE_SIZE - 1)
+
+// Row-major within the tile, so each tile row is one contiguous run of the planes
+typedef struct {
+    int values[TILE_SIZE * TILE_SIZE];
+    bool errors[TILE_SIZE * TILE_SIZE];
+    Cell cells[TILE_SIZE * TILE_SIZE];
+} Tile;
+
+typedef enum {
+    GRID_TILED,
+    GRID_FLAT
+} GridMode;
 
 
 // Spreadsheet structure
 struct Spreadsheet{
-    Cell **cells;
+    Tile **tiles;                 // GRID_TILED: tile_rows x tile_cols, NULL until first written
+    Tile *grid;                   // GRID_FLAT: every tile in one mapping, else NULL
+    size_t grid_bytes;
+    int tile_rows;
+    int tile_cols;
+    int tiles_used;               // tiles allocated so far (GRID_TILED only)
+    RangeNode *range_dependents;  // formulas reading a whole rectangle ('F' and 'X' cells)
+    NodePool pool;                // backing store for every tree node of the sheet
+    unsigned int *visit_mark;     // per-cell epoch of the last graph walk that reached it
+    unsigned int visit_epoch;     // current walk; bumping it clears every mark at once
+    Vector walk_stack;            // reusable explicit stack for graph walks
+    Vector calc_order;            // formula cells in evaluation order, see topo_order
+    int *recalc_heap;             // dirty chain positions during update_dependents
+    int recalc_heap_cap;
+    int *recalc_slot;             // per-cell index into recalc_cells (parallel recalc only)
+    Vector recalc_cells;          // dirty cells of the current parallel recalc
+    Vector recalc_edges;          // their dependents, grouped per dirty cell
+    Formula *formulas;            // payload of every non-constant cell, see Cell.formula
+    int formula_capacity;
+    int formula_free;             // head of the free slot list, -1 if none
+    FormulaTemplate *templates;   // shared formula shapes, see Formula.template
+    int template_capacity;
+    int template_free;            // head of the free slot list, -1 if none
+    int *template_buckets;        // hash table heads, -1 if empty
+    int template_bucket_count;    // power of two, at least template_capacity
+    int templates_used;
+    int order_holes;              // calc_order entries of cells that became constants
+    RangeAggregate *aggregates;   // one slot per 'F' cell, see Formula.agg_slot
+    int agg_capacity;
+    int agg_free;                 // head of the free slot list, -1 if none
+    Program *programs;            // compiled expressions of 'X' cells, see op_data.expression
+    int program_capacity;
+    int program_free;             // head of the free slot list, -1 if none
+    ColumnExtrema *col_extrema;   // per-column MIN/MAX index, allocated on first use
+    RangeSums range_sums;         // rectangle totals for 'F' cells, off by default
+    Batch batch;                  // open begin/commit transaction, if any
     int totalRows;
     int totalCols;
     int scroll_row;
@@ -188,6 +425,103 @@ struct Spreadsheet{
     double last_processing_time;
 };
 
+extern const Cell EMPTY_CELL;
+Tile* tile_alloc(Spreadsheet* sheet, int tile);
+
+static inline int tile_index(const Spreadsheet* sheet, int row, int col) {
+    return (row >> TILE_SHIFT) * sheet->tile_cols + (col >> TILE_SHIFT);
+}
+
+static inline int tile_offset(int row, int col) {
+    return ((row & TILE_MASK) << TILE_SHIFT) | (col & TILE_MASK);
+}
+
+// Tile number t, NULL if it does not exist yet
+static inline Tile* tile_at(const Spreadsheet* sheet, int t) {
+    return sheet->grid ? sheet->grid + t : sheet->tiles[t];
+}
+
+static inline Tile* get_tile(const Spreadsheet* sheet, int row, int col) {
+    return tile_at(sheet, tile_index(sheet, row, col));
+}
+
+// Tile of (row, col), allocated if needed. Only the command path writes new
+// tiles; recalculation touches formula cells, whose tiles already exist.
+static inline Tile* touch_tile(Spreadsheet* sheet, int row, int col) {
+    Tile* t = get_tile(sheet, row, col);
+    return t ? t : tile_alloc(sheet, tile_index(sheet, row, col));
+}
+
+static inline const Cell* get_cell(const Spreadsheet* sheet, int row, int col) {
+    Tile* t = get_tile(sheet, row, col);
+    return t ? &t->cells[tile_offset(row, col)] : &EMPTY_CELL;
+}
+
+static inline Cell* touch_cell(Spreadsheet* sheet, int row, int col) {
+    return &touch_tile(sheet, row, col)->cells[tile_offset(row, col)];
+}
+
+// Hot per-cell state. Scans over values (range aggregates, rendering) touch only
+// the planes and never pull formula metadata through the cache.
+static inline int get_cell_value(const Spreadsheet* sheet, int row, int col) {
+    Tile* t = get_tile(sheet, row, col);
+    return t ? t->values[tile_offset(row, col)] : 0;
+}
+
+// Writing the default into a missing tile leaves it missing
+static inline void set_cell_value(Spreadsheet* sheet, int row, int col, int value) {
+    Tile* t = get_tile(sheet, row, col);
+    if (!t && value == 0)
+        return;
+    if (!t)
+        t = tile_alloc(sheet, tile_index(sheet, row, col));
+    t->values[tile_offset(row, col)] = value;
+}
+
+static inline bool get_cell_error(const Spreadsheet* sheet, int row, int col) {
+    Tile* t = get_tile(sheet, row, col);
+    return t ? t->errors[tile_offset(row, col)] : false;
+}
+
+static inline void set_cell_error(Spreadsheet* sheet, int row, int col, bool has_error) {
+    Tile* t = get_tile(sheet, row, col);
+    if (!t && !has_error)
+        return;
+    if (!t)
+        t = tile_alloc(sheet, tile_index(sheet, row, col));
+    t->errors[tile_offset(row, col)] = has_error;
+}
+
+// Formula payload of a cell, NULL for a constant
+static inline Formula* get_formula(const Spreadsheet* sheet, int row, int col) {
+    int slot = get_cell(sheet, row, col)->formula;
+    return slot == 0 ? NULL : &sheet->formulas[slot];
+}
+
+static inline const FormulaTemplate* get_template(const Spreadsheet* sheet, const Formula* f) {
+    return &sheet->templates[f->template];
+}
+
+// Absolute dependencies of a template used by (row, col); -1 where there are none
+static inline PairOfPair template_dependencies(const FormulaTemplate* t, short row, short col) {
+    PairOfPair d = {{-1, -1}, {-1, -1}};
+    if (t->offsets.first.i != REL_NONE) {
+        d.first.i = row + t->offsets.first.i;
+        d.first.j = col + t->offsets.first.j;
+    }
+    if (t->offsets.second.i != REL_NONE) {
+        d.second.i = row + t->offsets.second.i;
+        d.second.j = col + t->offsets.second.j;
+    }
+    return d;
+}
+
+// Position of a cell in calc_order; constants have none
+static inline int get_topo_order(const Spreadsheet* sheet, int row, int col) {
+    Formula* f = get_formula(sheet, row, col);
+    return f ? f->topo_order : -1;
+}
+
 // Vector iterator
 typedef struct {
     Vector* vector;
@@ -195,6 +529,16 @@ typedef struct {
 } VectorIterator;
 
 
+// DepSet iterator: walks inline/array storage directly, the tree with an explicit stack
+typedef struct {
+    const Pair* items;
+    size_t index;
+    size_t count;
+    AVLNode* stack[DEPSET_STACK_DEPTH];
+    int top;
+} DepSetIterator;
+
+
 // Queue iterator
 // typedef struct {
 //     Queue* queue;
@@ -256,23 +600,69 @@ Pair* vector_iterator_next(VectorIterator* iterator);
 // void set_iterator_free(SetIterator* iterator);
 
 
-AVLNode* avl_create_node(short row, short col);
-AVLNode* avl_insert(AVLNode* root, short row, short col);
+void pool_init(NodePool* pool);
+void* pool_alloc(NodePool* pool, size_t size);
+void pool_release(NodePool* pool, void* ptr, size_t size);
+void pool_stats(const NodePool* pool, PoolStats* stats);
+void pool_destroy(NodePool* pool);
+
+AVLNode* avl_create_node(NodePool* pool, short row, short col);
+AVLNode* avl_insert(NodePool* pool, AVLNode* root, short row, short col);
 Pair* avl_find(AVLNode* root, short row, short col);
-AVLNode* avl_remove(AVLNode* root, short row, short col);
-void avl_free(AVLNode* root);
+AVLNode* avl_remove(NodePool* pool, AVLNode* root, short row, short col);
+void avl_free(NodePool* pool, AVLNode* root);
+void avl_collect(AVLNode* root, Vector* out);
+
+RangeNode* range_insert(NodePool* pool, RangeNode* root, PairOfPair range, short row, short col);
+RangeNode* range_remove(NodePool* pool, RangeNode* root, PairOfPair range, short row, short col);
+void range_stab(RangeNode* root, short row, short col, Vector* out);
+void range_overlap(RangeNode* root, PairOfPair rect, Vector* out);
+void range_visit(RangeNode* root, short row, short col, void (*visit)(void* ctx, Pair owner), void* ctx);
+void range_free(NodePool* pool, RangeNode* root);
+
+void depset_init(DepSet* set);
+void depset_insert(NodePool* pool, DepSet* set, short row, short col);
+void depset_remove(NodePool* pool, DepSet* set, short row, short col);
+bool depset_find(const DepSet* set, short row, short col);
+unsigned int depset_size(const DepSet* set);
+void depset_free(NodePool* pool, DepSet* set);
+void depset_collect(const DepSet* set, Vector* out);
+
+void depset_iterator_init(DepSetIterator* iterator, const DepSet* set);
+bool depset_iterator_has_next(DepSetIterator* iterator);
+Pair* depset_iterator_next(DepSetIterator* iterator);
 
 // void topological_sort_util(Cell* cell, Set* adjList, Set* visited, Vector* sorted, Spreadsheet *sheet);
-void topologic_util(Cell* currcell, Vector* adjList, char* visited, Vector* sorted, Spreadsheet* sheet);
-void topological_sort(Vector* adjList, int numVertices, Pair** cell_map, Vector* result, Spreadsheet* sheet);
 
-void create_cell(short row, short col, Cell* Cell);
-void free_cell(Cell* cell);
+void create_cell(Cell* cell);
+void free_cell(NodePool* pool, Cell* cell);
 
 short colNameToNumber(const char *colName);
 void colNumberToName(short colNumber, char *colName);
 // void print_cell(Cell* cell);
 Spreadsheet* create_spreadsheet(short rows, short cols);
+Spreadsheet* create_spreadsheet_mode(short rows, short cols, GridMode mode);
+unsigned int sheet_next_epoch(Spreadsheet* sheet);
+int formula_alloc(Spreadsheet* sheet);
+void formula_release(Spreadsheet* sheet, int slot);
+void load_cell_contents(const Spreadsheet* sheet, short row, short col, CellContents* out);
+int aggregate_alloc(Spreadsheet* sheet);
+void aggregate_release(Spreadsheet* sheet, int slot);
+int program_create(Spreadsheet* sheet, const int32_t* code, int code_size);
+bool program_fits(const Spreadsheet* sheet, const Program* prog, short row, short col);
+void program_retain(Spreadsheet* sheet, int slot);
+void program_release(Spreadsheet* sheet, int slot);
+int template_intern(Spreadsheet* sheet, const CellContents* contents);
+void template_release(Spreadsheet* sheet, int slot);
+void extrema_acquire(Spreadsheet* sheet, short col);
+void extrema_release(Spreadsheet* sheet, short col);
+void extrema_rebuild(Spreadsheet* sheet, short col);
+void extrema_update(Spreadsheet* sheet, short row, short col, int value);
+void extrema_query(Spreadsheet* sheet, short r1, short r2, short col, int* min_val, int* max_val);
+void range_sums_enable(Spreadsheet* sheet);
+void range_sums_disable(Spreadsheet* sheet);
+void range_sums_add(Spreadsheet* sheet, short row, short col, uint32_t value_delta, uint32_t square_delta, int error_delta);
+void range_sums_query(Spreadsheet* sheet, short r1, short c1, short r2, short c2, uint32_t* sum, uint32_t* sum_sq, int* errors);
 void print_spreadsheet(Spreadsheet* sheet);
 void free_spreadsheet(Spreadsheet* sheet);
 
@@ -0,0 +1,21 @@
+#ifndef FILL_H
+#define FILL_H
+
+#include "header.h"
+#include "ds.h"
+
+// Write one formula into every cell of region. The formula reads as written in the
+// top-left cell; every other cell gets it with its references moved by the cell's
+// offset from there, so the whole region shares a single template. Dependents are
+// recalculated once, after the whole region is written, or at commit inside a
+// begin/commit batch.
+//
+// Returns STATUS_OK, the parser's status if the formula does not parse,
+// ERR_INVALID_RANGE if a moved reference would leave the sheet, or
+// ERR_CIRCULAR_REFERENCE if the filled cells close a loop. On error no cell changes.
+CalcStatus fill_range(Spreadsheet *sheet, PairOfPair region, const char *formula);
+
+// The "fill <cell>:<cell> = <formula>" command; sets sheet->last_status
+void fill_command(Spreadsheet *sheet, char *args);
+
+#endif
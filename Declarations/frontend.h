@@ -13,11 +13,33 @@
 // Terminal control sequences
 #define CLEAR_SCREEN "\033[H\033[J"
 
+#define CELL_TEXT_MAX 12          // "-2147483648" and its terminator
+#define FRAME_BYTES 4096          // one frame, full or differential, with its escapes
+
+// What a terminal shows of the viewport: which part of the sheet and the text of
+// every visible cell. A zeroed frame has nothing drawn yet.
+typedef struct {
+    bool drawn;
+    int scroll_row, scroll_col;
+    int rows, cols;
+    char text[VIEWPORT_ROWS][VIEWPORT_COLS][CELL_TEXT_MAX];
+} ViewportFrame;
+
+// Draw the viewport to stdout in a single write. On a terminal only the cells whose
+// text changed since the last frame are redrawn.
 void display_viewport(Spreadsheet *sheet);
 
+// Draw the viewport to fd in a single write. Without a frame the grid goes out as
+// plain lines. With one, fd is a terminal showing that frame: it is cleared and
+// redrawn in full if nothing is drawn yet or the visible part of the sheet moved,
+// otherwise only the changed cells are rewritten in place. Either way the cursor is
+// left on the line below the grid, and the frame records what is now shown.
+void render_viewport(Spreadsheet *sheet, int fd, ViewportFrame *frame);
+
 void scroll_to(Spreadsheet *sheet, int row, int col);
 
 void handle_scroll(Spreadsheet *sheet, char direction);
 void run_ui(Spreadsheet *sheet);
+int run_batch(Spreadsheet *sheet, const char *path);
 
 #endif
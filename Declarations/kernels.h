@@ -0,0 +1,34 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include "header.h"
+#include "ds.h"
+
+// Running totals of a range scan. Sums are 64-bit; callers that need the old int
+// semantics truncate, which gives the same result as wrapping int accumulation.
+typedef struct {
+    int64_t sum;
+    uint64_t sum_sq;
+    int min_val;
+    int max_val;
+    int64_t errors;     // number of set error flags
+} RangeTotals;
+
+typedef void (*RangeKernel)(const int *values, const bool *errors, size_t n, RangeTotals *acc);
+
+void range_totals_init(RangeTotals *acc);
+
+// Fold n contiguous values and their error flags into acc, using the widest
+// instruction set the CPU supports (chosen once, on first call)
+void kernel_range_totals(const int *values, const bool *errors, size_t n, RangeTotals *acc);
+const char *kernel_isa_name(void);
+
+// Fold the rectangle (r1, c1)..(r2, c2) of the sheet into acc with kernel, one
+// tile row at a time. Missing tiles are skipped: they only add zeros.
+void kernel_rect_totals(const Spreadsheet *sheet, short r1, short c1, short r2, short c2, RangeKernel kernel, RangeTotals *acc);
+
+// The individual variants, for tests and benchmarks; NULL when not available
+void kernel_range_totals_scalar(const int *values, const bool *errors, size_t n, RangeTotals *acc);
+RangeKernel kernel_variant(const char *isa);
+
+#endif
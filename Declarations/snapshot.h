@@ -0,0 +1,78 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "header.h"
+#include "ds.h"
+
+// Binary sheet snapshot, version 3. All sections are 8-byte aligned so a loader can
+// read the records in place from a read-only mapping of the file:
+//
+//   SnapshotHeader
+//   SnapshotTile  x num_tiles       non-empty tiles: values and error planes
+//   SnapshotCell  x num_formulas    formula cells, in calc_order
+//   SnapshotCell  x num_sleepers    constant cells with the sleep flag
+//   SnapshotEdge  x num_edges       single-cell dependents, grouped by precedent
+//   int32_t       x code words      programs of 'X' cells, each its length and then its code
+//
+// The code section runs to file_bytes and holds each program once, in the relative
+// form of FormulaTemplate; cells sharing a template point at the same program.
+// Version 1 files, which have no 'X' cells, end with the edges and still load;
+// version 2 files, whose code held absolute addresses, do not. Numbers are stored in the byte order of the
+// machine that wrote the file; a loader on a machine with the other order rejects it.
+#define SNAPSHOT_MAGIC "GODSHEET"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define SNAPSHOT_RANGE_SUMS 1u          // flags: Fenwick range sums were enabled
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    int32_t rows;
+    int32_t cols;
+    uint32_t tile_size;
+    uint32_t flags;
+    uint64_t num_tiles;
+    uint64_t num_formulas;
+    uint64_t num_sleepers;
+    uint64_t num_edges;
+    uint64_t tiles_offset;
+    uint64_t cells_offset;          // formulas, then sleepers
+    uint64_t edges_offset;
+    uint64_t file_bytes;
+} SnapshotHeader;
+
+typedef struct {
+    uint32_t tile;                  // index into the tile_rows x tile_cols table
+    uint32_t reserved;
+    int32_t values[TILE_SIZE * TILE_SIZE];
+    uint8_t errors[TILE_SIZE * TILE_SIZE];
+} SnapshotTile;
+
+typedef struct {
+    int16_t row, col;
+    char type;                      // 'A', 'R', 'F', 'X', or 'C' for a sleeper
+    uint8_t is_sleep;
+    char op;                        // Operation for 'A', function letter for 'F'
+    uint8_t reserved;
+    int32_t constant;               // constant of 'A', program's word offset in the code section for 'X'
+    int16_t deps[4];                // dependencies: first.i, first.j, second.i, second.j
+} SnapshotCell;
+
+typedef struct {
+    int16_t row, col;               // precedent
+    int16_t dep_row, dep_col;       // formula reading it
+} SnapshotEdge;
+
+// 0 on success, -1 if the file could not be written or a batch is open
+int snapshot_save(const Spreadsheet *sheet, const char *path);
+
+// A new sheet with the given grid layout, or NULL if the file is missing or invalid
+Spreadsheet *snapshot_load(const char *path, GridMode mode);
+
+// Replace the contents of sheet with a snapshot, keeping its grid layout and
+// display settings. On failure, or while a batch is open, the sheet is left
+// untouched and -1 is returned.
+int snapshot_load_into(Spreadsheet *sheet, const char *path);
+
+#endif
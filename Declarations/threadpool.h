@@ -0,0 +1,36 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include "header.h"
+
+#define THREADPOOL_MAX_THREADS 64
+#define THREADPOOL_DEFAULT_MIN_NODES 1024   // smaller graphs run on the caller, lock-free
+
+// A DAG of num_nodes tasks in CSR form: the successors of node n are
+// targets[offsets[n] .. offsets[n+1]). in_degree holds each node's number of
+// predecessors and is consumed by the run. run(ctx, n) is called exactly once per
+// node, after run has returned for all of its predecessors.
+typedef struct {
+    int num_nodes;
+    const int *offsets;
+    const int *targets;
+    int *in_degree;
+    void (*run)(void *ctx, int node);
+    void *ctx;
+} TaskGraph;
+
+// Start a persistent pool of `threads` workers (the calling thread counts as one).
+// Graphs with fewer than min_nodes nodes are run serially on the caller.
+void threadpool_start(int threads, int min_nodes);
+void threadpool_stop(void);
+int threadpool_size(void);
+
+// Run a task graph to completion, in parallel with work stealing if the pool is
+// running and the graph is large enough
+void threadpool_run_graph(const TaskGraph *graph);
+
+// Run count independent tasks, in parallel whenever the pool is running. Meant for
+// a few coarse chunks of work, so min_nodes does not apply.
+void threadpool_run_each(int count, void (*run)(void *ctx, int node), void *ctx);
+
+#endif
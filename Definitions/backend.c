@@ -1,429 +1,1483 @@
+#define _POSIX_C_SOURCE 200809L
 #include "../Declarations/ds.h"
 #include "../Declarations/parser.h"
 #include "../Declarations/backend.h"
 #include "../Declarations/frontend.h"
+#include "../Declarations/threadpool.h"
+#include "../Declarations/kernels.h"
+#include <time.h>
 // valgrind --leak-check=full --show-leak-kinds=all --track-origins=yes --verbose --log-file=valgrind-out.txt ./bin/sheet 10 10
 // valgrind --leak-check=full --show-leak-kinds=all --track-origins=yes --verbose --trace-malloc=yes --trace-children=yes --tool=memcheck --log-file=valgrind-out.txt ./bin/sheet 10 10
 // valgrind --leak-check=full --show-leak-kinds=all --track-origins=yes --keep-stacktraces=alloc-and-free --verbose --trace-malloc=yes --trace-children=yes --tool=memcheck --log-file=valgrind-out.txt ./bin/sheet 10 10
 
+static bool uses_extrema(const CellContents *cell)
+{
+    return cell->type == 'F' && (cell->op_data.function.func_name == 'A' || cell->op_data.function.func_name == 'B');
+}
+
+// MIN/MAX formulas pin the column trees under their rectangle; acquire before
+// releasing so an unchanged rectangle keeps its trees
+static void retarget_extrema(Spreadsheet *sheet, const CellContents *cell, const CellContents *old)
+{
+    if (uses_extrema(cell))
+        for (short c = cell->dependencies.first.j; c <= cell->dependencies.second.j; c++)
+            extrema_acquire(sheet, c);
+    if (uses_extrema(old))
+        for (short c = old->dependencies.first.j; c <= old->dependencies.second.j; c++)
+            extrema_release(sheet, c);
+}
+
+static void order_remove(Spreadsheet *sheet, int pos);
+
+// Write committed contents back to the sheet. A cell that became a constant gives
+// up its formula slot and its place in calc_order; a formula swaps its template for
+// the one interned for contents. An 'X' cell's program reference in contents is
+// given up, the template holding its own.
+static void store_contents(Spreadsheet *sheet, const CellContents *contents)
+{
+    // A plain constant in a missing tile is what the tile already reads as
+    if (contents->type == 'C' && !contents->is_sleep && !get_tile(sheet, contents->row, contents->col))
+        return;
+    Cell *cell = touch_cell(sheet, contents->row, contents->col);
+    cell->type = contents->type;
+    cell->is_sleep = contents->is_sleep;
+    if (contents->type == 'C')
+    {
+        if (cell->formula != 0)
+        {
+            if (sheet->formulas[cell->formula].topo_order >= 0)
+                order_remove(sheet, sheet->formulas[cell->formula].topo_order);
+            formula_release(sheet, cell->formula);
+            cell->formula = 0;
+        }
+        return;
+    }
+    Formula *f = &sheet->formulas[cell->formula];
+    int old_template = f->template;
+    f->template = template_intern(sheet, contents);
+    if (old_template >= 0)
+        template_release(sheet, old_template);
+    if (contents->type == 'F')
+        f->agg_slot = contents->op_data.function.agg_slot;
+    else if (contents->type == 'X')
+        program_release(sheet, contents->op_data.expression.program);
+}
+
+// Add (or drop) an expression cell to the dependents of every cell it reads and
+// its rectangles to the range index
+static void link_expression(Spreadsheet *sheet, const CellContents *cell, bool link)
+{
+    const Program *prog = &sheet->programs[cell->op_data.expression.program];
+    for (int k = 0; k < prog->num_refs; k++)
+    {
+        Pair ref = offset_at(prog->refs[k], cell->row, cell->col);
+        DepSet *deps = &touch_cell(sheet, ref.i, ref.j)->dependents;
+        if (link)
+            depset_insert(&sheet->pool, deps, cell->row, cell->col);
+        else
+            depset_remove(&sheet->pool, deps, cell->row, cell->col);
+    }
+    for (int k = 0; k < prog->num_ranges; k++)
+    {
+        PairOfPair rect = rect_at(prog->ranges[k], cell->row, cell->col);
+        sheet->range_dependents = link
+            ? range_insert(&sheet->pool, sheet->range_dependents, rect, cell->row, cell->col)
+            : range_remove(&sheet->pool, sheet->range_dependents, rect, cell->row, cell->col);
+    }
+}
+
 // Function to update the dependencies of a cell: 1 -> no cycle/updated successfully, 0 -> cycle/not updated
-int update_dependencies(Cell *curr_cell, bool need_new_deps, PairOfPair *new_pairs, Spreadsheet *sheet, Cell cellcopy)
+// On success the program reference of 'X' contents is used up, see store_contents;
+// on a cycle the caller still owns it.
+int update_dependencies(CellContents *contents, bool need_new_deps, PairOfPair *new_pairs, Spreadsheet *sheet, const CellContents *old)
 {
-    if(curr_cell->type == cellcopy.type){
-        if(new_pairs->first.i == cellcopy.dependencies.first.i && new_pairs->first.j == cellcopy.dependencies.first.j && new_pairs->second.i == cellcopy.dependencies.second.i && new_pairs->second.j == cellcopy.dependencies.second.j){
+    // Two expressions may share a bounding box yet read different cells, so 'X'
+    // never takes the shortcut
+    if(contents->type == old->type && contents->type != 'X'){
+        if(new_pairs->first.i == old->dependencies.first.i && new_pairs->first.j == old->dependencies.first.j && new_pairs->second.i == old->dependencies.second.i && new_pairs->second.j == old->dependencies.second.j){
+            contents->dependencies = *new_pairs;
+            if (contents->type == 'F')
+                contents->op_data.function.agg_slot = old->op_data.function.agg_slot;
+            retarget_extrema(sheet, contents, old);
+            store_contents(sheet, contents);
             return 1;
         }
     }
 
     // Remove current cell from the dependents set of old dependencies
-    curr_cell->dependencies = *new_pairs;
+    contents->dependencies = *new_pairs;
 
     short r1,c1,r2,c2;
 
     if (need_new_deps)
     {
-        // Check for circular dependencies
-        if (check_circular_dependencies(curr_cell, sheet))
-        return 0;
-    }
-    
-    // Add current cell to the dependents set of new dependencies
-    r1 = cellcopy.dependencies.first.i, c1 = cellcopy.dependencies.first.j;
-    r2 = cellcopy.dependencies.second.i, c2 = cellcopy.dependencies.second.j;
-    if (cellcopy.type == 'F')
-    {
-        for (short i = r1; i <= r2; i++)
+        // A constant turning into a formula needs a slot to hold its order position
+        Cell *cell = touch_cell(sheet, contents->row, contents->col);
+        bool fresh = cell->formula == 0;
+        if (fresh)
+            cell->formula = formula_alloc(sheet);
+
+        // Check for circular dependencies; inside a batch that waits for the commit
+        if (sheet->batch.depth == 0 && check_circular_dependencies(contents, sheet))
         {
-            for (short j = c1; j <= c2; j++)
+            if (fresh)
             {
-                Cell *old_dep = &sheet->cells[i][j];
-                old_dep->dependents = avl_remove(old_dep->dependents, cellcopy.row, cellcopy.col);
+                if (sheet->formulas[cell->formula].topo_order >= 0)
+                    order_remove(sheet, sheet->formulas[cell->formula].topo_order);
+                formula_release(sheet, cell->formula);
+                cell->formula = 0;
             }
+            return 0;
+        }
+    }
+
+    // The aggregate slot follows the cell while it stays 'F'; a new rectangle needs a rescan
+    if (contents->type == 'F')
+    {
+        if (old->type == 'F')
+        {
+            contents->op_data.function.agg_slot = old->op_data.function.agg_slot;
+            sheet->aggregates[contents->op_data.function.agg_slot].valid = false;
         }
+        else
+            contents->op_data.function.agg_slot = aggregate_alloc(sheet);
+    }
+    else if (old->type == 'F')
+        aggregate_release(sheet, old->op_data.function.agg_slot);
+    retarget_extrema(sheet, contents, old);
+    
+    // Add current cell to the dependents set of new dependencies
+    r1 = old->dependencies.first.i, c1 = old->dependencies.first.j;
+    r2 = old->dependencies.second.i, c2 = old->dependencies.second.j;
+    if (old->type == 'F')
+    {
+        sheet->range_dependents = range_remove(&sheet->pool, sheet->range_dependents, old->dependencies, old->row, old->col);
     }
-    else if (cellcopy.type == 'A' || cellcopy.type == 'R')
+    else if (old->type == 'X')
+        link_expression(sheet, old, false);
+    else if (old->type == 'A' || old->type == 'R')
     {
         if (r1 != -1 && c1 != -1)
         {  
-            Cell *old_dep = &sheet->cells[r1][c1];
-            old_dep->dependents = avl_remove(old_dep->dependents, cellcopy.row, cellcopy.col);
+            Cell *old_dep = touch_cell(sheet, r1, c1);
+            depset_remove(&sheet->pool, &old_dep->dependents, old->row, old->col);
         }
         if (r2 != -1 && c2 != -1)
         {
-            Cell *old_dep = &sheet->cells[r2][c2];
-            old_dep->dependents = avl_remove(old_dep->dependents, cellcopy.row, cellcopy.col);
+            Cell *old_dep = touch_cell(sheet, r2, c2);
+            depset_remove(&sheet->pool, &old_dep->dependents, old->row, old->col);
         }
     }
 
     r1 = new_pairs->first.i, c1 = new_pairs->first.j;
     r2 = new_pairs->second.i, c2 = new_pairs->second.j;
-    if (curr_cell->type == 'F')
+    if (contents->type == 'F')
     {
-        for (short i = r1; i <= r2; i++)
-        {
-            for (short j = c1; j <= c2; j++)
-            {
-                Cell *new_dep = &sheet->cells[i][j];
-                new_dep->dependents = avl_insert(new_dep->dependents, curr_cell->row, curr_cell->col);
-            }
-        }
+        sheet->range_dependents = range_insert(&sheet->pool, sheet->range_dependents, *new_pairs, contents->row, contents->col);
     }
-    else if(curr_cell->type == 'A' || curr_cell->type == 'R')
+    else if (contents->type == 'X')
+        link_expression(sheet, contents, true);
+    else if(contents->type == 'A' || contents->type == 'R')
     {
         if (r1 != -1 && c1 != -1)
         {  
-            Cell *new_dep = &sheet->cells[r1][c1];
-            new_dep->dependents = avl_insert(new_dep->dependents, curr_cell->row, curr_cell->col);
+            Cell *new_dep = touch_cell(sheet, r1, c1);
+            depset_insert(&sheet->pool, &new_dep->dependents, contents->row, contents->col);
         }
         if (r2 != -1 && c2 != -1)
         {
-            Cell *new_dep = &sheet->cells[r2][c2];
-            new_dep->dependents = avl_insert(new_dep->dependents, curr_cell->row, curr_cell->col);
+            Cell *new_dep = touch_cell(sheet, r2, c2);
+            depset_insert(&sheet->pool, &new_dep->dependents, contents->row, contents->col);
         }
     }
 
+    store_contents(sheet, contents);
     return 1;
 }
 
-bool detect_cycle_dfs(Cell *cell, Spreadsheet *sheet, Vector *bin)
+// Append every formula that reads (row, col): single-cell references come from the
+// cell's own dependents set, range formulas from the sheet's range index
+static void collect_direct_dependents(Spreadsheet *sheet, short row, short col, Vector *out)
 {
-    if (cell->cell_state == 'P')
-        return true;
-    else if (cell->cell_state == 'V')
-        return false;
+    depset_collect(&get_cell(sheet, row, col)->dependents, out);
+    range_stab(sheet->range_dependents, row, col, out);
+}
 
-    cell->cell_state = 'P';
-    
+typedef struct {
+    Spreadsheet *sheet;
+    uint32_t sum_delta;
+    uint32_t sq_delta;
+    int err_delta;
+} AggregateDelta;
+
+static void apply_aggregate_delta(void *ctx, Pair owner)
+{
+    AggregateDelta *d = (AggregateDelta *)ctx;
+    // Expressions rescan their rectangles on every evaluation
+    if (get_cell(d->sheet, owner.i, owner.j)->type != 'F')
+        return;
+    Formula *reader = get_formula(d->sheet, owner.i, owner.j);
+    RangeAggregate *agg = &d->sheet->aggregates[reader->agg_slot];
+    if (!agg->valid)
+        return;
+
+    // Relaxed atomics: cells sharing a reader may be recalculated on different threads
+    __atomic_fetch_add(&agg->sum, d->sum_delta, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&agg->sum_sq, d->sq_delta, __ATOMIC_RELAXED);
+    if (d->err_delta)
+        __atomic_fetch_add(&agg->err_count, d->err_delta, __ATOMIC_RELAXED);
+}
+
+// Cell changed from (old_value, old_error) to its current state: fold the difference
+// into the aggregate of every range formula that reads it, and into its column's
+// MIN/MAX tree
+void notify_value_change(Spreadsheet *sheet, short row, short col, int old_value, bool old_error)
+{
+    int value = get_cell_value(sheet, row, col);
+    bool has_error = get_cell_error(sheet, row, col);
+    if (value == old_value && has_error == old_error)
+        return;
+    if (value != old_value)
+        extrema_update(sheet, row, col, value);
+
+    uint32_t v = (uint32_t)value, old = (uint32_t)old_value;
+    AggregateDelta d = {sheet, v - old, v * v - old * old, (int)has_error - (int)old_error};
+
+    // With the Fenwick trees on, readers query them instead of their own aggregate
+    if (sheet->range_sums.enabled)
+    {
+        range_sums_add(sheet, row, col, d.sum_delta, d.sq_delta, d.err_delta);
+        return;
+    }
+    range_visit(sheet->range_dependents, row, col, apply_aggregate_delta, &d);
+}
+
+static bool in_rect(PairOfPair rect, short row, short col)
+{
+    return rect.first.i <= row && row <= rect.second.i && rect.first.j <= col && col <= rect.second.j;
+}
+
+// Does the (new) formula of cell read (row, col)?
+static bool reads_cell(const Spreadsheet *sheet, const CellContents *cell, short row, short col)
+{
     short r1 = cell->dependencies.first.i, c1 = cell->dependencies.first.j;
     short r2 = cell->dependencies.second.i, c2 = cell->dependencies.second.j;
 
     if (cell->type == 'F')
+        return in_rect(cell->dependencies, row, col);
+    if (cell->type == 'A' || cell->type == 'R')
+        return (r1 == row && c1 == col) || (r2 == row && c2 == col);
+    if (cell->type == 'X')
+    {
+        const Program *prog = &sheet->programs[cell->op_data.expression.program];
+        for (int k = 0; k < prog->num_refs; k++)
+            if (cell->row + prog->refs[k].i == row && cell->col + prog->refs[k].j == col)
+                return true;
+        for (int k = 0; k < prog->num_ranges; k++)
+            if (in_rect(rect_at(prog->ranges[k], cell->row, cell->col), row, col))
+                return true;
+    }
+    return false;
+}
+
+// The sheet keeps every formula cell in a persistent topological order: calc_order
+// holds the cells by position and the formula's topo_order is the cell's position.
+// Positions only move when an edit breaks them. A cell that goes back to being a
+// constant leaves a hole {-1, -1} behind, squeezed out once holes make up half the order.
+
+// Give positions lo..hi back to the formulas sitting there
+static void order_renumber(Spreadsheet *sheet, int lo, int hi)
+{
+    for (int k = lo; k <= hi; k++)
+    {
+        Pair p = sheet->calc_order.data[k];
+        if (p.i >= 0)
+            get_formula(sheet, p.i, p.j)->topo_order = k;
+    }
+}
+
+// Put (row, col) at position pos, shifting the cells after it up by one
+static void order_insert(Spreadsheet *sheet, short row, short col, int pos)
+{
+    Vector *order = &sheet->calc_order;
+    vector_push_back(order, row, col);
+    int n = (int)order->size;
+
+    memmove(&order->data[pos + 1], &order->data[pos], (n - 1 - pos) * sizeof(Pair));
+    order->data[pos].i = row;
+    order->data[pos].j = col;
+    order_renumber(sheet, pos, n - 1);
+}
+
+static void order_remove(Spreadsheet *sheet, int pos)
+{
+    Vector *order = &sheet->calc_order;
+    order->data[pos].i = order->data[pos].j = -1;
+    if (++sheet->order_holes * 2 <= (int)order->size)
+        return;
+
+    size_t kept = 0;
+    for (size_t k = 0; k < order->size; k++)
+        if (order->data[k].i >= 0)
+            order->data[kept++] = order->data[k];
+    order->size = kept;
+    sheet->order_holes = 0;
+    order_renumber(sheet, 0, (int)kept - 1);
+}
+
+// Highest position after from held by a cell of the rectangle, or -1
+static int highest_in_rect_after(Spreadsheet *sheet, PairOfPair rect, int from)
+{
+    short r1 = rect.first.i, c1 = rect.first.j;
+    short r2 = rect.second.i, c2 = rect.second.j;
+    int best = -1;
+
+    // Either scan the rectangle or the order suffix after from, whichever is shorter
+    long area = (long)(r2 - r1 + 1) * (c2 - c1 + 1);
+    int n = (int)sheet->calc_order.size;
+    if (area <= n - from)
     {
         for (short i = r1; i <= r2; i++)
-        {
             for (short j = c1; j <= c2; j++)
-            {
-                Cell *dep = &sheet->cells[i][j];
-                vector_push_back(bin, dep->row, dep->col);
-                if (detect_cycle_dfs(dep, sheet, bin))
-                    return true;
-            }
+                if (get_topo_order(sheet, i, j) > best)
+                    best = get_topo_order(sheet, i, j);
+        return best > from ? best : -1;
+    }
+    for (int k = n - 1; k > from; k--)
+    {
+        Pair p = sheet->calc_order.data[k];
+        if (r1 <= p.i && p.i <= r2 && c1 <= p.j && p.j <= c2)
+            return k;
+    }
+    return -1;
+}
+
+// Highest position after from held by a cell that the new formula of cell reads, or -1
+static int highest_precedent_after(Spreadsheet *sheet, const CellContents *cell, int from)
+{
+    short r1 = cell->dependencies.first.i, c1 = cell->dependencies.first.j;
+    short r2 = cell->dependencies.second.i, c2 = cell->dependencies.second.j;
+    int best = -1;
+
+    if (cell->type == 'A' || cell->type == 'R')
+    {
+        if (r1 != -1 && c1 != -1 && get_topo_order(sheet, r1, c1) > best)
+            best = get_topo_order(sheet, r1, c1);
+        if (r2 != -1 && c2 != -1 && get_topo_order(sheet, r2, c2) > best)
+            best = get_topo_order(sheet, r2, c2);
+        return best > from ? best : -1;
+    }
+    if (cell->type == 'F')
+        return highest_in_rect_after(sheet, cell->dependencies, from);
+    if (cell->type != 'X')
+        return -1;
+
+    const Program *prog = &sheet->programs[cell->op_data.expression.program];
+    for (int k = 0; k < prog->num_refs; k++)
+    {
+        Pair ref = offset_at(prog->refs[k], cell->row, cell->col);
+        if (get_topo_order(sheet, ref.i, ref.j) > best)
+            best = get_topo_order(sheet, ref.i, ref.j);
+    }
+    for (int k = 0; k < prog->num_ranges; k++)
+    {
+        PairOfPair rect = rect_at(prog->ranges[k], cell->row, cell->col);
+        int in_range = highest_in_rect_after(sheet, rect, best > from ? best : from);
+        if (in_range > best)
+            best = in_range;
+    }
+    return best > from ? best : -1;
+}
+
+// Check whether the new formula of cell closes a loop and, if not, repair the
+// persistent order for its new precedents (Marchetti-Spaccamela et al.).
+//
+// Every path out of cell climbs the order, so a loop needs a precedent placed after
+// the cell. Only that window [topo_order, highest precedent] is searched, forward
+// along dependents with an explicit stack and epoch-stamped marks. When no precedent
+// reaches back, the cells found in the window move behind the rest of it.
+// The cell must already own a formula slot.
+bool check_circular_dependencies(const CellContents *cell, Spreadsheet *sheet)
+{
+    if (reads_cell(sheet, cell, cell->row, cell->col))
+        return true;
+
+    Vector *stack = &sheet->walk_stack;
+    int cols = sheet->totalCols;
+
+    if (get_topo_order(sheet, cell->row, cell->col) < 0)
+    {
+        // First formula in this cell: it has to come before everything that reads it
+        stack->size = 0;
+        collect_direct_dependents(sheet, cell->row, cell->col, stack);
+        int first = (int)sheet->calc_order.size;
+        for (size_t k = 0; k < stack->size; k++)
+        {
+            int pos = get_topo_order(sheet, stack->data[k].i, stack->data[k].j);
+            if (pos < first)
+                first = pos;
         }
+        order_insert(sheet, cell->row, cell->col, first);
     }
-    else if(cell->type == 'A' || cell->type == 'R')
+
+    int lo = get_topo_order(sheet, cell->row, cell->col);
+    int hi = highest_precedent_after(sheet, cell, lo);
+    if (hi < 0)
+        return false;
+
+    unsigned int epoch = sheet_next_epoch(sheet);
+    stack->size = 0;
+    vector_push_back(stack, cell->row, cell->col);
+
+    while (stack->size > 0)
     {
-        if (r1 != -1 && c1 != -1)
+        Pair p = stack->data[--stack->size];
+        unsigned int *mark = &sheet->visit_mark[p.i * cols + p.j];
+        if (*mark == epoch)
+            continue;
+        *mark = epoch;
+
+        if (reads_cell(sheet, cell, p.i, p.j))
+            return true;
+
+        // Cells past the window cannot lead back into it
+        size_t base = stack->size;
+        collect_direct_dependents(sheet, p.i, p.j, stack);
+        size_t kept = base;
+        for (size_t k = base; k < stack->size; k++)
         {
-            Cell *dep = &sheet->cells[r1][c1];
-            vector_push_back(bin, dep->row, dep->col);
-            if (detect_cycle_dfs(dep, sheet, bin))
-                return true;
+            Pair d = stack->data[k];
+            if (get_topo_order(sheet, d.i, d.j) <= hi)
+                stack->data[kept++] = d;
         }
-        if (r2 != -1 && c2 != -1)
+        stack->size = kept;
+    }
+
+    // Reorder the window: untouched cells (and holes) keep their order, reached cells follow them
+    stack->size = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int k = lo; k <= hi; k++)
         {
-            Cell *dep = &sheet->cells[r2][c2];
-            vector_push_back(bin, dep->row, dep->col);
-            if (detect_cycle_dfs(dep, sheet, bin))
-                return true;
+            Pair p = sheet->calc_order.data[k];
+            bool reached = p.i >= 0 && sheet->visit_mark[p.i * cols + p.j] == epoch;
+            if (reached == (pass == 1))
+                vector_push_back(stack, p.i, p.j);
         }
     }
-    cell->cell_state = 'V';
+    memcpy(&sheet->calc_order.data[lo], stack->data, (hi - lo + 1) * sizeof(Pair));
+    order_renumber(sheet, lo, hi);
+    stack->size = 0;
     return false;
 }
 
-void revertChanges(Vector *bins, Spreadsheet * sheet)
+
+// Min-heap of calc_order positions, used to sweep the chain forward
+static void heap_push(int *heap, int *size, int pos)
 {
-    if (bins == NULL) return;
+    int k = (*size)++;
+    while (k > 0 && heap[(k - 1) / 2] > pos)
+    {
+        heap[k] = heap[(k - 1) / 2];
+        k = (k - 1) / 2;
+    }
+    heap[k] = pos;
+}
 
-    VectorIterator it;
-    vector_iterator_init(&it, bins);
-    while (vector_iterator_has_next(&it))
+static int heap_pop(int *heap, int *size)
+{
+    int top = heap[0];
+    int last = heap[--(*size)];
+    int k = 0;
+    if (*size == 0)
+        return top;
+    while (2 * k + 1 < *size)
     {
-        Pair* p = vector_iterator_next(&it);
-        sheet->cells[p->i][p->j].cell_state = 'U';
+        int child = 2 * k + 1;
+        if (child + 1 < *size && heap[child + 1] < heap[child])
+            child++;
+        if (heap[child] >= last)
+            break;
+        heap[k] = heap[child];
+        k = child;
     }
+    heap[k] = last;
+    return top;
 }
 
-bool check_circular_dependencies(Cell *cell, Spreadsheet *sheet)
+// Re-evaluate one dirty cell and propagate its change into the range indexes
+static void recalc_cell(Spreadsheet *sheet, short row, short col)
 {
-    Vector bin;
-    vector_init(&bin);
+    int old_value = get_cell_value(sheet, row, col);
+    bool old_error = get_cell_error(sheet, row, col);
+    set_cell_error(sheet, row, col, false);
+    evaluate_cell(sheet, row, col);
+    notify_value_change(sheet, row, col, old_value, old_error);
+}
 
-    vector_push_back(&bin, cell->row, cell->col);
+typedef struct {
+    Spreadsheet *sheet;
+    const Pair *cells;
+} RecalcJob;
 
-    bool hascycle = detect_cycle_dfs(cell, sheet, &bin);
+static void recalc_node(void *ctx, int node)
+{
+    RecalcJob *job = (RecalcJob *)ctx;
+    recalc_cell(job->sheet, job->cells[node].i, job->cells[node].j);
+}
+
+static void ensure_recalc_slots(Spreadsheet *sheet)
+{
+    if (sheet->recalc_slot)
+        return;
+    sheet->recalc_slot = (int *)malloc((size_t)sheet->totalRows * sheet->totalCols * sizeof(int));
+    if (!sheet->recalc_slot)
+    {
+        fprintf(stderr, "Memory allocation failed for recalc slots\n");
+        exit(1);
+    }
+}
 
-    revertChanges(&bin, sheet);
-    vector_free(&bin);
-    return hascycle;
+// Seconds a SLEEP cell holds back its dependents after evaluation, 0 for any other cell
+int sleep_seconds(const Spreadsheet *sheet, short row, short col)
+{
+    int value = get_cell_value(sheet, row, col);
+    return get_cell(sheet, row, col)->is_sleep && !get_cell_error(sheet, row, col) && value > 0 ? value : 0;
 }
 
+typedef struct {
+    double deadline;    // CLOCK_MONOTONIC seconds
+    int node;
+} SleepTimer;
 
-static AVLNode* collect_traverse_avl_tree_backend(AVLNode* node, AVLNode** affected_cells, Spreadsheet* sheet, int *num_cells) {
-    if (node == NULL) return *affected_cells;
-    
-    // In-order traversal: left, current, right
-    *affected_cells = collect_traverse_avl_tree_backend(node->left, affected_cells, sheet, num_cells);
-    
-    // Process the current node
-    Pair p = node->pair;
+static double monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    // Only process if not already visited
-    if (avl_find(*affected_cells, p.i, p.j) == NULL) {
-        *affected_cells = avl_insert(*affected_cells, node->pair.i, node->pair.j);
-        (*num_cells)++;
-        *affected_cells = collect_traverse_avl_tree_backend((sheet->cells[p.i][p.j]).dependents, affected_cells, sheet, num_cells);
+// Min-heap of timers by deadline
+static void timer_push(SleepTimer *heap, int *size, SleepTimer timer)
+{
+    int k = (*size)++;
+    while (k > 0 && heap[(k - 1) / 2].deadline > timer.deadline)
+    {
+        heap[k] = heap[(k - 1) / 2];
+        k = (k - 1) / 2;
     }
-    
-    *affected_cells = collect_traverse_avl_tree_backend(node->right, affected_cells, sheet, num_cells);
-    return *affected_cells;
+    heap[k] = timer;
 }
 
-static void assign_topo_order(AVLNode* affected_cell, Spreadsheet* sheet, Pair** cell_map, int* index) {
-    if (affected_cell == NULL) return;
-    
-    // In-order traversal: left, current, right
-    assign_topo_order(affected_cell->left, sheet, cell_map, index);
-    
-    // Process the current affected_cell
-    Pair p = affected_cell->pair;
-    sheet->cells[p.i][p.j].topo_order = *index;
-    (*cell_map)[*index].i = p.i;
-    (*cell_map)[*index].j = p.j;
-    (*index)++;
-    
-    assign_topo_order(affected_cell->right, sheet, cell_map, index);
+static SleepTimer timer_pop(SleepTimer *heap, int *size)
+{
+    SleepTimer top = heap[0];
+    SleepTimer last = heap[--(*size)];
+    int k = 0;
+    while (2 * k + 1 < *size)
+    {
+        int child = 2 * k + 1;
+        if (child + 1 < *size && heap[child + 1].deadline < heap[child].deadline)
+            child++;
+        if (heap[child].deadline >= last.deadline)
+            break;
+        heap[k] = heap[child];
+        k = child;
+    }
+    if (*size > 0)
+        heap[k] = last;
+    return top;
 }
 
+// Kahn's algorithm on the calling thread, with SLEEP cells as timers: a sleeping
+// cell's dependents become ready when its timer fires, and every cell that does not
+// depend on it runs in the meantime. Independent sleeps overlap, so the run takes
+// as long as the slowest chain of sleeps rather than their sum. The first num_roots
+// nodes were evaluated by the caller; only their sleep is still to come.
+static void recalc_timed(Spreadsheet *sheet, const TaskGraph *graph, int num_roots)
+{
+    const Pair *cells = sheet->recalc_cells.data;
+    int *ready = (int *)malloc((graph->num_nodes + 1) * sizeof(int));
+    SleepTimer *timers = (SleepTimer *)malloc((graph->num_nodes + 1) * sizeof(SleepTimer));
+    if (!ready || !timers)
+    {
+        fprintf(stderr, "Memory allocation failed for recalculation\n");
+        exit(1);
+    }
+    int head = 0, tail = 0, num_timers = 0;
+    for (int n = 0; n < graph->num_nodes; n++)
+        if (graph->in_degree[n] == 0)
+            ready[tail++] = n;
 
-void update_dependents(Cell *curr_cell, Spreadsheet *sheet)
+    while (head < tail || num_timers > 0)
+    {
+        int node;
+        if (head < tail)
+        {
+            node = ready[head++];
+            if (node >= num_roots)
+                recalc_cell(sheet, cells[node].i, cells[node].j);
+            int seconds = sleep_seconds(sheet, cells[node].i, cells[node].j);
+            if (seconds > 0)
+            {
+                SleepTimer timer = {monotonic_seconds() + seconds, node};
+                timer_push(timers, &num_timers, timer);
+                continue;
+            }
+        }
+        else
+        {
+            // Nothing left to run until the next timer fires
+            double wait = timers[0].deadline - monotonic_seconds();
+            if (wait > 0)
+            {
+                struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+                nanosleep(&ts, NULL);
+                continue;
+            }
+            node = timer_pop(timers, &num_timers).node;
+        }
+        for (int e = graph->offsets[node]; e < graph->offsets[node + 1]; e++)
+            if (--graph->in_degree[graph->targets[e]] == 0)
+                ready[tail++] = graph->targets[e];
+    }
+    free(ready);
+    free(timers);
+}
+
+// Add p to the task graph and its dependents to the walk
+static void graph_add(Spreadsheet *sheet, Pair p, unsigned int epoch, int **offsets, size_t *offsets_cap)
 {
-    if (curr_cell->dependents == NULL)
+    Vector *cells = &sheet->recalc_cells;
+    Vector *edges = &sheet->recalc_edges;
+    int id = p.i * sheet->totalCols + p.j;
+    if (sheet->visit_mark[id] == epoch)
         return;
+    sheet->visit_mark[id] = epoch;
+    sheet->recalc_slot[id] = (int)cells->size;
 
-    // Collect all affected cells
-    AVLNode *affected_cells = NULL;
-    int num_cells = 0;
+    if (cells->size + 1 >= *offsets_cap)
+    {
+        *offsets_cap *= 2;
+        *offsets = (int *)realloc(*offsets, *offsets_cap * sizeof(int));
+        if (!*offsets)
+        {
+            fprintf(stderr, "Memory allocation failed for recalculation\n");
+            exit(1);
+        }
+    }
+    (*offsets)[cells->size] = (int)edges->size;
+    vector_push_back(cells, p.i, p.j);
 
-    affected_cells = collect_traverse_avl_tree_backend(curr_cell->dependents, &affected_cells, sheet, &num_cells);
+    size_t first = edges->size;
+    collect_direct_dependents(sheet, p.i, p.j, edges);
+    for (size_t k = first; k < edges->size; k++)
+        vector_push_back(&sheet->walk_stack, edges->data[k].i, edges->data[k].j);
+}
+
+// Gather the dirty cells into a task graph (dense numbering through recalc_slot,
+// successors in CSR form) and run it with in-degree counters. Each cell still reads
+// only finished precedents, so the results are identical to the serial sweep.
+// Without SLEEP cells the thread pool runs the graph; with them the timed scheduler
+// does. roots, if any, are cells already evaluated whose sleep their dependents
+// must still wait for.
+static void recalc_graph(Spreadsheet *sheet, const Vector *roots)
+{
+    Vector *stack = &sheet->walk_stack;
+    Vector *cells = &sheet->recalc_cells;
+    Vector *edges = &sheet->recalc_edges;
+    int cols = sheet->totalCols;
+    unsigned int epoch = sheet_next_epoch(sheet);
 
-    // Create cell mapping and adjacency matrix for topological sort
-    if (num_cells == 0)
+    ensure_recalc_slots(sheet);
+    cells->size = 0;
+    edges->size = 0;
+
+    size_t offsets_cap = 64;
+    int *offsets = (int *)malloc(offsets_cap * sizeof(int));
+    if (!offsets)
     {
-        avl_free(affected_cells);
-        affected_cells = NULL;
-        return;
+        fprintf(stderr, "Memory allocation failed for recalculation\n");
+        exit(1);
     }
 
-    // Create cell mapping
-    Pair *cell_map = (Pair *)malloc((num_cells + 1) * sizeof(Pair));
+    for (size_t k = 0; roots && k < roots->size; k++)
+        graph_add(sheet, roots->data[k], epoch, &offsets, &offsets_cap);
+    int num_roots = (int)cells->size;
+    bool sleepers = num_roots > 0;
+    while (stack->size > 0)
+    {
+        Pair p = stack->data[--stack->size];
+        sleepers |= get_cell(sheet, p.i, p.j)->is_sleep;
+        graph_add(sheet, p, epoch, &offsets, &offsets_cap);
+    }
+
+    int num_cells = (int)cells->size;
+    offsets[num_cells] = (int)edges->size;
 
-    int index = 1;
-    assign_topo_order(affected_cells, sheet, &cell_map, &index);
+    // Every edge target was reached by the walk, so it has a slot
+    int *targets = (int *)malloc((edges->size + 1) * sizeof(int));
+    int *in_degree = (int *)calloc(num_cells + 1, sizeof(int));
+    if (!targets || !in_degree)
+    {
+        fprintf(stderr, "Memory allocation failed for recalculation\n");
+        exit(1);
+    }
+    for (size_t k = 0; k < edges->size; k++)
+    {
+        targets[k] = sheet->recalc_slot[edges->data[k].i * cols + edges->data[k].j];
+        in_degree[targets[k]]++;
+    }
 
-    // Create adjacency matrix
-    Vector *adj_list = (Vector *)malloc((num_cells + 1) * sizeof(Vector));
+    RecalcJob job = {sheet, cells->data};
+    TaskGraph graph = {num_cells, offsets, targets, in_degree, recalc_node, &job};
+    if (sleepers)
+        recalc_timed(sheet, &graph, num_roots);
+    else
+        threadpool_run_graph(&graph);
 
-    for(int i = 1; i <= num_cells; i++)
-        vector_init(&adj_list[i]);
+    // Cleanup
+    free(offsets);
+    free(targets);
+    free(in_degree);
+}
 
-    // Fill adjacency list - only add edges between affected cells
-    for (int i = 1; i <= num_cells; i++)
+// Recalculate the formulas queued in sheet->walk_stack and everything reachable
+// from them through dependents.
+//
+// Formula cells already sit in a valid evaluation order in sheet->calc_order, kept
+// up to date by check_circular_dependencies, so nothing is sorted here. Dirty cells
+// are marked with a fresh epoch and queued by chain position; popping the smallest
+// position sweeps the chain forward, and every dirty precedent of a cell is popped
+// before it because it sits earlier in the chain.
+//
+// roots, if not NULL, are cells that were just evaluated and may sleep; see
+// recalc_graph. The sweep hands over to recalc_graph as soon as a SLEEP cell
+// is involved.
+static void recalc_queued(Spreadsheet *sheet, const Vector *roots)
+{
+    Vector *found = &sheet->walk_stack;
+    if ((roots && roots->size > 0) || threadpool_size() > 1)
     {
-        int xx = cell_map[i].i;
-        int yy = cell_map[i].j;
-        Cell *cell = &sheet->cells[xx][yy];
+        recalc_graph(sheet, roots);
+        return;
+    }
+    if (found->size == 0)
+        return;
 
-        short r1 = cell->dependencies.first.i, c1 = cell->dependencies.first.j;
-        short r2 = cell->dependencies.second.i, c2 = cell->dependencies.second.j;
+    int cols = sheet->totalCols;
+    unsigned int epoch = sheet_next_epoch(sheet);
 
-        if (cell->type == 'F')
+    // Each formula cell is queued at most once, so the chain length bounds the heap
+    if (sheet->recalc_heap_cap < (int)sheet->calc_order.size)
+    {
+        sheet->recalc_heap_cap = (int)sheet->calc_order.size;
+        sheet->recalc_heap = (int *)realloc(sheet->recalc_heap, sheet->recalc_heap_cap * sizeof(int));
+        if (!sheet->recalc_heap)
         {
-            for (short rr = r1; rr <= r2; rr++)
-            {
-                for (short j = c1; j <= c2; j++)
-                {
-                    Cell *dep = &(sheet->cells[rr][j]);
-                    // Only add edge if dependency is in affected_cells.
-                    if (avl_find(affected_cells, dep->row, dep->col) != NULL)
-                        vector_push_back(&adj_list[i], dep->row, dep->col);
-                }
-            }
+            fprintf(stderr, "Memory allocation failed for recalc heap\n");
+            exit(1);
         }
-        else if (cell->type == 'A' || cell->type == 'R')
+    }
+    int *heap = sheet->recalc_heap;
+    int heap_size = 0;
+
+    while (1)
+    {
+        for (size_t k = 0; k < found->size; k++)
         {
-            if (r1 != -1 && c1 != -1)
-            {
-                Cell *dep = &sheet->cells[r1][c1];
-                // Only add edge if dependency is in affected_cells.
-                if (avl_find(affected_cells, dep->row, dep->col) != NULL)
-                    vector_push_back(&adj_list[i], dep->row, dep->col);
-            }
+            Pair p = found->data[k];
+            if (sheet->visit_mark[p.i * cols + p.j] == epoch)
+                continue;
+            sheet->visit_mark[p.i * cols + p.j] = epoch;
+            heap_push(heap, &heap_size, get_topo_order(sheet, p.i, p.j));
+        }
+        found->size = 0;
+
+        if (heap_size == 0)
+            break;
 
-            if (r2 != -1 && c2 != -1)
+        // Recalculate cell value
+        Pair p = sheet->calc_order.data[heap_pop(heap, &heap_size)];
+        recalc_cell(sheet, p.i, p.j);
+
+        // A sleeping cell holds back only its own dependents: everything still
+        // queued sits later in the chain, so none of it has run yet
+        if (sleep_seconds(sheet, p.i, p.j) > 0)
+        {
+            found->size = 0;
+            for (int k = 0; k < heap_size; k++)
             {
-                Cell *dep = &sheet->cells[r2][c2];
-                // Only add edge if dependency is in affected_cells.
-                if (avl_find(affected_cells, dep->row, dep->col) != NULL)
-                    vector_push_back(&adj_list[i], dep->row, dep->col);
+                Pair q = sheet->calc_order.data[heap[k]];
+                vector_push_back(found, q.i, q.j);
             }
+            Vector sleeper;
+            vector_init(&sleeper);
+            vector_push_back(&sleeper, p.i, p.j);
+            recalc_graph(sheet, &sleeper);
+            vector_free(&sleeper);
+            return;
         }
+
+        collect_direct_dependents(sheet, p.i, p.j, found);
     }
+}
 
-    // Perform topological sort
-    Vector sorted;
-    topological_sort(adj_list, num_cells, &cell_map, &sorted, sheet);
+// Recalculate everything reachable from (row, col) through dependents, after the
+// cell's own sleep if it is a SLEEP cell
+void update_dependents(Spreadsheet *sheet, short row, short col)
+{
+    sheet->walk_stack.size = 0;
+    if (sleep_seconds(sheet, row, col) > 0)
+    {
+        Vector root;
+        vector_init(&root);
+        vector_push_back(&root, row, col);
+        recalc_queued(sheet, &root);
+        vector_free(&root);
+        return;
+    }
+    collect_direct_dependents(sheet, row, col, &sheet->walk_stack);
+    recalc_queued(sheet, NULL);
+}
 
-    // Update cells in topological order
-    VectorIterator update_it;
+// Recalculate the given formula cells and everything downstream of them in one sweep
+void recalc_formulas(Spreadsheet *sheet, const Vector *seeds)
+{
+    sheet->walk_stack.size = 0;
+    for (size_t k = 0; k < seeds->size; k++)
+        vector_push_back(&sheet->walk_stack, seeds->data[k].i, seeds->data[k].j);
+    recalc_queued(sheet, NULL);
+}
 
-    vector_iterator_init(&update_it, &sorted);
-    while (vector_iterator_has_next(&update_it))
+// MIN/MAX/AVG/SUM/STDEV ('A'..'E') of count values with the given totals
+static int function_value(char func_name, int sum, int sum_sq, int count, int min_val, int max_val)
+{
+    switch (func_name)
     {
-        Pair* p = vector_iterator_next(&update_it);
+    case 'A':
+        return min_val;
+    case 'B':
+        return max_val;
+    case 'C':
+        return sum / count;
+    case 'E':
+        if(count <=1){
+            return 0;
+        }else{
+            int mean = sum / count;
+            double variance = (double)((sum_sq) - 2*sum*mean + (mean * mean)*count) / count;
+            return (int)round(sqrt(variance));
+        }
+    default:
+        return sum;
+    }
+}
 
-        // Recalculate cell value
-        Cell *cell = &sheet->cells[p->i][p->j];
-        cell->has_error = false;
-        cell->topo_order = -1;
+// Function of a rectangle read by an expression; false if a cell in it has an error.
+// Expressions keep no aggregate of their own, so only the Fenwick trees save a scan.
+static bool expression_range(Spreadsheet *sheet, char func_name, PairOfPair r, int *value)
+{
+    short r1 = r.first.i, c1 = r.first.j, r2 = r.second.i, c2 = r.second.j;
+    int count = (r2 - r1 + 1) * (c2 - c1 + 1);
+    RangeTotals totals;
+    uint32_t sum, sum_sq;
+    int errors;
 
-        evaluate_cell(cell, sheet);
+    range_totals_init(&totals);
+    if (sheet->range_sums.enabled && func_name != 'A' && func_name != 'B')
+        range_sums_query(sheet, r1, c1, r2, c2, &sum, &sum_sq, &errors);
+    else
+    {
+        kernel_rect_totals(sheet, r1, c1, r2, c2, kernel_range_totals, &totals);
+        sum = (uint32_t)totals.sum;
+        sum_sq = (uint32_t)totals.sum_sq;
+        errors = (int)totals.errors;
     }
+    if (errors > 0)
+        return false;
+    *value = function_value(func_name, (int)sum, (int)sum_sq, count, totals.min_val, totals.max_val);
+    return true;
+}
 
-    // Cleanup
-    vector_free(&sorted);
-    for (int i = 1; i <= num_cells; i++)
-        vector_free(&adj_list[i]);
-    
-    free(adj_list);
-    free(cell_map);
-    adj_list = NULL;
-    cell_map = NULL;
-    avl_free(affected_cells);
-    affected_cells = NULL;
+// Function of the n values at args, totalled like a range
+static int list_value(char func_name, const int *args, int n)
+{
+    uint32_t sum = 0, sum_sq = 0;
+    int min_val = INT_MAX, max_val = INT_MIN;
+    for (int k = 0; k < n; k++)
+    {
+        uint32_t v = (uint32_t)args[k];
+        sum += v;
+        sum_sq += v * v;
+        if (args[k] < min_val)
+            min_val = args[k];
+        if (args[k] > max_val)
+            max_val = args[k];
+    }
+    return function_value(func_name, (int)sum, (int)sum_sq, n, min_val, max_val);
+}
+
+// Run compiled expression code (see ExprOp) for the cell at (row, col), which its
+// cell offsets are taken from. The code was checked by program_create or comes
+// straight from the compiler, so the loop does no bounds checks of its own.
+// Returns false if the expression reads a cell with an error or divides by zero.
+// Arithmetic wraps around like the int arithmetic of 'A' cells.
+bool run_expression(Spreadsheet *sheet, const int32_t *code, int code_size, short row, short col, int *result)
+{
+    int stack[EXPR_MAX_DEPTH];
+    int top = -1;
+    const int32_t *pc = code, *end = code + code_size;
+
+    while (pc < end)
+    {
+        switch ((ExprOp)*pc++)
+        {
+        case EX_CONST:
+            stack[++top] = *pc++;
+            break;
+        case EX_CELL:{
+            Pair p = offset_at(expr_unpack(*pc++), row, col);
+            if (get_cell_error(sheet, p.i, p.j))
+                return false;
+            stack[++top] = get_cell_value(sheet, p.i, p.j);
+            break; }
+        case EX_RANGE:{
+            PairOfPair r = {offset_at(expr_unpack(pc[1]), row, col), offset_at(expr_unpack(pc[2]), row, col)};
+            if (!expression_range(sheet, (char)pc[0], r, &stack[++top]))
+                return false;
+            pc += 3;
+            break; }
+        case EX_LIST:
+            top -= pc[1] - 1;
+            stack[top] = list_value((char)pc[0], &stack[top], pc[1]);
+            pc += 2;
+            break;
+        case EX_NEG:
+            stack[top] = (int)(0u - (uint32_t)stack[top]);
+            break;
+        case EX_ADD:
+            top--;
+            stack[top] = (int)((uint32_t)stack[top] + (uint32_t)stack[top + 1]);
+            break;
+        case EX_SUB:
+            top--;
+            stack[top] = (int)((uint32_t)stack[top] - (uint32_t)stack[top + 1]);
+            break;
+        case EX_MUL:
+            top--;
+            stack[top] = (int)((uint32_t)stack[top] * (uint32_t)stack[top + 1]);
+            break;
+        case EX_DIV:
+            top--;
+            if (stack[top + 1] == 0)
+                return false;
+            stack[top] = stack[top + 1] == -1 ? (int)(0u - (uint32_t)stack[top]) : stack[top] / stack[top + 1];
+            break;
+        }
+    }
+    *result = stack[0];
+    return true;
 }
 
-int evaluate_cell(Cell *cell, Spreadsheet *sheet)
+int evaluate_cell(Spreadsheet *sheet, short row, short col)
 {
-    if (cell->has_error)
+    const Cell *cell = get_cell(sheet, row, col);
+    Formula *f = get_formula(sheet, row, col);
+    const FormulaTemplate *t = f && f->template >= 0 ? get_template(sheet, f) : NULL;
+    PairOfPair deps = {{-1, -1}, {-1, -1}};
+    if (t)
+        deps = template_dependencies(t, row, col);
+    if (get_cell_error(sheet, row, col))
         return 0;
-    switch (cell->type)
+    switch (cell_type(cell))
     {
     case 'C':
-        if (cell->is_sleep && cell->value > 0)
-            sleep(cell->value);
-        cell->has_error=false;
+        set_cell_error(sheet, row, col, false);
         break;
 
     case 'A':
-        if(cell->dependencies.first.i != -1){
-            if(sheet->cells[cell->dependencies.first.i][cell->dependencies.first.j].has_error){
-                cell->has_error = true;
+        if(deps.first.i != -1){
+            if(get_cell_error(sheet, deps.first.i, deps.first.j)){
+                set_cell_error(sheet, row, col, true);
                 break;
             }
         }
-        if(cell->dependencies.second.i != -1){
-            if(sheet->cells[cell->dependencies.second.i][cell->dependencies.second.j].has_error){
-                cell->has_error = true;
+        if(deps.second.i != -1){
+            if(get_cell_error(sheet, deps.second.i, deps.second.j)){
+                set_cell_error(sheet, row, col, true);
                 break;
             }
         }
         int left, right;
-        left = (cell->dependencies.first.i != -1 && cell->dependencies.first.j != -1) ? sheet->cells[cell->dependencies.first.i][cell->dependencies.first.j].value
-                                                                                      : cell->op_data.arithmetic.constant;
-        right = (cell->dependencies.second.i != -1 && cell->dependencies.second.j != -1) ? sheet->cells[cell->dependencies.second.i][cell->dependencies.second.j].value
-                                                                                      : cell->op_data.arithmetic.constant;
+        left = (deps.first.i != -1 && deps.first.j != -1) ? get_cell_value(sheet, deps.first.i, deps.first.j)
+                                                                                      : t->op_data.arithmetic.constant;
+        right = (deps.second.i != -1 && deps.second.j != -1) ? get_cell_value(sheet, deps.second.i, deps.second.j)
+                                                                                      : t->op_data.arithmetic.constant;
                                                                                 
-        switch (cell->op_data.arithmetic.op)
+        switch (t->op_data.arithmetic.op)
         {
         case OP_ADD:
-            cell->value = left + right;
+            set_cell_value(sheet, row, col, left + right);
             return 0;
         case OP_SUB:
-            cell->value = left - right;
+            set_cell_value(sheet, row, col, left - right);
             return 0;
         case OP_MUL:
-            cell->value = left * right;
+            set_cell_value(sheet, row, col, left * right);
             return 0;
         case OP_DIV:
             if (right == 0)
             {
-                cell->has_error = true;
+                set_cell_error(sheet, row, col, true);
                 return 0;
             }
-            cell->value = left / right;
+            set_cell_value(sheet, row, col, left / right);
             return 0;
         default:
             return 0;
         }
-        cell->has_error=false;
+        set_cell_error(sheet, row, col, false);
         break;
 
     case 'F':{
-        int sum = 0, count = 0;
+        short r1 = deps.first.i, c1 = deps.first.j;
+        short r2 = deps.second.i, c2 = deps.second.j;
+        int count = (r2 - r1 + 1) * (c2 - c1 + 1);
         int min_val = INT_MAX, max_val = INT_MIN;
-        int sum_sq = 0;
+        RangeAggregate *agg = &sheet->aggregates[f->agg_slot];
+        char func_name = t->op_data.function.func_name;
 
-        short r1 = cell->dependencies.first.i, c1 = cell->dependencies.first.j;
-        short r2 = cell->dependencies.second.i, c2 = cell->dependencies.second.j;
+        // The aggregate (or the sheet's Fenwick trees) and the column trees are kept
+        // current by notify_value_change; only a new rectangle has to be scanned
+        bool scanned = false;
+        if (sheet->range_sums.enabled)
+        {
+            range_sums_query(sheet, r1, c1, r2, c2, &agg->sum, &agg->sum_sq, &agg->err_count);
+            agg->valid = true;
+        }
+        else if (!agg->valid)
+        {
+            // Each tile row of the rectangle is one contiguous run of the value and
+            // error planes; truncating the kernel's 64-bit sums wraps like int did
+            RangeTotals totals;
+            range_totals_init(&totals);
+            kernel_rect_totals(sheet, r1, c1, r2, c2, kernel_range_totals, &totals);
+            min_val = totals.min_val;
+            max_val = totals.max_val;
+            agg->sum = (uint32_t)totals.sum;
+            agg->sum_sq = (uint32_t)totals.sum_sq;
+            agg->err_count = (int)totals.errors;
+            agg->valid = true;
+            scanned = true;
+        }
 
-        for (short i = r1; i <= r2; i++)
+        if (!scanned && (func_name == 'A' || func_name == 'B'))
         {
             for (short j = c1; j <= c2; j++)
-            {
-                int dep_val = sheet->cells[i][j].value;
-                if (sheet->cells[i][j].has_error)
-                {
-                    cell->has_error = true;
-                    return 0;
-                }
-                sum += dep_val;
-                if (dep_val < min_val)
-                    min_val = dep_val;
-                if (dep_val > max_val)
-                    max_val = dep_val;
-                sum_sq += dep_val * dep_val;
-                count++;
-            }
+                extrema_query(sheet, r1, r2, j, &min_val, &max_val);
         }
-        switch (cell->op_data.function.func_name)
+
+        if (agg->err_count > 0)
         {
-        case 'D':
-            cell->value = sum;
-            break;
-        case 'C':
-            cell->value = sum / count;
-            break;
-        case 'A':
-            cell->value = min_val;
-            break;
-        case 'B':
-            cell->value = max_val;
-            break;
-        case 'E':
-            if(count <=1){
-                cell->value = 0;
-            }else{
-                int mean = sum / count;
-                double variance = (double)((sum_sq) - 2*sum*mean + (mean * mean)*count) / count;
-                cell->value = (int)round(sqrt(variance));
-            }
-            break;
+            set_cell_error(sheet, row, col, true);
+            return 0;
         }
-        cell->has_error = false;
+        set_cell_value(sheet, row, col, function_value(func_name, (int)agg->sum, (int)agg->sum_sq, count, min_val, max_val));
+        set_cell_error(sheet, row, col, false);
+        break; }
+
+    case 'X':{
+        const Program *prog = &sheet->programs[t->op_data.expression.program];
+        int value;
+        if (!run_expression(sheet, prog->code, prog->code_size, row, col, &value))
+        {
+            set_cell_error(sheet, row, col, true);
+            return 0;
+        }
+        set_cell_value(sheet, row, col, value);
+        set_cell_error(sheet, row, col, false);
         break; }
 
     case 'R':{
-        short r = cell->dependencies.first.i, c = cell->dependencies.first.j;
-        Cell *ref_cell = &sheet->cells[r][c];
-        if(ref_cell->has_error){
-            cell->has_error = true;
+        short r = deps.first.i, c = deps.first.j;
+        if(get_cell_error(sheet, r, c)){
+            set_cell_error(sheet, row, col, true);
             return 0;
         }
-        cell->value = ref_cell->value;
-        if (cell->is_sleep && cell->value > 0) sleep(cell->value);
-        cell->has_error=false;
+        int ref_value = get_cell_value(sheet, r, c);
+        set_cell_value(sheet, row, col, ref_value);
+        set_cell_error(sheet, row, col, false);
         break;}
     }
     return 0;
-}
\ No newline at end of file
+}
+// Kahn's algorithm over the cells in sheet->recalc_cells, each stamped with epoch and
+// numbered through recalc_slot; edges to unstamped cells are left out. queue receives
+// the slots in order. Returns how many were placed, fewer than all on a cycle.
+static int order_sort(Spreadsheet *sheet, unsigned int epoch, int *queue)
+{
+    Vector *cells = &sheet->recalc_cells;
+    Vector *edges = &sheet->recalc_edges;
+    int cols = sheet->totalCols;
+    int n = (int)cells->size;
+
+    int *offsets = (int *)malloc((n + 1) * sizeof(int));
+    int *in_degree = (int *)calloc(n + 1, sizeof(int));
+    if (!offsets || !in_degree)
+    {
+        fprintf(stderr, "Memory allocation failed for calc order\n");
+        exit(1);
+    }
+    edges->size = 0;
+    for (int k = 0; k < n; k++)
+    {
+        offsets[k] = (int)edges->size;
+        size_t base = edges->size;
+        collect_direct_dependents(sheet, cells->data[k].i, cells->data[k].j, edges);
+        size_t kept = base;
+        for (size_t e = base; e < edges->size; e++)
+            if (sheet->visit_mark[edges->data[e].i * cols + edges->data[e].j] == epoch)
+                edges->data[kept++] = edges->data[e];
+        edges->size = kept;
+    }
+    offsets[n] = (int)edges->size;
+    for (size_t k = 0; k < edges->size; k++)
+        in_degree[sheet->recalc_slot[edges->data[k].i * cols + edges->data[k].j]]++;
+
+    int head = 0, tail = 0;
+    for (int k = 0; k < n; k++)
+        if (in_degree[k] == 0)
+            queue[tail++] = k;
+    while (head < tail)
+    {
+        int k = queue[head++];
+        for (int e = offsets[k]; e < offsets[k + 1]; e++)
+        {
+            int next = sheet->recalc_slot[edges->data[e].i * cols + edges->data[e].j];
+            if (--in_degree[next] == 0)
+                queue[tail++] = next;
+        }
+    }
+    free(offsets);
+    free(in_degree);
+    return tail;
+}
+
+// Sort every formula cell into a fresh calc_order: the cells already in the chain
+// plus the new formulas among extra. Returns false, leaving calc_order untouched,
+// if the formulas contain a cycle.
+static bool order_rebuild(Spreadsheet *sheet, const Vector *extra)
+{
+    Vector *cells = &sheet->recalc_cells;
+    int cols = sheet->totalCols;
+    unsigned int epoch = sheet_next_epoch(sheet);
+
+    ensure_recalc_slots(sheet);
+    cells->size = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        const Vector *from = pass == 0 ? &sheet->calc_order : extra;
+        for (size_t k = 0; k < from->size; k++)
+        {
+            Pair p = from->data[k];
+            if (p.i < 0 || !get_formula(sheet, p.i, p.j) || sheet->visit_mark[p.i * cols + p.j] == epoch)
+                continue;
+            sheet->visit_mark[p.i * cols + p.j] = epoch;
+            sheet->recalc_slot[p.i * cols + p.j] = (int)cells->size;
+            vector_push_back(cells, p.i, p.j);
+        }
+    }
+
+    int n = (int)cells->size;
+    int *queue = (int *)malloc((n + 1) * sizeof(int));
+    if (!queue)
+    {
+        fprintf(stderr, "Memory allocation failed for calc order\n");
+        exit(1);
+    }
+    bool acyclic = order_sort(sheet, epoch, queue) == n;
+    if (acyclic)
+    {
+        sheet->calc_order.size = 0;
+        for (int k = 0; k < n; k++)
+            vector_push_back(&sheet->calc_order, cells->data[queue[k]].i, cells->data[queue[k]].j);
+        sheet->order_holes = 0;
+        order_renumber(sheet, 0, n - 1);
+    }
+    free(queue);
+    return acyclic;
+}
+
+typedef struct {
+    int lo;     // position of a formula
+    int hi;     // highest position of its precedents
+} OrderWindow;
+
+static int window_cmp(const void *a, const void *b)
+{
+    return ((const OrderWindow *)a)->lo - ((const OrderWindow *)b)->lo;
+}
+
+// Put the new formulas among cells (those without a position yet) into calc_order
+// as one block, ahead of the first cell that reads any of them
+static void order_insert_fresh(Spreadsheet *sheet, const Vector *cells)
+{
+    Vector *order = &sheet->calc_order;
+    Vector *stack = &sheet->walk_stack;
+    int first = (int)order->size;
+
+    stack->size = 0;
+    for (size_t k = 0; k < cells->size; k++)
+        if (get_topo_order(sheet, cells->data[k].i, cells->data[k].j) < 0)
+            collect_direct_dependents(sheet, cells->data[k].i, cells->data[k].j, stack);
+    for (size_t k = 0; k < stack->size; k++)
+    {
+        int pos = get_topo_order(sheet, stack->data[k].i, stack->data[k].j);
+        if (pos >= 0 && pos < first)
+            first = pos;
+    }
+
+    stack->size = 0;
+    for (size_t k = 0; k < cells->size; k++)
+        if (get_topo_order(sheet, cells->data[k].i, cells->data[k].j) < 0)
+            vector_push_back(stack, cells->data[k].i, cells->data[k].j);
+    if (stack->size == 0)
+        return;
+    int tail = (int)order->size - first;
+    for (size_t k = 0; k < stack->size; k++)
+        vector_push_back(order, -1, -1);
+    memmove(&order->data[first + stack->size], &order->data[first], tail * sizeof(Pair));
+    memcpy(&order->data[first], stack->data, stack->size * sizeof(Pair));
+    order_renumber(sheet, first, (int)order->size - 1);
+    stack->size = 0;
+}
+
+// Repair calc_order for the formulas a batch edited, the way check_circular_dependencies
+// does for one. Every edge into a cell outside dirty still climbs the order, so only an
+// edited formula placed before one of its precedents breaks it, across the window from
+// its position to that precedent. Overlapping windows merge; within each, the cells
+// reached from its formulas are sorted with Kahn's algorithm and moved behind the rest
+// of the window. Windows that do not overlap cannot reach each other. Returns false if
+// the edits closed a loop.
+static bool order_repair(Spreadsheet *sheet, const Vector *dirty)
+{
+    Vector *order = &sheet->calc_order;
+    Vector *cells = &sheet->recalc_cells;
+    Vector *stack = &sheet->walk_stack;
+    int cols = sheet->totalCols;
+    unsigned int epoch = sheet_next_epoch(sheet);
+
+    ensure_recalc_slots(sheet);
+    cells->size = 0;
+    for (size_t k = 0; k < dirty->size; k++)
+    {
+        Pair p = dirty->data[k];
+        if (!get_formula(sheet, p.i, p.j) || sheet->visit_mark[p.i * cols + p.j] == epoch)
+            continue;
+        sheet->visit_mark[p.i * cols + p.j] = epoch;
+        vector_push_back(cells, p.i, p.j);
+    }
+    order_insert_fresh(sheet, cells);
+
+    OrderWindow *windows = (OrderWindow *)malloc((cells->size + 1) * sizeof(OrderWindow));
+    if (!windows)
+    {
+        fprintf(stderr, "Memory allocation failed for calc order\n");
+        exit(1);
+    }
+    int num_windows = 0;
+    bool acyclic = true;
+    for (size_t k = 0; acyclic && k < cells->size; k++)
+    {
+        CellContents contents;
+        load_cell_contents(sheet, cells->data[k].i, cells->data[k].j, &contents);
+        int lo = get_topo_order(sheet, contents.row, contents.col);
+        int hi = highest_precedent_after(sheet, &contents, lo);
+        acyclic = !reads_cell(sheet, &contents, contents.row, contents.col);
+        if (hi >= 0)
+            windows[num_windows++] = (OrderWindow){lo, hi};
+    }
+    qsort(windows, num_windows, sizeof(OrderWindow), window_cmp);
+
+    for (int w = 0; acyclic && w < num_windows;)
+    {
+        int lo = windows[w].lo, hi = windows[w].hi;
+        epoch = sheet_next_epoch(sheet);
+        stack->size = 0;
+        for (; w < num_windows && windows[w].lo <= hi; w++)
+        {
+            if (windows[w].hi > hi)
+                hi = windows[w].hi;
+            vector_push_back(stack, order->data[windows[w].lo].i, order->data[windows[w].lo].j);
+        }
+
+        // Cells past the window cannot lead back into it
+        cells->size = 0;
+        while (stack->size > 0)
+        {
+            Pair p = stack->data[--stack->size];
+            if (sheet->visit_mark[p.i * cols + p.j] == epoch)
+                continue;
+            sheet->visit_mark[p.i * cols + p.j] = epoch;
+            sheet->recalc_slot[p.i * cols + p.j] = (int)cells->size;
+            vector_push_back(cells, p.i, p.j);
+
+            size_t base = stack->size;
+            collect_direct_dependents(sheet, p.i, p.j, stack);
+            size_t kept = base;
+            for (size_t k = base; k < stack->size; k++)
+            {
+                Pair d = stack->data[k];
+                if (get_topo_order(sheet, d.i, d.j) <= hi)
+                    stack->data[kept++] = d;
+            }
+            stack->size = kept;
+        }
+
+        int n = (int)cells->size;
+        int *queue = (int *)malloc((n + 1) * sizeof(int));
+        if (!queue)
+        {
+            fprintf(stderr, "Memory allocation failed for calc order\n");
+            exit(1);
+        }
+        acyclic = order_sort(sheet, epoch, queue) == n;
+        if (acyclic)
+        {
+            // Untouched cells (and holes) keep their order, reached cells follow them sorted
+            for (int k = lo; k <= hi; k++)
+            {
+                Pair p = order->data[k];
+                if (p.i < 0 || sheet->visit_mark[p.i * cols + p.j] != epoch)
+                    vector_push_back(stack, p.i, p.j);
+            }
+            for (int k = 0; k < n; k++)
+                vector_push_back(stack, cells->data[queue[k]].i, cells->data[queue[k]].j);
+            memcpy(&order->data[lo], stack->data, (hi - lo + 1) * sizeof(Pair));
+            order_renumber(sheet, lo, hi);
+            stack->size = 0;
+        }
+        free(queue);
+    }
+    free(windows);
+    return acyclic;
+}
+
+// Bring calc_order up to date after a batch edited the cells in dirty. A batch that
+// touches a good part of the sheet is cheaper to sort from scratch.
+static bool order_update(Spreadsheet *sheet, const Vector *dirty)
+{
+    if (dirty->size * 4 >= sheet->calc_order.size - sheet->order_holes)
+        return order_rebuild(sheet, dirty);
+    return order_repair(sheet, dirty);
+}
+
+void batch_begin(Spreadsheet *sheet)
+{
+    sheet->batch.depth++;
+}
+
+// Remember what a cell held before its first (or any later) edit in the batch
+void batch_record(Spreadsheet *sheet, const CellContents *old, int old_value, bool old_error)
+{
+    Batch *batch = &sheet->batch;
+    if (batch->undo_size == batch->undo_capacity)
+    {
+        batch->undo_capacity = batch->undo_capacity ? batch->undo_capacity * 2 : 64;
+        batch->undo = (BatchUndo *)realloc(batch->undo, batch->undo_capacity * sizeof(BatchUndo));
+        if (!batch->undo)
+        {
+            fprintf(stderr, "Memory allocation failed for batch undo log\n");
+            exit(1);
+        }
+    }
+    BatchUndo *u = &batch->undo[batch->undo_size++];
+    u->contents = *old;
+    if (old->type == 'X')
+        program_retain(sheet, old->op_data.expression.program);
+    u->value = old_value;
+    u->has_error = old_error;
+    vector_push_back(&batch->dirty, old->row, old->col);
+}
+
+// Put every edited cell back the way it was, newest edit first. Each program the
+// undo log kept alive goes back to its cell.
+static void batch_rollback(Spreadsheet *sheet)
+{
+    Batch *batch = &sheet->batch;
+    for (size_t k = batch->undo_size; k-- > 0;)
+    {
+        const BatchUndo *u = &batch->undo[k];
+        short row = u->contents.row, col = u->contents.col;
+        CellContents current, target = u->contents;
+        PairOfPair deps = target.dependencies;
+        load_cell_contents(sheet, row, col, &current);
+        int value = get_cell_value(sheet, row, col);
+        bool has_error = get_cell_error(sheet, row, col);
+
+        update_dependencies(&target, target.type != 'C', &deps, sheet, &current);
+        set_cell_value(sheet, row, col, u->value);
+        set_cell_error(sheet, row, col, u->has_error);
+        notify_value_change(sheet, row, col, value, has_error);
+    }
+}
+
+// Close one begin. The outermost commit repairs the order once, then recalculates
+// every edited formula and everything downstream of the edited cells in one sweep.
+// If the batch left a cycle, all of its edits are undone instead.
+CalcStatus batch_commit(Spreadsheet *sheet)
+{
+    Batch *batch = &sheet->batch;
+    if (batch->depth == 0)
+        return ERR_SYNTAX;
+    if (--batch->depth > 0)
+        return STATUS_OK;
+
+    if (!order_update(sheet, &batch->dirty))
+    {
+        batch->depth = 1;
+        batch_abort(sheet);
+        return ERR_CIRCULAR_REFERENCE;
+    }
+
+    // Sleeping constants written in the batch all start their sleep now
+    Vector *found = &sheet->walk_stack;
+    Vector sleepers;
+    vector_init(&sleepers);
+    found->size = 0;
+    for (size_t k = 0; k < batch->dirty.size; k++)
+    {
+        Pair p = batch->dirty.data[k];
+        if (get_formula(sheet, p.i, p.j))
+            vector_push_back(found, p.i, p.j);
+        else if (sleep_seconds(sheet, p.i, p.j) > 0)
+            vector_push_back(&sleepers, p.i, p.j);
+        collect_direct_dependents(sheet, p.i, p.j, found);
+    }
+    recalc_queued(sheet, &sleepers);
+    vector_free(&sleepers);
+    for (size_t k = 0; k < batch->undo_size; k++)
+        if (batch->undo[k].contents.type == 'X')
+            program_release(sheet, batch->undo[k].contents.op_data.expression.program);
+
+    batch->undo_size = 0;
+    batch->dirty.size = 0;
+    return STATUS_OK;
+}
+
+// Close every open begin and undo all edits of the batch
+void batch_abort(Spreadsheet *sheet)
+{
+    Batch *batch = &sheet->batch;
+    if (batch->depth == 0)
+        return;
+
+    // Rolling back inside the batch keeps cycle checks off while the edits unwind
+    batch->depth = 1;
+    batch_rollback(sheet);
+    batch->depth = 0;
+    order_update(sheet, &batch->dirty);
+    batch->undo_size = 0;
+    batch->dirty.size = 0;
+}
@@ -0,0 +1,325 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../Declarations/csv.h"
+#include "../Declarations/backend.h"
+#include "../Declarations/parser.h"
+#include "../Declarations/threadpool.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CSV_MIN_CHUNK (256 * 1024)     // smaller slices cost more to schedule than to parse
+#define CSV_CHUNKS_PER_THREAD 4
+
+// A slice of the file that starts and ends on line boundaries
+typedef struct {
+    const char *begin, *end;
+    int first_row;      // row of the block its first line lands in
+    int lines;
+    int width;          // most fields on any of its lines
+    bool bad;           // a field that is not an integer
+} CsvChunk;
+
+// Parsed block, validated before the sheet is touched: lines x width values with a
+// flag per field that was not empty
+typedef struct {
+    CsvChunk *chunks;
+    int width;
+    int *values;
+    unsigned char *present;
+} CsvJob;
+
+static const char *line_end(const char *p, const char *end)
+{
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    return nl ? nl : end;
+}
+
+static void count_chunk(void *ctx, int k)
+{
+    CsvChunk *chunk = &((CsvJob *)ctx)->chunks[k];
+    const char *p = chunk->begin;
+    while (p < chunk->end)
+    {
+        const char *eol = line_end(p, chunk->end);
+        int fields = 1;
+        for (const char *q = p; q < eol; q++)
+            fields += (*q == ',');
+        if (fields > chunk->width)
+            chunk->width = fields;
+        chunk->lines++;
+        p = eol + 1;
+    }
+}
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Parse one field of [p, eol) into *value. Returns the position after it (at the
+// comma or eol), or NULL if the field is neither empty nor an integer.
+static const char *parse_field(const char *p, const char *eol, int *value, bool *present)
+{
+    while (p < eol && is_blank(*p))
+        p++;
+    *present = false;
+    if (p == eol || *p == ',')
+        return p;
+
+    bool negative = false;
+    if (*p == '+' || *p == '-')
+        negative = (*p++ == '-');
+    if (p == eol || !isdigit((unsigned char)*p))
+        return NULL;
+
+    int64_t v = 0;
+    while (p < eol && isdigit((unsigned char)*p))
+    {
+        v = v * 10 + (*p++ - '0');
+        if (v > (int64_t)INT_MAX + 1)
+            return NULL;
+    }
+    if (!negative && v > INT_MAX)
+        return NULL;
+    while (p < eol && is_blank(*p))
+        p++;
+    if (p < eol && *p != ',')
+        return NULL;
+
+    *value = (int)(negative ? -v : v);
+    *present = true;
+    return p;
+}
+
+static void parse_chunk(void *ctx, int k)
+{
+    CsvJob *job = (CsvJob *)ctx;
+    CsvChunk *chunk = &job->chunks[k];
+    const char *p = chunk->begin;
+    size_t at = (size_t)chunk->first_row * job->width;
+
+    while (p < chunk->end)
+    {
+        const char *eol = line_end(p, chunk->end);
+        for (int f = 0;; f++)
+        {
+            bool present;
+            p = parse_field(p, eol, &job->values[at + f], &present);
+            if (!p)
+            {
+                chunk->bad = true;
+                return;
+            }
+            job->present[at + f] = present;
+            if (p == eol)
+                break;
+            p++;
+        }
+        at += job->width;
+        p = eol + 1;
+    }
+}
+
+// A cell about to receive an imported number stops being a formula (or a sleeper)
+static void make_constant(Spreadsheet *sheet, short row, short col)
+{
+    CellContents old, contents;
+    load_cell_contents(sheet, row, col, &old);
+    contents = old;
+    contents.type = 'C';
+    contents.is_sleep = false;
+    PairOfPair none = {{-1, -1}, {-1, -1}};
+    update_dependencies(&contents, false, &none, sheet, &old);
+}
+
+// Write the validated block and bring every index up to date with one pass each,
+// instead of the per-cell delta updates a normal assignment makes
+static void apply_block(Spreadsheet *sheet, const CsvJob *job, int lines, short row, short col)
+{
+    int width = job->width;
+    RangeSums *rs = &sheet->range_sums;
+
+    // Rebuilding the Fenwick trees is linear in the sheet; per-cell updates cost a
+    // log^2 each, so only large blocks are worth a rebuild
+    bool rebuild_sums = rs->enabled && (size_t)lines * width * 64 >= (size_t)sheet->totalRows * sheet->totalCols;
+    if (rebuild_sums)
+        range_sums_disable(sheet);
+
+    for (int r = 0; r < lines; r++)
+        for (int f = 0; f < width; f++)
+        {
+            size_t k = (size_t)r * width + f;
+            if (!job->present[k])
+                continue;
+            short R = row + r, C = col + f;
+            if (sheet->batch.depth > 0)
+            {
+                CellContents old;
+                load_cell_contents(sheet, R, C, &old);
+                batch_record(sheet, &old, get_cell_value(sheet, R, C), get_cell_error(sheet, R, C));
+            }
+            const Cell *cell = get_cell(sheet, R, C);
+            if (cell->formula != 0 || cell->is_sleep)
+                make_constant(sheet, R, C);
+
+            uint32_t old = (uint32_t)get_cell_value(sheet, R, C);
+            int old_error = get_cell_error(sheet, R, C);
+            uint32_t v = (uint32_t)job->values[k];
+            set_cell_value(sheet, R, C, job->values[k]);
+            set_cell_error(sheet, R, C, false);
+            if (rs->enabled)
+                range_sums_add(sheet, R, C, v - old, v * v - old * old, -old_error);
+        }
+
+    if (rebuild_sums)
+        range_sums_enable(sheet);
+    for (int f = 0; f < width; f++)
+        extrema_rebuild(sheet, col + f);
+
+    // Range formulas over the block rescan it; single-cell readers come from the
+    // dependents of each written cell. Collected only now, after every formula in
+    // the block has become a constant.
+    Vector seeds;
+    vector_init(&seeds);
+    PairOfPair rect = {{row, col}, {row + lines - 1, col + width - 1}};
+    range_overlap(sheet->range_dependents, rect, &seeds);
+    for (size_t k = 0; k < seeds.size; k++)
+    {
+        Formula *reader = get_formula(sheet, seeds.data[k].i, seeds.data[k].j);
+        if (get_cell(sheet, seeds.data[k].i, seeds.data[k].j)->type == 'F')
+            sheet->aggregates[reader->agg_slot].valid = false;
+    }
+    // Inside a batch the written cells are already marked dirty for the commit
+    if (sheet->batch.depth > 0)
+    {
+        vector_free(&seeds);
+        return;
+    }
+    for (int r = 0; r < lines; r++)
+        for (int f = 0; f < width; f++)
+            if (job->present[(size_t)r * width + f])
+                depset_collect(&get_cell(sheet, row + r, col + f)->dependents, &seeds);
+
+    recalc_formulas(sheet, &seeds);
+    vector_free(&seeds);
+}
+
+CalcStatus csv_import(Spreadsheet *sheet, const char *path, short row, short col)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return ERR_IO;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return ERR_IO;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        return STATUS_OK;
+    }
+    const char *base = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return ERR_IO;
+    posix_madvise((void *)base, size, POSIX_MADV_SEQUENTIAL);
+    const char *end = base + size;
+
+    // Cut the file into line-aligned slices, a few per thread
+    int num_chunks = threadpool_size() * CSV_CHUNKS_PER_THREAD;
+    if ((size_t)num_chunks > size / CSV_MIN_CHUNK)
+        num_chunks = size / CSV_MIN_CHUNK > 0 ? (int)(size / CSV_MIN_CHUNK) : 1;
+    CsvChunk *chunks = (CsvChunk *)calloc(num_chunks, sizeof(CsvChunk));
+    if (!chunks)
+    {
+        fprintf(stderr, "Memory allocation failed for CSV import\n");
+        exit(1);
+    }
+    const char *p = base;
+    for (int k = 0; k < num_chunks; k++)
+    {
+        const char *cut = k == num_chunks - 1 ? end : base + size / num_chunks * (k + 1);
+        if (cut < p)
+            cut = p;
+        if (cut < end)
+        {
+            cut = line_end(cut, end);
+            if (cut < end)
+                cut++;
+        }
+        chunks[k].begin = p;
+        chunks[k].end = cut;
+        p = cut;
+    }
+
+    CsvJob job = {chunks, 0, NULL, NULL};
+    threadpool_run_each(num_chunks, count_chunk, &job);
+    int lines = 0;
+    for (int k = 0; k < num_chunks; k++)
+    {
+        chunks[k].first_row = lines;
+        lines += chunks[k].lines;
+        if (chunks[k].width > job.width)
+            job.width = chunks[k].width;
+    }
+
+    CalcStatus status = STATUS_OK;
+    if (row + lines > sheet->totalRows || col + job.width > sheet->totalCols)
+        status = ERR_INVALID_RANGE;
+    else if (lines > 0)
+    {
+        size_t cells = (size_t)lines * job.width;
+        job.values = (int *)malloc(cells * sizeof(int));
+        job.present = (unsigned char *)calloc(cells, 1);
+        if (!job.values || !job.present)
+        {
+            fprintf(stderr, "Memory allocation failed for CSV import\n");
+            exit(1);
+        }
+        threadpool_run_each(num_chunks, parse_chunk, &job);
+        for (int k = 0; k < num_chunks; k++)
+            if (chunks[k].bad)
+                status = ERR_SYNTAX;
+    }
+    munmap((void *)base, size);
+
+    if (status == STATUS_OK && lines > 0)
+        apply_block(sheet, &job, lines, row, col);
+    free(job.values);
+    free(job.present);
+    free(chunks);
+    return status;
+}
+
+void csv_import_command(Spreadsheet *sheet, char *args)
+{
+    while (*args == ' ')
+        args++;
+    char *end = args + strlen(args);
+    while (end > args && end[-1] == ' ')
+        *--end = '\0';
+
+    // The anchor is the last " at <cell>", so a path may itself contain spaces
+    int row = 0, col = 0, constant;
+    char *at = NULL;
+    for (char *s = strstr(args, " at "); s; s = strstr(s + 1, " at "))
+        at = s;
+    if (at)
+    {
+        *at = '\0';
+        if (check_constant_or_cell_address(at + 4, &constant, &row, &col, sheet) != 1)
+        {
+            sheet->last_status = ERR_INVALID_CELL;
+            return;
+        }
+    }
+    if (*args == '\0')
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return;
+    }
+    sheet->last_status = csv_import(sheet, args, row, col);
+}
@@ -1,3 +1,5 @@
+#define _DEFAULT_SOURCE
+#include <sys/mman.h>
 #include "../Declarations/ds.h"
 #include "../Declarations/frontend.h"
 
@@ -173,6 +175,108 @@ Pair* vector_iterator_next(VectorIterator* iterator) {
 
 
 
+// Size classes served by the node pool; requests round up to the nearest one
+static const size_t pool_class_sizes[POOL_NUM_CLASSES] = {16, 32, 48, 64, 128, 256};
+
+// Slab header is padded so objects stay 16-byte aligned
+#define POOL_SLAB_HEADER ((sizeof(PoolSlab) + 15) & ~(size_t)15)
+
+static PoolClass* pool_class_for(NodePool* pool, size_t size) {
+    for (int k = 0; k < POOL_NUM_CLASSES; k++) {
+        if (size <= pool->classes[k].obj_size)
+            return &pool->classes[k];
+    }
+    return NULL;
+}
+
+void pool_init(NodePool* pool) {
+    for (int k = 0; k < POOL_NUM_CLASSES; k++) {
+        PoolClass* cls = &pool->classes[k];
+        cls->obj_size = pool_class_sizes[k];
+        cls->free_list = NULL;
+        cls->slabs = NULL;
+        cls->bump = cls->bump_end = NULL;
+        cls->capacity = 0;
+        cls->live = 0;
+    }
+    pool->live = 0;
+    pool->peak = 0;
+}
+
+void* pool_alloc(NodePool* pool, size_t size) {
+    PoolClass* cls = pool_class_for(pool, size);
+    if (!cls) return malloc(size);
+
+    void* obj;
+    if (cls->free_list) {
+        // Reuse a released object first
+        obj = cls->free_list;
+        cls->free_list = *(void**)obj;
+    } else {
+        if (cls->bump == cls->bump_end) {
+            PoolSlab* slab = (PoolSlab*)malloc(POOL_SLAB_BYTES);
+            if (!slab) {
+                fprintf(stderr, "Memory allocation failed for node pool\n");
+                exit(1);
+            }
+            slab->next = cls->slabs;
+            cls->slabs = slab;
+            cls->bump = (char*)slab + POOL_SLAB_HEADER;
+            size_t count = (POOL_SLAB_BYTES - POOL_SLAB_HEADER) / cls->obj_size;
+            cls->bump_end = cls->bump + count * cls->obj_size;
+            cls->capacity += count;
+        }
+        obj = cls->bump;
+        cls->bump += cls->obj_size;
+    }
+
+    cls->live++;
+    // The classes peak at different times, so only the total has a true peak
+    if (++pool->live > pool->peak)
+        pool->peak = pool->live;
+    return obj;
+}
+
+void pool_release(NodePool* pool, void* ptr, size_t size) {
+    if (!ptr) return;
+    PoolClass* cls = pool_class_for(pool, size);
+    if (!cls) {
+        free(ptr);
+        return;
+    }
+    *(void**)ptr = cls->free_list;
+    cls->free_list = ptr;
+    cls->live--;
+    pool->live--;
+}
+
+void pool_stats(const NodePool* pool, PoolStats* stats) {
+    stats->live = pool->live;
+    stats->peak = pool->peak;
+    stats->free = stats->bytes = 0;
+    for (int k = 0; k < POOL_NUM_CLASSES; k++) {
+        const PoolClass* cls = &pool->classes[k];
+        stats->free += cls->capacity - cls->live;
+        for (PoolSlab* slab = cls->slabs; slab; slab = slab->next)
+            stats->bytes += POOL_SLAB_BYTES;
+    }
+}
+
+// Hand every slab back at once; objects still live are dropped with them
+void pool_destroy(NodePool* pool) {
+    for (int k = 0; k < POOL_NUM_CLASSES; k++) {
+        PoolSlab* slab = pool->classes[k].slabs;
+        while (slab) {
+            PoolSlab* next = slab->next;
+            free(slab);
+            slab = next;
+        }
+    }
+    pool_init(pool);
+}
+
+
+
 // Get height with null check
 static inline unsigned char height(AVLNode* node) {
     return node ? node->height : 0;
@@ -192,8 +296,8 @@ static inline void update_node(AVLNode* node) {
     node->height = 1 + (h_left > h_right ? h_left : h_right);
 }
 // Create a new AVL node
-AVLNode* avl_create_node(short row, short col) {
-    AVLNode* node = (AVLNode*)malloc(sizeof(AVLNode));
+AVLNode* avl_create_node(NodePool* pool, short row, short col) {
+    AVLNode* node = (AVLNode*)pool_alloc(pool, sizeof(AVLNode));
     if (!node) return NULL;
     
     node->pair.i = row;
@@ -229,17 +333,17 @@ static AVLNode* left_rotate(AVLNode* x) {
     return y;
 }
 // AVL tree node insertion - returns new root
-AVLNode* avl_insert(AVLNode* root, short row, short col) {
+AVLNode* avl_insert(NodePool* pool, AVLNode* root, short row, short col) {
     if (!root)
-        return avl_create_node(row, col);
+        return avl_create_node(pool, row, col);
 
     Pair new_pair = {row, col};
     short cmp = compare_pairs(new_pair, root->pair);
     
     if (cmp < 0)
-        root->left = avl_insert(root->left, row, col);
+        root->left = avl_insert(pool, root->left, row, col);
     else if (cmp > 0)
-        root->right = avl_insert(root->right, row, col);
+        root->right = avl_insert(pool, root->right, row, col);
     else
         return root; // No duplicates
     
@@ -296,16 +400,16 @@ static AVLNode* min_value_node(AVLNode* node) {
     return current;
 }
 // Remove a node from AVL tree
-AVLNode* avl_remove(AVLNode* root, short row, short col) {
+AVLNode* avl_remove(NodePool* pool, AVLNode* root, short row, short col) {
     if (!root) return NULL;
     
     Pair remove_pair = {row, col};
     short cmp = compare_pairs(remove_pair, root->pair);
     
     if (cmp < 0)
-        root->left = avl_remove(root->left, row, col);
+        root->left = avl_remove(pool, root->left, row, col);
     else if (cmp > 0)
-        root->right = avl_remove(root->right, row, col);
+        root->right = avl_remove(pool, root->right, row, col);
     else {
         // Node with only one child or no child
         if (!root->left || !root->right) {
@@ -320,12 +424,12 @@ AVLNode* avl_remove(AVLNode* root, short row, short col) {
                 *root = *temp; // Copy contents
             }
             
-            free(temp);
+            pool_release(pool, temp, sizeof(AVLNode));
         } else {
             // Node with two children
             AVLNode* temp = min_value_node(root->right);
             root->pair = temp->pair;
-            root->right = avl_remove(root->right, temp->pair.i, temp->pair.j);
+            root->right = avl_remove(pool, root->right, temp->pair.i, temp->pair.j);
         }
     }
     
@@ -358,95 +462,426 @@ AVLNode* avl_remove(AVLNode* root, short row, short col) {
     return root;
 }
 // Free the entire AVL tree
-void avl_free(AVLNode* root) {
+void avl_free(NodePool* pool, AVLNode* root) {
     if (root) {
-        avl_free(root->left);
-        avl_free(root->right);
-        free(root);
+        avl_free(pool, root->left);
+        avl_free(pool, root->right);
+        pool_release(pool, root, sizeof(AVLNode));
         root = NULL;
     }
 }
+// Append every pair of the tree to out, in sorted order
+void avl_collect(AVLNode* root, Vector* out) {
+    if (!root) return;
+    avl_collect(root->left, out);
+    vector_push_back(out, root->pair.i, root->pair.j);
+    avl_collect(root->right, out);
+}
 
 
 
+// Array capacity for a spilled set of n pairs (powers of two, matching pool classes)
+static inline size_t depset_capacity(unsigned int n) {
+    size_t cap = 4;
+    while (cap < n)
+        cap <<= 1;
+    return cap;
+}
 
-void topologic_util(Cell* currcell, Vector* adjList, char* visited, Vector* sorted, Spreadsheet* sheet) {
-    // Mark current cell as visited
-    visited[currcell->topo_order] = 1;
-    
-    // Process all adjacent cells (dependencies)
-    VectorIterator it;
-    vector_iterator_init(&it, &adjList[currcell->topo_order]);
-    while(vector_iterator_has_next(&it)) {
-        Pair* adjcell = vector_iterator_next(&it);
-        // Only process if not already visited
-        if (visited[sheet->cells[adjcell->i][adjcell->j].topo_order] == 0) {
-            topologic_util(&sheet->cells[adjcell->i][adjcell->j], adjList, visited, sorted, sheet);
+// Position of (row, col) in a sorted run, or where it would be inserted
+static size_t depset_lower_bound(const Pair* items, size_t count, Pair key) {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (compare_pairs(items[mid], key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Sorted pairs of an inline or array set
+static inline Pair* depset_items(DepSet* set) {
+    return set->size <= DEPSET_INLINE ? set->u.items : set->u.array;
+}
+
+// Copy every pair of a tree into dst in sorted order
+static Pair* avl_flatten(AVLNode* root, Pair* dst) {
+    if (!root) return dst;
+    dst = avl_flatten(root->left, dst);
+    *dst++ = root->pair;
+    return avl_flatten(root->right, dst);
+}
+
+void depset_init(DepSet* set) {
+    set->u.tree = NULL;
+    set->size = 0;
+}
+
+unsigned int depset_size(const DepSet* set) {
+    return set->size;
+}
+
+bool depset_find(const DepSet* set, short row, short col) {
+    Pair key = {row, col};
+    if (set->size > DEPSET_TREE_MIN)
+        return avl_find(set->u.tree, row, col) != NULL;
+
+    const Pair* items = set->size <= DEPSET_INLINE ? set->u.items : set->u.array;
+    size_t pos = depset_lower_bound(items, set->size, key);
+    return pos < set->size && compare_pairs(items[pos], key) == 0;
+}
+
+void depset_insert(NodePool* pool, DepSet* set, short row, short col) {
+    Pair key = {row, col};
+
+    if (set->size > DEPSET_TREE_MIN) {
+        if (avl_find(set->u.tree, row, col)) return;
+        set->u.tree = avl_insert(pool, set->u.tree, row, col);
+        set->size++;
+        return;
+    }
+
+    Pair* items = depset_items(set);
+    size_t pos = depset_lower_bound(items, set->size, key);
+    if (pos < set->size && compare_pairs(items[pos], key) == 0)
+        return; // No duplicates
+
+    unsigned int n = set->size;
+    if (n == DEPSET_TREE_MIN) {
+        // Array is full: move everything into a tree
+        AVLNode* tree = NULL;
+        for (unsigned int k = 0; k < n; k++)
+            tree = avl_insert(pool, tree, items[k].i, items[k].j);
+        tree = avl_insert(pool, tree, row, col);
+        pool_release(pool, items, depset_capacity(n) * sizeof(Pair));
+        set->u.tree = tree;
+        set->size = n + 1;
+        return;
+    }
+
+    if (n < DEPSET_INLINE) {
+        memmove(&items[pos + 1], &items[pos], (n - pos) * sizeof(Pair));
+        items[pos] = key;
+        set->size = n + 1;
+        return;
+    }
+
+    // Spilled (or about to spill) array; regrow when the capacity class changes
+    Pair* dst = items;
+    if (n == DEPSET_INLINE || depset_capacity(n + 1) != depset_capacity(n)) {
+        dst = (Pair*)pool_alloc(pool, depset_capacity(n + 1) * sizeof(Pair));
+        memcpy(dst, items, pos * sizeof(Pair));
+    }
+    memmove(&dst[pos + 1], &items[pos], (n - pos) * sizeof(Pair));
+    dst[pos] = key;
+    if (dst != items && n > DEPSET_INLINE)
+        pool_release(pool, items, depset_capacity(n) * sizeof(Pair));
+    set->u.array = dst;
+    set->size = n + 1;
+}
+
+void depset_remove(NodePool* pool, DepSet* set, short row, short col) {
+    Pair key = {row, col};
+    unsigned int n = set->size;
+
+    if (n > DEPSET_TREE_MIN) {
+        if (!avl_find(set->u.tree, row, col)) return;
+        AVLNode* tree = avl_remove(pool, set->u.tree, row, col);
+        if (n - 1 > DEPSET_TREE_MIN) {
+            set->u.tree = tree;
+            set->size = n - 1;
+            return;
         }
+        // Back under the threshold: flatten into an array
+        Pair* array = (Pair*)pool_alloc(pool, depset_capacity(n - 1) * sizeof(Pair));
+        avl_flatten(tree, array);
+        avl_free(pool, tree);
+        set->u.array = array;
+        set->size = n - 1;
+        return;
+    }
+
+    Pair* items = depset_items(set);
+    size_t pos = depset_lower_bound(items, n, key);
+    if (pos >= n || compare_pairs(items[pos], key) != 0)
+        return;
+
+    if (n <= DEPSET_INLINE) {
+        memmove(&items[pos], &items[pos + 1], (n - pos - 1) * sizeof(Pair));
+        set->size = n - 1;
+        return;
     }
-    // Add current cell to sorted list after processing all dependencies
-    vector_push_back(sorted, currcell->row, currcell->col);
+
+    Pair* dst = items;
+    if (n - 1 == DEPSET_INLINE)
+        dst = set->u.items; // Moves back inline (overlaps the array pointer, copy first)
+    else if (depset_capacity(n - 1) != depset_capacity(n))
+        dst = (Pair*)pool_alloc(pool, depset_capacity(n - 1) * sizeof(Pair));
+
+    if (dst == items) {
+        memmove(&items[pos], &items[pos + 1], (n - pos - 1) * sizeof(Pair));
+    } else {
+        Pair tmp[DEPSET_TREE_MIN];
+        memcpy(tmp, items, pos * sizeof(Pair));
+        memcpy(&tmp[pos], &items[pos + 1], (n - pos - 1) * sizeof(Pair));
+        pool_release(pool, items, depset_capacity(n) * sizeof(Pair));
+        memcpy(dst, tmp, (n - 1) * sizeof(Pair));
+        if (dst != set->u.items)
+            set->u.array = dst;
+    }
+    set->size = n - 1;
 }
 
+void depset_free(NodePool* pool, DepSet* set) {
+    if (set->size > DEPSET_TREE_MIN)
+        avl_free(pool, set->u.tree);
+    else if (set->size > DEPSET_INLINE)
+        pool_release(pool, set->u.array, depset_capacity(set->size) * sizeof(Pair));
+    depset_init(set);
+}
 
-void topological_sort(Vector* adjList, int numVertices, Pair** cell_map, Vector* result, Spreadsheet* sheet) {
-    // Initialize visited set to track processed cells
-    char *visited = (char*)malloc((numVertices+1) *sizeof(char));
-    if (!visited) {
-        fprintf(stderr, "Memory allocation failed for visited array\n");
-        exit(1);
+// Append every pair of the set to out, in sorted order
+void depset_collect(const DepSet* set, Vector* out) {
+    DepSetIterator it;
+    depset_iterator_init(&it, set);
+    while (depset_iterator_has_next(&it)) {
+        Pair* p = depset_iterator_next(&it);
+        vector_push_back(out, p->i, p->j);
     }
-    for (int i = 1; i <= numVertices; i++)
-    {
-        visited[i] = 0;
+}
+
+static void depset_iterator_push_left(DepSetIterator* iterator, AVLNode* node) {
+    while (node) {
+        iterator->stack[iterator->top++] = node;
+        node = node->left;
     }
-    
+}
+
+void depset_iterator_init(DepSetIterator* iterator, const DepSet* set) {
+    iterator->index = 0;
+    iterator->top = 0;
+    if (set->size > DEPSET_TREE_MIN) {
+        iterator->items = NULL;
+        iterator->count = 0;
+        depset_iterator_push_left(iterator, set->u.tree);
+    } else {
+        iterator->items = set->size <= DEPSET_INLINE ? set->u.items : set->u.array;
+        iterator->count = set->size;
+    }
+}
+
+bool depset_iterator_has_next(DepSetIterator* iterator) {
+    return iterator->index < iterator->count || iterator->top > 0;
+}
+
+Pair* depset_iterator_next(DepSetIterator* iterator) {
+    if (iterator->index < iterator->count)
+        return (Pair*)&iterator->items[iterator->index++];
+    if (iterator->top == 0) return NULL;
+
+    AVLNode* node = iterator->stack[--iterator->top];
+    depset_iterator_push_left(iterator, node->right);
+    return &node->pair;
+}
 
-    // Initialize result vector
-    Vector sorted;
-    vector_init(&sorted);
-
-    // Process all vertices
-    for (int index = 1; index <= numVertices; index++) {
-        // The cell that has this topo_order
-        Cell* current = &sheet->cells[(*cell_map)[index].i][(*cell_map)[index].j];
-        // If it hasn't been visited, process it
-        if (current != NULL && visited[current->topo_order] == 0) {
-            topologic_util(current, adjList, visited, &sorted, sheet);
+
+// Range index ordering: top row of the rectangle first, owner breaks ties
+static int compare_ranges(PairOfPair ra, Pair oa, PairOfPair rb, Pair ob) {
+    if (ra.first.i != rb.first.i) {
+        return ra.first.i - rb.first.i;
+    }
+    return compare_pairs(oa, ob);
+}
+static inline unsigned char range_height(RangeNode* node) {
+    return node ? node->height : 0;
+}
+static inline int range_balance(RangeNode* node) {
+    return node ? range_height(node->left) - range_height(node->right) : 0;
+}
+// Update height and subtree extent of a node
+static inline void range_update_node(RangeNode* node) {
+    unsigned char h_left = range_height(node->left);
+    unsigned char h_right = range_height(node->right);
+    node->height = 1 + (h_left > h_right ? h_left : h_right);
+
+    node->max_row = node->range.second.i;
+    node->min_col = node->range.first.j;
+    node->max_col = node->range.second.j;
+    RangeNode* kids[2] = {node->left, node->right};
+    for (int k = 0; k < 2; k++) {
+        RangeNode* kid = kids[k];
+        if (!kid) continue;
+        if (kid->max_row > node->max_row) node->max_row = kid->max_row;
+        if (kid->min_col < node->min_col) node->min_col = kid->min_col;
+        if (kid->max_col > node->max_col) node->max_col = kid->max_col;
+    }
+}
+static RangeNode* range_create_node(NodePool* pool, PairOfPair range, short row, short col) {
+    RangeNode* node = (RangeNode*)pool_alloc(pool, sizeof(RangeNode));
+    if (!node) return NULL;
+
+    node->range = range;
+    node->owner.i = row;
+    node->owner.j = col;
+    node->left = node->right = NULL;
+    range_update_node(node);
+    return node;
+}
+static RangeNode* range_right_rotate(RangeNode* y) {
+    RangeNode* x = y->left;
+    y->left = x->right;
+    x->right = y;
+    range_update_node(y);
+    range_update_node(x);
+    return x;
+}
+static RangeNode* range_left_rotate(RangeNode* x) {
+    RangeNode* y = x->right;
+    x->right = y->left;
+    y->left = x;
+    range_update_node(x);
+    range_update_node(y);
+    return y;
+}
+static RangeNode* range_rebalance(RangeNode* root) {
+    range_update_node(root);
+    int balance = range_balance(root);
+
+    if (balance > 1) {
+        if (range_balance(root->left) < 0)
+            root->left = range_left_rotate(root->left);
+        return range_right_rotate(root);
+    }
+    if (balance < -1) {
+        if (range_balance(root->right) > 0)
+            root->right = range_right_rotate(root->right);
+        return range_left_rotate(root);
+    }
+    return root;
+}
+// Register that cell (row, col) reads range - returns new root
+RangeNode* range_insert(NodePool* pool, RangeNode* root, PairOfPair range, short row, short col) {
+    if (!root)
+        return range_create_node(pool, range, row, col);
+
+    Pair owner = {row, col};
+    int cmp = compare_ranges(range, owner, root->range, root->owner);
+
+    if (cmp < 0)
+        root->left = range_insert(pool, root->left, range, row, col);
+    else if (cmp > 0)
+        root->right = range_insert(pool, root->right, range, row, col);
+    else
+        return root; // No duplicates
+
+    return range_rebalance(root);
+}
+// Drop the registration of cell (row, col) for range - returns new root
+RangeNode* range_remove(NodePool* pool, RangeNode* root, PairOfPair range, short row, short col) {
+    if (!root) return NULL;
+
+    Pair owner = {row, col};
+    int cmp = compare_ranges(range, owner, root->range, root->owner);
+
+    if (cmp < 0)
+        root->left = range_remove(pool, root->left, range, row, col);
+    else if (cmp > 0)
+        root->right = range_remove(pool, root->right, range, row, col);
+    else {
+        if (!root->left || !root->right) {
+            RangeNode* child = root->left ? root->left : root->right;
+            pool_release(pool, root, sizeof(RangeNode));
+            return child;
         }
+        // Node with two children: pull up the in-order successor
+        RangeNode* succ = root->right;
+        while (succ->left)
+            succ = succ->left;
+        root->range = succ->range;
+        root->owner = succ->owner;
+        root->right = range_remove(pool, root->right, succ->range, succ->owner.i, succ->owner.j);
     }
 
-    // Create result vector for topo order
-    vector_init(result);
-    
-    // TODO: REMOVE THIS Reverse the order (as DFS gives reverse topological sort)
-    for (size_t i = 0; i < sorted.size; i++) {
-        vector_push_back(result, sorted.data[i].i, sorted.data[i].j);
+    return range_rebalance(root);
+}
+// Stabbing query: append the owner of every range covering (row, col) to out
+void range_stab(RangeNode* root, short row, short col, Vector* out) {
+    while (root) {
+        if (root->max_row < row || col < root->min_col || col > root->max_col)
+            return;
+
+        range_stab(root->left, row, col, out);
+
+        // Everything to the right starts at or below this node's top row
+        if (root->range.first.i > row)
+            return;
+
+        PairOfPair r = root->range;
+        if (r.second.i >= row && r.first.j <= col && col <= r.second.j)
+            vector_push_back(out, root->owner.i, root->owner.j);
+
+        root = root->right;
+    }
+}
+// Owners of every range that shares at least one cell with rect
+void range_overlap(RangeNode* root, PairOfPair rect, Vector* out) {
+    while (root) {
+        if (root->max_row < rect.first.i || rect.second.j < root->min_col || rect.first.j > root->max_col)
+            return;
+
+        range_overlap(root->left, rect, out);
+
+        if (root->range.first.i > rect.second.i)
+            return;
+
+        PairOfPair r = root->range;
+        if (r.second.i >= rect.first.i && r.first.j <= rect.second.j && rect.first.j <= r.second.j)
+            vector_push_back(out, root->owner.i, root->owner.j);
+
+        root = root->right;
     }
+}
+// Same query without a result buffer, for callers that may run concurrently
+void range_visit(RangeNode* root, short row, short col, void (*visit)(void* ctx, Pair owner), void* ctx) {
+    while (root) {
+        if (root->max_row < row || col < root->min_col || col > root->max_col)
+            return;
+
+        range_visit(root->left, row, col, visit, ctx);
+
+        if (root->range.first.i > row)
+            return;
 
-    // Clean up
-    free(visited);
-    vector_free(&sorted);
-    visited = NULL;
+        PairOfPair r = root->range;
+        if (r.second.i >= row && r.first.j <= col && col <= r.second.j)
+            visit(ctx, root->owner);
+
+        root = root->right;
+    }
 }
+// Free the entire range index
+void range_free(NodePool* pool, RangeNode* root) {
+    if (root) {
+        range_free(pool, root->left);
+        range_free(pool, root->right);
+        pool_release(pool, root, sizeof(RangeNode));
+    }
+}
+
 
-void create_cell(short row, short col, Cell* cell) {
-    cell->row = row;
-    cell->col = col;
-    cell->topo_order = -1;
+
+
+void create_cell(Cell* cell) {
+    cell->formula = 0;
     cell->type = 'C';
-    cell->value = 0;
-    cell->cell_state = 'N';
-    cell->dependents = NULL;
-    cell->has_error = false;
+    depset_init(&cell->dependents);
     cell->is_sleep = false;
 }
 
-void free_cell(Cell* cell) {
-    if(cell->dependents != NULL) {
-        avl_free(cell->dependents);
-        cell->dependents = NULL;
-    }
+void free_cell(NodePool* pool, Cell* cell) {
+    depset_free(pool, &cell->dependents);
 }
 
 short colNameToNumber(const char *colName) {
@@ -485,6 +920,10 @@ void colNumberToName(short colNumber, char *colName) { // 0 based argument
 }
 
 Spreadsheet* create_spreadsheet(short rows, short cols){
+    return create_spreadsheet_mode(rows, cols, GRID_TILED);
+}
+
+Spreadsheet* create_spreadsheet_mode(short rows, short cols, GridMode mode){
 
 
     Spreadsheet* sheet = (Spreadsheet*)malloc(sizeof(Spreadsheet));
@@ -501,18 +940,648 @@ Spreadsheet* create_spreadsheet(short rows, short cols){
     sheet->output_enabled = 1;
 
     sheet->last_status = STATUS_OK;
+    sheet->range_dependents = NULL;
+    pool_init(&sheet->pool);
 
-    sheet->cells = (Cell**)malloc(rows* sizeof(Cell*));
-    for (int i = 0; i < rows; i++) {
-        sheet->cells[i] = (Cell*)malloc(cols * sizeof(Cell));
-        for (int j = 0; j < cols; j++) 
-        {
-            create_cell(i, j, &sheet->cells[i][j]);
+    sheet->visit_mark = (unsigned int*)calloc((size_t)rows * cols, sizeof(unsigned int));
+    if (!sheet->visit_mark) {
+        fprintf(stderr, "Memory allocation failed for visit marks\n");
+        exit(1);
+    }
+    sheet->visit_epoch = 0;
+    vector_init(&sheet->walk_stack);
+    vector_init(&sheet->calc_order);
+    sheet->recalc_heap = NULL;
+    sheet->recalc_heap_cap = 0;
+    sheet->recalc_slot = NULL;
+    vector_init(&sheet->recalc_cells);
+    vector_init(&sheet->recalc_edges);
+    sheet->batch.depth = 0;
+    sheet->batch.undo = NULL;
+    sheet->batch.undo_size = sheet->batch.undo_capacity = 0;
+    vector_init(&sheet->batch.dirty);
+    sheet->formulas = NULL;
+    sheet->formula_capacity = 0;
+    sheet->formula_free = -1;
+    sheet->templates = NULL;
+    sheet->template_capacity = 0;
+    sheet->template_free = -1;
+    sheet->template_buckets = NULL;
+    sheet->template_bucket_count = 0;
+    sheet->templates_used = 0;
+    sheet->order_holes = 0;
+    sheet->aggregates = NULL;
+    sheet->agg_capacity = 0;
+    sheet->agg_free = -1;
+    sheet->programs = NULL;
+    sheet->program_capacity = 0;
+    sheet->program_free = -1;
+    sheet->col_extrema = NULL;
+    memset(&sheet->range_sums, 0, sizeof(RangeSums));
+
+    sheet->tile_rows = (rows + TILE_SIZE - 1) >> TILE_SHIFT;
+    sheet->tile_cols = (cols + TILE_SIZE - 1) >> TILE_SHIFT;
+    sheet->tiles_used = 0;
+    sheet->tiles = NULL;
+    sheet->grid = NULL;
+    sheet->grid_bytes = 0;
+    size_t num_tiles = (size_t)sheet->tile_rows * sheet->tile_cols;
+
+    if (mode == GRID_FLAT) {
+        // The kernel hands out zero pages on first touch, and zero is an empty cell
+        sheet->grid_bytes = num_tiles * sizeof(Tile);
+        void* grid = mmap(NULL, sheet->grid_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (grid == MAP_FAILED) {
+            fprintf(stderr, "Memory mapping failed for cell grid\n");
+            exit(1);
         }
+#ifdef MADV_HUGEPAGE
+        madvise(grid, sheet->grid_bytes, MADV_HUGEPAGE);  // advisory; ignored without THP
+#endif
+        sheet->grid = (Tile*)grid;
+        return sheet;
+    }
+
+    // Only the tile table is allocated up front; tiles appear on first write
+    sheet->tiles = (Tile**)calloc(num_tiles, sizeof(Tile*));
+    if (!sheet->tiles) {
+        fprintf(stderr, "Memory allocation failed for tile table\n");
+        exit(1);
     }
     return sheet;
 }
 
+// What every cell of a missing tile reads as: all zero, like a fresh tile
+const Cell EMPTY_CELL;
+
+Tile* tile_alloc(Spreadsheet* sheet, int tile){
+    // A zero-filled tile is a block of empty constants
+    Tile* t = (Tile*)calloc(1, sizeof(Tile));
+    if (!t) {
+        fprintf(stderr, "Memory allocation failed for tile\n");
+        exit(1);
+    }
+    sheet->tiles[tile] = t;
+    sheet->tiles_used++;
+    return t;
+}
+
+// Start a new graph walk: every cell counts as unvisited again without touching the marks
+unsigned int sheet_next_epoch(Spreadsheet* sheet){
+    if (++sheet->visit_epoch == 0) {
+        // Wrapped around: old marks could collide with new epochs, so clear them once
+        memset(sheet->visit_mark, 0, (size_t)sheet->totalRows * sheet->totalCols * sizeof(unsigned int));
+        sheet->visit_epoch = 1;
+    }
+    return sheet->visit_epoch;
+}
+
+// Take a formula slot for a cell that stops being a constant; it has no place in
+// calc_order until check_circular_dependencies gives it one. Slot 0 is never handed
+// out, so Cell.formula == 0 marks a constant.
+int formula_alloc(Spreadsheet* sheet){
+    if (sheet->formula_free == -1) {
+        int old_cap = sheet->formula_capacity;
+        sheet->formula_capacity = old_cap ? old_cap * 2 : 16;
+        sheet->formulas = (Formula*)realloc(sheet->formulas, sheet->formula_capacity * sizeof(Formula));
+        if (!sheet->formulas) {
+            fprintf(stderr, "Memory allocation failed for formulas\n");
+            exit(1);
+        }
+        for (int i = sheet->formula_capacity - 1; i >= (old_cap ? old_cap : 1); i--) {
+            sheet->formulas[i].template = sheet->formula_free;
+            sheet->formula_free = i;
+        }
+    }
+    int slot = sheet->formula_free;
+    sheet->formula_free = sheet->formulas[slot].template;
+    sheet->formulas[slot].template = -1;
+    sheet->formulas[slot].topo_order = -1;
+    return slot;
+}
+
+// Give a slot back along with its template reference
+void formula_release(Spreadsheet* sheet, int slot){
+    if (sheet->formulas[slot].template >= 0)
+        template_release(sheet, sheet->formulas[slot].template);
+    sheet->formulas[slot].template = sheet->formula_free;
+    sheet->formula_free = slot;
+}
+
+// Expand a cell into its full contents, with the template's offsets made absolute;
+// constants read no cells
+void load_cell_contents(const Spreadsheet* sheet, short row, short col, CellContents* out){
+    const Cell* cell = get_cell(sheet, row, col);
+    const Formula* f = get_formula(sheet, row, col);
+    out->row = row;
+    out->col = col;
+    out->type = cell_type(cell);
+    out->is_sleep = cell->is_sleep;
+    if (f && f->template >= 0) {
+        const FormulaTemplate* t = get_template(sheet, f);
+        out->op_data = t->op_data;
+        if (t->type == 'F')
+            out->op_data.function.agg_slot = f->agg_slot;
+        out->dependencies = template_dependencies(t, row, col);
+    } else {
+        memset(&out->op_data, 0, sizeof(OpData));
+        out->dependencies.first.i = out->dependencies.first.j = -1;
+        out->dependencies.second.i = out->dependencies.second.j = -1;
+    }
+}
+
+// Take an aggregate slot for a new 'F' cell; it starts invalid so the first
+// evaluation rescans the range
+int aggregate_alloc(Spreadsheet* sheet){
+    if (sheet->agg_free == -1) {
+        int old_cap = sheet->agg_capacity;
+        sheet->agg_capacity = old_cap ? old_cap * 2 : 16;
+        sheet->aggregates = (RangeAggregate*)realloc(sheet->aggregates, sheet->agg_capacity * sizeof(RangeAggregate));
+        if (!sheet->aggregates) {
+            fprintf(stderr, "Memory allocation failed for range aggregates\n");
+            exit(1);
+        }
+        for (int i = sheet->agg_capacity - 1; i >= old_cap; i--) {
+            sheet->aggregates[i].next_free = sheet->agg_free;
+            sheet->agg_free = i;
+        }
+    }
+    int slot = sheet->agg_free;
+    sheet->agg_free = sheet->aggregates[slot].next_free;
+    sheet->aggregates[slot].valid = false;
+    return slot;
+}
+
+void aggregate_release(Spreadsheet* sheet, int slot){
+    sheet->aggregates[slot].valid = false;
+    sheet->aggregates[slot].next_free = sheet->agg_free;
+    sheet->agg_free = slot;
+}
+
+// Walk the code once: every instruction complete, the stack never underflows or
+// grows past EXPR_MAX_DEPTH, exactly one value left at the end. Fills in the
+// distinct cells and rectangles read.
+static bool program_scan(Program* prog){
+    const int32_t* code = prog->code;
+    int n = prog->code_size, depth = 0;
+    for (int pc = 0; pc < n;) {
+        int pops, operands;
+        switch (code[pc]) {
+        case EX_CONST: case EX_CELL: pops = 0; operands = 1; break;
+        case EX_RANGE: pops = 0; operands = 3; break;
+        case EX_LIST: pops = pc + 2 < n ? code[pc + 2] : -1; operands = 2; break;
+        case EX_NEG: pops = 1; operands = 0; break;
+        case EX_ADD: case EX_SUB: case EX_MUL: case EX_DIV: pops = 2; operands = 0; break;
+        default: return false;
+        }
+        if (pc + operands >= n || pops < 0 || pops > depth || (code[pc] == EX_LIST && pops == 0))
+            return false;
+        if (code[pc] == EX_CELL) {
+            Pair p = expr_unpack(code[pc + 1]);
+            int k = 0;
+            while (k < prog->num_refs && (prog->refs[k].i != p.i || prog->refs[k].j != p.j))
+                k++;
+            if (k == prog->num_refs)
+                prog->refs[prog->num_refs++] = p;
+        } else if (code[pc] == EX_RANGE || code[pc] == EX_LIST) {
+            if (code[pc + 1] < 'A' || code[pc + 1] > 'E')
+                return false;
+        }
+        if (code[pc] == EX_RANGE) {
+            PairOfPair r = {expr_unpack(code[pc + 2]), expr_unpack(code[pc + 3])};
+            if (r.first.i > r.second.i || r.first.j > r.second.j)
+                return false;
+            int k = 0;
+            while (k < prog->num_ranges && memcmp(&prog->ranges[k], &r, sizeof(r)) != 0)
+                k++;
+            if (k == prog->num_ranges)
+                prog->ranges[prog->num_ranges++] = r;
+        }
+        depth += 1 - pops;
+        if (depth > EXPR_MAX_DEPTH)
+            return false;
+        pc += 1 + operands;
+    }
+    return depth == 1;
+}
+
+// Take a program slot holding a copy of code, with one reference for the caller.
+// Returns -1, taking nothing, if the code is not a well-formed expression; whether
+// its cells lie inside the sheet depends on where it is used, see program_fits.
+int program_create(Spreadsheet* sheet, const int32_t* code, int code_size){
+    if (sheet->program_free == -1) {
+        int old_cap = sheet->program_capacity;
+        sheet->program_capacity = old_cap ? old_cap * 2 : 16;
+        sheet->programs = (Program*)realloc(sheet->programs, sheet->program_capacity * sizeof(Program));
+        if (!sheet->programs) {
+            fprintf(stderr, "Memory allocation failed for programs\n");
+            exit(1);
+        }
+        for (int i = sheet->program_capacity - 1; i >= old_cap; i--) {
+            sheet->programs[i].code = NULL;
+            sheet->programs[i].next_free = sheet->program_free;
+            sheet->program_free = i;
+        }
+    }
+    int slot = sheet->program_free;
+    Program* prog = &sheet->programs[slot];
+
+    // Every cell or range operand is at least two words, which bounds both lists
+    prog->code = (int32_t*)malloc((code_size > 0 ? code_size : 1) * sizeof(int32_t));
+    prog->refs = (Pair*)malloc((code_size / 2 + 1) * sizeof(Pair));
+    prog->ranges = (PairOfPair*)malloc((code_size / 4 + 1) * sizeof(PairOfPair));
+    if (!prog->code || !prog->refs || !prog->ranges) {
+        fprintf(stderr, "Memory allocation failed for program\n");
+        exit(1);
+    }
+    memcpy(prog->code, code, code_size * sizeof(int32_t));
+    prog->code_size = code_size;
+    prog->num_refs = prog->num_ranges = 0;
+    if (!program_scan(prog)) {
+        free(prog->code);
+        free(prog->refs);
+        free(prog->ranges);
+        prog->code = NULL;
+        return -1;
+    }
+    sheet->program_free = prog->next_free;
+    prog->ref_count = 1;
+    return slot;
+}
+
+static bool fits(const Spreadsheet* sheet, int row, int col){
+    return row >= 0 && row < sheet->totalRows && col >= 0 && col < sheet->totalCols;
+}
+
+// Does every cell the program reads from (row, col) lie inside the sheet?
+bool program_fits(const Spreadsheet* sheet, const Program* prog, short row, short col){
+    for (int k = 0; k < prog->num_refs; k++)
+        if (!fits(sheet, row + prog->refs[k].i, col + prog->refs[k].j))
+            return false;
+    for (int k = 0; k < prog->num_ranges; k++)
+        if (!fits(sheet, row + prog->ranges[k].first.i, col + prog->ranges[k].first.j) ||
+            !fits(sheet, row + prog->ranges[k].second.i, col + prog->ranges[k].second.j))
+            return false;
+    return true;
+}
+
+void program_retain(Spreadsheet* sheet, int slot){
+    sheet->programs[slot].ref_count++;
+}
+
+void program_release(Spreadsheet* sheet, int slot){
+    Program* prog = &sheet->programs[slot];
+    if (--prog->ref_count > 0)
+        return;
+    free(prog->code);
+    free(prog->refs);
+    free(prog->ranges);
+    prog->code = NULL;
+    prog->next_free = sheet->program_free;
+    sheet->program_free = slot;
+}
+
+// Template for contents, with everything position dependent taken out
+static void template_key(const CellContents* contents, FormulaTemplate* key){
+    memset(key, 0, sizeof(FormulaTemplate));
+    key->type = contents->type;
+    key->offsets.first.i = key->offsets.first.j = REL_NONE;
+    key->offsets.second.i = key->offsets.second.j = REL_NONE;
+    if (contents->dependencies.first.i != -1) {
+        key->offsets.first.i = contents->dependencies.first.i - contents->row;
+        key->offsets.first.j = contents->dependencies.first.j - contents->col;
+    }
+    if (contents->dependencies.second.i != -1) {
+        key->offsets.second.i = contents->dependencies.second.i - contents->row;
+        key->offsets.second.j = contents->dependencies.second.j - contents->col;
+    }
+    if (key->type == 'A') {
+        key->op_data.arithmetic.op = contents->op_data.arithmetic.op;
+        key->op_data.arithmetic.constant = contents->op_data.arithmetic.constant;
+    } else if (key->type == 'F')
+        key->op_data.function.func_name = contents->op_data.function.func_name;
+    else if (key->type == 'X')
+        key->op_data.expression.program = contents->op_data.expression.program;
+}
+
+// FNV-1a over the fields that tell templates apart; programs count by their code
+static unsigned int template_hash(const Spreadsheet* sheet, const FormulaTemplate* key){
+    int32_t words[6] = {key->type, key->offsets.first.i, key->offsets.first.j,
+                        key->offsets.second.i, key->offsets.second.j, 0};
+    const int32_t* code = NULL;
+    int n = 0;
+    if (key->type == 'A')
+        words[5] = key->op_data.arithmetic.op * 31 + key->op_data.arithmetic.constant;
+    else if (key->type == 'F')
+        words[5] = key->op_data.function.func_name;
+    else if (key->type == 'X') {
+        code = sheet->programs[key->op_data.expression.program].code;
+        n = sheet->programs[key->op_data.expression.program].code_size;
+    }
+    unsigned int h = 2166136261u;
+    for (int k = 0; k < 6 + n; k++) {
+        uint32_t w = (uint32_t)(k < 6 ? words[k] : code[k - 6]);
+        for (int b = 0; b < 4; b++, w >>= 8)
+            h = (h ^ (w & 0xFF)) * 16777619u;
+    }
+    return h;
+}
+
+static bool template_equal(const Spreadsheet* sheet, const FormulaTemplate* a, const FormulaTemplate* b){
+    if (a->hash != b->hash || a->type != b->type || memcmp(&a->offsets, &b->offsets, sizeof(PairOfPair)) != 0)
+        return false;
+    switch (a->type) {
+    case 'A':
+        return a->op_data.arithmetic.op == b->op_data.arithmetic.op &&
+               a->op_data.arithmetic.constant == b->op_data.arithmetic.constant;
+    case 'F':
+        return a->op_data.function.func_name == b->op_data.function.func_name;
+    case 'X': {
+        const Program* pa = &sheet->programs[a->op_data.expression.program];
+        const Program* pb = &sheet->programs[b->op_data.expression.program];
+        return pa == pb || (pa->code_size == pb->code_size &&
+                            memcmp(pa->code, pb->code, pa->code_size * sizeof(int32_t)) == 0);
+    }
+    default:
+        return true;
+    }
+}
+
+static void template_grow(Spreadsheet* sheet){
+    int old_cap = sheet->template_capacity;
+    sheet->template_capacity = old_cap ? old_cap * 2 : 16;
+    sheet->templates = (FormulaTemplate*)realloc(sheet->templates, sheet->template_capacity * sizeof(FormulaTemplate));
+    free(sheet->template_buckets);
+    sheet->template_bucket_count = sheet->template_capacity;
+    sheet->template_buckets = (int*)malloc(sheet->template_bucket_count * sizeof(int));
+    if (!sheet->templates || !sheet->template_buckets) {
+        fprintf(stderr, "Memory allocation failed for formula templates\n");
+        exit(1);
+    }
+    for (int i = sheet->template_capacity - 1; i >= old_cap; i--) {
+        sheet->templates[i].ref_count = 0;
+        sheet->templates[i].next = sheet->template_free;
+        sheet->template_free = i;
+    }
+
+    // Rehash the templates in use into the larger table
+    for (int b = 0; b < sheet->template_bucket_count; b++)
+        sheet->template_buckets[b] = -1;
+    for (int i = 0; i < old_cap; i++) {
+        FormulaTemplate* t = &sheet->templates[i];
+        if (t->ref_count == 0)
+            continue;
+        int b = t->hash & (sheet->template_bucket_count - 1);
+        t->next = sheet->template_buckets[b];
+        sheet->template_buckets[b] = i;
+    }
+}
+
+// Template of contents with one more reference: an existing one if any cell
+// already has this shape, else a new one. A new 'X' template takes its own
+// reference on the program; the caller keeps the one in contents.
+int template_intern(Spreadsheet* sheet, const CellContents* contents){
+    FormulaTemplate key;
+    template_key(contents, &key);
+    key.hash = template_hash(sheet, &key);
+
+    if (sheet->template_bucket_count > 0) {
+        int b = key.hash & (sheet->template_bucket_count - 1);
+        for (int i = sheet->template_buckets[b]; i != -1; i = sheet->templates[i].next) {
+            if (template_equal(sheet, &sheet->templates[i], &key)) {
+                sheet->templates[i].ref_count++;
+                return i;
+            }
+        }
+    }
+
+    if (sheet->template_free == -1)
+        template_grow(sheet);
+    int slot = sheet->template_free;
+    sheet->template_free = sheet->templates[slot].next;
+    int b = key.hash & (sheet->template_bucket_count - 1);
+    key.ref_count = 1;
+    key.next = sheet->template_buckets[b];
+    sheet->templates[slot] = key;
+    sheet->template_buckets[b] = slot;
+    sheet->templates_used++;
+    if (key.type == 'X')
+        program_retain(sheet, key.op_data.expression.program);
+    return slot;
+}
+
+void template_release(Spreadsheet* sheet, int slot){
+    FormulaTemplate* t = &sheet->templates[slot];
+    if (--t->ref_count > 0)
+        return;
+    int* link = &sheet->template_buckets[t->hash & (sheet->template_bucket_count - 1)];
+    while (*link != slot)
+        link = &sheet->templates[*link].next;
+    *link = t->next;
+    if (t->type == 'X')
+        program_release(sheet, t->op_data.expression.program);
+    t->next = sheet->template_free;
+    sheet->template_free = slot;
+    sheet->templates_used--;
+}
+
+// One more MIN/MAX formula reads col; the first one builds the tree from the column
+void extrema_acquire(Spreadsheet* sheet, short col){
+    if (!sheet->col_extrema) {
+        sheet->col_extrema = (ColumnExtrema*)calloc(sheet->totalCols, sizeof(ColumnExtrema));
+        if (!sheet->col_extrema) {
+            fprintf(stderr, "Memory allocation failed for column extrema\n");
+            exit(1);
+        }
+    }
+    ColumnExtrema* ce = &sheet->col_extrema[col];
+    if (ce->refs++ > 0)
+        return;
+
+    int n = sheet->totalRows;
+    ce->min = (int*)malloc(2 * n * sizeof(int));
+    ce->max = (int*)malloc(2 * n * sizeof(int));
+    if (!ce->min || !ce->max) {
+        fprintf(stderr, "Memory allocation failed for column extrema\n");
+        exit(1);
+    }
+    extrema_rebuild(sheet, col);
+}
+
+// Refill the tree of col from the cells after a bulk write; a no-op for columns
+// nobody takes MIN/MAX over
+void extrema_rebuild(Spreadsheet* sheet, short col){
+    if (!sheet->col_extrema || sheet->col_extrema[col].refs == 0)
+        return;
+    ColumnExtrema* ce = &sheet->col_extrema[col];
+    int n = sheet->totalRows;
+    for (int r = 0; r < n; r++)
+        ce->min[n + r] = ce->max[n + r] = get_cell_value(sheet, r, col);
+    for (int i = n - 1; i > 0; i--) {
+        ce->min[i] = ce->min[2 * i] < ce->min[2 * i + 1] ? ce->min[2 * i] : ce->min[2 * i + 1];
+        ce->max[i] = ce->max[2 * i] > ce->max[2 * i + 1] ? ce->max[2 * i] : ce->max[2 * i + 1];
+    }
+}
+
+void extrema_release(Spreadsheet* sheet, short col){
+    ColumnExtrema* ce = &sheet->col_extrema[col];
+    if (--ce->refs > 0)
+        return;
+    free(ce->min);
+    free(ce->max);
+    ce->min = ce->max = NULL;
+}
+
+static void extrema_lock(ColumnExtrema* ce){
+    while (__atomic_test_and_set(&ce->lock, __ATOMIC_ACQUIRE))
+        ;
+}
+
+static void extrema_unlock(ColumnExtrema* ce){
+    __atomic_clear(&ce->lock, __ATOMIC_RELEASE);
+}
+
+// Cell (row, col) now holds value; a no-op for columns nobody takes MIN/MAX over
+void extrema_update(Spreadsheet* sheet, short row, short col, int value){
+    if (!sheet->col_extrema || sheet->col_extrema[col].refs == 0)
+        return;
+    ColumnExtrema* ce = &sheet->col_extrema[col];
+    extrema_lock(ce);
+    int i = sheet->totalRows + row;
+    ce->min[i] = ce->max[i] = value;
+    for (i >>= 1; i > 0; i >>= 1) {
+        ce->min[i] = ce->min[2 * i] < ce->min[2 * i + 1] ? ce->min[2 * i] : ce->min[2 * i + 1];
+        ce->max[i] = ce->max[2 * i] > ce->max[2 * i + 1] ? ce->max[2 * i] : ce->max[2 * i + 1];
+    }
+    extrema_unlock(ce);
+}
+
+// Fold the extremes of rows r1..r2 of col into *min_val / *max_val
+void extrema_query(Spreadsheet* sheet, short r1, short r2, short col, int* min_val, int* max_val){
+    ColumnExtrema* ce = &sheet->col_extrema[col];
+    int n = sheet->totalRows;
+    int lo = *min_val, hi = *max_val;
+    extrema_lock(ce);
+    for (int l = r1 + n, r = r2 + n + 1; l < r; l >>= 1, r >>= 1) {
+        if (l & 1) {
+            if (ce->min[l] < lo) lo = ce->min[l];
+            if (ce->max[l] > hi) hi = ce->max[l];
+            l++;
+        }
+        if (r & 1) {
+            r--;
+            if (ce->min[r] < lo) lo = ce->min[r];
+            if (ce->max[r] > hi) hi = ce->max[r];
+        }
+    }
+    extrema_unlock(ce);
+    *min_val = lo;
+    *max_val = hi;
+}
+
+// Build the Fenwick trees from the current cells in linear time: place every cell
+// at its own index, then push each partial sum to its parent, first along the
+// columns of every row and then along the rows of every column
+void range_sums_enable(Spreadsheet* sheet){
+    RangeSums* rs = &sheet->range_sums;
+    if (rs->enabled)
+        return;
+
+    int rows = sheet->totalRows, cols = sheet->totalCols;
+    size_t stride = (size_t)cols + 1, total = ((size_t)rows + 1) * stride;
+    rs->sum = (uint32_t*)calloc(total, sizeof(uint32_t));
+    rs->sum_sq = (uint32_t*)calloc(total, sizeof(uint32_t));
+    rs->errors = (int*)calloc(total, sizeof(int));
+    if (!rs->sum || !rs->sum_sq || !rs->errors) {
+        fprintf(stderr, "Memory allocation failed for range sums\n");
+        exit(1);
+    }
+
+    for (int i = 1; i <= rows; i++)
+        for (int j = 1; j <= cols; j++) {
+            uint32_t v = (uint32_t)get_cell_value(sheet, i - 1, j - 1);
+            size_t k = i * stride + j;
+            rs->sum[k] = v;
+            rs->sum_sq[k] = v * v;
+            rs->errors[k] = get_cell_error(sheet, i - 1, j - 1);
+        }
+    for (int i = 1; i <= rows; i++)
+        for (int j = 1; j <= cols; j++) {
+            int parent = j + (j & -j);
+            if (parent <= cols) {
+                rs->sum[i * stride + parent] += rs->sum[i * stride + j];
+                rs->sum_sq[i * stride + parent] += rs->sum_sq[i * stride + j];
+                rs->errors[i * stride + parent] += rs->errors[i * stride + j];
+            }
+        }
+    for (int i = 1; i <= rows; i++) {
+        int parent = i + (i & -i);
+        if (parent > rows)
+            continue;
+        for (int j = 1; j <= cols; j++) {
+            rs->sum[parent * stride + j] += rs->sum[i * stride + j];
+            rs->sum_sq[parent * stride + j] += rs->sum_sq[i * stride + j];
+            rs->errors[parent * stride + j] += rs->errors[i * stride + j];
+        }
+    }
+    rs->enabled = true;
+}
+
+// Drop the trees. The range aggregates stopped receiving deltas while they were
+// on, so every one of them is stale now
+void range_sums_disable(Spreadsheet* sheet){
+    RangeSums* rs = &sheet->range_sums;
+    if (!rs->enabled)
+        return;
+    free(rs->sum);
+    free(rs->sum_sq);
+    free(rs->errors);
+    rs->sum = rs->sum_sq = NULL;
+    rs->errors = NULL;
+    rs->enabled = false;
+    for (int slot = 0; slot < sheet->agg_capacity; slot++)
+        sheet->aggregates[slot].valid = false;
+}
+
+void range_sums_add(Spreadsheet* sheet, short row, short col, uint32_t value_delta, uint32_t square_delta, int error_delta){
+    RangeSums* rs = &sheet->range_sums;
+    size_t stride = (size_t)sheet->totalCols + 1;
+    while (__atomic_test_and_set(&rs->lock, __ATOMIC_ACQUIRE))
+        ;
+    for (int i = row + 1; i <= sheet->totalRows; i += i & -i)
+        for (int j = col + 1; j <= sheet->totalCols; j += j & -j) {
+            rs->sum[i * stride + j] += value_delta;
+            rs->sum_sq[i * stride + j] += square_delta;
+            rs->errors[i * stride + j] += error_delta;
+        }
+    __atomic_clear(&rs->lock, __ATOMIC_RELEASE);
+}
+
+// Totals over rows [0, row) x cols [0, col), added into the outputs with the given sign
+static void range_sums_prefix(RangeSums* rs, size_t stride, int row, int col, uint32_t sign,
+                              uint32_t* sum, uint32_t* sum_sq, int* errors){
+    for (int i = row; i > 0; i -= i & -i)
+        for (int j = col; j > 0; j -= j & -j) {
+            *sum += sign * rs->sum[i * stride + j];
+            *sum_sq += sign * rs->sum_sq[i * stride + j];
+            *errors += (int)sign * rs->errors[i * stride + j];
+        }
+}
+
+void range_sums_query(Spreadsheet* sheet, short r1, short c1, short r2, short c2, uint32_t* sum, uint32_t* sum_sq, int* errors){
+    RangeSums* rs = &sheet->range_sums;
+    size_t stride = (size_t)sheet->totalCols + 1;
+    *sum = *sum_sq = 0;
+    *errors = 0;
+    while (__atomic_test_and_set(&rs->lock, __ATOMIC_ACQUIRE))
+        ;
+    range_sums_prefix(rs, stride, r2 + 1, c2 + 1, 1u, sum, sum_sq, errors);
+    range_sums_prefix(rs, stride, r1, c2 + 1, (uint32_t)-1, sum, sum_sq, errors);
+    range_sums_prefix(rs, stride, r2 + 1, c1, (uint32_t)-1, sum, sum_sq, errors);
+    range_sums_prefix(rs, stride, r1, c1, 1u, sum, sum_sq, errors);
+    __atomic_clear(&rs->lock, __ATOMIC_RELEASE);
+}
+
 void print_spreadsheet(Spreadsheet* sheet){
     printf("  ");
     char* colname = (char*)malloc(4 * sizeof(char));
@@ -527,23 +1596,65 @@ void print_spreadsheet(Spreadsheet* sheet){
     for (int i = 0; i < sheet->totalRows; i++) {
         printf("%d ", i+1);
         for (int j = 0; j < sheet->totalCols; j++) {
-            Cell* cell = &sheet->cells[i][j];
-            printf(" %d ", cell->value);
+            printf(" %d ", get_cell_value(sheet, i, j));
         }
         printf("\n");
     }
 }
 
 void free_spreadsheet(Spreadsheet* sheet){
-    for (int i = 0; i < sheet->totalRows; i++) {
-        for (int j = 0; j < sheet->totalCols; j++) {
-            free_cell(&(sheet->cells[i][j]));
+    // Every tree node lives in the pool, so the cells need no per-node walk
+    if (sheet->grid) {
+        munmap(sheet->grid, sheet->grid_bytes);
+        sheet->grid = NULL;
+    } else {
+        size_t num_tiles = (size_t)sheet->tile_rows * sheet->tile_cols;
+        for (size_t t = 0; t < num_tiles; t++)
+            free(sheet->tiles[t]);
+        free(sheet->tiles);
+        sheet->tiles = NULL;
+    }
+    sheet->range_dependents = NULL;
+    pool_destroy(&sheet->pool);
+    free(sheet->visit_mark);
+    sheet->visit_mark = NULL;
+    vector_free(&sheet->walk_stack);
+    vector_free(&sheet->calc_order);
+    free(sheet->recalc_heap);
+    sheet->recalc_heap = NULL;
+    free(sheet->recalc_slot);
+    sheet->recalc_slot = NULL;
+    vector_free(&sheet->recalc_cells);
+    vector_free(&sheet->recalc_edges);
+    free(sheet->batch.undo);
+    sheet->batch.undo = NULL;
+    vector_free(&sheet->batch.dirty);
+    range_sums_disable(sheet);
+    free(sheet->formulas);
+    sheet->formulas = NULL;
+    free(sheet->templates);
+    sheet->templates = NULL;
+    free(sheet->template_buckets);
+    sheet->template_buckets = NULL;
+    free(sheet->aggregates);
+    sheet->aggregates = NULL;
+    for (int slot = 0; slot < sheet->program_capacity; slot++) {
+        if (sheet->programs[slot].code) {
+            free(sheet->programs[slot].code);
+            free(sheet->programs[slot].refs);
+            free(sheet->programs[slot].ranges);
+        }
+    }
+    free(sheet->programs);
+    sheet->programs = NULL;
+    if (sheet->col_extrema) {
+        for (int c = 0; c < sheet->totalCols; c++) {
+            free(sheet->col_extrema[c].min);
+            free(sheet->col_extrema[c].max);
         }
-        free(sheet->cells[i]);
-        sheet->cells[i] = NULL;
+        free(sheet->col_extrema);
+        sheet->col_extrema = NULL;
     }
-    free(sheet->cells);
-    sheet->cells = NULL;
     free(sheet);
     sheet = NULL;
 }
\ No newline at end of file
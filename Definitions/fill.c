@@ -0,0 +1,139 @@
+#include "../Declarations/fill.h"
+#include "../Declarations/backend.h"
+#include "../Declarations/parser.h"
+
+// A dependency of the top-left cell as read from dr rows and dc columns further on
+static Pair shift(Pair p, short dr, short dc)
+{
+    if (p.i != -1)
+    {
+        p.i += dr;
+        p.j += dc;
+    }
+    return p;
+}
+
+static bool dependency_fits(const Spreadsheet *sheet, Pair p, short dr, short dc)
+{
+    return p.i == -1 || (p.i + dr < sheet->totalRows && p.j + dc < sheet->totalCols);
+}
+
+// Parse formula for the top-left cell without touching the sheet: the value and
+// error of a constant or folded formula come back in *value and *has_error
+static int parse_top_left(Spreadsheet *sheet, CellContents *proto, const char *formula, bool *need_new_dep,
+                          PairOfPair *pairs, int *value, bool *has_error)
+{
+    short row = proto->row, col = proto->col;
+    int old_value = get_cell_value(sheet, row, col);
+    bool old_error = get_cell_error(sheet, row, col);
+    proto->is_sleep = false;
+    int result = parse_formula(sheet, proto, formula, need_new_dep, pairs);
+    *value = get_cell_value(sheet, row, col);
+    *has_error = get_cell_error(sheet, row, col);
+    set_cell_value(sheet, row, col, old_value);
+    set_cell_error(sheet, row, col, old_error);
+    return result;
+}
+
+CalcStatus fill_range(Spreadsheet *sheet, PairOfPair region, const char *formula)
+{
+    short r0 = region.first.i, c0 = region.first.j;
+    short dr_max = region.second.i - r0, dc_max = region.second.j - c0;
+
+    CellContents proto;
+    load_cell_contents(sheet, r0, c0, &proto);
+    bool need_new_dep = false;
+    PairOfPair pairs = {{-1, -1}, {-1, -1}};
+    int value;
+    bool has_error;
+    sheet->last_status = STATUS_OK;
+    if (parse_top_left(sheet, &proto, formula, &need_new_dep, &pairs, &value, &has_error) != 0)
+        return sheet->last_status != STATUS_OK ? sheet->last_status : ERR_SYNTAX;
+
+    // Every reference moves with its cell, so the bottom-right cell reads furthest out
+    bool fits = proto.type == 'X'
+        ? program_fits(sheet, &sheet->programs[proto.op_data.expression.program], region.second.i, region.second.j)
+        : dependency_fits(sheet, pairs.first, dr_max, dc_max) && dependency_fits(sheet, pairs.second, dr_max, dc_max);
+    if (!fits)
+    {
+        if (proto.type == 'X')
+            program_release(sheet, proto.op_data.expression.program);
+        return ERR_INVALID_RANGE;
+    }
+
+    // The batch defers the cycle check and the recalculation to one pass over the
+    // region and the cells it reaches, and undoes every cell if the region closes a loop
+    batch_begin(sheet);
+    for (short dr = 0; dr <= dr_max; dr++)
+        for (short dc = 0; dc <= dc_max; dc++)
+        {
+            short row = r0 + dr, col = c0 + dc;
+            CellContents old, contents = proto;
+            load_cell_contents(sheet, row, col, &old);
+            int old_value = get_cell_value(sheet, row, col);
+            bool old_error = get_cell_error(sheet, row, col);
+            batch_record(sheet, &old, old_value, old_error);
+
+            contents.row = row;
+            contents.col = col;
+            PairOfPair deps = {shift(pairs.first, dr, dc), shift(pairs.second, dr, dc)};
+            // Each cell uses up one program reference, see update_dependencies
+            if (contents.type == 'X')
+                program_retain(sheet, contents.op_data.expression.program);
+            update_dependencies(&contents, need_new_dep, &deps, sheet, &old);
+            if (contents.type == 'C')
+            {
+                set_cell_value(sheet, row, col, value);
+                set_cell_error(sheet, row, col, has_error);
+            }
+            notify_value_change(sheet, row, col, old_value, old_error);
+        }
+    if (proto.type == 'X')
+        program_release(sheet, proto.op_data.expression.program);
+    return batch_commit(sheet);
+}
+
+void fill_command(Spreadsheet *sheet, char *args)
+{
+    char *eq = strchr(args, '=');
+    char *colon = strchr(args, ':');
+    if (!eq || !colon || colon > eq)
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return;
+    }
+
+    // Cut "<cell>:<cell> = <formula>" into its three parts, dropping the spaces around them
+    char *formula = eq + 1;
+    *eq = '\0';
+    *colon = '\0';
+    char *parts[3] = {args, colon + 1, formula};
+    for (int k = 0; k < 3; k++)
+    {
+        while (*parts[k] == ' ')
+            parts[k]++;
+        char *end = parts[k] + strlen(parts[k]);
+        while (end > parts[k] && end[-1] == ' ')
+            *--end = '\0';
+    }
+
+    int constant, r1, c1, r2, c2;
+    if (check_constant_or_cell_address(parts[0], &constant, &r1, &c1, sheet) != 1 ||
+        check_constant_or_cell_address(parts[1], &constant, &r2, &c2, sheet) != 1)
+    {
+        sheet->last_status = ERR_INVALID_CELL;
+        return;
+    }
+    if (r1 > r2 || c1 > c2)
+    {
+        sheet->last_status = ERR_INVALID_RANGE;
+        return;
+    }
+    if (*parts[2] == '\0')
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return;
+    }
+    PairOfPair region = {{r1, c1}, {r2, c2}};
+    sheet->last_status = fill_range(sheet, region, parts[2]);
+}
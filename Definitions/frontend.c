@@ -1,6 +1,11 @@
+#include <errno.h>
 #include "../Declarations/ds.h"
 #include "../Declarations/frontend.h"
 #include "../Declarations/parser.h"
+#include "../Declarations/snapshot.h"
+#include "../Declarations/csv.h"
+#include "../Declarations/fill.h"
+#include "../Declarations/backend.h"
 
 /* Convert column index to Excel-style label */
 static void get_col_label(int col, char* buffer) {
@@ -19,39 +24,201 @@ static void get_col_label(int col, char* buffer) {
     buffer[len] = '\0';
 }
 
-/* Display 10x10 viewport */
-void display_viewport(Spreadsheet *sheet) {
-    if (!sheet->output_enabled) return;
-    
-    // Print column headers
-    printf("    ");
-    for(int col = sheet->scroll_col;
-        col < sheet->scroll_col + VIEWPORT_COLS && col < sheet->totalCols;
-        col++) {
-        char col_buf[4];
-        get_col_label(col, col_buf);
-        printf("%-*s", CELL_WIDTH, col_buf);
-    }
-    printf("\n");
-
-     // Print cells
-    for(int row = sheet->scroll_row;
-        row < sheet->scroll_row + VIEWPORT_ROWS && row < sheet->totalRows;
-        row++) {
-        printf("%3d ", row+1);
-        for(int col = sheet->scroll_col;
-            col < sheet->scroll_col + VIEWPORT_COLS && col < sheet->totalCols;
-            col++) {
-            Cell* cell = &sheet->cells[row][col];
-            if (cell->has_error) {
-                printf("%-*s", CELL_WIDTH, "ERR");
-            } 
-            else {
-                printf("%-*d", CELL_WIDTH, cell->value);
+/* Decimal digits of 0..99, two characters each */
+static const char digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Write v in decimal to out, unterminated, and return its length */
+static int format_int(char *out, int v) {
+    char digits[CELL_TEXT_MAX];
+    char *p = digits + sizeof(digits);
+    unsigned int u = v < 0 ? 0u - (unsigned int)v : (unsigned int)v;
+    while (u >= 100) {
+        unsigned int pair = (u % 100) * 2;
+        u /= 100;
+        *--p = digit_pairs[pair + 1];
+        *--p = digit_pairs[pair];
+    }
+    if (u >= 10) {
+        *--p = digit_pairs[u * 2 + 1];
+        *--p = digit_pairs[u * 2];
+    } else {
+        *--p = '0' + u;
+    }
+    if (v < 0)
+        *--p = '-';
+
+    int len = digits + sizeof(digits) - p;
+    memcpy(out, p, len);
+    return len;
+}
+
+static char *put_str(char *p, const char *s) {
+    size_t len = strlen(s);
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/* Text left-aligned in a column, as printf("%-*s", CELL_WIDTH, text) would */
+static char *put_cell(char *p, const char *text) {
+    int len = strlen(text);
+    memcpy(p, text, len);
+    p += len;
+    while (len++ < CELL_WIDTH)
+        *p++ = ' ';
+    return p;
+}
+
+/* Row number as printf("%3d ", row + 1) would */
+static char *put_row_label(char *p, int row) {
+    char digits[CELL_TEXT_MAX];
+    int len = format_int(digits, row + 1);
+    for (int k = len; k < 3; k++)
+        *p++ = ' ';
+    memcpy(p, digits, len);
+    p += len;
+    *p++ = ' ';
+    return p;
+}
+
+/* Move the cursor to a line and column, both counted from 1 */
+static char *put_cursor(char *p, int line, int column) {
+    *p++ = '\033';
+    *p++ = '[';
+    p += format_int(p, line);
+    *p++ = ';';
+    p += format_int(p, column);
+    *p++ = 'H';
+    return p;
+}
+
+static char *put_row(char *p, const ViewportFrame *frame, int r) {
+    p = put_row_label(p, frame->scroll_row + r);
+    for (int c = 0; c < frame->cols; c++)
+        p = put_cell(p, frame->text[r][c]);
+    return p;
+}
+
+/* Visible part of the sheet and the text of its cells */
+static void capture_frame(Spreadsheet *sheet, ViewportFrame *frame) {
+    frame->scroll_row = sheet->scroll_row;
+    frame->scroll_col = sheet->scroll_col;
+    frame->rows = sheet->totalRows - sheet->scroll_row;
+    if (frame->rows > VIEWPORT_ROWS) frame->rows = VIEWPORT_ROWS;
+    frame->cols = sheet->totalCols - sheet->scroll_col;
+    if (frame->cols > VIEWPORT_COLS) frame->cols = VIEWPORT_COLS;
+
+    for (int r = 0; r < frame->rows; r++)
+        for (int c = 0; c < frame->cols; c++) {
+            int row = frame->scroll_row + r, col = frame->scroll_col + c;
+            char *text = frame->text[r][c];
+            if (get_cell_error(sheet, row, col))
+                strcpy(text, "ERR");
+            else
+                text[format_int(text, get_cell_value(sheet, row, col))] = '\0';
+        }
+}
+
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+void render_viewport(Spreadsheet *sheet, int fd, ViewportFrame *frame) {
+    static char buffer[FRAME_BYTES];
+    ViewportFrame now;
+    capture_frame(sheet, &now);
+    now.drawn = true;
+
+    char *p = buffer;
+    if (!frame || !frame->drawn ||
+        frame->scroll_row != now.scroll_row || frame->scroll_col != now.scroll_col ||
+        frame->rows != now.rows || frame->cols != now.cols) {
+        if (frame)
+            p = put_str(p, CLEAR_SCREEN);
+
+        // Column headers
+        p = put_str(p, "    ");
+        for (int c = 0; c < now.cols; c++) {
+            char label[4];
+            get_col_label(now.scroll_col + c, label);
+            p = put_cell(p, label);
+        }
+        *p++ = '\n';
+
+        for (int r = 0; r < now.rows; r++) {
+            p = put_row(p, &now, r);
+            *p++ = '\n';
+        }
+    } else {
+        // The header sits on line 1 and grid row r on line r + 2
+        for (int r = 0; r < now.rows; r++) {
+            bool changed = false, wide = false;
+            for (int c = 0; c < now.cols; c++) {
+                if (strcmp(frame->text[r][c], now.text[r][c]) != 0)
+                    changed = true;
+                if (strlen(frame->text[r][c]) > CELL_WIDTH || strlen(now.text[r][c]) > CELL_WIDTH)
+                    wide = true;
             }
+            if (!changed)
+                continue;
+
+            // Text wider than its column pushes the rest of the row along, so
+            // such a row is redrawn whole and cleared past its new end
+            if (wide) {
+                p = put_cursor(p, r + 2, 1);
+                p = put_row(p, &now, r);
+                p = put_str(p, "\033[K");
+                continue;
+            }
+            for (int c = 0; c < now.cols; c++)
+                if (strcmp(frame->text[r][c], now.text[r][c]) != 0) {
+                    p = put_cursor(p, r + 2, 5 + c * CELL_WIDTH);
+                    p = put_cell(p, now.text[r][c]);
+                }
         }
-        printf("\n");
+        p = put_cursor(p, now.rows + 2, 1);
+        p = put_str(p, "\033[J");
     }
+
+    if (frame)
+        *frame = now;
+    write_all(fd, buffer, p - buffer);
+}
+
+/* What stdout shows when it is a terminal */
+static ViewportFrame screen;
+static int stdout_is_tty = -1;
+
+void display_viewport(Spreadsheet *sheet) {
+    if (!sheet->output_enabled) return;
+
+    if (stdout_is_tty < 0)
+        stdout_is_tty = isatty(STDOUT_FILENO);
+    // The frame bypasses stdio, so whatever is buffered there goes out first
+    fflush(stdout);
+    render_viewport(sheet, STDOUT_FILENO, stdout_is_tty ? &screen : NULL);
+}
+
+/* On a terminal showing the grid the prompt is kept on the line below it */
+static void place_prompt(Spreadsheet *sheet) {
+    // With output off, prompts and replies scroll the grid away
+    if (!sheet->output_enabled)
+        screen.drawn = false;
+    if (screen.drawn)
+        printf("\033[%d;1H\033[J", screen.rows + 2);
 }
 
 void handle_scroll(Spreadsheet *sheet, char direction) {
@@ -98,6 +265,140 @@ void scroll_to(Spreadsheet *sheet, int row, int col) {
     display_viewport(sheet);
 }
 
+static const char *status_name(CalcStatus status) {
+    switch(status)
+    {
+        case (STATUS_OK):
+            return "ok";
+
+        case (ERR_INVALID_CELL):
+            return "INVALID_CELL";
+
+        case (ERR_CIRCULAR_REF):
+            return "CIRCULAR_REF";
+
+        case (ERR_INVALID_RANGE):
+            return "INVALID_RANGE";
+
+        case (ERR_SYNTAX):
+            return "INVALID_SYNTAX";
+
+        case (ERR_IO):
+            return "IO_ERROR";
+
+        default:
+            return "ERR";
+    }
+}
+
+/* Run one input line: -1 to quit, 0 if it needs no redraw or timing, 1 if it does */
+static int execute_line(Spreadsheet *sheet, char *input) {
+    if (strlen(input) == 0)
+        return 0;
+
+    if (strcmp(input, "q") == 0)
+        return -1;
+
+    if (strcmp(input, "disable_output") == 0) {
+        sheet->output_enabled = 0;
+        sheet->last_status = STATUS_OK;
+        return 0;
+    }
+
+    if (strcmp(input, "enable_output") == 0) {
+        sheet->output_enabled = 1;
+        sheet->last_status = STATUS_OK;
+        display_viewport(sheet);
+        return 0;
+    }
+
+    if (strcmp(input, "enable_range_sums") == 0) {
+        range_sums_enable(sheet);
+        sheet->last_status = STATUS_OK;
+        return 0;
+    }
+
+    if (strcmp(input, "disable_range_sums") == 0) {
+        range_sums_disable(sheet);
+        sheet->last_status = STATUS_OK;
+        return 0;
+    }
+
+    if (strcmp(input, "begin") == 0) {
+        batch_begin(sheet);
+        sheet->last_status = STATUS_OK;
+        return 0;
+    }
+
+    if (strcmp(input, "commit") == 0) {
+        sheet->last_status = batch_commit(sheet);
+        return 1;
+    }
+
+    // Snapshots are taken and restored between batches only, like commit outside one
+    if ((strncmp(input, "save ", 5) == 0 || strncmp(input, "load ", 5) == 0) && sheet->batch.depth > 0) {
+        sheet->last_status = ERR_SYNTAX;
+        return 0;
+    }
+
+    if (strncmp(input, "save ", 5) == 0) {
+        sheet->last_status = snapshot_save(sheet, input + 5) == 0 ? STATUS_OK : ERR_IO;
+        return 0;
+    }
+
+    if (strncmp(input, "load ", 5) == 0) {
+        if (snapshot_load_into(sheet, input + 5) == 0) {
+            sheet->last_status = STATUS_OK;
+            display_viewport(sheet);
+        } else {
+            sheet->last_status = ERR_IO;
+        }
+        return 0;
+    }
+
+    if (strncmp(input, "scroll_to ", 10) == 0) {
+        char cell_ref[10];
+        sscanf(input + 10, "%s", cell_ref);
+        int col = 0, i = 0;
+        while (cell_ref[i] && isalpha(cell_ref[i])) {
+            col = col * 26 + (toupper(cell_ref[i]) - 'A' + 1);
+            i++;
+        }
+        col = col - 1;  // Convert to 0-based index
+        int row = atoi(cell_ref + i) - 1;  // Convert to 0-based index
+
+        if (row < 0 || row >= sheet->totalRows || col < 0 || col >= sheet->totalCols) {
+            sheet->last_status = ERR_INVALID_CELL;
+            return 0;
+        }
+        
+        scroll_to(sheet, row, col);
+        sheet->last_status = STATUS_OK;
+        printf("[%.1f] (%s) > ", sheet->last_processing_time, "ok");
+        fflush(stdout);
+        return 0;
+    }
+
+    // If input is a single character and that character is one of "wasd"
+    if (strlen(input) == 1 && strchr("wasd", input[0]) != NULL) {
+        handle_scroll(sheet, input[0]);
+        sheet->last_status = STATUS_OK;
+        if (sheet->output_enabled) {
+            display_viewport(sheet);  // Always show full viewport for w/a/s/d
+        }
+        // printf("[%.1f] (%s) > ", sheet->last_processing_time, "ok");
+        // fflush(stdout);
+        return 0;
+    } else if (strncmp(input, "import ", 7) == 0) {
+        csv_import_command(sheet, input + 7);
+    } else if (strncmp(input, "fill ", 5) == 0) {
+        fill_command(sheet, input + 5);
+    } else {
+        process_command(sheet, input);  
+    }
+    return 1;
+}
+
 /* Main UI loop */
 void run_ui(Spreadsheet *sheet) {
     struct timeval start_time, end_time;
@@ -106,35 +407,8 @@ void run_ui(Spreadsheet *sheet) {
     display_viewport(sheet);
 
     while(1) {
-        char *sheet_stat;
-        switch(sheet->last_status)
-        {
-            case (STATUS_OK):
-                sheet_stat = "ok";
-                break;
-            
-            case (ERR_INVALID_CELL):
-                sheet_stat = "INVALID_CELL";
-                break;
-            
-            case (ERR_CIRCULAR_REF):
-                sheet_stat = "CIRCULAR_REF";
-                break;
-            
-            case (ERR_INVALID_RANGE):
-                sheet_stat = "INVALID_RANGE";
-                break;
-
-            case (ERR_SYNTAX):
-                sheet_stat = "INVALID_SYNTAX";
-                break;
-            
-            default:
-                sheet_stat = "ERR";
-                break;
-        }
-
-        printf("[%.1f] (%s) > ", sheet->last_processing_time, sheet_stat);
+        place_prompt(sheet);
+        printf("[%.1f] (%s) > ", sheet->last_processing_time, status_name(sheet->last_status));
         fflush(stdout);
 
         if(!fgets(input, sizeof(input), stdin)) break;
@@ -142,63 +416,15 @@ void run_ui(Spreadsheet *sheet) {
 
         gettimeofday(&start_time, NULL);
         
-        if (strlen(input) == 0)
-            continue;
-
-        if (strcmp(input, "q") == 0)
+        int result = execute_line(sheet, input);
+        if (result < 0)
             break;
-
-        if (strcmp(input, "disable_output") == 0) {
-            sheet->output_enabled = 0;
-            sheet->last_status = STATUS_OK;
+        if (result == 0)
             continue;
-        }
 
-        if (strcmp(input, "enable_output") == 0) {
-            sheet->output_enabled = 1;
-            sheet->last_status = STATUS_OK;
+        // Values are stale inside a batch until it commits
+        if (sheet->batch.depth == 0)
             display_viewport(sheet);
-            continue;
-        }
-    
-        if (strncmp(input, "scroll_to ", 10) == 0) {
-            char cell_ref[10];
-            sscanf(input + 10, "%s", cell_ref);
-            int col = 0, i = 0;
-            while (cell_ref[i] && isalpha(cell_ref[i])) {
-                col = col * 26 + (toupper(cell_ref[i]) - 'A' + 1);
-                i++;
-            }
-            col = col - 1;  // Convert to 0-based index
-            int row = atoi(cell_ref + i) - 1;  // Convert to 0-based index
-
-            if (row < 0 || row >= sheet->totalRows || col < 0 || col >= sheet->totalCols) {
-                sheet->last_status = ERR_INVALID_CELL;
-                continue;
-            }
-            
-            scroll_to(sheet, row, col);
-            sheet->last_status = STATUS_OK;
-            printf("[%.1f] (%s) > ", sheet->last_processing_time, "ok");
-            fflush(stdout);
-            continue;
-        }
-
-        // If input is a single character and that character is one of "wasd"
-        if (strlen(input) == 1 && strchr("wasd", input[0]) != NULL) {
-            handle_scroll(sheet, input[0]);
-            sheet->last_status = STATUS_OK;
-            if (sheet->output_enabled) {
-                display_viewport(sheet);  // Always show full viewport for w/a/s/d
-            }
-            // printf("[%.1f] (%s) > ", sheet->last_processing_time, "ok");
-            // fflush(stdout);
-            continue;
-        } else {
-            process_command(sheet, input);  
-        }
-
-        display_viewport(sheet);
 
         gettimeofday(&end_time, NULL);
         sheet->last_processing_time =
@@ -207,4 +433,64 @@ void run_ui(Spreadsheet *sheet) {
 
         sheet->last_cmd_time = end_time;
     }
+}
+
+/* Run a script of commands as one batch with no per-line output, then show the result.
+   The first line that fails undoes the whole script and its status is reported. */
+int run_batch(Spreadsheet *sheet, const char *path) {
+    struct timeval start_time, end_time;
+    char input[256];  // Room for an import path as well as any formula
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Could not open batch file: %s\n", path);
+        return -1;
+    }
+
+    gettimeofday(&start_time, NULL);
+    bool output = sheet->output_enabled;
+    sheet->output_enabled = 0;
+    batch_begin(sheet);
+
+    int line = 0, failed_line = 0;
+    CalcStatus failed = STATUS_OK;
+    while (fgets(input, sizeof(input), fp)) {
+        line++;
+        input[strcspn(input, "\r\n")] = '\0';
+        sheet->last_status = STATUS_OK;
+        // A commit with no begin of the script's own would close the script's batch
+        if (strcmp(input, "commit") == 0 && sheet->batch.depth == 1)
+            sheet->last_status = ERR_SYNTAX;
+        else if (execute_line(sheet, input) < 0)
+            break;
+        if (sheet->last_status != STATUS_OK) {
+            failed = sheet->last_status;
+            failed_line = line;
+            break;
+        }
+    }
+    fclose(fp);
+
+    if (failed != STATUS_OK) {
+        batch_abort(sheet);
+        sheet->last_status = failed;
+    } else {
+        // The script may leave begins of its own open; close them all
+        while (sheet->batch.depth > 1)
+            batch_commit(sheet);
+        sheet->last_status = batch_commit(sheet);
+    }
+    sheet->output_enabled = output;
+
+    gettimeofday(&end_time, NULL);
+    sheet->last_processing_time =
+        (end_time.tv_sec - start_time.tv_sec) +
+        (end_time.tv_usec - start_time.tv_usec) / 1000000.0;
+    sheet->last_cmd_time = end_time;
+
+    if (failed != STATUS_OK)
+        fprintf(stderr, "Batch file %s failed at line %d, nothing was changed\n", path, failed_line);
+    display_viewport(sheet);
+    printf("[%.1f] (%s)\n", sheet->last_processing_time, status_name(sheet->last_status));
+    return sheet->last_status == STATUS_OK ? 0 : -1;
 }
\ No newline at end of file
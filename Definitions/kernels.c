@@ -0,0 +1,221 @@
+#include "../Declarations/kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+void range_totals_init(RangeTotals *acc)
+{
+    acc->sum = 0;
+    acc->sum_sq = 0;
+    acc->min_val = INT_MAX;
+    acc->max_val = INT_MIN;
+    acc->errors = 0;
+}
+
+void kernel_range_totals_scalar(const int *values, const bool *errors, size_t n, RangeTotals *acc)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        int v = values[i];
+        acc->sum += v;
+        acc->sum_sq += (uint64_t)((int64_t)v * v);
+        if (v < acc->min_val)
+            acc->min_val = v;
+        if (v > acc->max_val)
+            acc->max_val = v;
+        acc->errors += errors[i];
+    }
+}
+
+#ifdef KERNELS_X86
+
+// 4 lanes per step. SSE2 has no signed min/max, sign extension or abs for 32-bit
+// lanes, so those are built from compares and shifts. Squares go through |v|, which
+// fits an unsigned 32-bit lane, so the unsigned 32x32->64 multiply gives v*v exactly.
+__attribute__((target("sse2")))
+static void range_totals_sse2(const int *values, const bool *errors, size_t n, RangeTotals *acc)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i vsum = zero, vsq = zero, verr = zero;
+    __m128i vmin = _mm_set1_epi32(acc->min_val);
+    __m128i vmax = _mm_set1_epi32(acc->max_val);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(values + i));
+        __m128i sign = _mm_srai_epi32(v, 31);
+        vsum = _mm_add_epi64(vsum, _mm_unpacklo_epi32(v, sign));
+        vsum = _mm_add_epi64(vsum, _mm_unpackhi_epi32(v, sign));
+
+        __m128i a = _mm_sub_epi32(_mm_xor_si128(v, sign), sign);
+        __m128i a_odd = _mm_srli_epi64(a, 32);
+        vsq = _mm_add_epi64(vsq, _mm_mul_epu32(a, a));
+        vsq = _mm_add_epi64(vsq, _mm_mul_epu32(a_odd, a_odd));
+
+        __m128i lt = _mm_cmplt_epi32(v, vmin);
+        vmin = _mm_or_si128(_mm_and_si128(lt, v), _mm_andnot_si128(lt, vmin));
+        __m128i gt = _mm_cmpgt_epi32(v, vmax);
+        vmax = _mm_or_si128(_mm_and_si128(gt, v), _mm_andnot_si128(gt, vmax));
+    }
+
+    // Error flags are 0/1 bytes: a sum of absolute differences against zero counts them
+    size_t e = 0;
+    for (; e + 16 <= i; e += 16)
+        verr = _mm_add_epi64(verr, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(errors + e)), zero));
+
+    int64_t s[2], q[2], c[2];
+    int mn[4], mx[4];
+    _mm_storeu_si128((__m128i *)s, vsum);
+    _mm_storeu_si128((__m128i *)q, vsq);
+    _mm_storeu_si128((__m128i *)c, verr);
+    _mm_storeu_si128((__m128i *)mn, vmin);
+    _mm_storeu_si128((__m128i *)mx, vmax);
+
+    acc->sum += s[0] + s[1];
+    acc->sum_sq += (uint64_t)q[0] + (uint64_t)q[1];
+    acc->errors += c[0] + c[1];
+    for (int k = 0; k < 4; k++)
+    {
+        if (mn[k] < acc->min_val)
+            acc->min_val = mn[k];
+        if (mx[k] > acc->max_val)
+            acc->max_val = mx[k];
+    }
+    for (; e < i; e++)
+        acc->errors += errors[e];
+    kernel_range_totals_scalar(values + i, errors + i, n - i, acc);
+}
+
+// 8 lanes per step with native sign extension, abs and min/max
+__attribute__((target("avx2")))
+static void range_totals_avx2(const int *values, const bool *errors, size_t n, RangeTotals *acc)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i vsum = zero, vsq = zero, verr = zero;
+    __m256i vmin = _mm256_set1_epi32(acc->min_val);
+    __m256i vmax = _mm256_set1_epi32(acc->max_val);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(values + i));
+        vsum = _mm256_add_epi64(vsum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+        vsum = _mm256_add_epi64(vsum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+
+        __m256i a = _mm256_abs_epi32(v);
+        __m256i a_odd = _mm256_srli_epi64(a, 32);
+        vsq = _mm256_add_epi64(vsq, _mm256_mul_epu32(a, a));
+        vsq = _mm256_add_epi64(vsq, _mm256_mul_epu32(a_odd, a_odd));
+
+        vmin = _mm256_min_epi32(vmin, v);
+        vmax = _mm256_max_epi32(vmax, v);
+    }
+
+    size_t e = 0;
+    for (; e + 32 <= i; e += 32)
+        verr = _mm256_add_epi64(verr, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(errors + e)), zero));
+
+    int64_t s[4], q[4], c[4];
+    int mn[8], mx[8];
+    _mm256_storeu_si256((__m256i *)s, vsum);
+    _mm256_storeu_si256((__m256i *)q, vsq);
+    _mm256_storeu_si256((__m256i *)c, verr);
+    _mm256_storeu_si256((__m256i *)mn, vmin);
+    _mm256_storeu_si256((__m256i *)mx, vmax);
+
+    for (int k = 0; k < 4; k++)
+    {
+        acc->sum += s[k];
+        acc->sum_sq += (uint64_t)q[k];
+        acc->errors += c[k];
+    }
+    for (int k = 0; k < 8; k++)
+    {
+        if (mn[k] < acc->min_val)
+            acc->min_val = mn[k];
+        if (mx[k] > acc->max_val)
+            acc->max_val = mx[k];
+    }
+    for (; e < i; e++)
+        acc->errors += errors[e];
+    kernel_range_totals_scalar(values + i, errors + i, n - i, acc);
+}
+
+#endif
+
+void kernel_rect_totals(const Spreadsheet *sheet, short r1, short c1, short r2, short c2, RangeKernel kernel, RangeTotals *acc)
+{
+    for (int tr = r1 >> TILE_SHIFT; tr <= r2 >> TILE_SHIFT; tr++)
+    {
+        int row_lo = tr << TILE_SHIFT > r1 ? tr << TILE_SHIFT : r1;
+        int row_hi = (tr << TILE_SHIFT) + TILE_MASK < r2 ? (tr << TILE_SHIFT) + TILE_MASK : r2;
+        for (int tc = c1 >> TILE_SHIFT; tc <= c2 >> TILE_SHIFT; tc++)
+        {
+            int col_lo = tc << TILE_SHIFT > c1 ? tc << TILE_SHIFT : c1;
+            int col_hi = (tc << TILE_SHIFT) + TILE_MASK < c2 ? (tc << TILE_SHIFT) + TILE_MASK : c2;
+            const Tile *t = tile_at(sheet, tr * sheet->tile_cols + tc);
+            if (!t)
+            {
+                if (acc->min_val > 0)
+                    acc->min_val = 0;
+                if (acc->max_val < 0)
+                    acc->max_val = 0;
+                continue;
+            }
+            for (int i = row_lo; i <= row_hi; i++)
+            {
+                int first = tile_offset(i, col_lo);
+                kernel(t->values + first, t->errors + first, col_hi - col_lo + 1, acc);
+            }
+        }
+    }
+}
+
+RangeKernel kernel_variant(const char *isa)
+{
+    if (strcmp(isa, "scalar") == 0)
+        return kernel_range_totals_scalar;
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (strcmp(isa, "sse2") == 0 && __builtin_cpu_supports("sse2"))
+        return range_totals_sse2;
+    if (strcmp(isa, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+        return range_totals_avx2;
+#endif
+    return NULL;
+}
+
+static RangeKernel selected;
+static const char *selected_name;
+
+static RangeKernel select_kernel(void)
+{
+    static const char *order[] = {"avx2", "sse2", "scalar"};
+    RangeKernel kernel = NULL;
+    int k = 0;
+    while (!(kernel = kernel_variant(order[k])))
+        k++;
+
+    // Every thread that races here picks the same variant
+    __atomic_store_n(&selected_name, order[k], __ATOMIC_RELAXED);
+    __atomic_store_n(&selected, kernel, __ATOMIC_RELEASE);
+    return kernel;
+}
+
+void kernel_range_totals(const int *values, const bool *errors, size_t n, RangeTotals *acc)
+{
+    RangeKernel kernel = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    if (!kernel)
+        kernel = select_kernel();
+    kernel(values, errors, n, acc);
+}
+
+const char *kernel_isa_name(void)
+{
+    if (!__atomic_load_n(&selected, __ATOMIC_ACQUIRE))
+        select_kernel();
+    return __atomic_load_n(&selected_name, __ATOMIC_RELAXED);
+}
@@ -2,17 +2,65 @@
 #include "../Declarations/backend.h"
 #include "../Declarations/parser.h"
 #include "../Declarations/ds.h"
+#include "../Declarations/threadpool.h"
+#include "../Declarations/snapshot.h"
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    // Recalc threads: --threads N, else GODSHEET_THREADS, else serial
+    int threads = 1;
+    const char *env_threads = getenv("GODSHEET_THREADS");
+    if (env_threads)
+        threads = atoi(env_threads);
+
+    // Grid layout: --grid tiled|flat, else GODSHEET_GRID, else tiled
+    GridMode grid = GRID_TILED;
+    const char *grid_name = getenv("GODSHEET_GRID");
+
+    // Start from a snapshot instead of an empty sheet: --load FILE, in place of rows cols
+    const char *load_path = NULL;
+
+    // Run a script of commands as one batch and exit: --batch FILE
+    const char *batch_path = NULL;
+
+    int argi = 1;
+    while (argi < argc && strncmp(argv[argi], "--", 2) == 0)
     {
-        fprintf(stderr, "Usage: %s rows cols\n", argv[0]);
+        if (strcmp(argv[argi], "--threads") == 0 && argi + 1 < argc)
+        {
+            threads = atoi(argv[argi + 1]);
+            argi += 2;
+        }
+        else if (strcmp(argv[argi], "--load") == 0 && argi + 1 < argc)
+        {
+            load_path = argv[argi + 1];
+            argi += 2;
+        }
+        else if (strcmp(argv[argi], "--batch") == 0 && argi + 1 < argc)
+        {
+            batch_path = argv[argi + 1];
+            argi += 2;
+        }
+        else if (strcmp(argv[argi], "--grid") == 0 && argi + 1 < argc)
+        {
+            grid_name = argv[argi + 1];
+            argi += 2;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", argv[argi]);
+            return 1;
+        }
+    }
+
+    if (argc - argi != (load_path ? 0 : 2))
+    {
+        fprintf(stderr, "Usage: %s [--threads N] [--grid tiled|flat] [--batch FILE] (rows cols | --load FILE)\n", argv[0]);
         return 1;
     }
 
-    int rows = atoi(argv[1]);
-    int cols = atoi(argv[2]);
+    int rows = load_path ? 1 : atoi(argv[argi]);
+    int cols = load_path ? 1 : atoi(argv[argi + 1]);
 
     // Debug print to confirm argument values
 
@@ -22,13 +70,44 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    Spreadsheet *sheet = create_spreadsheet(rows, cols);
+    if (threads < 1 || threads > THREADPOOL_MAX_THREADS)
+    {
+        fprintf(stderr, "Invalid thread count. Must be between 1 and %d\n", THREADPOOL_MAX_THREADS);
+        return 1;
+    }
+    if (grid_name && strcmp(grid_name, "flat") == 0)
+        grid = GRID_FLAT;
+    else if (grid_name && strcmp(grid_name, "tiled") != 0)
+    {
+        fprintf(stderr, "Invalid grid mode: %s (expected tiled or flat)\n", grid_name);
+        return 1;
+    }
+    threadpool_start(threads, THREADPOOL_DEFAULT_MIN_NODES);
+
+    Spreadsheet *sheet;
+    if (load_path)
+    {
+        sheet = snapshot_load(load_path, grid);
+        if (!sheet)
+        {
+            fprintf(stderr, "Could not load snapshot: %s\n", load_path);
+            threadpool_stop();
+            return 1;
+        }
+    }
+    else
+        sheet = create_spreadsheet_mode(rows, cols, grid);
     gettimeofday(&sheet->last_cmd_time, NULL);  // Initialize last_cmd_time properly
 
     // Run the UI without terminal configuration
-    run_ui(sheet);
+    int status = 0;
+    if (batch_path)
+        status = run_batch(sheet, batch_path) == 0 ? 0 : 1;
+    else
+        run_ui(sheet);
 
     // Clean up and exit
     free_spreadsheet(sheet);
-    return 0;
+    threadpool_stop();
+    return status;
 }
\ No newline at end of file
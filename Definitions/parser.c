@@ -22,182 +22,163 @@ Operation char_to_operation(char c)
     }
 }
 
-static int col_label_to_index(const char *label)
+// The right-hand side is read in a single pass with no copies and no allocation:
+// lex_operand hands out operands as spans of the input, and parse_formula picks the
+// command shape from them, trying the same shapes in the same order as the regex
+// based parser it replaced so every input gets the same status as before.
+
+typedef enum
 {
-    int result = 0;
-    char c;
-    for (int i = 0; label[i] != '\0'; i++)
-    {
-        if (!isalpha(label[i]) || islower(c = label[i]))
-        {
-            return -1;
-        }
-        result = result * 26 + (c - 'A' + 1);
-    }
-    return result - 1;
-}
+    TOK_NUMBER, // [-+]?[0-9]+
+    TOK_CELL    // [A-Z]+[0-9]+
+} TokenKind;
 
-static int parse_cell_address(Spreadsheet *sheet, const char **input, int *row, int *col)
+typedef struct
 {
-    regex_t regex;
-    const char *pattern = "^[A-Z]+[0-9]+$";
-    if (regcomp(&regex, pattern, REG_EXTENDED) != 0)
-    {
-        sheet->last_status = ERR_SYNTAX;
-        return -1;
-    }
+    TokenKind kind;
+    const char *start;
+    const char *end;
+    int letters; // column letters of a TOK_CELL
+} Token;
 
-    regmatch_t match;
-    if (regexec(&regex, *input, 1, &match, 0) != 0)
-    {
-        regfree(&regex);
-        sheet->last_status = ERR_SYNTAX;
-        return -1;
-    }
+static bool is_upper(char c)
+{
+    return c >= 'A' && c <= 'Z';
+}
 
-    regfree(&regex);
-    char col_part[4] = {'\0', '\0', '\0', '\0'};
-    int i = 0;
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
 
-    while (isalpha(**input) && i < 3)
+// Read one operand from [*p, end). On success *p moves past it.
+static bool lex_operand(const char **p, const char *end, Token *tok)
+{
+    const char *s = *p, *q = s;
+    if (q < end && (*q == '+' || *q == '-'))
+        q++;
+    if (q < end && is_digit(*q))
     {
-        col_part[i++] = **input;
-        (*input)++;
+        while (q < end && is_digit(*q))
+            q++;
+        tok->kind = TOK_NUMBER;
     }
-    if (i == 0)
+    else if (q == s && q < end && is_upper(*q))
     {
-        sheet->last_status = ERR_SYNTAX;
-        return -1;
-    } // No column letters
-
-    // Convert column to index
-    *col = col_label_to_index(col_part);
-
-    *row = 0;
-    while (isdigit(**input))
-    {
-        *row = *row * 10 + (**input - '0');
-        (*input)++;
-    }
-    *row -= 1;
-    if(*row >= sheet->totalRows || *col >= sheet->totalCols || *row < 0 || *col < 0){
-        sheet->last_status = ERR_INVALID_RANGE;
-        return -1;
+        while (q < end && is_upper(*q))
+            q++;
+        tok->letters = (int)(q - s);
+        if (q == end || !is_digit(*q))
+            return false;
+        while (q < end && is_digit(*q))
+            q++;
+        tok->kind = TOK_CELL;
     }
-    return 0;
+    else
+        return false;
+    tok->start = s;
+    tok->end = q;
+    *p = q;
+    return true;
 }
 
-static int is_valid_formula(const char *formula)
+// Is [s, end) exactly one token of the given kind?
+static bool lex_whole(const char *s, const char *end, TokenKind kind, Token *tok)
 {
-    // Regex pattern that matches one of the fixed formula names,
-    // followed by '(' with any characters inside and a closing ')'
-    const char *pattern = "^(MIN|MAX|AVG|SUM|STDEV|SLEEP)\\(.*\\)$";
-    regex_t regex;
-    int ret = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB);
-    if (ret)
-    {
-        // Handle error in regex compilation as needed
-        return 0;
-    }
-    ret = regexec(&regex, formula, 0, NULL, 0);
-    regfree(&regex);
-    return ret == 0;
+    return lex_operand(&s, end, tok) && tok->kind == kind && s == end;
 }
 
-// Parse a range (e.g., "A1:B2") and store cells in the range array
-static int parse_range(Spreadsheet *sheet, const char *range_str, bool *need_new_dep, PairOfPair *new_pairs)
+// Column and row of a cell token; both saturate instead of overflowing, which
+// lands them outside any sheet
+static void cell_position(const Token *tok, int *row, int *col)
 {
-    if (range_str == NULL)
-    {
-        sheet->last_status = ERR_SYNTAX;
-        return -1;
-    }
-    char *colon = strchr(range_str, ':');
-    // Split the range into start and end
-    int len = strlen(range_str);
-    char *range_copy = malloc(len + 1);
-    strcpy(range_copy, range_str);
-    range_copy[colon - range_str] = '\0';
-
-    // Parse start and end cells
-    int start_row, start_col, end_row, end_col;
-    const char *start_ptr = range_copy;
-    const char *end_ptr = colon + 1;
+    const char *p = tok->start;
+    int c = 0, r = 0;
+    for (; p < tok->start + tok->letters; p++)
+        c = c <= MAX_COLS ? c * 26 + (*p - 'A' + 1) : c;
+    for (; p < tok->end; p++)
+        r = r <= MAX_ROWS ? r * 10 + (*p - '0') : r;
+    *col = c - 1;
+    *row = r - 1;
+}
 
-    if (parse_cell_address(sheet, &start_ptr, &start_row, &start_col) != 0 ||
-        parse_cell_address(sheet, &end_ptr, &end_row, &end_col) != 0)
+// Address on the left-hand side, in a range or in SLEEP: at most three column
+// letters, inside the sheet
+static int resolve_address(Spreadsheet *sheet, const Token *tok, int *row, int *col)
+{
+    if (tok->letters > 3)
     {
-        free(range_copy);
-        range_copy = NULL;
+        sheet->last_status = ERR_INVALID_RANGE;
         return -1;
     }
-
-    // Validate range order
-    if (start_row > end_row || start_col > end_col)
+    cell_position(tok, row, col);
+    if (*row >= sheet->totalRows || *col >= sheet->totalCols || *row < 0 || *col < 0)
     {
         sheet->last_status = ERR_INVALID_RANGE;
-        free(range_copy);
-        range_copy = NULL;
         return -1;
     }
-    new_pairs->first.i = start_row;
-    new_pairs->first.j = start_col;
-
-    new_pairs->second.i = end_row;
-    new_pairs->second.j = end_col;
-
-    *need_new_dep = true;
-
-    free(range_copy);
-    range_copy = NULL;
     return 0;
 }
 
-// Parse arithmetic expression (e.g., "A1+2" or "B2*C3")
-static int parse_arithmetic(Spreadsheet *sheet, Cell *target_cell, const char *formula, bool *need_new_dep, PairOfPair *new_pairs)
+// Parse an address that must make up all of [s, end)
+static int parse_cell_address(Spreadsheet *sheet, const char *s, const char *end, int *row, int *col)
 {
-    regex_t regex;
-    const char *pattern = "^([-+]?[0-9]+|[A-Z]+[0-9]+)([+*/-])([-+]?[0-9]+|[A-Z]+[0-9]+)$";
-    if (regcomp(&regex, pattern, REG_EXTENDED) != 0)
+    Token tok;
+    if (!lex_whole(s, end, TOK_CELL, &tok))
     {
         sheet->last_status = ERR_SYNTAX;
         return -1;
     }
+    return resolve_address(sheet, &tok, row, col);
+}
 
-    regmatch_t matches[4]; // matches[0]: full match, [1]: operand1, [2]: operator, [3]: operand2
-    int ret = regexec(&regex, formula, 4, matches, 0);
-    regfree(&regex);
-    if (ret != 0)
+// Operand of an arithmetic formula: 0 for a constant, 1 for a cell inside the sheet, -1 otherwise
+static int resolve_operand(Spreadsheet *sheet, const Token *tok, int *value, int *row, int *col)
+{
+    if (tok->kind == TOK_NUMBER)
     {
-        sheet->last_status = ERR_SYNTAX;
-        return -1;
+        *value = (int)strtol(tok->start, NULL, 10);
+        return 0;
     }
+    cell_position(tok, row, col);
+    if (*row >= sheet->totalRows || *col >= sheet->totalCols || *row < 0 || *col < 0)
+        return -1;
+    return 1;
+}
 
-    // Extract operand1
-    int len = matches[1].rm_eo - matches[1].rm_so;
-    char operand1[64] = {0};
-    strncpy(operand1, formula + matches[1].rm_so, len);
-    operand1[len] = '\0';
-
-    // Extract operator
-    len = matches[2].rm_eo - matches[2].rm_so;
-    char op_str[4] = {0};
-    strncpy(op_str, formula + matches[2].rm_so, len);
-    op_str[len] = '\0';
+static bool is_number(const char *s, const char *end)
+{
+    Token tok;
+    return lex_whole(s, end, TOK_NUMBER, &tok);
+}
 
-    // Extract operand2
-    len = matches[3].rm_eo - matches[3].rm_so;
-    char operand2[64] = {0};
-    strncpy(operand2, formula + matches[3].rm_so, len);
-    operand2[len] = '\0';
+// Length of the function name that starts formula and is followed by '(', else 0
+static int function_name(const char *formula, char *code)
+{
+    static const struct { const char *name; char code; } functions[] = {
+        {"MIN", 'A'}, {"MAX", 'B'}, {"AVG", 'C'}, {"SUM", 'D'}, {"STDEV", 'E'}, {"SLEEP", 'S'}};
+    for (size_t k = 0; k < sizeof(functions) / sizeof(functions[0]); k++)
+    {
+        size_t len = strlen(functions[k].name);
+        if (strncmp(formula, functions[k].name, len) == 0 && formula[len] == '(')
+        {
+            *code = functions[k].code;
+            return (int)len;
+        }
+    }
+    return 0;
+}
 
+// Parse arithmetic expression (e.g., "A1+2" or "B2*C3")
+static int parse_arithmetic(Spreadsheet *sheet, CellContents *target_cell, const Token *operand1, char op, const Token *operand2, bool *need_new_dep, PairOfPair *new_pairs)
+{
     target_cell->type = 'A';
-    target_cell->op_data.arithmetic.op = char_to_operation(op_str[0]);
+    target_cell->op_data.arithmetic.op = char_to_operation(op);
     target_cell->op_data.arithmetic.constant = 0;
 
     // Process operand1
     int type1, value1 = -1, row1, col1;
-    type1 = check_constant_or_cell_address(operand1, &value1, &row1, &col1, sheet);
+    type1 = resolve_operand(sheet, operand1, &value1, &row1, &col1);
     if (type1 == 0)
     {
         // Operand is a numeric constant.
@@ -219,7 +200,7 @@ static int parse_arithmetic(Spreadsheet *sheet, Cell *target_cell, const char *f
 
     // Process operand2
     int type2, value2 = -1, row2, col2;
-    type2 = check_constant_or_cell_address(operand2, &value2, &row2, &col2, sheet);
+    type2 = resolve_operand(sheet, operand2, &value2, &row2, &col2);
     if (type2 == 0)
     {
         new_pairs->second.i = -1;
@@ -255,7 +236,9 @@ static int parse_arithmetic(Spreadsheet *sheet, Cell *target_cell, const char *f
         case OP_DIV:
             if (value2 == 0)
             {
-                target_cell->has_error = true;
+                target_cell->type = 'C';
+                set_cell_error(sheet, target_cell->row, target_cell->col, true);
+                *need_new_dep = false;
                 return 0;
             }
             evaluated = value1 / value2;
@@ -265,7 +248,7 @@ static int parse_arithmetic(Spreadsheet *sheet, Cell *target_cell, const char *f
             return -1;
         }
         target_cell->type = 'C';
-        target_cell->value = evaluated;
+        set_cell_value(sheet, target_cell->row, target_cell->col, evaluated);
         *need_new_dep = false;
         return 0;
     }
@@ -273,56 +256,26 @@ static int parse_arithmetic(Spreadsheet *sheet, Cell *target_cell, const char *f
     return 0;
 }
 
-static bool is_number(const char *str) {
-    if (!str || *str == '\0')
-        return false;
-    // Allow leading sign
-    if (*str == '+' || *str == '-')
-        str++;
-    
-    if (*str == '\0')
-        return false;
-    
-    while (*str) 
-    {
-        if (!isdigit((unsigned char)*str))
-            return false;
-        str++;
-    }
-    return true;
-}
-
-// Parse function call (e.g., "SUM(A1:B2)")
-static int parse_function(Spreadsheet *sheet, Cell *target_cell, const char *formula, bool *need_new_dep, PairOfPair *new_pairs)
+// Parse function call (e.g., "SUM(A1:B2)"). The argument runs up to the first ')';
+// anything between it and the final ')' is ignored, as it always was.
+static int parse_function(Spreadsheet *sheet, CellContents *target_cell, const char *formula, int name_len, char code, bool *need_new_dep, PairOfPair *new_pairs)
 {
-    // Extract function name
-    char func_name[10] = {0};
-    const char *p = formula;
-
-    int i = 0;
-    while (*p && *p != '(' && i < 9)
-    {
-        func_name[i++] = *p++;
-    }
-    // Find closing parenthesis
-    const char *close_paren = strchr(p, ')');
-
-    // Extract range/value
-    int range_len = close_paren - p - 1;
-    char *range_str = malloc(range_len + 1);
-    strncpy(range_str, p + 1, range_len);
-    range_str[range_len] = '\0';
-
-    int stat = 0;
+    const char *arg = formula + name_len + 1;
+    const char *close = strchr(arg, ')');
+    int row, col;
+    Token tok;
 
-    if (strcmp(func_name, "SLEEP") == 0)
+    if (code == 'S')
     {
-        target_cell->is_sleep =  true;
-        int row, col;
-        const char *ptr = range_str;
-        if (parse_cell_address(sheet, &ptr, &row, &col) == 0)
+        target_cell->is_sleep = true;
+        if (lex_whole(arg, close, TOK_CELL, &tok))
         {
-            target_cell->type='R';
+            if (resolve_address(sheet, &tok, &row, &col) != 0)
+            {
+                sheet->last_status = ERR_SYNTAX;
+                return -1;
+            }
+            target_cell->type = 'R';
             new_pairs->first.i = row;
             new_pairs->first.j = col;
 
@@ -331,39 +284,250 @@ static int parse_function(Spreadsheet *sheet, Cell *target_cell, const char *for
 
             *need_new_dep = true;
         }
-        else if (is_number(ptr))
+        else if (is_number(arg, close))
         {
-            target_cell->type='C';
-            target_cell->value= atoi(ptr);
+            target_cell->type = 'C';
+            set_cell_value(sheet, target_cell->row, target_cell->col, (int)strtol(arg, NULL, 10));
             *need_new_dep = false;
         }
         else
         {
             sheet->last_status = ERR_SYNTAX;
-            stat = -1;
+            return -1;
         }
-        free(range_str);
-        range_str = NULL;
-        return stat;
+        return 0;
     }
 
     target_cell->type = 'F';
+    target_cell->op_data.function.func_name = code;
 
-    if (strcmp(func_name, "MIN") == 0) target_cell->op_data.function.func_name = 'A';
-    else if (strcmp(func_name, "MAX") == 0) target_cell->op_data.function.func_name = 'B';
-    else if (strcmp(func_name, "AVG") == 0) target_cell->op_data.function.func_name = 'C';
-    else if (strcmp(func_name, "SUM") == 0) target_cell->op_data.function.func_name = 'D';
-    else if (strcmp(func_name, "STDEV") == 0) target_cell->op_data.function.func_name = 'E';
-
-    if (!strchr(range_str, ':') || parse_range(sheet, range_str, need_new_dep, new_pairs) != 0)
+    // Any problem with the range, even one outside the sheet, is a syntax error here
+    const char *colon = memchr(arg, ':', close - arg);
+    int end_row, end_col;
+    if (!colon ||
+        parse_cell_address(sheet, arg, colon, &row, &col) != 0 ||
+        parse_cell_address(sheet, colon + 1, close, &end_row, &end_col) != 0 ||
+        row > end_row || col > end_col)
     {
         sheet->last_status = ERR_SYNTAX;
-        stat = -1;
+        return -1;
     }
+    new_pairs->first.i = row;
+    new_pairs->first.j = col;
 
-    free(range_str);
-    range_str = NULL;
-    return stat; 
+    new_pairs->second.i = end_row;
+    new_pairs->second.j = end_col;
+
+    *need_new_dep = true;
+    return 0;
+}
+
+// Inputs that fit none of the shapes above are compiled into bytecode for an 'X'
+// cell (see ExprOp): numbers and cells combined with + - * / under the usual
+// precedence, unary signs, parentheses, and MIN/MAX/AVG/SUM/STDEV over either a
+// range or a list of two or more expressions, which may nest further calls.
+//
+//   expr    := term {('+' | '-') term}
+//   term    := unary {('*' | '/') unary}
+//   unary   := {'+' | '-'} primary
+//   primary := number | cell | '(' expr ')' | NAME '(' cell ':' cell ')' | NAME '(' expr ',' expr {',' expr} ')'
+#define EXPR_MAX_NESTING 64
+
+typedef struct
+{
+    Spreadsheet *sheet;
+    short row, col;     // cell being compiled for; addresses become offsets from it
+    const char *p;
+    const char *end;
+    int32_t *code;  // room for 2 words per input character, which no expression exceeds
+    int size;
+    int nesting;    // open parentheses and calls
+} Compiler;
+
+static void emit(Compiler *c, int32_t word)
+{
+    c->code[c->size++] = word;
+}
+
+// Packed offset of a cell token inside the sheet
+static bool compile_address(Compiler *c, const Token *tok, int32_t *word)
+{
+    int row, col;
+    if (tok->letters > 3)
+        return false;
+    cell_position(tok, &row, &col);
+    if (row < 0 || col < 0 || row >= c->sheet->totalRows || col >= c->sheet->totalCols)
+        return false;
+    *word = expr_pack(row - c->row, col - c->col);
+    return true;
+}
+
+static bool compile_expr(Compiler *c);
+
+static bool compile_call(Compiler *c, char code)
+{
+    // A range argument: CELL ':' CELL ')'
+    Token first, last;
+    const char *q = c->p;
+    if (lex_operand(&q, c->end, &first) && first.kind == TOK_CELL && q < c->end && *q == ':')
+    {
+        int32_t from, to;
+        q++;
+        if (!lex_operand(&q, c->end, &last) || last.kind != TOK_CELL || q == c->end || *q != ')' ||
+            !compile_address(c, &first, &from) || !compile_address(c, &last, &to))
+            return false;
+        emit(c, EX_RANGE);
+        emit(c, code);
+        emit(c, from);
+        emit(c, to);
+        c->p = q + 1;
+        return true;
+    }
+
+    int n = 0;
+    do
+    {
+        if (!compile_expr(c))
+            return false;
+        n++;
+    } while (c->p < c->end && *c->p == ',' && c->p++);
+    if (n < 2 || c->p == c->end || *c->p != ')')
+        return false;
+    c->p++;
+    emit(c, EX_LIST);
+    emit(c, code);
+    emit(c, n);
+    return true;
+}
+
+static bool compile_primary(Compiler *c)
+{
+    if (c->p == c->end)
+        return false;
+
+    if (*c->p == '(')
+    {
+        c->p++;
+        if (!compile_expr(c) || c->p == c->end || *c->p != ')')
+            return false;
+        c->p++;
+        return true;
+    }
+
+    if (is_digit(*c->p))
+    {
+        int64_t value = 0;
+        while (c->p < c->end && is_digit(*c->p))
+        {
+            value = value * 10 + (*c->p++ - '0');
+            if (value > INT_MAX)
+                return false;
+        }
+        emit(c, EX_CONST);
+        emit(c, (int32_t)value);
+        return true;
+    }
+
+    // SLEEP only ever stands on its own
+    char code;
+    int name_len = function_name(c->p, &code);
+    if (name_len > 0)
+    {
+        if (code == 'S' || ++c->nesting > EXPR_MAX_NESTING)
+            return false;
+        c->p += name_len + 1;
+        bool ok = compile_call(c, code);
+        c->nesting--;
+        return ok;
+    }
+
+    Token tok;
+    int32_t word;
+    if (!is_upper(*c->p) || !lex_operand(&c->p, c->end, &tok) || !compile_address(c, &tok, &word))
+        return false;
+    emit(c, EX_CELL);
+    emit(c, word);
+    return true;
+}
+
+static bool compile_unary(Compiler *c)
+{
+    bool negate = false;
+    while (c->p < c->end && (*c->p == '-' || *c->p == '+'))
+        negate ^= (*c->p++ == '-');
+    if (!compile_primary(c))
+        return false;
+    if (negate)
+        emit(c, EX_NEG);
+    return true;
+}
+
+static bool compile_term(Compiler *c)
+{
+    if (!compile_unary(c))
+        return false;
+    while (c->p < c->end && (*c->p == '*' || *c->p == '/'))
+    {
+        int32_t op = *c->p++ == '*' ? EX_MUL : EX_DIV;
+        if (!compile_unary(c))
+            return false;
+        emit(c, op);
+    }
+    return true;
+}
+
+static bool compile_expr(Compiler *c)
+{
+    if (++c->nesting > EXPR_MAX_NESTING || !compile_term(c))
+        return false;
+    while (c->p < c->end && (*c->p == '+' || *c->p == '-'))
+    {
+        int32_t op = *c->p++ == '+' ? EX_ADD : EX_SUB;
+        if (!compile_term(c))
+            return false;
+        emit(c, op);
+    }
+    c->nesting--;
+    return true;
+}
+
+// Compile formula into an 'X' cell. An expression that reads no cells is folded
+// into a constant right away, like a constant arithmetic formula.
+static int parse_expression(Spreadsheet *sheet, CellContents *target_cell, const char *formula, bool *need_new_dep, PairOfPair *new_pairs)
+{
+    size_t len = strlen(formula);
+    Compiler c = {sheet, target_cell->row, target_cell->col, formula, formula + len, (int32_t *)malloc((2 * len + 2) * sizeof(int32_t)), 0, 0};
+    if (!c.code)
+    {
+        fprintf(stderr, "Memory allocation failed for expression\n");
+        exit(1);
+    }
+    bool ok = compile_expr(&c) && c.p == c.end;
+    int slot = ok ? program_create(sheet, c.code, c.size) : -1;
+    free(c.code);
+    if (slot < 0)
+        return -1;
+
+    const Program *prog = &sheet->programs[slot];
+    target_cell->is_sleep = false;
+    new_pairs->first.i = new_pairs->first.j = -1;
+    new_pairs->second.i = new_pairs->second.j = -1;
+    if (prog->num_refs == 0 && prog->num_ranges == 0)
+    {
+        int value;
+        if (run_expression(sheet, prog->code, prog->code_size, target_cell->row, target_cell->col, &value))
+            set_cell_value(sheet, target_cell->row, target_cell->col, value);
+        else
+            set_cell_error(sheet, target_cell->row, target_cell->col, true);
+        program_release(sheet, slot);
+        target_cell->type = 'C';
+        *need_new_dep = false;
+        return 0;
+    }
+    target_cell->type = 'X';
+    target_cell->op_data.expression.program = slot;
+    *need_new_dep = true;
+    return 0;
 }
 
 int check_constant_or_cell_address(const char *str, int *constant_value, int *row, int *col, Spreadsheet* sheet)
@@ -404,91 +568,63 @@ int check_constant_or_cell_address(const char *str, int *constant_value, int *ro
     return 1;
 }
 
-static bool match_formula(const char *formula) 
+// The fixed formula shapes: constant, function call, binary arithmetic, reference
+static int parse_shape(Spreadsheet *sheet, CellContents *cell, const char *formula, bool *need_new_dep, PairOfPair *new_pairs)
 {
-    regex_t regex;
-    const char *pattern = "^([-+]?[0-9]+|[A-Z]+[0-9]+)([+*/-])([-+]?[0-9]+|[A-Z]+[0-9]+)$";
-
-    if (regcomp(&regex, pattern, REG_EXTENDED) != 0) {
-        fprintf(stderr, "Could not compile regex\n");
-        exit(1);
-    }
-
-    int ret = regexec(&regex, formula, 0, NULL, 0);
-    regfree(&regex);
-    return (ret == 0);
-}
-
-int parse_formula(Spreadsheet *sheet, Cell *cell, const char *formula, bool *need_new_dep, PairOfPair *new_pairs)
-{
-    cell->has_error = false;
+    const char *end = formula + strlen(formula);
 
     /*                                      Check if the value is a single constant                                        */
-    bool is_numeric = true;
-    if (!is_number(formula))
-        is_numeric = false;
-
-    if (is_numeric){
-        int value = atoi(formula);
+    if (is_number(formula, end))
+    {
         cell->type = 'C';
-        cell->value = value;
+        set_cell_value(sheet, cell->row, cell->col, atoi(formula));
         *need_new_dep = false;
         return 0;
     }
 
-    /*                                      Check if the input is a formula                                                      */
-    if (is_valid_formula(formula))
-    {
-        if (parse_function(sheet, cell, formula, need_new_dep, new_pairs) != 0) 
-            return -1;
-    }
+    /*                                      Check if the input is a function: NAME( ... )                                          */
+    char code;
+    int name_len = function_name(formula, &code);
+    if (name_len > 0 && end - formula >= name_len + 2 && end[-1] == ')')
+        return parse_function(sheet, cell, formula, name_len, code, need_new_dep, new_pairs);
+
     /*                                      Check if it's an arithmetic expression                                                */
-    else if (match_formula(formula))
+    Token operand1, operand2;
+    const char *p = formula;
+    if (lex_operand(&p, end, &operand1) && p < end && char_to_operation(*p) != OP_NONE)
     {
-        if (parse_arithmetic(sheet, cell, formula, need_new_dep, new_pairs) != 0) 
-            return -1;
+        char op = *p++;
+        if (lex_operand(&p, end, &operand2) && p == end)
+            return parse_arithmetic(sheet, cell, &operand1, op, &operand2, need_new_dep, new_pairs);
     }
+
     // Must be a cell reference
-    else if (isalpha(formula[0]))
+    if (isalpha((unsigned char)formula[0]))
     {
         int row, col;
-        const char *ptr = formula;
-        if (parse_cell_address(sheet, &ptr, &row, &col) != 0) return -1;
+        if (parse_cell_address(sheet, formula, end, &row, &col) != 0) return -1;
         cell->type = 'R';
         new_pairs->first.i = row; new_pairs->first.j = col;
         new_pairs->second.i = -1; new_pairs->second.j = -1;
         *need_new_dep = true;
-
-    }
-    else
-    {
-        sheet->last_status = ERR_SYNTAX;
-        return -1;
+        return 0;
     }
-    return 0;
+
+    sheet->last_status = ERR_SYNTAX;
+    return -1;
 }
 
-static void deep_copy_cell(Cell *dest, const Cell *src) {
-    dest->value = src->value;
-    dest->row = src->row;
-    dest->col = src->col;
-    dest->topo_order = src->topo_order;
-    dest->type = src->type;
-    dest->cell_state = src->cell_state;
-    dest->is_sleep = src->is_sleep;
-    dest->has_error = src->has_error;
-    dest->dependencies = src->dependencies;
-
-    // Deep copy op_data based on the type
-    if (src->type == 'A') 
-    {
-        dest->op_data.arithmetic.op = src->op_data.arithmetic.op;
-        dest->op_data.arithmetic.constant = src->op_data.arithmetic.constant;
-    } 
-    else if (src->type == 'F') 
-    {
-        dest->op_data.function.func_name = src->op_data.function.func_name;
-    } 
+int parse_formula(Spreadsheet *sheet, CellContents *cell, const char *formula, bool *need_new_dep, PairOfPair *new_pairs)
+{
+    set_cell_error(sheet, cell->row, cell->col, false);
+    if (parse_shape(sheet, cell, formula, need_new_dep, new_pairs) == 0)
+        return 0;
+
+    // Only what no fixed shape takes is compiled, so every formula that parsed
+    // before keeps its cell type; one that does not compile either keeps its status
+    if (parse_expression(sheet, cell, formula, need_new_dep, new_pairs) == 0)
+        return 0;
+    return -1;
 }
 
 void process_command(Spreadsheet *sheet, char *input)
@@ -502,11 +638,6 @@ void process_command(Spreadsheet *sheet, char *input)
     while (*input == ' ')
         input++;
 
-    char *start = input;
-    while (start < input + strlen(input) && *start != '\0')
-        start++;
-
-    char *end = start - 1;
     char *eq_pos = strchr(input, '=');
 
     if (!eq_pos)
@@ -515,13 +646,10 @@ void process_command(Spreadsheet *sheet, char *input)
         return;
     }
 
-    *eq_pos = '\0';
-    char *cellRef = input;
     char *formula = eq_pos + 1;
 
     int row, col;
-    const char *cellRefPtr = cellRef;
-    if (parse_cell_address(sheet, &cellRefPtr, &row, &col) != 0)
+    if (parse_cell_address(sheet, input, eq_pos, &row, &col) != 0)
         return;
 
     if (row >= sheet->totalRows || col >= sheet->totalCols)
@@ -531,7 +659,7 @@ void process_command(Spreadsheet *sheet, char *input)
     }
     /*              Cell is successfully parsed, now we go to the RHS                      */
 
-    end = formula + strlen(formula) - 1;
+    char *end = formula + strlen(formula) - 1;
     while (end > formula && *end == ' ')
         *end-- = '\0';
 
@@ -541,32 +669,55 @@ void process_command(Spreadsheet *sheet, char *input)
         return;
     }
 
-    Cell *target_cell = &sheet->cells[row][col];
+    // The parser fills in a decoded copy; the sheet only changes once it is committed
+    CellContents old_contents, contents;
+    load_cell_contents(sheet, row, col, &old_contents);
+    contents = old_contents;
+    int old_value = get_cell_value(sheet, row, col);
+    bool old_error = get_cell_error(sheet, row, col);
+    contents.is_sleep = false;
+    set_cell_error(sheet, row, col, false);
 
-    Cell cellcopy;
-    deep_copy_cell(&cellcopy, target_cell);
-    target_cell->is_sleep = false;
-    target_cell->has_error = false;
-
-    bool need_new_dep;
-    PairOfPair new_pairs;
+    bool need_new_dep = false;
+    PairOfPair new_pairs = {{-1, -1}, {-1, -1}};
 
     // Attempt to parse and validate the new formula
-    if (parse_formula(sheet, target_cell, formula, &need_new_dep, &new_pairs) != 0){
+    if (parse_formula(sheet, &contents, formula, &need_new_dep, &new_pairs) != 0){
+        // The cell keeps its contents, so it keeps its error too
+        set_cell_error(sheet, row, col, old_error);
+        return;
+    }
+
+    // Inside a batch only the new contents are recorded; cycles and recalculation wait for commit
+    if (sheet->batch.depth > 0)
+    {
+        batch_record(sheet, &old_contents, old_value, old_error);
+        update_dependencies(&contents, need_new_dep, &new_pairs, sheet, &old_contents);
+        if (contents.type == 'C')
+            evaluate_cell(sheet, row, col);
+        notify_value_change(sheet, row, col, old_value, old_error);
+        sheet->last_status = STATUS_OK;
         return;
     }
 
-    if (update_dependencies(target_cell, need_new_dep, &new_pairs, sheet, cellcopy) == 1 && 
-        evaluate_cell(target_cell, sheet) == 0)
+    if (update_dependencies(&contents, need_new_dep, &new_pairs, sheet, &old_contents) == 1 && 
+        evaluate_cell(sheet, row, col) == 0)
     {   // 0 -> cycle, 1 -> no cycle
         sheet->last_status = STATUS_OK;
     }
     else{
-        deep_copy_cell(target_cell, &cellcopy);
+        // The cell kept its old contents, so nothing owns the new program
+        if (contents.type == 'X')
+            program_release(sheet, contents.op_data.expression.program);
+        set_cell_value(sheet, row, col, old_value);
+        set_cell_error(sheet, row, col, old_error);
         sheet->last_status = ERR_CIRCULAR_REFERENCE;
     }
 
-    if((cellcopy.value != target_cell->value) || (target_cell->is_sleep != cellcopy.is_sleep) || (target_cell->has_error != cellcopy.has_error)) 
-        update_dependents(target_cell, sheet);
+    notify_value_change(sheet, row, col, old_value, old_error);
+    // A SLEEP cell sleeps on every assignment, holding back its dependents
+    bool sleeps = sheet->last_status == STATUS_OK && sleep_seconds(sheet, row, col) > 0;
+    if((old_value != get_cell_value(sheet, row, col)) || (get_cell(sheet, row, col)->is_sleep != old_contents.is_sleep) || (get_cell_error(sheet, row, col) != old_error) || sleeps) 
+        update_dependents(sheet, row, col);
     return;
 }
\ No newline at end of file
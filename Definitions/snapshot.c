@@ -0,0 +1,462 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../Declarations/snapshot.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+// A tile is worth storing if any value or error flag is set; formulas, sleep flags
+// and dependents are carried by the cell and edge sections
+static bool tile_has_values(const Tile *t)
+{
+    for (int k = 0; k < TILE_SIZE * TILE_SIZE; k++)
+        if (t->values[k] != 0 || t->errors[k])
+            return true;
+    return false;
+}
+
+// Cells are written with absolute dependencies, whatever template they share
+static void encode_cell(SnapshotCell *out, const Spreadsheet *sheet, short row, short col)
+{
+    CellContents contents;
+    load_cell_contents(sheet, row, col, &contents);
+    memset(out, 0, sizeof(SnapshotCell));
+    out->row = row;
+    out->col = col;
+    out->type = contents.type;
+    out->is_sleep = contents.is_sleep;
+    if (out->type == 'A')
+    {
+        out->op = (char)contents.op_data.arithmetic.op;
+        out->constant = contents.op_data.arithmetic.constant;
+    }
+    else if (out->type == 'F')
+        out->op = contents.op_data.function.func_name;
+    out->deps[0] = contents.dependencies.first.i;
+    out->deps[1] = contents.dependencies.first.j;
+    out->deps[2] = contents.dependencies.second.i;
+    out->deps[3] = contents.dependencies.second.j;
+}
+
+// Program of the 'X' cell at (row, col)
+static int cell_program(const Spreadsheet *sheet, short row, short col)
+{
+    return get_template(sheet, get_formula(sheet, row, col))->op_data.expression.program;
+}
+
+int snapshot_save(const Spreadsheet *sheet, const char *path)
+{
+    // Formulas written since begin have no place in calc_order until the commit
+    if (sheet->batch.depth > 0)
+        return -1;
+
+    int num_tiles = sheet->tile_rows * sheet->tile_cols;
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.version = SNAPSHOT_VERSION;
+    h.byte_order = SNAPSHOT_BYTE_ORDER;
+    h.rows = sheet->totalRows;
+    h.cols = sheet->totalCols;
+    h.tile_size = TILE_SIZE;
+    h.flags = sheet->range_sums.enabled ? SNAPSHOT_RANGE_SUMS : 0;
+
+    // Count first so the header can carry every offset
+    for (int t = 0; t < num_tiles; t++)
+    {
+        const Tile *tile = tile_at(sheet, t);
+        if (!tile)
+            continue;
+        if (tile_has_values(tile))
+            h.num_tiles++;
+        for (int k = 0; k < TILE_SIZE * TILE_SIZE; k++)
+        {
+            const Cell *cell = &tile->cells[k];
+            h.num_edges += depset_size(&cell->dependents);
+            if (cell->formula == 0 && cell->is_sleep)
+                h.num_sleepers++;
+        }
+    }
+    h.num_formulas = sheet->calc_order.size - sheet->order_holes;
+
+    // Each program is written once, however many cells share it; code_at maps a
+    // program slot to its word offset in the code section
+    int32_t *code_at = (int32_t *)malloc((sheet->program_capacity + 1) * sizeof(int32_t));
+    if (!code_at)
+    {
+        fprintf(stderr, "Memory allocation failed for snapshot\n");
+        exit(1);
+    }
+    for (int k = 0; k < sheet->program_capacity; k++)
+        code_at[k] = -1;
+    uint64_t code_words = 0;
+    for (size_t k = 0; k < sheet->calc_order.size; k++)
+    {
+        Pair p = sheet->calc_order.data[k];
+        if (p.i < 0 || get_cell(sheet, p.i, p.j)->type != 'X')
+            continue;
+        int program = cell_program(sheet, p.i, p.j);
+        if (code_at[program] >= 0)
+            continue;
+        code_at[program] = (int32_t)code_words;
+        code_words += 1 + sheet->programs[program].code_size;
+    }
+    h.tiles_offset = sizeof(SnapshotHeader);
+    h.cells_offset = h.tiles_offset + h.num_tiles * sizeof(SnapshotTile);
+    h.edges_offset = ALIGN8(h.cells_offset + (h.num_formulas + h.num_sleepers) * sizeof(SnapshotCell));
+    h.file_bytes = h.edges_offset + h.num_edges * sizeof(SnapshotEdge) + code_words * sizeof(int32_t);
+
+    // Write next to the target and rename, so a failed save keeps the old file
+    size_t len = strlen(path);
+    char *tmp_path = (char *)malloc(len + 5);
+    if (!tmp_path)
+    {
+        fprintf(stderr, "Memory allocation failed for snapshot\n");
+        exit(1);
+    }
+    memcpy(tmp_path, path, len);
+    memcpy(tmp_path + len, ".tmp", 5);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp)
+    {
+        free(code_at);
+        free(tmp_path);
+        return -1;
+    }
+
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    // One 20KB tile record, reused for every tile; saves never run concurrently
+    static SnapshotTile rec;
+    for (int t = 0; ok && t < num_tiles; t++)
+    {
+        const Tile *tile = tile_at(sheet, t);
+        if (!tile || !tile_has_values(tile))
+            continue;
+        rec.tile = t;
+        rec.reserved = 0;
+        memcpy(rec.values, tile->values, sizeof(rec.values));
+        for (int k = 0; k < TILE_SIZE * TILE_SIZE; k++)
+            rec.errors[k] = tile->errors[k];
+        ok = fwrite(&rec, sizeof(rec), 1, fp) == 1;
+    }
+
+    SnapshotCell cell_rec;
+    for (size_t k = 0; ok && k < sheet->calc_order.size; k++)
+    {
+        Pair p = sheet->calc_order.data[k];
+        if (p.i < 0)
+            continue;
+        encode_cell(&cell_rec, sheet, p.i, p.j);
+        if (cell_rec.type == 'X')
+            cell_rec.constant = code_at[cell_program(sheet, p.i, p.j)];
+        ok = fwrite(&cell_rec, sizeof(cell_rec), 1, fp) == 1;
+    }
+
+    Vector found;
+    vector_init(&found);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1 && ok)
+        {
+            static const char zeros[8];
+            long pad = (long)(h.edges_offset - (uint64_t)ftell(fp));
+            ok = pad == 0 || fwrite(zeros, pad, 1, fp) == 1;
+        }
+        // Pass 0 writes the sleepers, pass 1 the edges, both in tile order
+        for (int t = 0; ok && t < num_tiles; t++)
+        {
+            const Tile *tile = tile_at(sheet, t);
+            if (!tile)
+                continue;
+            short row0 = (t / sheet->tile_cols) << TILE_SHIFT;
+            short col0 = (t % sheet->tile_cols) << TILE_SHIFT;
+            for (int k = 0; ok && k < TILE_SIZE * TILE_SIZE; k++)
+            {
+                const Cell *cell = &tile->cells[k];
+                short row = row0 + (k >> TILE_SHIFT), col = col0 + (k & TILE_MASK);
+                if (pass == 0 && cell->formula == 0 && cell->is_sleep)
+                {
+                    encode_cell(&cell_rec, sheet, row, col);
+                    ok = fwrite(&cell_rec, sizeof(cell_rec), 1, fp) == 1;
+                }
+                if (pass == 1 && depset_size(&cell->dependents) > 0)
+                {
+                    found.size = 0;
+                    depset_collect(&cell->dependents, &found);
+                    for (size_t e = 0; ok && e < found.size; e++)
+                    {
+                        SnapshotEdge edge = {row, col, found.data[e].i, found.data[e].j};
+                        ok = fwrite(&edge, sizeof(edge), 1, fp) == 1;
+                    }
+                }
+            }
+        }
+    }
+    vector_free(&found);
+
+    // Programs in the order their first cells were written
+    for (size_t k = 0; ok && k < sheet->calc_order.size; k++)
+    {
+        Pair p = sheet->calc_order.data[k];
+        if (p.i < 0 || get_cell(sheet, p.i, p.j)->type != 'X')
+            continue;
+        int program = cell_program(sheet, p.i, p.j);
+        if (code_at[program] < 0)
+            continue;
+        code_at[program] = -1;
+        const Program *prog = &sheet->programs[program];
+        int32_t size = prog->code_size;
+        ok = fwrite(&size, sizeof(size), 1, fp) == 1 &&
+             fwrite(prog->code, sizeof(int32_t), prog->code_size, fp) == (size_t)prog->code_size;
+    }
+    free(code_at);
+
+    if (fclose(fp) != 0)
+        ok = false;
+    if (ok)
+        ok = rename(tmp_path, path) == 0;
+    if (!ok)
+        remove(tmp_path);
+    free(tmp_path);
+    return ok ? 0 : -1;
+}
+
+static bool in_sheet(const Spreadsheet *sheet, int row, int col)
+{
+    return row >= 0 && row < sheet->totalRows && col >= 0 && col < sheet->totalCols;
+}
+
+// Code section of a file being loaded. Each program is created the first time a
+// cell uses it; programs[offset] keeps one reference until loading ends.
+typedef struct {
+    const int32_t *code;
+    uint64_t words;
+    int *programs;      // program slot by word offset, -1 until created
+} SnapshotCode;
+
+// Rebuild one formula cell at calc_order position pos; false if the record is invalid
+static bool restore_formula(Spreadsheet *sheet, const SnapshotCell *rec, int pos, SnapshotCode *code)
+{
+    const int16_t *d = rec->deps;
+    if (!in_sheet(sheet, rec->row, rec->col) || get_formula(sheet, rec->row, rec->col))
+        return false;
+    CellContents contents;
+    memset(&contents, 0, sizeof(contents));
+    contents.row = rec->row;
+    contents.col = rec->col;
+    contents.type = rec->type;
+    contents.is_sleep = rec->is_sleep != 0;
+    contents.dependencies.first.i = d[0];
+    contents.dependencies.first.j = d[1];
+    contents.dependencies.second.i = d[2];
+    contents.dependencies.second.j = d[3];
+
+    if (rec->type == 'X')
+    {
+        // program_create checks the code itself, program_fits that it stays in the sheet
+        uint64_t at = (uint32_t)rec->constant;
+        if (rec->constant < 0 || at >= code->words || code->code[at] <= 0 || (uint64_t)code->code[at] > code->words - at - 1)
+            return false;
+        if (code->programs[at] < 0)
+            code->programs[at] = program_create(sheet, code->code + at + 1, code->code[at]);
+        if (code->programs[at] < 0 || !program_fits(sheet, &sheet->programs[code->programs[at]], rec->row, rec->col))
+            return false;
+        contents.op_data.expression.program = code->programs[at];
+        contents.dependencies.first.i = contents.dependencies.first.j = -1;
+        contents.dependencies.second.i = contents.dependencies.second.j = -1;
+    }
+    else if (rec->type == 'F')
+    {
+        if (rec->op < 'A' || rec->op > 'E' || !in_sheet(sheet, d[0], d[1]) || !in_sheet(sheet, d[2], d[3]) ||
+            d[0] > d[2] || d[1] > d[3])
+            return false;
+        contents.op_data.function.func_name = rec->op;
+    }
+    else if (rec->type == 'A' || rec->type == 'R')
+    {
+        if ((d[0] != -1 && !in_sheet(sheet, d[0], d[1])) || (d[2] != -1 && !in_sheet(sheet, d[2], d[3])))
+            return false;
+        if (rec->type == 'A' && (rec->op < OP_ADD || rec->op > OP_DIV))
+            return false;
+        contents.op_data.arithmetic.op = (Operation)rec->op;
+        contents.op_data.arithmetic.constant = rec->constant;
+    }
+    else
+        return false;
+
+    Cell *cell = touch_cell(sheet, rec->row, rec->col);
+    cell->type = rec->type;
+    cell->is_sleep = contents.is_sleep;
+    cell->formula = formula_alloc(sheet);
+    Formula *f = &sheet->formulas[cell->formula];
+    f->template = template_intern(sheet, &contents);
+    f->topo_order = pos;
+    vector_push_back(&sheet->calc_order, rec->row, rec->col);
+
+    if (rec->type == 'F')
+    {
+        // Aggregates start invalid and are rebuilt on the first recalculation
+        f->agg_slot = aggregate_alloc(sheet);
+        sheet->range_dependents = range_insert(&sheet->pool, sheet->range_dependents, contents.dependencies, rec->row, rec->col);
+        if (rec->op == 'A' || rec->op == 'B')
+            for (short c = d[1]; c <= d[3]; c++)
+                extrema_acquire(sheet, c);
+    }
+    else if (rec->type == 'X')
+    {
+        // Its single cells come back with the edges, its rectangles go in the range index
+        const Program *prog = &sheet->programs[contents.op_data.expression.program];
+        for (int k = 0; k < prog->num_ranges; k++)
+            sheet->range_dependents = range_insert(&sheet->pool, sheet->range_dependents,
+                                                   rect_at(prog->ranges[k], rec->row, rec->col), rec->row, rec->col);
+    }
+    return true;
+}
+
+// Where the code section starts
+static uint64_t code_offset(const SnapshotHeader *h)
+{
+    return h->edges_offset + h->num_edges * sizeof(SnapshotEdge);
+}
+
+static bool header_valid(const SnapshotHeader *h, uint64_t size)
+{
+    // Version 2 stored absolute cell addresses in its code; there is no telling
+    // them apart from offsets, so those files are not read
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 || h->version < 1 || h->version == 2 || h->version > SNAPSHOT_VERSION ||
+        h->byte_order != SNAPSHOT_BYTE_ORDER || h->tile_size != TILE_SIZE)
+        return false;
+    if (h->rows < 1 || h->rows > MAX_ROWS || h->cols < 1 || h->cols > MAX_COLS)
+        return false;
+
+    uint64_t cells = (uint64_t)h->rows * h->cols;
+    uint64_t tiles = (uint64_t)((h->rows + TILE_MASK) >> TILE_SHIFT) * ((h->cols + TILE_MASK) >> TILE_SHIFT);
+    if (h->num_tiles > tiles || h->num_formulas + h->num_sleepers > cells || h->num_edges > size / sizeof(SnapshotEdge) ||
+        h->file_bytes != size)
+        return false;
+    if (!(h->tiles_offset == sizeof(SnapshotHeader) &&
+          h->cells_offset == h->tiles_offset + h->num_tiles * sizeof(SnapshotTile) &&
+          h->edges_offset == ALIGN8(h->cells_offset + (h->num_formulas + h->num_sleepers) * sizeof(SnapshotCell)) &&
+          h->file_bytes >= code_offset(h)))
+        return false;
+    uint64_t code_bytes = h->file_bytes - code_offset(h);
+    // Cells share programs, so the code section no longer bounds the edges; each
+    // edge is checked against its formula as it is loaded
+    return code_bytes % sizeof(int32_t) == 0 && (h->version != 1 || code_bytes == 0);
+}
+
+Spreadsheet *snapshot_load(const char *path, GridMode mode)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(SnapshotHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *base = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    const SnapshotHeader *h = (const SnapshotHeader *)base;
+    if (!header_valid(h, size))
+    {
+        munmap((void *)base, size);
+        return NULL;
+    }
+
+    Spreadsheet *sheet = create_spreadsheet_mode(h->rows, h->cols, mode);
+    int num_tiles = sheet->tile_rows * sheet->tile_cols;
+    bool ok = true;
+
+    // Values first: the MIN/MAX column trees are built from them as formulas arrive
+    const SnapshotTile *tiles = (const SnapshotTile *)(base + h->tiles_offset);
+    for (uint64_t k = 0; ok && k < h->num_tiles; k++)
+    {
+        const SnapshotTile *rec = &tiles[k];
+        if (rec->tile >= (uint32_t)num_tiles)
+        {
+            ok = false;
+            break;
+        }
+        Tile *t = tile_at(sheet, rec->tile);
+        if (!t)
+            t = tile_alloc(sheet, rec->tile);
+        memcpy(t->values, rec->values, sizeof(t->values));
+        for (int c = 0; c < TILE_SIZE * TILE_SIZE; c++)
+            t->errors[c] = rec->errors[c] != 0;
+    }
+
+    const SnapshotCell *cells = (const SnapshotCell *)(base + h->cells_offset);
+    SnapshotCode code = {(const int32_t *)(base + code_offset(h)), (h->file_bytes - code_offset(h)) / sizeof(int32_t), NULL};
+    code.programs = (int *)malloc((code.words + 1) * sizeof(int));
+    if (!code.programs)
+    {
+        fprintf(stderr, "Memory allocation failed for snapshot\n");
+        exit(1);
+    }
+    for (uint64_t k = 0; k < code.words; k++)
+        code.programs[k] = -1;
+    for (uint64_t k = 0; ok && k < h->num_formulas; k++)
+        ok = restore_formula(sheet, &cells[k], (int)k, &code);
+    // The templates hold their programs now
+    for (uint64_t k = 0; k < code.words; k++)
+        if (code.programs[k] >= 0)
+            program_release(sheet, code.programs[k]);
+    free(code.programs);
+    for (uint64_t k = h->num_formulas; ok && k < h->num_formulas + h->num_sleepers; k++)
+    {
+        const SnapshotCell *rec = &cells[k];
+        ok = in_sheet(sheet, rec->row, rec->col) && !get_formula(sheet, rec->row, rec->col);
+        if (ok)
+            touch_cell(sheet, rec->row, rec->col)->is_sleep = true;
+    }
+
+    // Edges arrive grouped by precedent, so each dependents set is filled in one go
+    const SnapshotEdge *edges = (const SnapshotEdge *)(base + h->edges_offset);
+    for (uint64_t k = 0; ok && k < h->num_edges; k++)
+    {
+        const SnapshotEdge *e = &edges[k];
+        ok = in_sheet(sheet, e->row, e->col) && in_sheet(sheet, e->dep_row, e->dep_col) &&
+             get_formula(sheet, e->dep_row, e->dep_col);
+        if (ok)
+            depset_insert(&sheet->pool, &touch_cell(sheet, e->row, e->col)->dependents, e->dep_row, e->dep_col);
+    }
+
+    if (ok && (h->flags & SNAPSHOT_RANGE_SUMS))
+        range_sums_enable(sheet);
+    munmap((void *)base, size);
+    if (!ok)
+    {
+        free_spreadsheet(sheet);
+        return NULL;
+    }
+    return sheet;
+}
+
+int snapshot_load_into(Spreadsheet *sheet, const char *path)
+{
+    // Swapping the sheet would drop the open batch and its undo log
+    if (sheet->batch.depth > 0)
+        return -1;
+
+    Spreadsheet *loaded = snapshot_load(path, sheet->grid ? GRID_FLAT : GRID_TILED);
+    if (!loaded)
+        return -1;
+
+    // Keep the display settings of the running sheet, start at the top-left corner
+    loaded->output_enabled = sheet->output_enabled;
+    loaded->last_cmd_time = sheet->last_cmd_time;
+    loaded->last_processing_time = sheet->last_processing_time;
+
+    Spreadsheet old = *sheet;
+    *sheet = *loaded;
+    *loaded = old;
+    free_spreadsheet(loaded);
+    return 0;
+}
@@ -0,0 +1,273 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../Declarations/threadpool.h"
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+// Per-worker deque: the owner pushes and pops at the bottom, thieves take from the top.
+// Every node is pushed at most once per run, so bottom never exceeds the graph size
+typedef struct {
+    pthread_mutex_t lock;
+    int *items;
+    int top, bottom;
+} WorkDeque;
+
+static struct {
+    int threads;                  // 0 when the pool is not running
+    int min_nodes;
+    pthread_t *tids;
+    WorkDeque *deques;
+    int deque_cap;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;          // a new graph was posted, or shutdown
+    pthread_cond_t done;          // the last helper left the current graph
+    unsigned long generation;
+    int busy;
+    bool shutdown;
+
+    const TaskGraph *graph;
+    int remaining;                // nodes not yet run, updated atomically
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER,
+           .wake = PTHREAD_COND_INITIALIZER,
+           .done = PTHREAD_COND_INITIALIZER };
+
+static void deque_push(WorkDeque *dq, int node)
+{
+    pthread_mutex_lock(&dq->lock);
+    dq->items[dq->bottom++] = node;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static bool deque_pop(WorkDeque *dq, int *node)
+{
+    bool found = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        *node = dq->items[--dq->bottom];
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static bool deque_steal(WorkDeque *dq, int *node)
+{
+    bool found = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        *node = dq->items[dq->top++];
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static void work_loop(int self)
+{
+    const TaskGraph *g = pool.graph;
+    int idle = 0;
+
+    while (__atomic_load_n(&pool.remaining, __ATOMIC_ACQUIRE) > 0) {
+        int node;
+        bool found = deque_pop(&pool.deques[self], &node);
+        for (int k = 1; !found && k < pool.threads; k++)
+            found = deque_steal(&pool.deques[(self + k) % pool.threads], &node);
+
+        if (!found) {
+            // Back off: a ready node may be stuck behind a long evaluation
+            if (++idle < 64) {
+                sched_yield();
+            } else {
+                struct timespec ts = { 0, 50000 };
+                nanosleep(&ts, NULL);
+            }
+            continue;
+        }
+        idle = 0;
+
+        g->run(g->ctx, node);
+
+        // The acq_rel decrement publishes this node's results to whoever readies the successor
+        for (int k = g->offsets[node]; k < g->offsets[node + 1]; k++) {
+            int next = g->targets[k];
+            if (__atomic_sub_fetch(&g->in_degree[next], 1, __ATOMIC_ACQ_REL) == 0)
+                deque_push(&pool.deques[self], next);
+        }
+        __atomic_sub_fetch(&pool.remaining, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    int self = (int)(intptr_t)arg;
+    unsigned long seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.shutdown && pool.generation == seen)
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        if (pool.shutdown) {
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        work_loop(self);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0)
+            pthread_cond_signal(&pool.done);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+void threadpool_start(int threads, int min_nodes)
+{
+    threadpool_stop();
+    if (threads > THREADPOOL_MAX_THREADS)
+        threads = THREADPOOL_MAX_THREADS;
+    pool.min_nodes = min_nodes;
+    if (threads <= 1)
+        return;
+
+    pool.deques = (WorkDeque *)calloc(threads, sizeof(WorkDeque));
+    pool.tids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    if (!pool.deques || !pool.tids) {
+        fprintf(stderr, "Memory allocation failed for thread pool\n");
+        exit(1);
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    pool.deque_cap = 0;
+    pool.shutdown = false;
+    pool.generation = 0;
+    pool.threads = threads;
+
+    // Worker 0 is whichever thread calls threadpool_run_graph
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&pool.tids[i], NULL, worker_main, (void *)(intptr_t)i) != 0) {
+            fprintf(stderr, "Failed to start worker thread\n");
+            exit(1);
+        }
+    }
+}
+
+void threadpool_stop(void)
+{
+    if (pool.threads == 0)
+        return;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = true;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 1; i < pool.threads; i++)
+        pthread_join(pool.tids[i], NULL);
+
+    for (int i = 0; i < pool.threads; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].items);
+    }
+    free(pool.deques);
+    free(pool.tids);
+    pool.deques = NULL;
+    pool.tids = NULL;
+    pool.threads = 0;
+}
+
+int threadpool_size(void)
+{
+    return pool.threads > 0 ? pool.threads : 1;
+}
+
+// Plain Kahn on the calling thread
+static void run_serial(const TaskGraph *g)
+{
+    int *queue = (int *)malloc(g->num_nodes * sizeof(int));
+    int head = 0, tail = 0;
+
+    for (int n = 0; n < g->num_nodes; n++)
+        if (g->in_degree[n] == 0)
+            queue[tail++] = n;
+
+    while (head < tail) {
+        int node = queue[head++];
+        g->run(g->ctx, node);
+        for (int k = g->offsets[node]; k < g->offsets[node + 1]; k++)
+            if (--g->in_degree[g->targets[k]] == 0)
+                queue[tail++] = g->targets[k];
+    }
+    free(queue);
+}
+
+static void run_parallel(const TaskGraph *g)
+{
+    if (pool.deque_cap < g->num_nodes) {
+        for (int i = 0; i < pool.threads; i++) {
+            free(pool.deques[i].items);
+            pool.deques[i].items = (int *)malloc(g->num_nodes * sizeof(int));
+        }
+        pool.deque_cap = g->num_nodes;
+    }
+
+    // Deal the initially ready nodes round-robin so every worker starts with something
+    int next = 0;
+    for (int i = 0; i < pool.threads; i++)
+        pool.deques[i].top = pool.deques[i].bottom = 0;
+    for (int n = 0; n < g->num_nodes; n++)
+        if (g->in_degree[n] == 0) {
+            WorkDeque *dq = &pool.deques[next];
+            dq->items[dq->bottom++] = n;
+            next = (next + 1) % pool.threads;
+        }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.graph = g;
+    pool.remaining = g->num_nodes;
+    pool.busy = pool.threads - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    work_loop(0);
+
+    // Helpers may still be leaving work_loop; the graph must outlive them
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pool.graph = NULL;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void threadpool_run_graph(const TaskGraph *g)
+{
+    if (g->num_nodes == 0)
+        return;
+    if (pool.threads <= 1 || g->num_nodes < pool.min_nodes) {
+        run_serial(g);
+        return;
+    }
+    run_parallel(g);
+}
+
+void threadpool_run_each(int count, void (*run)(void *ctx, int node), void *ctx)
+{
+    if (count <= 0)
+        return;
+    int *offsets = (int *)calloc(count + 1, sizeof(int));
+    int *in_degree = (int *)calloc(count, sizeof(int));
+    if (!offsets || !in_degree) {
+        fprintf(stderr, "Memory allocation failed for thread pool\n");
+        exit(1);
+    }
+    TaskGraph g = {count, offsets, NULL, in_degree, run, ctx};
+    if (pool.threads <= 1 || count == 1)
+        run_serial(&g);
+    else
+        run_parallel(&g);
+    free(offsets);
+    free(in_degree);
+}
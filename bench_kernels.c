@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "Declarations/ds.h"
+#include "Declarations/kernels.h"
+
+// Micro-benchmark for the range aggregation kernels: the original per-cell loop
+// of evaluate_cell 'F' over packed 48-byte cells, the same loop over the value and
+// error planes, the kernels on the planes, and the dispatched kernel on a sheet in
+// GRID_FLAT mode. Run with `make bench`.
+
+#define BENCH_ROWS 999
+#define BENCH_COLS 1001
+#define BENCH_REPS 20
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Layout of a cell before the value and error planes were split out
+typedef struct {
+    int value;
+    char metadata[43];
+    bool has_error;
+} __attribute__((packed, aligned(2))) LegacyCell;
+
+// The loop evaluate_cell used before the kernels, minus the early exit on errors
+static void legacy_loop(LegacyCell** cells, RangeTotals* acc) {
+    int sum = 0, sum_sq = 0, errors = 0;
+    int min_val = INT_MAX, max_val = INT_MIN;
+    for (short i = 0; i < BENCH_ROWS; i++)
+        for (short j = 1; j < BENCH_COLS; j++) {
+            int dep_val = cells[i][j].value;
+            if (cells[i][j].has_error)
+                errors++;
+            sum += dep_val;
+            if (dep_val < min_val) min_val = dep_val;
+            if (dep_val > max_val) max_val = dep_val;
+            sum_sq += dep_val * dep_val;
+        }
+    acc->sum = sum;
+    acc->sum_sq = (uint32_t)sum_sq;
+    acc->min_val = min_val;
+    acc->max_val = max_val;
+    acc->errors = errors;
+}
+
+// The rectangle B1:ALM999 the way evaluate_cell scans it: one plane run per tile row
+static void plane_rows(Spreadsheet* sheet, RangeKernel kernel, RangeTotals* acc) {
+    range_totals_init(acc);
+    kernel_rect_totals(sheet, 0, 1, BENCH_ROWS - 1, BENCH_COLS - 1, kernel, acc);
+}
+
+static void report(const char* name, double best_ms, size_t bytes, const RangeTotals* t) {
+    printf("%-22s %8.3f ms  %7.2f GB/s   sum=%u min=%d max=%d errors=%lld\n",
+           name, best_ms, bytes / (best_ms * 1e6), (uint32_t)t->sum, t->min_val, t->max_val,
+           (long long)t->errors);
+}
+
+int main(void) {
+    size_t n = (size_t)BENCH_ROWS * (BENCH_COLS - 1);
+    Spreadsheet* sheet = create_spreadsheet(BENCH_ROWS, BENCH_COLS);
+    Spreadsheet* flat = create_spreadsheet_mode(BENCH_ROWS, BENCH_COLS, GRID_FLAT);
+    LegacyCell** legacy = (LegacyCell**)malloc(BENCH_ROWS * sizeof(LegacyCell*));
+    for (int i = 0; i < BENCH_ROWS; i++)
+        legacy[i] = (LegacyCell*)calloc(BENCH_COLS, sizeof(LegacyCell));
+
+    srand(12);
+    for (int i = 0; i < BENCH_ROWS; i++)
+        for (int j = 1; j < BENCH_COLS; j++) {
+            int v = rand() % 200001 - 100000;
+            bool e = (rand() % 1000 == 0);
+            legacy[i][j].value = v;
+            legacy[i][j].has_error = e;
+            set_cell_value(sheet, i, j, v);
+            set_cell_error(sheet, i, j, e);
+            set_cell_value(flat, i, j, v);
+            set_cell_error(flat, i, j, e);
+        }
+
+    printf("Scanning %zu cells, best of %d runs, kernel dispatch: %s\n\n", n, BENCH_REPS, kernel_isa_name());
+
+    RangeTotals t;
+    double best = 1e30;
+    for (int r = 0; r < BENCH_REPS; r++) {
+        double t0 = now_ms();
+        legacy_loop(legacy, &t);
+        double dt = now_ms() - t0;
+        if (dt < best) best = dt;
+    }
+    report("legacy packed cells", best, n * sizeof(LegacyCell), &t);
+
+    const char* isas[] = {"scalar", "sse2", "avx2"};
+    for (int v = 0; v < 3; v++) {
+        RangeKernel kernel = kernel_variant(isas[v]);
+        char name[32];
+        sprintf(name, "planes %s", isas[v]);
+        if (!kernel) {
+            printf("%-22s (not supported on this CPU)\n", name);
+            continue;
+        }
+        best = 1e30;
+        for (int r = 0; r < BENCH_REPS; r++) {
+            double t0 = now_ms();
+            plane_rows(sheet, kernel, &t);
+            double dt = now_ms() - t0;
+            if (dt < best) best = dt;
+        }
+        report(name, best, n * (sizeof(int) + sizeof(bool)), &t);
+    }
+
+    best = 1e30;
+    for (int r = 0; r < BENCH_REPS; r++) {
+        double t0 = now_ms();
+        plane_rows(flat, kernel_range_totals, &t);
+        double dt = now_ms() - t0;
+        if (dt < best) best = dt;
+    }
+    report("flat grid dispatched", best, n * (sizeof(int) + sizeof(bool)), &t);
+
+    for (int i = 0; i < BENCH_ROWS; i++)
+        free(legacy[i]);
+    free(legacy);
+    free_spreadsheet(sheet);
+    free_spreadsheet(flat);
+    return 0;
+}
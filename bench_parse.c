@@ -0,0 +1,897 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "Declarations/ds.h"
+#include "Declarations/parser.h"
+#include "Declarations/backend.h"
+#include "Declarations/fill.h"
+
+// Parse throughput: the regex-based parser that process_command used before the
+// single-pass lexer, against the current one. Every command of the corpus is first
+// run through both on two sheets to check that they agree on status and result;
+// the only inputs allowed to differ are expressions the old grammar rejected.
+// Run with `make bench`.
+
+#define BENCH_ROWS 999
+#define BENCH_COLS 702
+#define BENCH_COMMANDS 50000
+#define BENCH_REPS 3
+#define FILL_COLS 1000          // filled columns, 999 rows each
+#define FILL_CELL_COLS 20       // the same formula assigned cell by cell, for comparison
+#define FILL_EDITS 50           // single-cell edits on the filled sheet, each way
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* ---- Previous parser, kept verbatim apart from the names ---- */
+
+static int legacy_col_label_to_index(const char *label)
+{
+    int result = 0;
+    char c;
+    for (int i = 0; label[i] != '\0'; i++)
+    {
+        if (!isalpha(label[i]) || islower(c = label[i]))
+        {
+            return -1;
+        }
+        result = result * 26 + (c - 'A' + 1);
+    }
+    return result - 1;
+}
+
+static int legacy_parse_cell_address(Spreadsheet *sheet, const char **input, int *row, int *col)
+{
+    regex_t regex;
+    const char *pattern = "^[A-Z]+[0-9]+$";
+    if (regcomp(&regex, pattern, REG_EXTENDED) != 0)
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return -1;
+    }
+
+    regmatch_t match;
+    if (regexec(&regex, *input, 1, &match, 0) != 0)
+    {
+        regfree(&regex);
+        sheet->last_status = ERR_SYNTAX;
+        return -1;
+    }
+
+    regfree(&regex);
+    char col_part[4] = {'\0', '\0', '\0', '\0'};
+    int i = 0;
+
+    while (isalpha(**input) && i < 3)
+    {
+        col_part[i++] = **input;
+        (*input)++;
+    }
+    if (i == 0)
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return -1;
+    } // No column letters
+
+    // Convert column to index
+    *col = legacy_col_label_to_index(col_part);
+
+    *row = 0;
+    while (isdigit(**input))
+    {
+        *row = *row * 10 + (**input - '0');
+        (*input)++;
+    }
+    *row -= 1;
+    if(*row >= sheet->totalRows || *col >= sheet->totalCols || *row < 0 || *col < 0){
+        sheet->last_status = ERR_INVALID_RANGE;
+        return -1;
+    }
+    return 0;
+}
+
+static int legacy_is_valid_formula(const char *formula)
+{
+    // Regex pattern that matches one of the fixed formula names,
+    // followed by '(' with any characters inside and a closing ')'
+    const char *pattern = "^(MIN|MAX|AVG|SUM|STDEV|SLEEP)\\(.*\\)$";
+    regex_t regex;
+    int ret = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB);
+    if (ret)
+    {
+        // Handle error in regex compilation as needed
+        return 0;
+    }
+    ret = regexec(&regex, formula, 0, NULL, 0);
+    regfree(&regex);
+    return ret == 0;
+}
+
+// Parse a range (e.g., "A1:B2") and store cells in the range array
+static int legacy_parse_range(Spreadsheet *sheet, const char *range_str, bool *need_new_dep, PairOfPair *new_pairs)
+{
+    if (range_str == NULL)
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return -1;
+    }
+    char *colon = strchr(range_str, ':');
+    // Split the range into start and end
+    int len = strlen(range_str);
+    char *range_copy = malloc(len + 1);
+    strcpy(range_copy, range_str);
+    range_copy[colon - range_str] = '\0';
+
+    // Parse start and end cells
+    int start_row, start_col, end_row, end_col;
+    const char *start_ptr = range_copy;
+    const char *end_ptr = colon + 1;
+
+    if (legacy_parse_cell_address(sheet, &start_ptr, &start_row, &start_col) != 0 ||
+        legacy_parse_cell_address(sheet, &end_ptr, &end_row, &end_col) != 0)
+    {
+        free(range_copy);
+        range_copy = NULL;
+        return -1;
+    }
+
+    // Validate range order
+    if (start_row > end_row || start_col > end_col)
+    {
+        sheet->last_status = ERR_INVALID_RANGE;
+        free(range_copy);
+        range_copy = NULL;
+        return -1;
+    }
+    new_pairs->first.i = start_row;
+    new_pairs->first.j = start_col;
+
+    new_pairs->second.i = end_row;
+    new_pairs->second.j = end_col;
+
+    *need_new_dep = true;
+
+    free(range_copy);
+    range_copy = NULL;
+    return 0;
+}
+
+// Parse arithmetic expression (e.g., "A1+2" or "B2*C3")
+static int legacy_parse_arithmetic(Spreadsheet *sheet, CellContents *target_cell, const char *formula, bool *need_new_dep, PairOfPair *new_pairs)
+{
+    regex_t regex;
+    const char *pattern = "^([-+]?[0-9]+|[A-Z]+[0-9]+)([+*/-])([-+]?[0-9]+|[A-Z]+[0-9]+)$";
+    if (regcomp(&regex, pattern, REG_EXTENDED) != 0)
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return -1;
+    }
+
+    regmatch_t matches[4]; // matches[0]: full match, [1]: operand1, [2]: operator, [3]: operand2
+    int ret = regexec(&regex, formula, 4, matches, 0);
+    regfree(&regex);
+    if (ret != 0)
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return -1;
+    }
+
+    // Extract operand1
+    int len = matches[1].rm_eo - matches[1].rm_so;
+    char operand1[64] = {0};
+    strncpy(operand1, formula + matches[1].rm_so, len);
+    operand1[len] = '\0';
+
+    // Extract operator
+    len = matches[2].rm_eo - matches[2].rm_so;
+    char op_str[4] = {0};
+    strncpy(op_str, formula + matches[2].rm_so, len);
+    op_str[len] = '\0';
+
+    // Extract operand2
+    len = matches[3].rm_eo - matches[3].rm_so;
+    char operand2[64] = {0};
+    strncpy(operand2, formula + matches[3].rm_so, len);
+    operand2[len] = '\0';
+
+    target_cell->type = 'A';
+    target_cell->op_data.arithmetic.op = char_to_operation(op_str[0]);
+    target_cell->op_data.arithmetic.constant = 0;
+
+    // Process operand1
+    int type1, value1 = -1, row1, col1;
+    type1 = check_constant_or_cell_address(operand1, &value1, &row1, &col1, sheet);
+    if (type1 == 0)
+    {
+        // Operand is a numeric constant.
+        new_pairs->first.i = -1;
+        new_pairs->first.j = -1;
+        target_cell->op_data.arithmetic.constant = value1;
+    }
+    else if (type1 == 1)
+    {
+        // Operand is a cell reference.
+        new_pairs->first.i = row1;
+        new_pairs->first.j = col1;
+    }
+    else
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return -1;
+    }
+
+    // Process operand2
+    int type2, value2 = -1, row2, col2;
+    type2 = check_constant_or_cell_address(operand2, &value2, &row2, &col2, sheet);
+    if (type2 == 0)
+    {
+        new_pairs->second.i = -1;
+        new_pairs->second.j = -1;
+
+        target_cell->op_data.arithmetic.constant = value2;
+    }
+    else if (type2 == 1)
+    {
+        new_pairs->second.i = row2;
+        new_pairs->second.j = col2;
+    }
+    else
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return -1;
+    }
+
+    if (type1 == 0 && type2 == 0)
+    {
+        int evaluated;
+        switch (target_cell->op_data.arithmetic.op)
+        {
+        case OP_ADD:
+            evaluated = value1 + value2;
+            break;
+        case OP_SUB:
+            evaluated = value1 - value2;
+            break;
+        case OP_MUL:
+            evaluated = value1 * value2;
+            break;
+        case OP_DIV:
+            if (value2 == 0)
+            {
+                target_cell->type = 'C';
+                set_cell_error(sheet, target_cell->row, target_cell->col, true);
+                *need_new_dep = false;
+                return 0;
+            }
+            evaluated = value1 / value2;
+            break;
+        default:
+            sheet->last_status = ERR_SYNTAX;
+            return -1;
+        }
+        target_cell->type = 'C';
+        set_cell_value(sheet, target_cell->row, target_cell->col, evaluated);
+        *need_new_dep = false;
+        return 0;
+    }
+    *need_new_dep = true;
+    return 0;
+}
+
+static bool legacy_is_number(const char *str) {
+    if (!str || *str == '\0')
+        return false;
+    // Allow leading sign
+    if (*str == '+' || *str == '-')
+        str++;
+    
+    if (*str == '\0')
+        return false;
+    
+    while (*str) 
+    {
+        if (!isdigit((unsigned char)*str))
+            return false;
+        str++;
+    }
+    return true;
+}
+
+// Parse function call (e.g., "SUM(A1:B2)")
+static int legacy_parse_function(Spreadsheet *sheet, CellContents *target_cell, const char *formula, bool *need_new_dep, PairOfPair *new_pairs)
+{
+    // Extract function name
+    char func_name[10] = {0};
+    const char *p = formula;
+
+    int i = 0;
+    while (*p && *p != '(' && i < 9)
+    {
+        func_name[i++] = *p++;
+    }
+    // Find closing parenthesis
+    const char *close_paren = strchr(p, ')');
+
+    // Extract range/value
+    int range_len = close_paren - p - 1;
+    char *range_str = malloc(range_len + 1);
+    strncpy(range_str, p + 1, range_len);
+    range_str[range_len] = '\0';
+
+    int stat = 0;
+
+    if (strcmp(func_name, "SLEEP") == 0)
+    {
+        target_cell->is_sleep =  true;
+        int row, col;
+        const char *ptr = range_str;
+        if (legacy_parse_cell_address(sheet, &ptr, &row, &col) == 0)
+        {
+            target_cell->type='R';
+            new_pairs->first.i = row;
+            new_pairs->first.j = col;
+
+            new_pairs->second.i = -1;
+            new_pairs->second.j = -1;
+
+            *need_new_dep = true;
+        }
+        else if (legacy_is_number(ptr))
+        {
+            target_cell->type='C';
+            set_cell_value(sheet, target_cell->row, target_cell->col, atoi(ptr));
+            *need_new_dep = false;
+        }
+        else
+        {
+            sheet->last_status = ERR_SYNTAX;
+            stat = -1;
+        }
+        free(range_str);
+        range_str = NULL;
+        return stat;
+    }
+
+    target_cell->type = 'F';
+
+    if (strcmp(func_name, "MIN") == 0) target_cell->op_data.function.func_name = 'A';
+    else if (strcmp(func_name, "MAX") == 0) target_cell->op_data.function.func_name = 'B';
+    else if (strcmp(func_name, "AVG") == 0) target_cell->op_data.function.func_name = 'C';
+    else if (strcmp(func_name, "SUM") == 0) target_cell->op_data.function.func_name = 'D';
+    else if (strcmp(func_name, "STDEV") == 0) target_cell->op_data.function.func_name = 'E';
+
+    if (!strchr(range_str, ':') || legacy_parse_range(sheet, range_str, need_new_dep, new_pairs) != 0)
+    {
+        sheet->last_status = ERR_SYNTAX;
+        stat = -1;
+    }
+
+    free(range_str);
+    range_str = NULL;
+    return stat; 
+}
+
+static bool legacy_match_formula(const char *formula) 
+{
+    regex_t regex;
+    const char *pattern = "^([-+]?[0-9]+|[A-Z]+[0-9]+)([+*/-])([-+]?[0-9]+|[A-Z]+[0-9]+)$";
+
+    if (regcomp(&regex, pattern, REG_EXTENDED) != 0) {
+        fprintf(stderr, "Could not compile regex\n");
+        exit(1);
+    }
+
+    int ret = regexec(&regex, formula, 0, NULL, 0);
+    regfree(&regex);
+    return (ret == 0);
+}
+
+static int legacy_parse_formula(Spreadsheet *sheet, CellContents *cell, const char *formula, bool *need_new_dep, PairOfPair *new_pairs)
+{
+    set_cell_error(sheet, cell->row, cell->col, false);
+
+    /*                                      Check if the value is a single constant                                        */
+    bool is_numeric = true;
+    if (!legacy_is_number(formula))
+        is_numeric = false;
+
+    if (is_numeric){
+        int value = atoi(formula);
+        cell->type = 'C';
+        set_cell_value(sheet, cell->row, cell->col, value);
+        *need_new_dep = false;
+        return 0;
+    }
+
+    /*                                      Check if the input is a formula                                                      */
+    if (legacy_is_valid_formula(formula))
+    {
+        if (legacy_parse_function(sheet, cell, formula, need_new_dep, new_pairs) != 0) 
+            return -1;
+    }
+    /*                                      Check if it's an arithmetic expression                                                */
+    else if (legacy_match_formula(formula))
+    {
+        if (legacy_parse_arithmetic(sheet, cell, formula, need_new_dep, new_pairs) != 0) 
+            return -1;
+    }
+    // Must be a cell reference
+    else if (isalpha(formula[0]))
+    {
+        int row, col;
+        const char *ptr = formula;
+        if (legacy_parse_cell_address(sheet, &ptr, &row, &col) != 0) return -1;
+        cell->type = 'R';
+        new_pairs->first.i = row; new_pairs->first.j = col;
+        new_pairs->second.i = -1; new_pairs->second.j = -1;
+        *need_new_dep = true;
+
+    }
+    else
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return -1;
+    }
+    return 0;
+}
+
+static void legacy_process_command(Spreadsheet *sheet, char *input)
+{
+    if (!input || *input == '\0')
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return;
+    }
+
+    while (*input == ' ')
+        input++;
+
+    char *start = input;
+    while (start < input + strlen(input) && *start != '\0')
+        start++;
+
+    char *end = start - 1;
+    char *eq_pos = strchr(input, '=');
+
+    if (!eq_pos)
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return;
+    }
+
+    *eq_pos = '\0';
+    char *cellRef = input;
+    char *formula = eq_pos + 1;
+
+    int row, col;
+    const char *cellRefPtr = cellRef;
+    if (legacy_parse_cell_address(sheet, &cellRefPtr, &row, &col) != 0)
+        return;
+
+    if (row >= sheet->totalRows || col >= sheet->totalCols)
+    {
+        sheet->last_status = ERR_INVALID_CELL;
+        return;
+    }
+    /*              Cell is successfully parsed, now we go to the RHS                      */
+
+    end = formula + strlen(formula) - 1;
+    while (end > formula && *end == ' ')
+        *end-- = '\0';
+
+    if (strlen(formula) == 0)
+    {
+        sheet->last_status = ERR_SYNTAX;
+        return;
+    }
+
+    // The parser fills in a decoded copy; the sheet only changes once it is committed
+    CellContents old_contents, contents;
+    load_cell_contents(sheet, row, col, &old_contents);
+    contents = old_contents;
+    int old_value = get_cell_value(sheet, row, col);
+    bool old_error = get_cell_error(sheet, row, col);
+    contents.is_sleep = false;
+    set_cell_error(sheet, row, col, false);
+
+    bool need_new_dep = false;
+    PairOfPair new_pairs = {{-1, -1}, {-1, -1}};
+
+    // Attempt to parse and validate the new formula
+    if (legacy_parse_formula(sheet, &contents, formula, &need_new_dep, &new_pairs) != 0){
+        notify_value_change(sheet, row, col, old_value, old_error);
+        return;
+    }
+
+    if (update_dependencies(&contents, need_new_dep, &new_pairs, sheet, &old_contents) == 1 && 
+        evaluate_cell(sheet, row, col) == 0)
+    {   // 0 -> cycle, 1 -> no cycle
+        sheet->last_status = STATUS_OK;
+    }
+    else{
+        set_cell_value(sheet, row, col, old_value);
+        set_cell_error(sheet, row, col, old_error);
+        sheet->last_status = ERR_CIRCULAR_REFERENCE;
+    }
+
+    notify_value_change(sheet, row, col, old_value, old_error);
+    if((old_value != get_cell_value(sheet, row, col)) || (get_cell(sheet, row, col)->is_sleep != old_contents.is_sleep) || (get_cell_error(sheet, row, col) != old_error)) 
+        update_dependents(sheet, row, col);
+    return;
+}
+/* ---- Corpus ---- */
+
+static const char *fuzz_cells[] = {"A1", "B2", "Z999", "AAA1", "ABCD1", "A0", "a1", "AA10", "ZZZ5", "A1000", "B", "1A", "AZ01"};
+static const char *fuzz_numbers[] = {"0", "5", "-3", "+7", "007", "99999999999", "-", "+", "--1", "2147483647"};
+static const char *fuzz_ops[] = {"+", "-", "*", "/", "%", "x", ""};
+static const char *fuzz_funcs[] = {"MIN", "MAX", "AVG", "SUM", "STDEV", "SLEEP", "sum", "SUMX", "SUM "};
+
+static const char *pick(const char **list, int n) {
+    return list[rand() % n];
+}
+#define PICK(list) pick(list, (int)(sizeof(list) / sizeof(list[0])))
+
+// A right-hand side built to hit the edges of the grammar
+static void fuzz_formula(char *out) {
+    const char *operands[2];
+    for (int k = 0; k < 2; k++)
+        operands[k] = rand() % 2 ? PICK(fuzz_cells) : PICK(fuzz_numbers);
+    switch (rand() % 8) {
+        case 0: sprintf(out, "%s", operands[0]); break;
+        case 1: case 2: sprintf(out, "%s%s%s", operands[0], PICK(fuzz_ops), operands[1]); break;
+        case 3: sprintf(out, "%s(%s:%s)", PICK(fuzz_funcs), PICK(fuzz_cells), PICK(fuzz_cells)); break;
+        case 4: sprintf(out, "%s(%s)", PICK(fuzz_funcs), operands[0]); break;
+        case 5: sprintf(out, "%s(%s:%s)%s)", PICK(fuzz_funcs), PICK(fuzz_cells), PICK(fuzz_cells), operands[1]); break;
+        case 6: sprintf(out, "%s(%s:%s", PICK(fuzz_funcs), PICK(fuzz_cells), PICK(fuzz_cells)); break;
+        default: {
+            static const char alphabet[] = "AB19+-*/():Z0 S";
+            int len = 1 + rand() % 10;
+            for (int k = 0; k < len; k++)
+                out[k] = alphabet[rand() % (sizeof(alphabet) - 1)];
+            out[len] = '\0';
+        }
+    }
+}
+
+// A valid edit of the kind a command replay is made of
+static void replay_command(char *out) {
+    char a[4], b[4], c[4];
+    colNumberToName(rand() % 26, a);
+    colNumberToName(rand() % 26, b);
+    colNumberToName(rand() % 26, c);
+    int r = rand() % 500 + 1, r2 = rand() % 500 + 1;
+    int kind = rand() % 20;
+    if (kind < 8)
+        sprintf(out, "%s%d=%d", a, r, rand() % 2001 - 1000);
+    else if (kind < 14)
+        sprintf(out, "%s%d=%s%d%c%d", a, r, b, r2, "+-*/"[rand() % 4], rand() % 9 + 1);
+    else if (kind < 16)
+        sprintf(out, "%s%d=%s%d", a, r, b, r2);
+    else
+        sprintf(out, "%s%d=%s(%s%d:%s%d)", a, r, (const char *[]){"MIN", "MAX", "AVG", "SUM", "STDEV"}[rand() % 5],
+                b, r2, b, r2 + rand() % 5);
+}
+
+/* ---- Agreement ---- */
+
+static bool same_parse(Spreadsheet *a, Spreadsheet *b, const char *formula) {
+    CellContents ca, cb;
+    load_cell_contents(a, 0, 0, &ca);
+    load_cell_contents(b, 0, 0, &cb);
+    bool need_a = false, need_b = false;
+    PairOfPair pa = {{-1, -1}, {-1, -1}}, pb = pa;
+    a->last_status = b->last_status = STATUS_OK;
+    int ra = legacy_parse_formula(a, &ca, formula, &need_a, &pa);
+    int rb = parse_formula(b, &cb, formula, &need_b, &pb);
+    if (rb == 0 && cb.type == 'X')
+        program_release(b, cb.op_data.expression.program);
+    // Expressions the old grammar rejected now compile; nothing else may change.
+    // A folded one wrote its value, which the next comparison must not see.
+    if (ra != 0 && rb == 0) {
+        set_cell_value(b, 0, 0, get_cell_value(a, 0, 0));
+        set_cell_error(b, 0, 0, get_cell_error(a, 0, 0));
+        return true;
+    }
+    if (ra != rb)
+        return false;
+    if (ra != 0)
+        return a->last_status == b->last_status;
+    if (ca.type != cb.type || ca.is_sleep != cb.is_sleep || need_a != need_b ||
+        memcmp(&pa, &pb, sizeof(pa)) != 0 ||
+        get_cell_value(a, 0, 0) != get_cell_value(b, 0, 0) || get_cell_error(a, 0, 0) != get_cell_error(b, 0, 0))
+        return false;
+    if (ca.type == 'A')
+        return ca.op_data.arithmetic.op == cb.op_data.arithmetic.op &&
+               ca.op_data.arithmetic.constant == cb.op_data.arithmetic.constant;
+    if (ca.type == 'F')
+        return ca.op_data.function.func_name == cb.op_data.function.func_name;
+    return true;
+}
+
+// Does only the current parser accept formula, as an expression?
+static bool only_new_accepts(Spreadsheet *a, Spreadsheet *b, const char *formula) {
+    CellContents ca, cb;
+    load_cell_contents(a, 0, 0, &ca);
+    load_cell_contents(b, 0, 0, &cb);
+    bool need = false;
+    PairOfPair pairs = {{-1, -1}, {-1, -1}};
+    if (legacy_parse_formula(a, &ca, formula, &need, &pairs) == 0 || parse_formula(b, &cb, formula, &need, &pairs) != 0)
+        return false;
+    if (cb.type == 'X')
+        program_release(b, cb.op_data.expression.program);
+    set_cell_value(b, 0, 0, get_cell_value(a, 0, 0));
+    set_cell_error(b, 0, 0, get_cell_error(a, 0, 0));
+    return true;
+}
+
+static bool same_sheets(Spreadsheet *a, Spreadsheet *b) {
+    for (int i = 0; i < a->totalRows; i++)
+        for (int j = 0; j < a->totalCols; j++)
+            if (get_cell_value(a, i, j) != get_cell_value(b, i, j) || get_cell_error(a, i, j) != get_cell_error(b, i, j))
+                return false;
+    return true;
+}
+
+/* ---- Evaluation: helper cells against one compiled expression per row ---- */
+
+#define MODEL_ROWS 900
+#define MODEL_REPS 20
+
+static void model_command(Spreadsheet *s, const char *cmd) {
+    char buf[96];
+    strcpy(buf, cmd);
+    process_command(s, buf);
+}
+
+// Row r computes (A*B + C*D) / (E+1) - SUM(A:E), into L through six helper cells
+// or into F as one 'X' cell
+static Spreadsheet *build_model(bool expression) {
+    Spreadsheet *s = create_spreadsheet(BENCH_ROWS, BENCH_COLS);
+    char cmd[96];
+    for (int r = 1; r <= MODEL_ROWS; r++) {
+        for (int c = 0; c < 5; c++) {
+            sprintf(cmd, "%c%d=%d", 'A' + c, r, (r * 7 + c * 13) % 50 + c);
+            model_command(s, cmd);
+        }
+        if (expression) {
+            sprintf(cmd, "F%d=(A%d*B%d+C%d*D%d)/(E%d+1)-SUM(A%d:E%d)", r, r, r, r, r, r, r, r);
+            model_command(s, cmd);
+            continue;
+        }
+        const char *helpers[] = {"F%d=A%d*B%d", "G%d=C%d*D%d", "H%d=F%d+G%d", "I%d=E%d+1",
+                                 "J%d=H%d/I%d", "K%d=SUM(A%d:E%d)", "L%d=J%d-K%d"};
+        for (int k = 0; k < 7; k++) {
+            sprintf(cmd, helpers[k], r, r, r);
+            model_command(s, cmd);
+        }
+    }
+    return s;
+}
+
+// Formula cells, and dependency edges counting each indexed rectangle as one
+static void model_size(Spreadsheet *s, int *formulas, int *edges) {
+    *formulas = (int)s->calc_order.size - s->order_holes;
+    *edges = 0;
+    for (int i = 0; i < MODEL_ROWS; i++)
+        for (int j = 0; j < 12; j++) {
+            const Cell *cell = get_cell(s, i, j);
+            *edges += (int)depset_size(&cell->dependents);
+            if (cell->type == 'F')
+                *edges += 1;
+            else if (cell->type == 'X')
+                *edges += s->programs[get_template(s, get_formula(s, i, j))->op_data.expression.program].num_ranges;
+        }
+}
+
+static size_t program_bytes(const Program *prog) {
+    return sizeof(Program) + prog->code_size * sizeof(int32_t) + prog->num_refs * sizeof(Pair) +
+           prog->num_ranges * sizeof(PairOfPair);
+}
+
+// Bytes of formula storage as the sheet holds it, and as it would with every cell
+// keeping a template and program of its own
+static void model_bytes(Spreadsheet *s, size_t *shared, size_t *unshared) {
+    int formulas = (int)s->calc_order.size - s->order_holes;
+    *shared = formulas * sizeof(Formula) + s->templates_used * sizeof(FormulaTemplate);
+    *unshared = formulas * (sizeof(Formula) + sizeof(FormulaTemplate));
+    for (int k = 0; k < s->program_capacity; k++)
+        if (s->programs[k].code)
+            *shared += program_bytes(&s->programs[k]);
+    for (size_t k = 0; k < s->calc_order.size; k++) {
+        Pair p = s->calc_order.data[k];
+        if (p.i >= 0 && get_cell(s, p.i, p.j)->type == 'X')
+            *unshared += program_bytes(&s->programs[get_template(s, get_formula(s, p.i, p.j))->op_data.expression.program]);
+    }
+}
+
+// Best time to recalculate every formula of the model once
+static double model_recalc(Spreadsheet *s) {
+    Vector all;
+    vector_init(&all);
+    for (size_t k = 0; k < s->calc_order.size; k++)
+        if (s->calc_order.data[k].i >= 0)
+            vector_push_back(&all, s->calc_order.data[k].i, s->calc_order.data[k].j);
+    double best = 1e30;
+    for (int rep = 0; rep < MODEL_REPS; rep++) {
+        double t0 = now_ms();
+        recalc_formulas(s, &all);
+        double dt = now_ms() - t0;
+        if (dt < best) best = dt;
+    }
+    vector_free(&all);
+    return best;
+}
+
+// Rate of count things, in the given unit, done in best_ms
+static void report(const char *name, double best_ms, int count, const char *unit) {
+    printf("%-28s %9.1f ms  %10.0f %s/s\n", name, best_ms, count / (best_ms / 1e3), unit);
+}
+
+int main(void) {
+    static char corpus[BENCH_COMMANDS][48];
+    char line[64];
+    srand(20);
+
+    // Parse-level agreement on the edge-case corpus, and on every command of the replay
+    Spreadsheet *a = create_spreadsheet(BENCH_ROWS, BENCH_COLS);
+    Spreadsheet *b = create_spreadsheet(BENCH_ROWS, BENCH_COLS);
+    int checked = 0;
+    for (int k = 0; k < 100000; k++, checked++) {
+        fuzz_formula(line);
+        if (!same_parse(a, b, line)) {
+            printf("Parsers disagree on \"%s\"\n", line);
+            return 1;
+        }
+    }
+    for (int k = 0; k < BENCH_COMMANDS; k++)
+        replay_command(corpus[k]);
+
+    // Whole-command agreement: statuses after every command, then every cell
+    Spreadsheet *legacy_sheet = create_spreadsheet(BENCH_ROWS, BENCH_COLS);
+    Spreadsheet *sheet = create_spreadsheet(BENCH_ROWS, BENCH_COLS);
+    for (int k = 0; k < 20000; k++, checked++) {
+        if (k % 4 == 0) {
+            char lhs[8];
+            sprintf(lhs, "%s", PICK(fuzz_cells));
+            fuzz_formula(line + sprintf(line, "%s=", lhs));
+            if (strstr(line, "SLEEP") || only_new_accepts(a, b, strchr(line, '=') + 1))
+                continue;
+        } else
+            strcpy(line, corpus[k]);
+        char copy[64];
+        strcpy(copy, line);
+        legacy_process_command(legacy_sheet, copy);
+        strcpy(copy, line);
+        process_command(sheet, copy);
+        if (legacy_sheet->last_status != sheet->last_status) {
+            printf("Statuses differ on \"%s\"\n", line);
+            return 1;
+        }
+    }
+    if (!same_sheets(legacy_sheet, sheet)) {
+        printf("Sheets differ after the command replay\n");
+        return 1;
+    }
+    printf("Parsers agree on %d commands\n\n", checked);
+
+    // Parse only: the right-hand side of every replay command
+    const char *formulas[BENCH_COMMANDS];
+    for (int k = 0; k < BENCH_COMMANDS; k++)
+        formulas[k] = strchr(corpus[k], '=') + 1;
+    for (int variant = 0; variant < 2; variant++) {
+        double best = 1e30;
+        for (int r = 0; r < BENCH_REPS; r++) {
+            double t0 = now_ms();
+            for (int k = 0; k < BENCH_COMMANDS; k++) {
+                CellContents c = {0, 0, 'C', false, {{0, 0}}, {{-1, -1}, {-1, -1}}};
+                bool need = false;
+                PairOfPair pairs = {{-1, -1}, {-1, -1}};
+                if (variant == 0)
+                    legacy_parse_formula(a, &c, formulas[k], &need, &pairs);
+                else
+                    parse_formula(b, &c, formulas[k], &need, &pairs);
+            }
+            double dt = now_ms() - t0;
+            if (dt < best) best = dt;
+        }
+        report(variant == 0 ? "parse_formula, regex" : "parse_formula, lexer", best, BENCH_COMMANDS, "commands");
+    }
+
+    // Whole commands, parse plus dependency updates and recalculation, on fresh sheets
+    for (int variant = 0; variant < 2; variant++) {
+        Spreadsheet *s = create_spreadsheet(BENCH_ROWS, BENCH_COLS);
+        double t0 = now_ms();
+        for (int k = 0; k < BENCH_COMMANDS; k++) {
+            strcpy(line, corpus[k]);
+            if (variant == 0)
+                legacy_process_command(s, line);
+            else
+                process_command(s, line);
+        }
+        report(variant == 0 ? "process_command, regex" : "process_command, lexer", now_ms() - t0, BENCH_COMMANDS, "commands");
+        free_spreadsheet(s);
+    }
+
+    // The same model as helper cells and as compiled expressions, fully recalculated
+    printf("\n");
+    Spreadsheet *helpers = build_model(false), *compiled = build_model(true);
+    double helper_ms = model_recalc(helpers), compiled_ms = model_recalc(compiled);
+    for (int r = 0; r < MODEL_ROWS; r++)
+        if (get_cell_value(helpers, r, 11) != get_cell_value(compiled, r, 5) ||
+            get_cell_error(helpers, r, 11) != get_cell_error(compiled, r, 5)) {
+            printf("Models differ in row %d\n", r + 1);
+            return 1;
+        }
+    for (int variant = 0; variant < 2; variant++) {
+        int formulas, edges;
+        Spreadsheet *s = variant == 0 ? helpers : compiled;
+        size_t shared, unshared;
+        model_size(s, &formulas, &edges);
+        model_bytes(s, &shared, &unshared);
+        printf("%-28s %6d formulas %6d edges %9.3f ms per full recalculation\n",
+               variant == 0 ? "model, helper cells" : "model, expressions", formulas, edges,
+               variant == 0 ? helper_ms : compiled_ms);
+        printf("%-28s %6d templates %8zu bytes of formulas, %zu unshared\n", "", s->templates_used, shared, unshared);
+    }
+    free_spreadsheet(helpers);
+    free_spreadsheet(compiled);
+
+    // A block of formulas reading along each row: one fill, or a command per cell
+    printf("\n");
+    for (int variant = 0; variant < 2; variant++) {
+        Spreadsheet *s = create_spreadsheet(BENCH_ROWS, FILL_COLS + 2);
+        for (int r = 1; r <= BENCH_ROWS; r++) {
+            sprintf(line, "A%d=%d", r, r);
+            process_command(s, line);
+        }
+        int cols = variant == 0 ? FILL_COLS : FILL_CELL_COLS;
+        double t0 = now_ms();
+        if (variant == 0) {
+            char last[4];
+            colNumberToName(cols, last);
+            sprintf(line, "B1:%s%d=A1*2+1", last, BENCH_ROWS);
+            fill_command(s, line);
+        } else {
+            for (int c = 1; c <= cols; c++)
+                for (int r = 1; r <= BENCH_ROWS; r++) {
+                    char lhs[4], rhs[4];
+                    colNumberToName(c, lhs);
+                    colNumberToName(c - 1, rhs);
+                    sprintf(line, "%s%d=%s%d*2+1", lhs, r, rhs, r);
+                    process_command(s, line);
+                }
+        }
+        report(variant == 0 ? "fill, one command" : "fill, command per cell", now_ms() - t0, cols * BENCH_ROWS, "cells");
+
+        // On the filled sheet, single cells made to read the end of a later row move
+        // their row behind it; a one-cell fill should cost what the assignment does
+        for (int way = 0; variant == 0 && way < 2; way++) {
+            char last[4];
+            colNumberToName(FILL_COLS, last);
+            t0 = now_ms();
+            for (int k = 0; k < FILL_EDITS; k++) {
+                int r = 3 * k + 1 + way;
+                if (way == 0) {
+                    sprintf(line, "C%d=%s%d+1", r, last, 3 * k + 3);
+                    process_command(s, line);
+                } else {
+                    sprintf(line, "C%d:C%d=%s%d+1", r, r, last, 3 * k + 3);
+                    fill_command(s, line);
+                }
+            }
+            report(way == 0 ? "moving edit, assignment" : "moving edit, one-cell fill", now_ms() - t0, FILL_EDITS, "edits");
+        }
+        free_spreadsheet(s);
+    }
+
+    free_spreadsheet(a);
+    free_spreadsheet(b);
+    free_spreadsheet(legacy_sheet);
+    free_spreadsheet(sheet);
+    return 0;
+}
@@ -1,10 +1,17 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "Declarations/ds.h"
 #include "Declarations/backend.h"
 #include "Declarations/parser.h"
 #include "Declarations/frontend.h"
+#include "Declarations/threadpool.h"
+#include "Declarations/kernels.h"
+#include "Declarations/snapshot.h"
+#include "Declarations/csv.h"
+#include "Declarations/fill.h"
 
 // Basic assertion macro
 #define ASSERT(condition, message) \
@@ -36,18 +43,15 @@
     } while (0)
 
 // Debug print function
-void debug_print_cell(Cell* cell) {
-    if (!cell) {
-        printf("Cell is NULL\n");
-        return;
-    }
+void debug_print_cell(Spreadsheet* sheet, short row, short col) {
+    const Cell* cell = get_cell(sheet, row, col);
     printf("Cell [%d,%d]: value=%d, type=%c, has_error=%d\n",
-           cell->row, cell->col, cell->value, cell->type, cell->has_error);
-    if (cell->dependencies.first.i != -1 || cell->dependencies.first.j != -1 ||
-        cell->dependencies.second.i != -1 || cell->dependencies.second.j != -1) {
+           row, col, get_cell_value(sheet, row, col), cell->type,
+           get_cell_error(sheet, row, col));
+    if (get_formula(sheet, row, col)) {
         printf("  Has dependencies\n");
     }
-    if (cell->dependents) {
+    if (depset_size(&cell->dependents) > 0) {
         printf("  Has dependents\n");
     }
 }
@@ -63,20 +67,12 @@ Spreadsheet* setup_with_size(int rows, int cols) {
     }
     
     // Verify the sheet structure
-    if (sheet->cells == NULL) {
-        fprintf(stderr, "Sheet cells array is NULL\n");
+    if (sheet->tiles == NULL) {
+        fprintf(stderr, "Sheet tile table is NULL\n");
         free(sheet);
         return NULL;
     }
     
-    for (int i = 0; i < sheet->totalRows; i++) {
-        if (sheet->cells[i] == NULL) {
-            fprintf(stderr, "Row %d is NULL\n", i);
-            free_spreadsheet(sheet);
-            return NULL;
-        }
-    }
-    
     printf("Spreadsheet created successfully\n");
     return sheet;
 }
@@ -91,20 +87,12 @@ Spreadsheet* setup() {
     }
     
     // Verify the sheet structure
-    if (sheet->cells == NULL) {
-        fprintf(stderr, "Sheet cells array is NULL\n");
+    if (sheet->tiles == NULL) {
+        fprintf(stderr, "Sheet tile table is NULL\n");
         free(sheet);
         return NULL;
     }
     
-    for (int i = 0; i < sheet->totalRows; i++) {
-        if (sheet->cells[i] == NULL) {
-            fprintf(stderr, "Row %d is NULL\n", i);
-            free_spreadsheet(sheet);
-            return NULL;
-        }
-    }
-    
     printf("Spreadsheet created successfully\n");
     return sheet;
 }
@@ -140,7 +128,7 @@ int test_basic_cell_operations() {
         cmd[sizeof(cmd) - 1] = '\0';
         
         process_command(sheet, cmd);
-        ASSERT(sheet->cells[0][i].value == tests[i].expected_value,
+        ASSERT(get_cell_value(sheet, 0, i) == tests[i].expected_value,
                tests[i].description);
     }
 
@@ -175,7 +163,7 @@ int test_arithmetic_operations() {
         
         process_command(sheet, setup_cmd);
         process_command(sheet, test_cmd);
-        ASSERT(sheet->cells[0][1].value == tests[i].expected_value,
+        ASSERT(get_cell_value(sheet, 0, 1) == tests[i].expected_value,
                tests[i].description);
     }
 
@@ -213,7 +201,7 @@ int test_spreadsheet_functions() {
         strncpy(cmd, tests[i].command, sizeof(cmd) - 1);
         cmd[sizeof(cmd) - 1] = '\0';
         process_command(sheet, cmd);
-        ASSERT(sheet->cells[0][1].value == tests[i].expected_value,
+        ASSERT(get_cell_value(sheet, 0, 1) == tests[i].expected_value,
                tests[i].description);
     }
 
@@ -254,13 +242,13 @@ int test_division_by_zero() {
     process_command(sheet, cmd3);
 
     // Verify cell access
-    if (sheet->cells == NULL || sheet->cells[2] == NULL) {
+    if (sheet->tiles == NULL || get_tile(sheet, 2, 0) == NULL) {
         printf("FAIL: Invalid cell access\n");
         teardown(sheet);
         return 0;
     }
 
-    ASSERT(sheet->cells[2][0].has_error, "Division by zero should set error");
+    ASSERT(get_cell_error(sheet, 2, 0), "Division by zero should set error");
     teardown(sheet);
     return 1;
 }
@@ -273,9 +261,9 @@ int test_circular_dependencies() {
 
     // Debug print initial state
     printf("Initial state of A1:\n");
-    debug_print_cell(&sheet->cells[0][0]);
+    debug_print_cell(sheet, 0, 0);
     printf("Initial state of A2:\n");
-    debug_print_cell(&sheet->cells[0][1]);
+    debug_print_cell(sheet, 0, 1);
 
     // First command
     printf("\nProcessing A1=A2+1...\n");
@@ -284,8 +272,8 @@ int test_circular_dependencies() {
     
     printf("After first command:\n");
     printf("Status: %d\n", sheet->last_status);
-    debug_print_cell(&sheet->cells[0][0]);
-    debug_print_cell(&sheet->cells[0][1]);
+    debug_print_cell(sheet, 0, 0);
+    debug_print_cell(sheet, 0, 1);
 
     if (sheet->last_status != STATUS_OK) {
         printf("FAIL: Failed to set A1=A2+1\n");
@@ -300,8 +288,8 @@ int test_circular_dependencies() {
 
     printf("After second command:\n");
     printf("Status: %d\n", sheet->last_status);
-    debug_print_cell(&sheet->cells[0][0]);
-    debug_print_cell(&sheet->cells[0][1]);
+    debug_print_cell(sheet, 0, 0);
+    debug_print_cell(sheet, 0, 1);
 
     ASSERT(sheet->last_status == ERR_CIRCULAR_REFERENCE, "Circular dependency not detected");
     
@@ -318,9 +306,9 @@ int test_formula_evaluation() {
     if (sheet == NULL) return 0;
 
     printf("Initial state of A1, A2, A3:\n");
-    debug_print_cell(&sheet->cells[0][0]);
-    debug_print_cell(&sheet->cells[1][0]);
-    debug_print_cell(&sheet->cells[2][0]);
+    debug_print_cell(sheet, 0, 0);
+    debug_print_cell(sheet, 1, 0);
+    debug_print_cell(sheet, 2, 0);
 
     char cmd1[] = "A1=5";
     char cmd2[] = "A2=10";
@@ -328,17 +316,17 @@ int test_formula_evaluation() {
 
     printf("\nProcessing %s...\n", cmd1);
     process_command(sheet, cmd1);
-    debug_print_cell(&sheet->cells[0][0]);
+    debug_print_cell(sheet, 0, 0);
 
     printf("\nProcessing %s...\n", cmd2);
     process_command(sheet, cmd2);
-    debug_print_cell(&sheet->cells[1][0]);
+    debug_print_cell(sheet, 1, 0);
 
     printf("\nProcessing %s...\n", cmd3);
     process_command(sheet, cmd3);
-    debug_print_cell(&sheet->cells[2][0]);
+    debug_print_cell(sheet, 2, 0);
 
-    ASSERT(sheet->cells[2][0].value == 15, "Formula evaluation failed (5 + 10 = 15)");
+    ASSERT(get_cell_value(sheet, 2, 0) == 15, "Formula evaluation failed (5 + 10 = 15)");
     
     printf("Test completed successfully\n");
     teardown(sheet);
@@ -419,7 +407,7 @@ int test_advanced_operations() {
             teardown(sheet);
             return 0;
         }
-        debug_print_cell(&sheet->cells[0][i]);
+        debug_print_cell(sheet, 0, i);
     }
 
     // Arithmetic operations (same as before)
@@ -443,7 +431,7 @@ int test_advanced_operations() {
             teardown(sheet);
             return 0;
         }
-        debug_print_cell(&sheet->cells[0][10+i]);
+        debug_print_cell(sheet, 0, 10+i);
     }
 
     // Test SUM function separately first
@@ -457,7 +445,7 @@ int test_advanced_operations() {
         return 0;
     }
     printf("SUM result: ");
-    debug_print_cell(&sheet->cells[0][14]);
+    debug_print_cell(sheet, 0, 14);
 
     // Test other functions one by one
     printf("\nTesting AVG function...\n");
@@ -470,7 +458,7 @@ int test_advanced_operations() {
         return 0;
     }
     printf("AVG result: ");
-    debug_print_cell(&sheet->cells[0][15]);
+    debug_print_cell(sheet, 0, 15);
 
     // Test MAX function
     printf("\nTesting MAX function...\n");
@@ -483,7 +471,7 @@ int test_advanced_operations() {
         return 0;
     }
     printf("MAX result: ");
-    debug_print_cell(&sheet->cells[0][16]);
+    debug_print_cell(sheet, 0, 16);
 
     // Test MIN function
     printf("\nTesting MIN function...\n");
@@ -496,7 +484,7 @@ int test_advanced_operations() {
         return 0;
     }
     printf("MIN result: ");
-    debug_print_cell(&sheet->cells[0][17]);
+    debug_print_cell(sheet, 0, 17);
 
     // Now test complex formula
     printf("\nTesting complex formula...\n");
@@ -509,7 +497,7 @@ int test_advanced_operations() {
         return 0;
     }
     printf("Complex formula result: ");
-    debug_print_cell(&sheet->cells[0][18]);
+    debug_print_cell(sheet, 0, 18);
 
     printf("Test completed successfully\n");
     teardown(sheet);
@@ -569,11 +557,11 @@ int test_statistical_functions() {
             return 0;
         }
 
-        if (sheet->cells[0][1].value != tests[i].expected_value) {  // B1 is at [0][1]
+        if (get_cell_value(sheet, 0, 1) != tests[i].expected_value) {  // B1 is at [0][1]
             printf("FAIL: %s\n", tests[i].description);
             printf("Expected: %d, Got: %d\n",
                    tests[i].expected_value,
-                   sheet->cells[0][1].value);
+                   get_cell_value(sheet, 0, 1));
             teardown(sheet);
             return 0;
         }
@@ -653,20 +641,20 @@ int test_sleep_functionality() {
         }
 
         // Verify sleep flag based on expectation
-        if (tests[i].expect_sleep && !sheet->cells[0][1].is_sleep) {
+        if (tests[i].expect_sleep && !get_cell(sheet, 0, 1)->is_sleep) {
             printf("FAIL: Sleep flag not set for %s\n", tests[i].description);
             teardown(sheet);
             return 0;
-        } else if (!tests[i].expect_sleep && sheet->cells[0][1].is_sleep) {
+        } else if (!tests[i].expect_sleep && get_cell(sheet, 0, 1)->is_sleep) {
             printf("FAIL: Sleep flag incorrectly set for %s\n", tests[i].description);
             teardown(sheet);
             return 0;
         }
         
         // Verify cell value
-        if (sheet->cells[0][1].value != tests[i].expected_value) {
+        if (get_cell_value(sheet, 0, 1) != tests[i].expected_value) {
             printf("FAIL: Incorrect value for %s\n", tests[i].description);
-            printf("Expected: %d, Got: %d\n", tests[i].expected_value, sheet->cells[0][1].value);
+            printf("Expected: %d, Got: %d\n", tests[i].expected_value, get_cell_value(sheet, 0, 1));
             teardown(sheet);
             return 0;
         }
@@ -734,16 +722,16 @@ int test_range_operations() {
         // Verify result based on test case
         switch(i) {
             case 0: // Adjacent cells
-                ASSERT(sheet->cells[0][2].value == 3, "Adjacent cells sum failed");
+                ASSERT(get_cell_value(sheet, 0, 2) == 3, "Adjacent cells sum failed");
                 break;
             case 1: // Wide range
-                ASSERT(sheet->cells[0][26].value == 27, "Wide range sum failed");
+                ASSERT(get_cell_value(sheet, 0, 26) == 27, "Wide range sum failed");
                 break;
             case 2: // Tall range
-                ASSERT(sheet->cells[0][1].value == 1, "Tall range average failed");
+                ASSERT(get_cell_value(sheet, 0, 1) == 1, "Tall range average failed");
                 break;
             case 3: // Single cell
-                ASSERT(sheet->cells[0][1].value == 1, "Single cell sum failed");
+                ASSERT(get_cell_value(sheet, 0, 1) == 1, "Single cell sum failed");
                 break;
             case 4: // Beyond limits
                 ASSERT(sheet->last_status != STATUS_OK, "Range limit check failed");
@@ -805,7 +793,7 @@ int test_combined_operations() {
         // Verify result based on test case
         switch(i) {
             case 0: // Sleep with functions
-                ASSERT(sheet->cells[0][1].is_sleep, "Sleep property not set");
+                ASSERT(get_cell(sheet, 0, 1)->is_sleep, "Sleep property not set");
                 break;
         
             case 1: // Circular with functions
@@ -865,7 +853,7 @@ int test_edge_cases() {
         }
 
         // Verify error flag is set only for runtime errors, not syntax errors
-        if (!sheet->cells[0][0].has_error &&
+        if (!get_cell_error(sheet, 0, 0) &&
             tests[i].expected_status != STATUS_OK && 
             tests[i].expected_status != ERR_SYNTAX) {
             printf("FAIL: Error flag not set for %s\n", tests[i].description);
@@ -888,6 +876,1930 @@ int test_edge_cases() {
 
 
 
+// Range formulas register once in the range index instead of on every cell
+int test_range_dependency_index() {
+    printf("Starting range dependency index test...\n");
+
+    Spreadsheet* sheet = setup_with_size(999, 1000);
+    if (!sheet) return 0;
+
+    char cmd[256];
+    strcpy(cmd, "A1=SUM(B1:ALL999)");
+    process_command(sheet, cmd);
+    ASSERT_STATUS(sheet, STATUS_OK, "Large SUM should be accepted");
+    ASSERT(depset_size(&get_cell(sheet, 500, 500)->dependents) == 0, "Range cells should not get per-cell dependents");
+
+    strcpy(cmd, "C7=5");
+    process_command(sheet, cmd);
+    strcpy(cmd, "ALL999=7");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 0, 0), 12, "SUM should follow edits inside the range");
+
+    strcpy(cmd, "B2=A1+1");
+    process_command(sheet, cmd);
+    ASSERT_STATUS(sheet, ERR_CIRCULAR_REFERENCE, "Loop through a range should be detected");
+    ASSERT_EQ(get_cell_value(sheet, 0, 0), 12, "Rejected edit should leave the SUM unchanged");
+
+    // Move the range away: edits to the old rectangle no longer matter
+    strcpy(cmd, "A1=MAX(A2:A3)");
+    process_command(sheet, cmd);
+    strcpy(cmd, "C7=100");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 0, 0), 0, "Old range should be unregistered");
+    strcpy(cmd, "A3=9");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 0, 0), 9, "New range should be registered");
+
+    strcpy(cmd, "B2=A1+1");
+    process_command(sheet, cmd);
+    ASSERT_STATUS(sheet, STATUS_OK, "Old range should not cause a false cycle");
+
+    teardown(sheet);
+    return 1;
+}
+
+// Tree nodes come from the sheet's pool and are reused after removal
+int test_node_pool() {
+    printf("Starting node pool test...\n");
+
+    Spreadsheet* sheet = setup_with_size(100, 10);
+    if (!sheet) return 0;
+
+    PoolStats stats;
+    pool_stats(&sheet->pool, &stats);
+    ASSERT(stats.live == 0 && stats.bytes == 0, "Fresh sheet should hold no nodes");
+
+    // 80 readers of A1 push its dependents set past the array size into a tree
+    char cmd[256];
+    for (int r = 1; r <= 80; r++) {
+        sprintf(cmd, "B%d=A1+1", r);
+        process_command(sheet, cmd);
+    }
+    pool_stats(&sheet->pool, &stats);
+    ASSERT(stats.live == 80, "Every reader should own one tree node");
+    size_t peak = stats.peak;
+    size_t bytes = stats.bytes;
+
+    // Dropping and re-adding edges reuses freed nodes instead of growing
+    for (int k = 0; k < 100; k++) {
+        strcpy(cmd, "B80=5");
+        process_command(sheet, cmd);
+        strcpy(cmd, "B80=A1+1");
+        process_command(sheet, cmd);
+    }
+    pool_stats(&sheet->pool, &stats);
+    ASSERT(stats.live == 80, "Live count should be back to eighty");
+    ASSERT(stats.bytes == bytes, "Pool should not grow while reusing nodes");
+    ASSERT(stats.peak >= peak, "Peak should never drop");
+
+    for (int r = 1; r <= 80; r++) {
+        sprintf(cmd, "B%d=7", r);
+        process_command(sheet, cmd);
+    }
+    pool_stats(&sheet->pool, &stats);
+    ASSERT(stats.live == 0, "Removed edges should be released to the pool");
+    ASSERT(stats.free > 0, "Released nodes should be counted as free");
+    teardown(sheet);
+
+    // The peak is the most objects live at once, not the sum of each size's peak
+    NodePool pool;
+    pool_init(&pool);
+    void* objs[10];
+    for (int k = 0; k < 10; k++) objs[k] = pool_alloc(&pool, 16);
+    for (int k = 0; k < 10; k++) pool_release(&pool, objs[k], 16);
+    for (int k = 0; k < 10; k++) objs[k] = pool_alloc(&pool, 64);
+    void* extra = pool_alloc(&pool, 16);
+    pool_stats(&pool, &stats);
+    ASSERT(stats.live == 11, "Live should count objects of every size");
+    ASSERT(stats.peak == 11, "Peaks of different sizes at different times should not add up");
+    pool_release(&pool, extra, 16);
+    for (int k = 0; k < 10; k++) pool_release(&pool, objs[k], 64);
+    pool_stats(&pool, &stats);
+    ASSERT(stats.live == 0 && stats.peak == 11, "Peak should survive releases");
+    pool_destroy(&pool);
+    return 1;
+}
+
+// Dependents sets move between inline, array and tree storage as they grow and shrink
+int test_dependents_set() {
+    printf("Starting dependents set test...\n");
+
+    NodePool pool;
+    pool_init(&pool);
+    DepSet set;
+    depset_init(&set);
+
+    // Insert in scrambled order with duplicates, check order and contents at every size
+    for (int k = 0; k < 200; k++) {
+        short r = (short)((k * 37) % 200);
+        depset_insert(&pool, &set, r, 1);
+        depset_insert(&pool, &set, r, 1);
+        ASSERT_EQ((int)depset_size(&set), k + 1, "Size should count distinct pairs");
+
+        DepSetIterator it;
+        depset_iterator_init(&it, &set);
+        int seen = 0, last = -1;
+        while (depset_iterator_has_next(&it)) {
+            Pair* p = depset_iterator_next(&it);
+            ASSERT(p->i > last, "Iteration should be sorted");
+            last = p->i;
+            seen++;
+        }
+        ASSERT_EQ(seen, k + 1, "Iteration should visit every pair");
+    }
+    ASSERT(depset_find(&set, 74, 1), "Inserted pair should be found");
+    ASSERT(!depset_find(&set, 74, 2), "Missing pair should not be found");
+
+    for (int k = 199; k >= 0; k--) {
+        short r = (short)((k * 37) % 200);
+        depset_remove(&pool, &set, r, 1);
+        depset_remove(&pool, &set, r, 1);
+        ASSERT_EQ((int)depset_size(&set), k, "Remove should drop exactly one pair");
+        ASSERT(!depset_find(&set, r, 1), "Removed pair should be gone");
+        if (k > 0) {
+            short other = (short)(((k - 1) * 37) % 200);
+            ASSERT(depset_find(&set, other, 1), "Remaining pairs should survive");
+        }
+    }
+
+    PoolStats stats;
+    pool_stats(&pool, &stats);
+    ASSERT(stats.live == 0, "Empty set should hold no pool memory");
+
+    depset_free(&pool, &set);
+    pool_destroy(&pool);
+    return 1;
+}
+
+// Cycle checks walk a grid-long reference chain without recursion
+int test_long_chain_cycle_check() {
+    printf("Starting long chain cycle check test...\n");
+
+    Spreadsheet* sheet = setup_with_size(999, 101);
+    if (!sheet) return 0;
+
+    // A1 <- A2 <- ... <- A999 <- B1 <- ... <- CV999: 99,900 links
+    char cmd[256], prev[16] = "A1", name[16], col[4];
+    for (int c = 0; c < 100; c++) {
+        colNumberToName(c, col);
+        for (int r = 1; r <= 999; r++) {
+            if (c == 0 && r == 1) continue;
+            sprintf(name, "%s%d", col, r);
+            sprintf(cmd, "%s=%s+1", name, prev);
+            process_command(sheet, cmd);
+            strcpy(prev, name);
+        }
+    }
+    ASSERT_STATUS(sheet, STATUS_OK, "Building the chain should succeed");
+    ASSERT_EQ(get_cell_value(sheet, 998, 99), 99899, "Chain tail should count every link");
+
+    sprintf(cmd, "A1=%s+1", prev);
+    process_command(sheet, cmd);
+    ASSERT_STATUS(sheet, ERR_CIRCULAR_REFERENCE, "Closing the chain should be a cycle");
+
+    // Same walk, but the new reference is outside the chain (value stays 0, no recalc)
+    strcpy(cmd, "CW1=-1");
+    process_command(sheet, cmd);
+    strcpy(cmd, "A1=CW1+1");
+    process_command(sheet, cmd);
+    ASSERT_STATUS(sheet, STATUS_OK, "Reference outside the chain is not a cycle");
+
+    // Recalculating the whole chain must not recurse
+    strcpy(cmd, "CW1=10");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 998, 99), 99910, "Chain tail should follow the new head");
+
+    teardown(sheet);
+    return 1;
+}
+
+int test_diamond_recalc() {
+    printf("Starting diamond recalculation test...\n");
+
+    Spreadsheet* sheet = setup_with_size(10, 10);
+    if (!sheet) return 0;
+    char cmd[64];
+
+    // D1 reads A1 through two paths and E1 reads all of them through a range;
+    // each must see its precedents' new values, not stale ones
+    strcpy(cmd, "A1=1");
+    process_command(sheet, cmd);
+    strcpy(cmd, "B1=A1+1");
+    process_command(sheet, cmd);
+    strcpy(cmd, "C1=A1*2");
+    process_command(sheet, cmd);
+    strcpy(cmd, "D1=B1+C1");
+    process_command(sheet, cmd);
+    strcpy(cmd, "E1=SUM(A1:D1)");
+    process_command(sheet, cmd);
+    strcpy(cmd, "F1=E1-D1");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 0, 4), 9, "E1 should be 1+2+2+4");
+
+    strcpy(cmd, "A1=10");
+    process_command(sheet, cmd);
+    ASSERT_STATUS(sheet, STATUS_OK, "Updating the source should succeed");
+    ASSERT_EQ(get_cell_value(sheet, 0, 3), 31, "D1 should be 11+20");
+    ASSERT_EQ(get_cell_value(sheet, 0, 4), 72, "E1 should be 10+11+20+31");
+    ASSERT_EQ(get_cell_value(sheet, 0, 5), 41, "F1 should be 72-31");
+
+    strcpy(cmd, "A1=0");
+    process_command(sheet, cmd);
+    strcpy(cmd, "C1=1/A1");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_error(sheet, 0, 3), true, "D1 should inherit C1's error");
+    ASSERT_EQ(get_cell_error(sheet, 0, 5), true, "F1 should inherit the error through E1");
+
+    strcpy(cmd, "A1=2");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_error(sheet, 0, 5), false, "Error should clear once the divisor is set");
+    ASSERT_EQ(get_cell_value(sheet, 0, 5), 5, "F1 should be 8-3 with C1=1/2=0");
+
+    teardown(sheet);
+    return 1;
+}
+
+// Did the last recalculation sweep reach (row, col)? The sweep marks every cell it
+// queues with the newest epoch.
+static int swept(Spreadsheet* sheet, int row, int col) {
+    return sheet->visit_mark[row * sheet->totalCols + col] == sheet->visit_epoch;
+}
+
+// Every formula sits where its topo_order says and every constant is a hole
+static int chain_consistent(Spreadsheet* sheet) {
+    for (size_t k = 0; k < sheet->calc_order.size; k++) {
+        Pair p = sheet->calc_order.data[k];
+        if (p.i >= 0 && get_topo_order(sheet, p.i, p.j) != (int)k) return 0;
+    }
+    return 1;
+}
+
+int test_calc_chain_sweep() {
+    printf("Starting calc chain sweep test...\n");
+
+    Spreadsheet* sheet = setup_with_size(30, 10);
+    if (!sheet) return 0;
+    char cmd[64];
+
+    // Twelve readers of B1 take the front of the chain, then a chain D1..D10 off A1
+    for (int r = 1; r <= 12; r++) {
+        sprintf(cmd, "C%d=B1+%d", r, r);
+        process_command(sheet, cmd);
+    }
+    strcpy(cmd, "D1=A1+1");
+    process_command(sheet, cmd);
+    for (int r = 2; r <= 10; r++) {
+        sprintf(cmd, "D%d=D%d+1", r, r - 1);
+        process_command(sheet, cmd);
+    }
+    strcpy(cmd, "E1=SUM(D1:D10)");
+    process_command(sheet, cmd);
+    ASSERT_EQ((int)sheet->calc_order.size, 23, "Every formula should be in the chain");
+    ASSERT(get_topo_order(sheet, 0, 3) > get_topo_order(sheet, 11, 2), "D1 should sit after the B1 readers");
+
+    // Repeated edits of A1 sweep from D1 on and never touch the front of the chain
+    for (int v = 1; v <= 5; v++) {
+        sprintf(cmd, "A1=%d", v * 7);
+        process_command(sheet, cmd);
+        ASSERT_EQ(get_cell_value(sheet, 9, 3), v * 7 + 10, "D10 should follow A1");
+        ASSERT_EQ(get_cell_value(sheet, 0, 4), 10 * v * 7 + 55, "E1 should sum the chain");
+        for (int r = 0; r < 10; r++)
+            ASSERT(swept(sheet, r, 3), "The sweep should reach every cell of the D chain");
+        ASSERT(swept(sheet, 0, 4), "The sweep should reach E1");
+        for (int r = 0; r < 12; r++)
+            ASSERT(!swept(sheet, r, 2), "The sweep should not touch cells before the first dirty one");
+    }
+    strcpy(cmd, "B1=100");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 11, 2), 112, "C12 should follow B1");
+    ASSERT(!swept(sheet, 0, 3) && !swept(sheet, 0, 4), "Cells later in the chain but not downstream stay clean");
+
+    // Readers turned constants leave holes until they are half the chain
+    int d1 = get_topo_order(sheet, 0, 3);
+    for (int r = 1; r <= 11; r++) {
+        sprintf(cmd, "C%d=0", r);
+        process_command(sheet, cmd);
+    }
+    ASSERT_EQ(sheet->order_holes, 11, "Holes should wait for compaction");
+    ASSERT_EQ(get_topo_order(sheet, 0, 3), d1, "Holes should not move the cells after them");
+    strcpy(cmd, "A1=1");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 0, 4), 65, "The sweep should skip holes");
+    ASSERT(!swept(sheet, 11, 2), "C12 should stay clean across the holes");
+
+    strcpy(cmd, "C12=0");
+    process_command(sheet, cmd);
+    ASSERT_EQ(sheet->order_holes, 0, "The twelfth hole should squeeze the chain");
+    ASSERT_EQ((int)sheet->calc_order.size, 11, "Only the D chain and E1 should remain");
+    ASSERT(chain_consistent(sheet), "Compaction should renumber every formula");
+    ASSERT_EQ(get_topo_order(sheet, 0, 3), 0, "D1 should move to the front");
+
+    // After compaction the sweep still runs in order from the edited cell
+    for (int v = 1; v <= 3; v++) {
+        sprintf(cmd, "A1=%d", -v);
+        process_command(sheet, cmd);
+        ASSERT_EQ(get_cell_value(sheet, 9, 3), 10 - v, "D10 should follow A1 after compaction");
+        ASSERT_EQ(get_cell_value(sheet, 0, 4), 55 - 10 * v, "E1 should follow A1 after compaction");
+    }
+    strcpy(cmd, "D5=100");
+    process_command(sheet, cmd);
+    ASSERT(!swept(sheet, 0, 3) && !swept(sheet, 3, 3), "Cells before D5 should not be swept");
+    ASSERT(swept(sheet, 5, 3) && swept(sheet, 9, 3), "Cells after D5 should be swept");
+    ASSERT_EQ(get_cell_value(sheet, 9, 3), 105, "D10 should follow D5");
+    ASSERT(chain_consistent(sheet), "The chain should stay consistent");
+
+    teardown(sheet);
+    return 1;
+}
+
+static int range_total(Spreadsheet* sheet, int r1, int c1, int r2, int c2) {
+    int total = 0;
+    for (int r = r1; r <= r2; r++)
+        for (int c = c1; c <= c2; c++)
+            total += get_cell_value(sheet, r, c);
+    return total;
+}
+
+int test_range_aggregates() {
+    printf("Starting range aggregate test...\n");
+
+    Spreadsheet* sheet = setup_with_size(999, 1000);
+    if (!sheet) return 0;
+
+    char cmd[64];
+    strcpy(cmd, "A1=SUM(B1:ALL999)");
+    process_command(sheet, cmd);
+    strcpy(cmd, "A2=AVG(B1:ALL999)");
+    process_command(sheet, cmd);
+    strcpy(cmd, "A3=STDEV(B1:B4)");
+    process_command(sheet, cmd);
+
+    // Each edit folds a delta into the aggregates instead of rescanning ~1M cells
+    char col[4];
+    for (int k = 0; k < 2000; k++) {
+        colNumberToName(1 + (k * 101) % 999, col);
+        sprintf(cmd, "%s%d=%d", col, 5 + (k * 37) % 995, k % 50 - 10);
+        process_command(sheet, cmd);
+    }
+    int expected = range_total(sheet, 0, 1, 998, 999);
+    ASSERT_EQ(get_cell_value(sheet, 0, 0), expected, "SUM should track every delta");
+    ASSERT_EQ(get_cell_value(sheet, 1, 0), expected / (999 * 999), "AVG should track every delta");
+
+    // STDEV over B1:B4 after the squares changed
+    strcpy(cmd, "B1=2");
+    process_command(sheet, cmd);
+    strcpy(cmd, "B2=4");
+    process_command(sheet, cmd);
+    strcpy(cmd, "B3=4");
+    process_command(sheet, cmd);
+    strcpy(cmd, "B4=6");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 2, 0), 1, "STDEV of 2,4,4,6 should round to 1");
+
+    // Errors are counted, so clearing one restores the aggregate value
+    strcpy(cmd, "C1=1/0");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_error(sheet, 0, 0), true, "SUM over an error should be an error");
+    strcpy(cmd, "C1=5");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_error(sheet, 0, 0), false, "Clearing the error should clear the SUM");
+    ASSERT_EQ(get_cell_value(sheet, 0, 0), range_total(sheet, 0, 1, 998, 999), "SUM should match a rescan");
+
+    // Wrapping matches a plain int accumulation
+    strcpy(cmd, "D1=2147483647");
+    process_command(sheet, cmd);
+    strcpy(cmd, "D2=10");
+    process_command(sheet, cmd);
+    strcpy(cmd, "E1=SUM(D1:D2)");
+    process_command(sheet, cmd);
+    strcpy(cmd, "D2=20");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 0, 4), (int)(2147483647u + 20u), "SUM should wrap like int");
+
+    // Moving the range rescans; the old slot is reused by the next formula
+    strcpy(cmd, "E1=SUM(B1:B2)");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 0, 4), 6, "New range should be rescanned");
+    strcpy(cmd, "E1=7");
+    process_command(sheet, cmd);
+    strcpy(cmd, "E2=SUM(B3:B4)");
+    process_command(sheet, cmd);
+    strcpy(cmd, "B3=5");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 1, 4), 11, "Reused slot should start fresh");
+
+    teardown(sheet);
+    return 1;
+}
+
+int test_range_extrema() {
+    printf("Starting range extrema test...\n");
+
+    Spreadsheet* sheet = setup_with_size(999, 30);
+    if (!sheet) return 0;
+
+    char cmd[64];
+    for (int r = 1; r <= 999; r++) {
+        sprintf(cmd, "B%d=%d", r, (r * 7919) % 1000);
+        process_command(sheet, cmd);
+        sprintf(cmd, "C%d=%d", r, -((r * 104729) % 1000));
+        process_command(sheet, cmd);
+    }
+
+    // A dashboard of readers over the same columns shares one tree per column
+    for (int r = 1; r <= 200; r++) {
+        sprintf(cmd, "D%d=MAX(B1:B999)", r);
+        process_command(sheet, cmd);
+        sprintf(cmd, "E%d=MIN(B%d:C%d)", r, r, r + 500);
+        process_command(sheet, cmd);
+    }
+    ASSERT_EQ(sheet->col_extrema[1].refs, 400, "Every reader should pin column B");
+    ASSERT_EQ(sheet->col_extrema[2].refs, 200, "Only MIN readers cover column C");
+    ASSERT_EQ(get_cell_value(sheet, 0, 3), 999, "MAX of column B");
+
+    // Overwriting the current extreme cannot be undone by a delta
+    int top = 0;
+    for (int r = 0; r < 999; r++)
+        if (get_cell_value(sheet, r, 1) == 999) top = r;
+    sprintf(cmd, "B%d=0", top + 1);
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 199, 3), 998, "MAX should fall back to the runner-up");
+
+    strcpy(cmd, "C10=-5000");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 0, 4), -5000, "MIN over B1:C501 should see C10");
+    int expected = 0;
+    for (int r = 10; r <= 510; r++)
+        for (int c = 1; c <= 2; c++)
+            if (get_cell_value(sheet, r, c) < expected) expected = get_cell_value(sheet, r, c);
+    ASSERT_EQ(get_cell_value(sheet, 10, 4), expected, "MIN over B11:C511 should not");
+
+    // Errors still win over the extremes
+    strcpy(cmd, "B500=1/0");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_error(sheet, 5, 3), true, "MAX over an error is an error");
+    strcpy(cmd, "B500=2000");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 5, 3), 2000, "MAX should see the repaired cell");
+
+    // Readers that stop being MIN/MAX release their columns
+    for (int r = 1; r <= 200; r++) {
+        sprintf(cmd, "E%d=SUM(B%d:C%d)", r, r, r + 500);
+        process_command(sheet, cmd);
+    }
+    ASSERT_EQ(sheet->col_extrema[2].refs, 0, "Column C should be released");
+    ASSERT(sheet->col_extrema[2].min == NULL, "Column C tree should be freed");
+    ASSERT_EQ(sheet->col_extrema[1].refs, 200, "MAX readers still pin column B");
+
+    teardown(sheet);
+    return 1;
+}
+
+int test_value_planes() {
+    printf("Starting value plane test...\n");
+
+    Spreadsheet* sheet = setup_with_size(5, 7);
+    if (!sheet) return 0;
+
+    char cmd[32];
+    strcpy(cmd, "C2=41");
+    process_command(sheet, cmd);
+    strcpy(cmd, "D2=C2+1");
+    process_command(sheet, cmd);
+    strcpy(cmd, "E4=1/0");
+    process_command(sheet, cmd);
+
+    // Row-major planes inside the tile, one int and one flag per cell, independent of Cell
+    Tile* tile = get_tile(sheet, 0, 0);
+    ASSERT(tile != NULL, "Writing C2 should allocate its tile");
+    ASSERT_EQ(tile->values[1 * TILE_SIZE + 2], 41, "C2 should sit at row 1, column 2");
+    ASSERT_EQ(tile->values[1 * TILE_SIZE + 3], 42, "D2 should follow C2 in the same run");
+    ASSERT_EQ(tile->errors[3 * TILE_SIZE + 4], true, "E4 should be flagged in the error plane");
+    ASSERT_EQ(get_cell_error(sheet, 1, 3), false, "D2 should not be flagged");
+
+    // Rolled-back edits restore the planes too
+    strcpy(cmd, "C2=D2");
+    process_command(sheet, cmd);
+    ASSERT_STATUS(sheet, ERR_CIRCULAR_REFERENCE, "C2=D2 should be a cycle");
+    ASSERT_EQ(get_cell_value(sheet, 1, 2), 41, "C2 should keep its value");
+    ASSERT_EQ(get_cell_value(sheet, 1, 3), 42, "D2 should keep its value");
+
+    teardown(sheet);
+    return 1;
+}
+
+int test_compact_cells() {
+    printf("Starting compact cell test...\n");
+
+    Spreadsheet* sheet = setup_with_size(50, 50);
+    if (!sheet) return 0;
+
+    // Constants carry only their dependents, flags and an empty formula index
+    ASSERT(sizeof(Cell) <= 32, "Grid cells should stay within 32 bytes");
+    char cmd[32];
+    for (int i = 0; i < 50; i++) {
+        sprintf(cmd, "A%d=%d", i + 1, i);
+        process_command(sheet, cmd);
+    }
+    ASSERT(get_formula(sheet, 0, 0) == NULL, "A constant should not own a formula slot");
+    ASSERT_EQ(sheet->formula_capacity, 0, "A sheet of constants should need no formula table");
+
+    strcpy(cmd, "B1=SUM(A1:A50)");
+    process_command(sheet, cmd);
+    strcpy(cmd, "C1=B1+1");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 0, 2), 1226, "C1 should read B1");
+    Formula* f = get_formula(sheet, 0, 1);
+    ASSERT(f != NULL, "B1 should own a formula slot");
+    CellContents b1;
+    load_cell_contents(sheet, 0, 1, &b1);
+    ASSERT_EQ(b1.dependencies.second.i, 49, "B1 should keep its rectangle in the side table");
+    ASSERT(get_topo_order(sheet, 0, 1) < get_topo_order(sheet, 0, 2), "B1 should be ordered before C1");
+
+    // A cycle from a constant cell leaves it without a slot or an order position
+    int order_size = (int)sheet->calc_order.size;
+    strcpy(cmd, "A1=C1");
+    process_command(sheet, cmd);
+    ASSERT_STATUS(sheet, ERR_CIRCULAR_REFERENCE, "A1=C1 should be a cycle");
+    ASSERT(get_formula(sheet, 0, 0) == NULL, "A1 should still be a constant");
+    ASSERT_EQ((int)sheet->calc_order.size - sheet->order_holes, order_size, "The cycle should not grow the order");
+
+    // Going back to a constant frees the slot, and the freed slot is reused
+    int slot = get_cell(sheet, 0, 1)->formula;
+    strcpy(cmd, "B1=7");
+    process_command(sheet, cmd);
+    ASSERT(get_formula(sheet, 0, 1) == NULL, "B1 should give its slot up");
+    ASSERT_EQ(get_cell_value(sheet, 0, 2), 8, "C1 should follow the new constant");
+    strcpy(cmd, "D1=C1*2");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell(sheet, 0, 3)->formula, slot, "D1 should reuse the freed slot");
+    ASSERT_EQ(get_cell_value(sheet, 0, 3), 16, "D1 should read C1");
+
+    teardown(sheet);
+    return 1;
+}
+
+int test_sparse_tiles() {
+    printf("Starting sparse tile test...\n");
+
+    // The largest sheet allocates nothing per cell up front
+    Spreadsheet* sheet = setup_with_size(999, 18278);
+    if (!sheet) return 0;
+    ASSERT_EQ(sheet->tile_rows, 16, "999 rows should need 16 tile rows");
+    ASSERT_EQ(sheet->tile_cols, 286, "18278 columns should need 286 tile columns");
+    ASSERT_EQ(sheet->tiles_used, 0, "A new sheet should have no tiles");
+    ASSERT_EQ(get_cell_value(sheet, 998, 18277), 0, "Untouched cells should read as 0");
+    ASSERT(get_formula(sheet, 500, 9000) == NULL, "Untouched cells should be constants");
+
+    char cmd[64];
+    strcpy(cmd, "ZZZ999=0");
+    process_command(sheet, cmd);
+    ASSERT_EQ(sheet->tiles_used, 0, "Writing 0 should not allocate a tile");
+
+    strcpy(cmd, "B2=5");
+    process_command(sheet, cmd);
+    strcpy(cmd, "ZZZ999=-3");
+    process_command(sheet, cmd);
+    ASSERT_EQ(sheet->tiles_used, 2, "Each written tile should be allocated once");
+
+    // Ranges spanning thousands of empty tiles
+    strcpy(cmd, "C1=SUM(A2:ZZZ999)");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 0, 2), 2, "SUM should skip empty tiles");
+    strcpy(cmd, "D1=MAX(B3:ZZZ999)");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 0, 3), 0, "Empty tiles should count as zeros for MAX");
+    strcpy(cmd, "E1=MIN(A100:ZZZ999)");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 0, 4), -3, "MIN should see the far corner");
+
+    // A reference into an empty tile allocates only the reader's tile
+    strcpy(cmd, "A70=MXA900");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 69, 0), 0, "A reference to an empty cell should read 0");
+    ASSERT_EQ(sheet->tiles_used, 4, "The reader and the read cell's dependents need tiles");
+    strcpy(cmd, "MXA900=7");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 69, 0), 7, "A70 should follow MXA900");
+    ASSERT_EQ(get_cell_value(sheet, 0, 2), 16, "SUM should follow both new values");
+
+    teardown(sheet);
+    return 1;
+}
+
+// Same error flag, and the same value unless both are errors
+static bool same_cell(Spreadsheet* a, Spreadsheet* b, int row, int col) {
+    bool err = get_cell_error(a, row, col);
+    return err == get_cell_error(b, row, col) &&
+           (err || get_cell_value(a, row, col) == get_cell_value(b, row, col));
+}
+
+int test_flat_grid() {
+    printf("Starting flat grid test...\n");
+
+    Spreadsheet* flat = create_spreadsheet_mode(200, 300, GRID_FLAT);
+    Spreadsheet* tiled = setup_with_size(200, 300);
+    if (!flat || !tiled) return 0;
+    ASSERT(flat->grid != NULL && flat->tiles == NULL, "Flat mode should map one grid");
+    ASSERT_EQ((int)(flat->grid_bytes / sizeof(Tile)), 4 * 5, "The mapping should hold every tile");
+    ASSERT(get_tile(flat, 199, 299) == flat->grid + 4 * 5 - 1, "Tiles should be found by arithmetic");
+    ASSERT_EQ(get_cell_value(flat, 150, 250), 0, "Zero-filled cells should read as 0");
+    ASSERT(get_formula(flat, 150, 250) == NULL, "Zero-filled cells should be constants");
+    ASSERT_EQ(cell_type(get_cell(flat, 150, 250)), 'C', "Zero-filled cells should read as type C");
+
+    // Both layouts must agree on everything a command sequence produces
+    const char* cmds[] = {
+        "A1=5", "BZ70=A1*3", "KN200=BZ70-A1", "C3=SUM(A4:KN200)", "D3=MAX(BM60:CA80)",
+        "E3=MIN(A4:KN200)", "F3=STDEV(A1:BZ70)", "A1=C3", "A1=-4", "BZ70=1/0",
+        "G3=AVG(BZ1:BZ200)", "BZ70=10", "KN200=7", "H3=G3+E3"
+    };
+    char cmd[64];
+    for (size_t k = 0; k < sizeof(cmds) / sizeof(cmds[0]); k++) {
+        strcpy(cmd, cmds[k]);
+        process_command(flat, cmd);
+        strcpy(cmd, cmds[k]);
+        process_command(tiled, cmd);
+        ASSERT_EQ(flat->last_status, tiled->last_status, "Both layouts should report the same status");
+    }
+    for (int i = 0; i < 200; i++)
+        for (int j = 0; j < 300; j++)
+            if (!same_cell(flat, tiled, i, j)) {
+                printf("Cell [%d,%d] differs\n", i, j);
+                ASSERT(0, "Flat and tiled sheets should match");
+            }
+    ASSERT_EQ(get_cell_value(flat, 2, 2), 17, "C3 should sum BZ70 and KN200");
+
+    free_spreadsheet(flat);
+    teardown(tiled);
+    return 1;
+}
+
+// Every cell, formula kind and order position of a must match b
+static bool same_sheet(Spreadsheet* a, Spreadsheet* b) {
+    if (a->totalRows != b->totalRows || a->totalCols != b->totalCols)
+        return false;
+    for (int i = 0; i < a->totalRows; i++)
+        for (int j = 0; j < a->totalCols; j++) {
+            const Cell* ca = get_cell(a, i, j);
+            const Cell* cb = get_cell(b, i, j);
+            if (!same_cell(a, b, i, j) || cell_type(ca) != cell_type(cb) || ca->is_sleep != cb->is_sleep ||
+                depset_size(&ca->dependents) != depset_size(&cb->dependents))
+                return false;
+            if ((get_formula(a, i, j) == NULL) != (get_formula(b, i, j) == NULL))
+                return false;
+        }
+    return true;
+}
+
+int test_snapshots() {
+    printf("Starting snapshot test...\n");
+
+    Spreadsheet* sheet = setup_with_size(100, 120);
+    if (!sheet) return 0;
+    range_sums_enable(sheet);
+    const char* cmds[] = {
+        "A1=5", "B1=A1*3", "C1=B1-A1", "D1=SUM(A1:C1)", "E1=MAX(A1:D1)", "F1=MIN(A1:E1)",
+        "A2=1/0", "B2=A2+1", "C2=STDEV(A1:B1)", "DP90=AVG(A1:C1)", "DQ100=SLEEP(0)",
+        "G1=C1", "H1=G1+G1", "B1=9", "C1=7"
+    };
+    char cmd[64];
+    for (size_t k = 0; k < sizeof(cmds) / sizeof(cmds[0]); k++) {
+        strcpy(cmd, cmds[k]);
+        process_command(sheet, cmd);
+    }
+
+    char path[64];
+    sprintf(path, "/tmp/godsheet_test_%d.snap", (int)getpid());
+    ASSERT_EQ(snapshot_save(sheet, path), 0, "Saving should succeed");
+
+    Spreadsheet* tiled = snapshot_load(path, GRID_TILED);
+    Spreadsheet* flat = snapshot_load(path, GRID_FLAT);
+    ASSERT(tiled != NULL && flat != NULL, "The snapshot should load in both layouts");
+    ASSERT(same_sheet(sheet, tiled) && same_sheet(sheet, flat), "Loaded sheets should match the original");
+    ASSERT(tiled->range_sums.enabled, "Range sums should come back on");
+    ASSERT_EQ(tiled->order_holes, 0, "Loading should compact the calculation order");
+
+    // The rebuilt graph must drive recalculation exactly like the original one
+    const char* edits[] = {"A1=2", "G1=A1", "A2=4", "D1=MIN(A1:H1)", "A1=D1"};
+    for (size_t k = 0; k < sizeof(edits) / sizeof(edits[0]); k++) {
+        Spreadsheet* all[] = {sheet, tiled, flat};
+        for (int s = 0; s < 3; s++) {
+            strcpy(cmd, edits[k]);
+            process_command(all[s], cmd);
+        }
+        ASSERT_EQ(tiled->last_status, sheet->last_status, "Loaded sheet should report the same status");
+        ASSERT(same_sheet(sheet, tiled) && same_sheet(sheet, flat), "Loaded sheets should recalculate the same");
+    }
+
+    // Loading in place swaps the contents but keeps the sheet
+    Spreadsheet* target = setup_with_size(3, 3);
+    ASSERT_EQ(snapshot_load_into(target, path), 0, "Loading in place should succeed");
+    ASSERT_EQ(target->totalCols, 120, "The snapshot's dimensions should win");
+    ASSERT_EQ(get_cell_value(target, 0, 2), 7, "C1 should come from the snapshot");
+
+    // A truncated file is rejected and leaves the sheet alone
+    FILE* fp = fopen(path, "r+b");
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    ASSERT(truncate(path, size - 8) == 0, "Truncating the snapshot should work");
+    ASSERT(snapshot_load(path, GRID_TILED) == NULL, "A truncated snapshot should be rejected");
+    ASSERT_EQ(snapshot_load_into(target, path), -1, "Loading a truncated snapshot should fail");
+    ASSERT_EQ(target->totalCols, 120, "A failed load should keep the sheet");
+    remove(path);
+    ASSERT(snapshot_load(path, GRID_TILED) == NULL, "A missing snapshot should be rejected");
+
+    teardown(target);
+    free_spreadsheet(flat);
+    free_spreadsheet(tiled);
+    teardown(sheet);
+    return 1;
+}
+
+static void write_file(const char* path, const char* text) {
+    FILE* fp = fopen(path, "w");
+    fputs(text, fp);
+    fclose(fp);
+}
+
+int test_csv_import() {
+    printf("Starting CSV import test...\n");
+
+    // Same starting formulas on both sheets; the reference gets the block cell by cell
+    Spreadsheet* sheet = setup_with_size(20, 10);
+    Spreadsheet* ref = setup_with_size(20, 10);
+    if (!sheet || !ref) return 0;
+    const char* cmds[] = {
+        "H1=MAX(A2:C5)", "H2=SUM(A2:C5)", "H3=A3+1", "B3=5", "C2=A2*2", "I1=C2+1",
+        "A5=1/0", "H4=AVG(A5:A5)", "C4=SLEEP(0)", "I2=I1+H2"
+    };
+    char cmd[128];
+    for (size_t k = 0; k < sizeof(cmds) / sizeof(cmds[0]); k++) {
+        strcpy(cmd, cmds[k]);
+        process_command(sheet, cmd);
+        strcpy(cmd, cmds[k]);
+        process_command(ref, cmd);
+    }
+    const char* block[] = {"A2=1", "B2=2", "C2=3", "A3=4", "C3=-6", "A4=7", "B4=8", "C4=9", "A5=10"};
+    for (size_t k = 0; k < sizeof(block) / sizeof(block[0]); k++) {
+        strcpy(cmd, block[k]);
+        process_command(ref, cmd);
+    }
+
+    char path[64];
+    sprintf(path, "/tmp/godsheet_test_%d.csv", (int)getpid());
+    write_file(path, "1,2,3\n4, ,-6\r\n7,8,+9\n10\n");
+    ASSERT_EQ(csv_import(sheet, path, 1, 0), STATUS_OK, "Import should succeed");
+    for (int i = 0; i < 20; i++)
+        for (int j = 0; j < 10; j++)
+            ASSERT(same_cell(sheet, ref, i, j), "Import should match assigning the cells one by one");
+    ASSERT(get_formula(sheet, 1, 2) == NULL, "C2 should now be a constant");
+    ASSERT(!get_cell(sheet, 3, 2)->is_sleep, "C4 should no longer sleep");
+    ASSERT_EQ(get_cell_value(sheet, 1, 7), 43, "H2 should see the whole block");
+    ASSERT_EQ(get_cell_value(sheet, 1, 8), 47, "I2 should follow both of its precedents");
+
+    // Bad input leaves the sheet alone
+    write_file(path, "1,2\n3,x\n");
+    ASSERT_EQ(csv_import(sheet, path, 0, 0), ERR_SYNTAX, "A non-integer field should be rejected");
+    ASSERT_EQ(get_cell_value(sheet, 0, 0), 0, "A rejected import should change nothing");
+    write_file(path, "99999999999\n");
+    ASSERT_EQ(csv_import(sheet, path, 0, 0), ERR_SYNTAX, "An out-of-range integer should be rejected");
+    write_file(path, "1,2,3\n");
+    ASSERT_EQ(csv_import(sheet, path, 0, 8), ERR_INVALID_RANGE, "A block past the last column should be rejected");
+    ASSERT_EQ(get_cell_value(sheet, 0, 8), 4, "I1 should be untouched");
+
+    // The command form with an anchor
+    sprintf(cmd, "%s at B10", path);
+    csv_import_command(sheet, cmd);
+    ASSERT_EQ(sheet->last_status, STATUS_OK, "import <file> at <cell> should succeed");
+    ASSERT_EQ(get_cell_value(sheet, 9, 3), 3, "The block should start at B10");
+    sprintf(cmd, "%s at Z99", path);
+    csv_import_command(sheet, cmd);
+    ASSERT_EQ(sheet->last_status, ERR_INVALID_CELL, "An anchor outside the sheet should be rejected");
+    remove(path);
+    ASSERT_EQ(csv_import(sheet, path, 0, 0), ERR_IO, "A missing file should be reported");
+    teardown(ref);
+    teardown(sheet);
+
+    // A block large enough to be split across the pool, read back through formulas
+    sheet = setup_with_size(999, 120);
+    strcpy(cmd, "DP1=SUM(A2:CV999)");
+    process_command(sheet, cmd);
+    strcpy(cmd, "DP2=MIN(A2:CV999)");
+    process_command(sheet, cmd);
+    range_sums_enable(sheet);
+    FILE* fp = fopen(path, "w");
+    long long total = 0;
+    for (int i = 0; i < 998; i++)
+        for (int j = 0; j < 100; j++) {
+            int v = (i * 131 + j * 7) % 20001 - 10000;
+            total += v;
+            fprintf(fp, j == 99 ? "%d\n" : "%d,", v);
+        }
+    fclose(fp);
+    threadpool_start(4, 1);
+    ASSERT_EQ(csv_import(sheet, path, 1, 0), STATUS_OK, "Large import should succeed");
+    threadpool_stop();
+    ASSERT_EQ(get_cell_value(sheet, 0, 119), (int)total, "SUM should cover every imported cell");
+    ASSERT_EQ(get_cell_value(sheet, 1, 119), -10000, "MIN should see the imported cells");
+    ASSERT_EQ(get_cell_value(sheet, 998, 99), (997 * 131 + 99 * 7) % 20001 - 10000, "Last cell should land in place");
+    remove(path);
+    teardown(sheet);
+    return 1;
+}
+
+int test_fill() {
+    printf("Starting fill test...\n");
+
+    // Each fill against the reference sheet assigning the cells one at a time
+    Spreadsheet* sheet = setup_with_size(30, 12);
+    Spreadsheet* ref = setup_with_size(30, 12);
+    if (!sheet || !ref) return 0;
+    char cmd[128];
+    for (int r = 1; r <= 30; r++) {
+        sprintf(cmd, "A%d=%d", r, r * 3 - 40);
+        process_command(sheet, cmd);
+        sprintf(cmd, "A%d=%d", r, r * 3 - 40);
+        process_command(ref, cmd);
+    }
+    strcpy(cmd, "A7=1/0");
+    process_command(sheet, cmd);
+    strcpy(cmd, "A7=1/0");
+    process_command(ref, cmd);
+    strcpy(cmd, "L1=SUM(B1:F30)");
+    process_command(sheet, cmd);
+    strcpy(cmd, "L1=SUM(B1:F30)");
+    process_command(ref, cmd);
+
+    struct { const char* region; const char* formula; int r1, c1, r2, c2; } fills[] = {
+        {"B1:B30", "A1*2", 0, 1, 29, 1},
+        {"C2:C30", "C1+B2", 1, 2, 29, 2},
+        {"D1:E27", "MAX(A1:B4)", 0, 3, 26, 4},
+        {"F1:F30", "(A1+B1)/(C1-1)+SUM(A1:A1)", 0, 5, 29, 5},
+        {"G1:H3", "5", 0, 6, 2, 7},
+        {"I3:I30", "G1", 2, 8, 29, 8},
+    };
+    for (size_t k = 0; k < sizeof(fills) / sizeof(fills[0]); k++) {
+        sprintf(cmd, "%s = %s", fills[k].region, fills[k].formula);
+        fill_command(sheet, cmd);
+        ASSERT_STATUS(sheet, STATUS_OK, "Fill should succeed");
+        for (int r = fills[k].r1; r <= fills[k].r2; r++)
+            for (int c = fills[k].c1; c <= fills[k].c2; c++) {
+                int dr = r - fills[k].r1, dc = c - fills[k].c1;
+                char lhs[8], shifted[64], *out = shifted;
+                colNumberToName(c, lhs);
+                // Move every cell reference of the formula by (dr, dc)
+                for (const char* p = fills[k].formula; *p;) {
+                    if (isupper((unsigned char)*p) && isdigit((unsigned char)p[1])) {
+                        char col[4];
+                        colNumberToName(*p - 'A' + dc, col);
+                        int row = (int)strtol(p + 1, (char**)&p, 10);
+                        out += sprintf(out, "%s%d", col, row + dr);
+                    } else {
+                        *out++ = *p++;
+                    }
+                }
+                *out = '\0';
+                sprintf(cmd, "%s%d=%s", lhs, r + 1, shifted);
+                process_command(ref, cmd);
+            }
+        ASSERT(same_sheet(sheet, ref), "Fill should match assigning the cells one by one");
+    }
+    ASSERT(get_formula(sheet, 29, 5)->template == get_formula(sheet, 0, 5)->template, "A filled column should share one template");
+    ASSERT(get_cell_error(sheet, 0, 11), "L1 should see the error filled down from A7");
+
+    // References leaving the sheet, loops and bad regions change nothing
+    fill_command(sheet, strcpy(cmd, "J1:J30=A2+1"));
+    ASSERT_STATUS(sheet, ERR_INVALID_RANGE, "A reference moved past the last row should be rejected");
+    fill_command(sheet, strcpy(cmd, "K1:L1=SUM(K2:L2)"));
+    ASSERT_STATUS(sheet, ERR_INVALID_RANGE, "A rectangle moved past the last column should be rejected");
+    fill_command(sheet, strcpy(cmd, "J2:J30=J1+1"));
+    ASSERT_STATUS(sheet, STATUS_OK, "A chain down the region is not a loop");
+    ASSERT_EQ(get_cell_value(sheet, 29, 9), 29, "The chain should recalculate in order");
+    fill_command(sheet, strcpy(cmd, "K1:K29=K2+1"));
+    ASSERT_STATUS(sheet, STATUS_OK, "A chain up the region is not a loop");
+    ASSERT_EQ(get_cell_value(sheet, 0, 10), 29, "The chain should recalculate in order");
+
+    strcpy(cmd, "J5=H5");
+    process_command(sheet, cmd);
+    int h6 = get_cell_value(sheet, 5, 7);
+    fill_command(sheet, strcpy(cmd, "H5:H7=J5+1"));
+    ASSERT_STATUS(sheet, ERR_CIRCULAR_REFERENCE, "A fill closing a loop should be rejected");
+    ASSERT_EQ(get_cell_value(sheet, 5, 7), h6, "A rejected fill should keep the old values");
+    ASSERT(get_formula(sheet, 5, 7) == NULL, "A rejected fill should keep the old contents");
+    fill_command(sheet, strcpy(cmd, "E5:E7=E5"));
+    ASSERT_STATUS(sheet, ERR_CIRCULAR_REFERENCE, "A self-reading fill should be rejected");
+    fill_command(sheet, strcpy(cmd, "B3:B1=1"));
+    ASSERT_STATUS(sheet, ERR_INVALID_RANGE, "A reversed region should be rejected");
+    fill_command(sheet, strcpy(cmd, "B1:Z99=1"));
+    ASSERT_STATUS(sheet, ERR_INVALID_CELL, "A region outside the sheet should be rejected");
+    fill_command(sheet, strcpy(cmd, "B1:B3=A1+"));
+    ASSERT_STATUS(sheet, ERR_SYNTAX, "A bad formula should be rejected");
+    fill_command(sheet, strcpy(cmd, "B1:B3"));
+    ASSERT_STATUS(sheet, ERR_SYNTAX, "A fill needs a formula");
+    for (int r = 0; r < 30; r++)
+        for (int c = 0; c < 9; c++)
+            ASSERT(same_cell(sheet, ref, r, c), "Rejected fills should change nothing");
+
+    // Inside a batch the fill waits for the commit like any other edit
+    batch_begin(sheet);
+    fill_command(sheet, strcpy(cmd, "K1:K30=A1-1"));
+    ASSERT_STATUS(sheet, STATUS_OK, "Fill inside a batch should be accepted");
+    ASSERT_EQ(batch_commit(sheet), STATUS_OK, "The batch should commit");
+    ASSERT_EQ(get_cell_value(sheet, 29, 10), 49, "K30 should be recalculated at commit");
+    teardown(ref);
+    teardown(sheet);
+
+    // A full-height block, with a range formula reading it
+    sheet = setup_with_size(999, 60);
+    strcpy(cmd, "BH1=SUM(B1:BF999)");
+    process_command(sheet, cmd);
+    for (int r = 1; r <= 999; r++) {
+        sprintf(cmd, "A%d=%d", r, r);
+        process_command(sheet, cmd);
+    }
+    fill_command(sheet, strcpy(cmd, "B1:BF999=A1+1"));
+    ASSERT_STATUS(sheet, STATUS_OK, "Large fill should succeed");
+    ASSERT_EQ(sheet->templates_used, 2, "The block should share one template");
+    ASSERT_EQ(get_cell_value(sheet, 998, 57), 1056, "BF999 should read along its row");
+    ASSERT_EQ(get_cell_value(sheet, 0, 59), 57 * 999 * 1000 / 2 + 999 * 1653, "BH1 should see the filled block");
+    teardown(sheet);
+    return 1;
+}
+
+static double seconds_since(const struct timeval* start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+int test_sleep_scheduling() {
+    printf("Starting sleep scheduling test...\n");
+
+    Spreadsheet* sheet = setup();
+    if (!sheet) return 0;
+    const char* cmds[] = {"A1=0", "B1=SLEEP(A1)", "B2=SLEEP(A1)", "B3=SLEEP(A1)", "B4=SLEEP(A1)",
+                          "C1=SLEEP(B1)", "D1=A1+1", "E1=SUM(B1:B4)+C1"};
+    char cmd[64];
+    for (size_t k = 0; k < sizeof(cmds) / sizeof(cmds[0]); k++) {
+        strcpy(cmd, cmds[k]);
+        process_command(sheet, cmd);
+        ASSERT_STATUS(sheet, STATUS_OK, "Setup should succeed");
+    }
+
+    // Four one-second sleeps side by side and one chained behind B1: two seconds, not five
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    strcpy(cmd, "A1=1");
+    process_command(sheet, cmd);
+    double elapsed = seconds_since(&start);
+    printf("Independent sleeps took %.2f seconds\n", elapsed);
+    ASSERT(elapsed >= 1.9, "C1 should wait for the sleep of B1 before its own");
+    ASSERT(elapsed < 3.0, "Independent sleeps should overlap");
+    ASSERT_EQ(get_cell_value(sheet, 0, 2), 1, "C1 should read B1");
+    ASSERT_EQ(get_cell_value(sheet, 0, 3), 2, "D1 should not wait for the sleepers");
+    ASSERT_EQ(get_cell_value(sheet, 0, 4), 5, "E1 should see every sleeper");
+
+    // Sleeping constants written in a batch all start at the commit
+    batch_begin(sheet);
+    const char* sleepers[] = {"F1=SLEEP(1)", "F2=SLEEP(1)", "F3=SLEEP(1)", "G1=F1+F3"};
+    for (size_t k = 0; k < sizeof(sleepers) / sizeof(sleepers[0]); k++) {
+        strcpy(cmd, sleepers[k]);
+        process_command(sheet, cmd);
+    }
+    gettimeofday(&start, NULL);
+    ASSERT_EQ(batch_commit(sheet), STATUS_OK, "The batch should commit");
+    elapsed = seconds_since(&start);
+    printf("Batched sleeps took %.2f seconds\n", elapsed);
+    ASSERT(elapsed >= 0.9 && elapsed < 2.0, "Batched sleeps should overlap");
+    ASSERT_EQ(get_cell_value(sheet, 0, 6), 2, "G1 should read the sleepers");
+
+    teardown(sheet);
+    return 1;
+}
+
+// What render_viewport writes, read back through a pipe
+static int render_to_string(Spreadsheet* sheet, ViewportFrame* frame, char* out, size_t size) {
+    int fds[2];
+    if (pipe(fds) != 0) return 0;
+    render_viewport(sheet, fds[1], frame);
+    close(fds[1]);
+    size_t len = 0;
+    ssize_t n;
+    while (len + 1 < size && (n = read(fds[0], out + len, size - 1 - len)) > 0)
+        len += n;
+    close(fds[0]);
+    out[len] = '\0';
+    return 1;
+}
+
+// The viewport as printf used to draw it, cell by cell
+static void printf_viewport(Spreadsheet* sheet, char* out) {
+    out += sprintf(out, "    ");
+    for (int col = sheet->scroll_col; col < sheet->scroll_col + VIEWPORT_COLS && col < sheet->totalCols; col++) {
+        char label[4];
+        colNumberToName(col, label);
+        out += sprintf(out, "%-*s", CELL_WIDTH, label);
+    }
+    out += sprintf(out, "\n");
+    for (int row = sheet->scroll_row; row < sheet->scroll_row + VIEWPORT_ROWS && row < sheet->totalRows; row++) {
+        out += sprintf(out, "%3d ", row + 1);
+        for (int col = sheet->scroll_col; col < sheet->scroll_col + VIEWPORT_COLS && col < sheet->totalCols; col++) {
+            if (get_cell_error(sheet, row, col))
+                out += sprintf(out, "%-*s", CELL_WIDTH, "ERR");
+            else
+                out += sprintf(out, "%-*d", CELL_WIDTH, get_cell_value(sheet, row, col));
+        }
+        out += sprintf(out, "\n");
+    }
+}
+
+int test_viewport_rendering() {
+    printf("Starting viewport rendering test...\n");
+
+    Spreadsheet* sheet = setup_with_size(15, 30);
+    if (!sheet) return 0;
+    char out[FRAME_BYTES + 1], expected[FRAME_BYTES + 1], cmd[64];
+    const char* cmds[] = {"A1=5", "B2=-42", "C3=1/0", "D4=A1*20000000", "J10=99", "E5=MAX(A1:B2)"};
+    for (size_t k = 0; k < sizeof(cmds) / sizeof(cmds[0]); k++) {
+        strcpy(cmd, cmds[k]);
+        process_command(sheet, cmd);
+    }
+    set_cell_value(sheet, 5, 5, INT_MIN);
+    set_cell_value(sheet, 6, 6, INT_MAX);
+
+    // Without a terminal the frame is exactly what printf drew, wherever the viewport is
+    int scrolls[][2] = {{0, 0}, {3, 2}, {10, 25}, {14, 29}};
+    for (size_t k = 0; k < sizeof(scrolls) / sizeof(scrolls[0]); k++) {
+        sheet->scroll_row = scrolls[k][0];
+        sheet->scroll_col = scrolls[k][1];
+        ASSERT(render_to_string(sheet, NULL, out, sizeof(out)), "Render should reach the pipe");
+        printf_viewport(sheet, expected);
+        ASSERT(strcmp(out, expected) == 0, "Plain frame should match the printf layout");
+    }
+
+    // A terminal is cleared and drawn in full the first time
+    ViewportFrame frame = {0};
+    sheet->scroll_row = 0;
+    sheet->scroll_col = 0;
+    render_to_string(sheet, &frame, out, sizeof(out));
+    strcpy(expected, CLEAR_SCREEN);
+    printf_viewport(sheet, expected + strlen(CLEAR_SCREEN));
+    ASSERT(strcmp(out, expected) == 0, "First terminal frame should be cleared and drawn whole");
+    ASSERT(frame.drawn && frame.rows == 10 && frame.cols == 10, "The frame should record the drawn grid");
+
+    // Then only changed cells go out, and the cursor returns below the grid
+    render_to_string(sheet, &frame, out, sizeof(out));
+    ASSERT(strcmp(out, "\033[12;1H\033[J") == 0, "An unchanged grid should only move the cursor");
+    strcpy(cmd, "C3=7");
+    process_command(sheet, cmd);
+    strcpy(cmd, "H8=1");
+    process_command(sheet, cmd);
+    render_to_string(sheet, &frame, out, sizeof(out));
+    ASSERT(strcmp(out, "\033[4;21H7       \033[9;61H1       \033[12;1H\033[J") == 0,
+           "Changed cells should be redrawn in place");
+
+    // Text wider than a column moves the rest of its row, so that row is redrawn whole
+    strcpy(cmd, "A1=6");
+    process_command(sheet, cmd);
+    render_to_string(sheet, &frame, out, sizeof(out));
+    ASSERT(strcmp(out, "\033[2;5H6       "
+                       "\033[5;1H  4 0       0       0       120000000"
+                       "0       0       0       0       0       0       \033[K"
+                       "\033[6;37H6       "
+                       "\033[12;1H\033[J") == 0,
+           "A row with wide text should be redrawn whole and cleared past its end");
+
+    // Scrolling redraws everything
+    handle_scroll(sheet, 'd');
+    render_to_string(sheet, &frame, out, sizeof(out));
+    ASSERT(strncmp(out, CLEAR_SCREEN, strlen(CLEAR_SCREEN)) == 0, "A scrolled grid should be drawn whole");
+    ASSERT(frame.scroll_col == 10, "The frame should follow the scroll");
+
+    teardown(sheet);
+    return 1;
+}
+
+// A random assignment within the top-left 12x12 cells
+static void random_command(char* cmd) {
+    char a[4], b[4], c[4];
+    colNumberToName(rand() % 12, a);
+    colNumberToName(rand() % 12, b);
+    int r = rand() % 12 + 1, r2 = rand() % 12 + 1;
+    switch (rand() % 5) {
+        case 0: sprintf(cmd, "%s%d=%d", a, r, rand() % 41 - 20); break;
+        case 1: sprintf(cmd, "%s%d=%s%d+%d", a, r, b, r2, rand() % 9); break;
+        case 2: colNumberToName(rand() % 12, c);
+                sprintf(cmd, "%s%d=%s%d*%s%d", a, r, b, r2, c, rand() % 12 + 1); break;
+        case 3: sprintf(cmd, "%s%d=%s%d/%d", a, r, b, r2, rand() % 3); break;
+        default: {
+            int lo = rand() % 12, hi = lo + rand() % (12 - lo);
+            colNumberToName(lo, b);
+            colNumberToName(hi, c);
+            sprintf(cmd, "%s%d=%s(%s%d:%s%d)", a, r, rand() % 2 ? "SUM" : "MAX", b, r2, c, r2 + rand() % (13 - r2));
+        }
+    }
+}
+
+int test_batches() {
+    printf("Starting batch test...\n");
+
+    Spreadsheet* direct = setup_with_size(20, 20);
+    Spreadsheet* batched = setup_with_size(20, 20);
+    if (!direct || !batched) return 0;
+    srand(19);
+
+    // Every edit the direct sheet accepts, replayed as one batch, lands on the same sheet
+    char cmd[64], copy[64];
+    batch_begin(batched);
+    for (int step = 0; step < 400; step++) {
+        random_command(cmd);
+        strcpy(copy, cmd);
+        process_command(direct, copy);
+        if (direct->last_status != STATUS_OK)
+            continue;
+        strcpy(copy, cmd);
+        process_command(batched, copy);
+        ASSERT_EQ(batched->last_status, STATUS_OK, "Edits inside a batch are accepted");
+    }
+    ASSERT_EQ(batch_commit(batched), STATUS_OK, "The batch should commit");
+    ASSERT(same_sheet(direct, batched), "A committed batch should match the direct edits");
+    ASSERT_EQ(batched->order_holes, 0, "Commit should leave a compact calculation order");
+    for (size_t k = 0; k < batched->calc_order.size; k++) {
+        Pair p = batched->calc_order.data[k];
+        ASSERT_EQ(get_topo_order(batched, p.i, p.j), (int)k, "Order positions should be consistent");
+    }
+
+    // Nested begins commit with the outermost one, here on the thread pool
+    threadpool_start(4, 1);
+    batch_begin(batched);
+    batch_begin(batched);
+    strcpy(cmd, "A1=1000");
+    process_command(batched, cmd);
+    ASSERT_EQ(batch_commit(batched), STATUS_OK, "The inner commit should succeed");
+    ASSERT_EQ(batched->batch.depth, 1, "The outer batch should still be open");
+    ASSERT_EQ(batch_commit(batched), STATUS_OK, "The outer commit should succeed");
+    threadpool_stop();
+    strcpy(cmd, "A1=1000");
+    process_command(direct, cmd);
+    ASSERT(same_sheet(direct, batched), "A nested batch should match the direct edit");
+    ASSERT_EQ(batch_commit(batched), ERR_SYNTAX, "Commit without begin is an error");
+
+    // A cycle anywhere in the batch rolls all of it back, including imported cells
+    char path[64];
+    sprintf(path, "/tmp/godsheet_test_%d.csv", (int)getpid());
+    write_file(path, "1,2,3\n4,5,6\n");
+    batch_begin(batched);
+    const char* edits[] = {"B2=7", "C3=SUM(A1:B2)", "A1=C3+1", "D4=A1", "E5=SLEEP(0)"};
+    for (size_t k = 0; k < sizeof(edits) / sizeof(edits[0]); k++) {
+        strcpy(cmd, edits[k]);
+        process_command(batched, cmd);
+    }
+    ASSERT_EQ(csv_import(batched, path, 0, 1), STATUS_OK, "Import inside a batch should succeed");
+    strcpy(cmd, "B2=C3");
+    process_command(batched, cmd);
+    ASSERT_EQ(batch_commit(batched), ERR_CIRCULAR_REFERENCE, "The batch should fail on its cycle");
+    ASSERT(same_sheet(direct, batched), "A failed batch should leave the sheet as it was");
+    remove(path);
+
+    // The rebuilt order still drives recalculation correctly
+    for (int step = 0; step < 100; step++) {
+        random_command(cmd);
+        strcpy(copy, cmd);
+        process_command(direct, copy);
+        strcpy(copy, cmd);
+        process_command(batched, copy);
+        ASSERT_EQ(batched->last_status, direct->last_status, "Both sheets should accept the same edits");
+    }
+    ASSERT(same_sheet(direct, batched), "Edits after a rollback should match");
+
+    // Small batches repair the order in place rather than resorting the sheet. A
+    // batch ending in an edit the direct sheet refused as a cycle fails as a whole,
+    // and its accepted edits are then replayed one by one.
+    int failures = 0;
+    srand(5);
+    for (int round = 0; round < 200; round++) {
+        char accepted[4][64];
+        int num_accepted = 0;
+        bool cyclic = false;
+        batch_begin(batched);
+        while (num_accepted < 4 && !cyclic) {
+            random_command(cmd);
+            strcpy(copy, cmd);
+            process_command(direct, copy);
+            cyclic = direct->last_status == ERR_CIRCULAR_REFERENCE;
+            if (direct->last_status != STATUS_OK && !cyclic)
+                continue;
+            if (!cyclic)
+                strcpy(accepted[num_accepted++], cmd);
+            strcpy(copy, cmd);
+            process_command(batched, copy);
+        }
+        ASSERT_EQ(batch_commit(batched), cyclic ? ERR_CIRCULAR_REFERENCE : STATUS_OK, "A small batch should fail only on its cycle");
+        ASSERT(chain_consistent(batched), "The repaired order should be consistent");
+        if (cyclic) {
+            failures++;
+            for (int k = 0; k < num_accepted; k++) {
+                strcpy(copy, accepted[k]);
+                process_command(batched, copy);
+            }
+        }
+        ASSERT(same_sheet(direct, batched), "A small batch should match its edits made directly");
+    }
+    ASSERT(failures > 0, "Some small batches should have closed a cycle");
+
+    // Snapshots wait for the commit: inside a batch the new formulas have no
+    // calculation order yet, and loading would drop the open batch
+    sprintf(path, "/tmp/godsheet_batch_%d.snap", (int)getpid());
+    ASSERT_EQ(snapshot_save(batched, path), 0, "Saving between batches should succeed");
+    batch_begin(batched);
+    strcpy(cmd, "L1=A1+1");
+    process_command(batched, cmd);
+    ASSERT_EQ(snapshot_save(batched, path), -1, "Saving inside a batch should be refused");
+    ASSERT_EQ(snapshot_load_into(batched, path), -1, "Loading inside a batch should be refused");
+    ASSERT_EQ(batched->batch.depth, 1, "A refused load should keep the batch open");
+    strcpy(cmd, "A1=3");
+    process_command(batched, cmd);
+    ASSERT_EQ(batch_commit(batched), STATUS_OK, "The batch should still commit");
+    ASSERT_EQ(get_cell_value(batched, 0, 11), 4, "L1 should see the edit made after the refused load");
+    Spreadsheet* loaded = snapshot_load(path, GRID_TILED);
+    ASSERT(loaded != NULL, "The snapshot saved between batches should load");
+    teardown(loaded);
+
+    // A script runs as one batch, and its first failing line undoes all of it
+    char script[64];
+    sprintf(script, "/tmp/godsheet_batch_%d.txt", (int)getpid());
+    batched->output_enabled = 0;
+    strcpy(cmd, "A1=3");
+    process_command(direct, cmd);
+    strcpy(cmd, "L1=A1+1");
+    process_command(direct, cmd);
+    ASSERT(same_sheet(direct, batched), "Both sheets should hold the committed batch");
+    const struct { const char* text; CalcStatus status; } scripts[] = {
+        {"A1=5\nB1=A1*2\nZZ1=1\nC1=7\n", ERR_INVALID_RANGE},
+        {"A1=5\nB1=A1+\n", ERR_SYNTAX},
+        {"A1=5\nimport /nonexistent.csv A1\n", ERR_IO},
+        {"A1=5\nload /nonexistent.snap\n", ERR_SYNTAX},
+        {"A1=5\nsave /tmp/unused.snap\n", ERR_SYNTAX},
+        {"A1=5\ncommit\nB1=1\n", ERR_SYNTAX},
+        {"A1=B1\nB1=A1\n", ERR_CIRCULAR_REFERENCE},
+    };
+    for (size_t k = 0; k < sizeof(scripts) / sizeof(scripts[0]); k++) {
+        write_file(script, scripts[k].text);
+        ASSERT_EQ(run_batch(batched, script), -1, "A failing script should report failure");
+        ASSERT_STATUS(batched, scripts[k].status, "The first failing line's status should be reported");
+        ASSERT_EQ(batched->batch.depth, 0, "A failing script should close its batch");
+        ASSERT(same_sheet(direct, batched), "A failing script should change nothing");
+    }
+    write_file(script, "begin\nA1=5\n\nB1=A1*2\ncommit\nC1=B1+1\n");
+    ASSERT_EQ(run_batch(batched, script), 0, "A good script should succeed");
+    ASSERT_STATUS(batched, STATUS_OK, "A good script should report ok");
+    ASSERT_EQ(get_cell_value(batched, 0, 2), 11, "C1 should see the whole script");
+    remove(script);
+    remove(path);
+
+    teardown(batched);
+    teardown(direct);
+    return 1;
+}
+
+int test_parser_edges() {
+    printf("Starting parser edge case test...\n");
+
+    Spreadsheet* sheet = setup_with_size(10, 10);
+    if (!sheet) return 0;
+
+    // Statuses the grammar has always given, kept by the single-pass parser
+    struct { const char* cmd; CalcStatus status; } cases[] = {
+        {"A1=5", STATUS_OK},
+        {"A1=+7", STATUS_OK},
+        {"A2=-3*-2", STATUS_OK},
+        {"A3=A1/0", STATUS_OK},
+        {"A1= 5", ERR_SYNTAX},
+        {"A1 =5", ERR_SYNTAX},
+        {"=5", ERR_SYNTAX},
+        {"A1", ERR_SYNTAX},
+        {"a1=5", ERR_SYNTAX},
+        {"K1=5", ERR_INVALID_RANGE},
+        {"A11=5", ERR_INVALID_RANGE},
+        {"A0=5", ERR_INVALID_RANGE},
+        {"ABCD1=5", ERR_INVALID_RANGE},
+        {"B1=K1", ERR_INVALID_RANGE},
+        {"B1=a1", ERR_SYNTAX},
+        {"B1=K1+1", ERR_SYNTAX},
+        {"B1=A1%2", ERR_SYNTAX},
+        {"B1=A1%2+3", ERR_SYNTAX},
+        {"B1=SUM(A1:K1)", ERR_SYNTAX},
+        {"B1=SUM(B2:A1)", ERR_SYNTAX},
+        {"B1=SUM(A1)", ERR_SYNTAX},
+        {"B1=SUM()", ERR_SYNTAX},
+        {"B1=SUM(A1:A2", ERR_SYNTAX},
+        {"B1=sum(A1:A2)", ERR_SYNTAX},
+        {"B1=SLEEP(K1)", ERR_SYNTAX},
+        {"B1=SLEEP(x)", ERR_SYNTAX},
+        {"B1=SLEEP(0)", STATUS_OK},
+        {"B1=SUM(A1:A2)junk)", STATUS_OK},
+        {"B2=MAX(A1:A2)  ", STATUS_OK},
+    };
+    char cmd[64];
+    for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+        strcpy(cmd, cases[k].cmd);
+        process_command(sheet, cmd);
+        if (sheet->last_status != cases[k].status)
+            printf("Command: %s\n", cases[k].cmd);
+        ASSERT_STATUS(sheet, cases[k].status, "Parser status should not change");
+    }
+    ASSERT_EQ(get_cell_value(sheet, 0, 0), 7, "A1=+7 should hold 7");
+    ASSERT_EQ(get_cell_value(sheet, 1, 0), 6, "Constant arithmetic should fold");
+    ASSERT(get_cell_error(sheet, 2, 0), "A3 should hold a division error");
+    ASSERT_EQ(get_cell_value(sheet, 0, 1), 13, "B1 should sum A1:A2");
+    ASSERT_EQ(get_cell_value(sheet, 1, 1), 7, "B2 should ignore its trailing spaces");
+
+    teardown(sheet);
+    return 1;
+}
+
+int test_expressions() {
+    printf("Starting compiled expression test...\n");
+
+    Spreadsheet* sheet = setup_with_size(20, 20);
+    if (!sheet) return 0;
+
+    struct { const char* cmd; CalcStatus status; } cases[] = {
+        {"A1=4", STATUS_OK},
+        {"A2=6", STATUS_OK},
+        {"A3=10", STATUS_OK},
+        {"B1=A1+A2*A3", STATUS_OK},
+        {"B2=(A1+A2)*A3", STATUS_OK},
+        {"B3=-(A1-A2)*2", STATUS_OK},
+        {"B4=SUM(A1:A3)/MAX(A1,A2,3)+1", STATUS_OK},
+        {"B5=MAX(SUM(A1:A3),A3*3)", STATUS_OK},
+        {"B6=A1+2+3", STATUS_OK},
+        {"B7=(2+3)*4", STATUS_OK},
+        {"B8=A1/(A2-6)", STATUS_OK},
+        {"B9=B8+1", STATUS_OK},
+        {"C1=AVG(A1,A2)+STDEV(A1:A3)", STATUS_OK},
+        {"C2=(A1+A2", ERR_SYNTAX},
+        {"C2=A1+", ERR_SYNTAX},
+        {"C2=A1++A2", STATUS_OK},
+        {"C3=SUM(A1:A2)+Z1", ERR_SYNTAX},
+        {"C3=SLEEP(1)+1", ERR_SYNTAX},
+        {"C3=MAX(A1)", ERR_SYNTAX},
+        {"C3=(A1 +1)*SUM(A1:A2)", ERR_SYNTAX},
+        {"C3=SUM(A1:C3)+1", ERR_CIRCULAR_REFERENCE},
+        {"A1=B1+1", ERR_CIRCULAR_REFERENCE},
+    };
+    char cmd[256];
+    for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+        strcpy(cmd, cases[k].cmd);
+        process_command(sheet, cmd);
+        if (sheet->last_status != cases[k].status)
+            printf("Command: %s\n", cases[k].cmd);
+        ASSERT_STATUS(sheet, cases[k].status, "Unexpected expression status");
+    }
+    ASSERT_EQ(get_cell_value(sheet, 0, 1), 64, "Multiplication should bind tighter");
+    ASSERT_EQ(get_cell_value(sheet, 1, 1), 100, "Parentheses should group");
+    ASSERT_EQ(get_cell_value(sheet, 2, 1), 4, "Unary minus should negate a group");
+    ASSERT_EQ(get_cell_value(sheet, 3, 1), 4, "Functions should combine in one expression");
+    ASSERT_EQ(get_cell_value(sheet, 4, 1), 30, "Function calls should nest");
+    ASSERT_EQ(get_cell_value(sheet, 5, 1), 9, "Chains of operators should parse");
+    ASSERT(get_cell(sheet, 6, 1)->type == 'C', "An expression without cells should fold");
+    ASSERT_EQ(get_cell_value(sheet, 6, 1), 20, "Folded expression value");
+    ASSERT(get_cell_error(sheet, 7, 1), "Division by zero should be an error");
+    ASSERT(get_cell_error(sheet, 8, 1), "Errors should propagate into expressions");
+    ASSERT_EQ(get_cell_value(sheet, 0, 2), 8, "AVG of a list plus STDEV of a range");
+    ASSERT_EQ(get_cell_value(sheet, 1, 2), 10, "A doubled sign should read as one");
+    ASSERT(get_cell(sheet, 0, 1)->type == 'X', "B1 should hold a compiled expression");
+    ASSERT(get_cell(sheet, 0, 0)->type == 'C' && get_cell_value(sheet, 0, 0) == 4, "A cycle should leave A1 alone");
+    ASSERT(depset_find(&get_cell(sheet, 0, 0)->dependents, 0, 1), "B1 should depend on A1");
+
+    // Recalculation through single cells and ranges
+    strcpy(cmd, "A2=1");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 0, 1), 14, "B1 after editing A2");
+    ASSERT_EQ(get_cell_value(sheet, 1, 1), 50, "B2 after editing A2");
+    ASSERT_EQ(get_cell_value(sheet, 2, 1), -6, "B3 after editing A2");
+    ASSERT_EQ(get_cell_value(sheet, 3, 1), 4, "B4 after editing A2");
+    ASSERT(!get_cell_error(sheet, 7, 1) && get_cell_value(sheet, 7, 1) == 0, "B8 should clear its error");
+    ASSERT_EQ(get_cell_value(sheet, 8, 1), 1, "B9 should follow B8");
+
+    // Nesting deeper than the value stack or the compiler allows is rejected
+    char* p = cmd + sprintf(cmd, "C4=");
+    for (int k = 0; k < 70; k++)
+        *p++ = '(';
+    p += sprintf(p, "A1");
+    for (int k = 0; k < 70; k++)
+        *p++ = ')';
+    *p = '\0';
+    process_command(sheet, cmd);
+    ASSERT_STATUS(sheet, ERR_SYNTAX, "Nesting past the limit should be rejected");
+    p = cmd + sprintf(cmd, "C4=MAX(");
+    for (int k = 0; k < 70; k++)
+        p += sprintf(p, "%sA1", k ? "," : "");
+    strcpy(p, ")");
+    process_command(sheet, cmd);
+    ASSERT_STATUS(sheet, ERR_SYNTAX, "A list deeper than the value stack should be rejected");
+
+    // Snapshots carry the programs
+    char path[64];
+    sprintf(path, "/tmp/godsheet_expr_%d.snap", (int)getpid());
+    ASSERT(snapshot_save(sheet, path) == 0, "Snapshot should save");
+    Spreadsheet* loaded = snapshot_load(path, GRID_TILED);
+    remove(path);
+    ASSERT(loaded != NULL, "Snapshot with expressions should load");
+    ASSERT(same_sheet(sheet, loaded), "Loaded sheet should match");
+    for (int which = 0; which < 2; which++) {
+        strcpy(cmd, "A3=-2");
+        process_command(which ? loaded : sheet, cmd);
+    }
+    ASSERT(same_sheet(sheet, loaded), "Both sheets should recalculate alike");
+    ASSERT_EQ(get_cell_value(loaded, 4, 1), 3, "B5 after editing A3");
+    teardown(loaded);
+
+    // A constant replaces the program and its edges; a rolled back batch restores it
+    CellContents contents;
+    load_cell_contents(sheet, 0, 1, &contents);
+    int slot = contents.op_data.expression.program;
+    strcpy(cmd, "B1=5");
+    process_command(sheet, cmd);
+    ASSERT(sheet->programs[slot].code == NULL, "The replaced program should be released");
+    ASSERT(!depset_find(&get_cell(sheet, 0, 0)->dependents, 0, 1), "B1 should no longer depend on A1");
+
+    load_cell_contents(sheet, 1, 1, &contents);
+    slot = contents.op_data.expression.program;
+    batch_begin(sheet);
+    const char* edits[] = {"B2=A1*2", "B2=MIN(A1,A3,1)", "B2=B2+0", "B2=A3-B9", "A1=B2"};
+    for (size_t k = 0; k < sizeof(edits) / sizeof(edits[0]); k++) {
+        strcpy(cmd, edits[k]);
+        process_command(sheet, cmd);
+    }
+    ASSERT(batch_commit(sheet) == ERR_CIRCULAR_REFERENCE, "The batch should close a loop");
+    load_cell_contents(sheet, 1, 1, &contents);
+    ASSERT(contents.op_data.expression.program == slot, "B2 should get its program back");
+    ASSERT_EQ(get_cell_value(sheet, 1, 1), -10, "B2 should keep its value");
+    strcpy(cmd, "A1=3");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 1, 1), -8, "The restored B2 should still recalculate");
+
+    teardown(sheet);
+    return 1;
+}
+
+int test_templates() {
+    printf("Starting formula template test...\n");
+
+    Spreadsheet* sheet = setup_with_size(200, 10);
+    if (!sheet) return 0;
+
+    // Every row of a filled column has the same shape relative to its cell
+    char cmd[128];
+    for (int r = 1; r <= 200; r++) {
+        sprintf(cmd, "A%d=%d", r, r);
+        process_command(sheet, cmd);
+        sprintf(cmd, "B%d=A%d*2", r, r);
+        process_command(sheet, cmd);
+        sprintf(cmd, "C%d=(A%d+B%d)/3-1", r, r, r);
+        process_command(sheet, cmd);
+        if (r > 1) {
+            sprintf(cmd, "D%d=SUM(A%d:B%d)", r, r - 1, r);
+            process_command(sheet, cmd);
+        }
+    }
+    ASSERT_EQ(sheet->templates_used, 3, "Each filled column should share one template");
+    for (int r = 1; r < 200; r++) {
+        ASSERT(get_formula(sheet, r, 1)->template == get_formula(sheet, 0, 1)->template, "B column should share a template");
+        ASSERT(get_formula(sheet, r, 2)->template == get_formula(sheet, 0, 2)->template, "C column should share a template");
+    }
+    ASSERT(get_formula(sheet, 0, 1)->template != get_formula(sheet, 0, 2)->template, "Different shapes should differ");
+    ASSERT_EQ(get_cell_value(sheet, 99, 2), 99, "C100 should read its own row");
+    ASSERT_EQ(get_cell_value(sheet, 199, 3), 1197, "D200 should read its own rectangle");
+
+    // Editing one precedent only touches the cells of its own row
+    strcpy(cmd, "A50=1000");
+    process_command(sheet, cmd);
+    ASSERT_EQ(get_cell_value(sheet, 49, 1), 2000, "B50 should follow A50");
+    ASSERT_EQ(get_cell_value(sheet, 49, 2), 999, "C50 should follow A50");
+    ASSERT_EQ(get_cell_value(sheet, 50, 3), 3153, "D51 should follow A50");
+    ASSERT_EQ(get_cell_value(sheet, 50, 2), 50, "C51 should not change");
+
+    // A cell leaving the family takes a template of its own; the last one frees it
+    strcpy(cmd, "B7=A7+1");
+    process_command(sheet, cmd);
+    ASSERT_EQ(sheet->templates_used, 4, "A new shape should get its own template");
+    ASSERT_EQ(get_cell_value(sheet, 6, 2), 4, "C7 should read the new B7");
+    strcpy(cmd, "B7=7");
+    process_command(sheet, cmd);
+    ASSERT_EQ(sheet->templates_used, 3, "The unused template should be released");
+    for (int r = 1; r <= 200; r++) {
+        sprintf(cmd, "C%d=0", r);
+        process_command(sheet, cmd);
+    }
+    ASSERT_EQ(sheet->templates_used, 2, "An emptied column should release its template");
+    CellContents contents;
+    load_cell_contents(sheet, 10, 1, &contents);
+    ASSERT(contents.dependencies.first.i == 10 && contents.dependencies.first.j == 0, "B11 should decode to A11");
+
+    // Edges that would leave the sheet are rejected where the formula is placed
+    strcpy(cmd, "E1=(A1+A2)*2");
+    process_command(sheet, cmd);
+    strcpy(cmd, "E200=(A200+A201)*2");
+    process_command(sheet, cmd);
+    ASSERT_STATUS(sheet, ERR_SYNTAX, "A reference past the last row should be rejected");
+    ASSERT_EQ(sheet->templates_used, 3, "The rejected formula should not intern a template");
+
+    // Snapshots write the shared program once and rebuild the same families
+    for (int r = 2; r <= 200; r++) {
+        sprintf(cmd, "E%d=(A%d+A%d)*2", r - 1, r - 1, r);
+        process_command(sheet, cmd);
+    }
+    char path[64];
+    sprintf(path, "/tmp/godsheet_tmpl_%d.snap", (int)getpid());
+    ASSERT(snapshot_save(sheet, path) == 0, "Snapshot should save");
+    Spreadsheet* loaded = snapshot_load(path, GRID_TILED);
+    remove(path);
+    ASSERT(loaded != NULL, "Snapshot with templates should load");
+    ASSERT(same_sheet(sheet, loaded), "Loaded sheet should match");
+    ASSERT_EQ(loaded->templates_used, sheet->templates_used, "Loaded sheet should have the same families");
+    for (int which = 0; which < 2; which++) {
+        strcpy(cmd, "A120=-5");
+        process_command(which ? loaded : sheet, cmd);
+    }
+    ASSERT(same_sheet(sheet, loaded), "Both sheets should recalculate alike");
+    ASSERT_EQ(get_cell_value(loaded, 118, 4), 228, "E119 after editing A120");
+    teardown(loaded);
+
+    teardown(sheet);
+    return 1;
+}
+
+int test_range_sums() {
+    printf("Starting Fenwick range sums test...\n");
+
+    const int rows = 40, cols = 40;
+    Spreadsheet* indexed = setup_with_size(rows, cols);
+    Spreadsheet* plain = setup_with_size(rows, cols);
+    if (!indexed || !plain) return 0;
+
+    range_sums_enable(indexed);
+    ASSERT(indexed->range_sums.enabled, "Range sums should be on");
+
+    // Overlapping aggregates over the top-left 30x30 block, written to the last columns
+    const char* funcs[] = {"SUM", "AVG", "STDEV", "MIN", "MAX"};
+    char cmd[64], copy[64], a[4], b[4], out[4];
+    srand(1117);
+    for (int k = 0; k < 60; k++) {
+        int r1 = rand() % 30, c1 = rand() % 30;
+        int r2 = r1 + rand() % (30 - r1), c2 = c1 + rand() % (30 - c1);
+        colNumberToName(c1, a);
+        colNumberToName(c2, b);
+        colNumberToName(30 + k % 10, out);
+        sprintf(cmd, "%s%d=%s(%s%d:%s%d)", out, k / 10 + 1, funcs[k % 5], a, r1 + 1, b, r2 + 1);
+        strcpy(copy, cmd);
+        process_command(indexed, copy);
+        strcpy(copy, cmd);
+        process_command(plain, copy);
+    }
+
+    for (int step = 0; step < 1500; step++) {
+        colNumberToName(rand() % 30, a);
+        int r = rand() % 30 + 1;
+        if (rand() % 10 == 0)
+            sprintf(cmd, "%s%d=%d/0", a, r, rand() % 5);
+        else
+            sprintf(cmd, "%s%d=%d", a, r, rand() % 2001 - 1000);
+        strcpy(copy, cmd);
+        process_command(indexed, copy);
+        strcpy(copy, cmd);
+        process_command(plain, copy);
+
+        // Toggling mid-stream must leave nothing stale behind
+        if (step == 500) range_sums_disable(indexed);
+        if (step == 900) range_sums_enable(indexed);
+
+        for (int i = 0; i < rows; i++)
+            for (int j = 30; j < cols; j++) {
+                if (!same_cell(indexed, plain, i, j)) {
+                    printf("Mismatch at [%d,%d] after %s\n", i, j, cmd);
+                    ASSERT(0, "Fenwick and scanned aggregates should agree");
+                }
+            }
+    }
+
+    teardown(indexed);
+    teardown(plain);
+    return 1;
+}
+
+int test_aggregation_kernels() {
+    printf("Starting aggregation kernel test (dispatch: %s)...\n", kernel_isa_name());
+
+    const size_t n = 1037;   // not a multiple of any vector width
+    int* values = (int*)malloc(n * sizeof(int));
+    bool* errors = (bool*)malloc(n * sizeof(bool));
+    srand(4242);
+    for (size_t i = 0; i < n; i++) {
+        values[i] = rand() % 2000001 - 1000000;
+        errors[i] = (rand() % 17 == 0);
+    }
+    values[5] = INT_MIN;
+    values[700] = INT_MAX;
+
+    const char* isas[] = {"scalar", "sse2", "avx2"};
+    RangeTotals expected;
+    for (int v = 0; v < 3; v++) {
+        RangeKernel kernel = kernel_variant(isas[v]);
+        if (!kernel) continue;
+
+        // Every prefix length, to hit each tail path
+        for (size_t len = 0; len <= n; len += (len < 70 ? 1 : 97)) {
+            RangeTotals got, want;
+            range_totals_init(&got);
+            kernel(values, errors, len, &got);
+            range_totals_init(&want);
+            kernel_range_totals_scalar(values, errors, len, &want);
+            ASSERT(got.sum == want.sum && got.sum_sq == want.sum_sq, "Sums should match the scalar kernel");
+            ASSERT(got.min_val == want.min_val && got.max_val == want.max_val, "Extremes should match");
+            ASSERT(got.errors == want.errors, "Error counts should match");
+        }
+        range_totals_init(&expected);
+        kernel(values, errors, n, &expected);
+    }
+
+    // Truncated 64-bit totals equal wrapping int accumulation
+    int sum = 0, sum_sq = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum = (int)((uint32_t)sum + (uint32_t)values[i]);
+        sum_sq = (int)((uint32_t)sum_sq + (uint32_t)values[i] * (uint32_t)values[i]);
+    }
+    ASSERT_EQ((int)(uint32_t)expected.sum, sum, "Truncated sum should wrap like int");
+    ASSERT_EQ((int)(uint32_t)expected.sum_sq, sum_sq, "Truncated squares should wrap like int");
+    ASSERT_EQ(expected.min_val, INT_MIN, "Min should see INT_MIN");
+    ASSERT_EQ(expected.max_val, INT_MAX, "Max should see INT_MAX");
+
+    free(values);
+    free(errors);
+    return 1;
+}
+
+// Build a layered sheet: row 1 holds inputs, every later row reads the row above
+// through arithmetic, divisions (some by zero) and ranges
+static void build_layered_sheet(Spreadsheet* sheet, int rows, int cols) {
+    char cmd[128], col[4], a[4], b[4];
+    for (int r = 1; r <= rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            colNumberToName(c, col);
+            colNumberToName((c + 1) % cols, a);
+            colNumberToName((c + 7) % cols, b);
+            if (r == 1)
+                sprintf(cmd, "%s1=%d", col, c % 5);
+            else if ((r + c) % 5 == 0)
+                sprintf(cmd, "%s%d=%s%d/%s%d", col, r, col, r - 1, a, r - 1);
+            else if ((r + c) % 5 == 1 && c + 1 < cols)
+                sprintf(cmd, "%s%d=SUM(%s%d:%s%d)", col, r, col, r - 1, a, r - 1);
+            else if ((r + c) % 5 == 2 && c + 7 < cols)
+                sprintf(cmd, "%s%d=MAX(%s%d:%s%d)", col, r, col, r - 1, b, r - 1);
+            else
+                sprintf(cmd, "%s%d=%s%d+%s%d", col, r, col, r - 1, b, r - 1);
+            process_command(sheet, cmd);
+        }
+    }
+}
+
+int test_parallel_recalc() {
+    printf("Starting parallel recalculation test...\n");
+
+    const int rows = 30, cols = 40;
+    Spreadsheet* parallel = setup_with_size(rows, cols);
+    Spreadsheet* serial = setup_with_size(rows, cols);
+    if (!parallel || !serial) return 0;
+
+    // Every graph goes through the pool, however small
+    threadpool_start(4, 1);
+    ASSERT_EQ(threadpool_size(), 4, "Pool should report its size");
+    build_layered_sheet(parallel, rows, cols);
+    threadpool_stop();
+    ASSERT_EQ(threadpool_size(), 1, "Stopped pool should be serial");
+    build_layered_sheet(serial, rows, cols);
+
+    char cmd[64], copy[64], col[4];
+    srand(808);
+    for (int step = 0; step < 60; step++) {
+        colNumberToName(rand() % cols, col);
+        sprintf(cmd, "%s1=%d", col, rand() % 7 - 2);
+
+        // process_command edits its input in place
+        strcpy(copy, cmd);
+        threadpool_start(4, 1);
+        process_command(parallel, copy);
+        threadpool_stop();
+        strcpy(copy, cmd);
+        process_command(serial, copy);
+
+        for (int r = 0; r < rows; r++)
+            for (int c = 0; c < cols; c++) {
+                if (!same_cell(parallel, serial, r, c)) {
+                    printf("Mismatch at [%d,%d] after %s\n", r, c, cmd);
+                    ASSERT(0, "Parallel and serial recalculation should agree");
+                }
+            }
+    }
+
+    teardown(parallel);
+    teardown(serial);
+    return 1;
+}
+
+// Random edits against a shadow model: every cell's value/error must match a from-scratch
+// evaluation, and the persistent order must put each precedent before its readers
+#define MODEL_ROWS 6
+#define MODEL_COLS 6
+
+typedef struct {
+    char kind;          // 'C' constant, 'R' reference, 'A' binary op, 'F' range function
+    int value;          // constant value
+    char op;            // '+', '-', '/'
+    int ref[2][2];      // operand cells (row, col); -1 row means "use constant"
+    int constant;
+    char func;          // 'A'..'E' as in evaluate_cell
+    int rect[4];        // r1, c1, r2, c2
+} ModelCell;
+
+static ModelCell model[MODEL_ROWS][MODEL_COLS];
+
+static void model_eval(int r, int c, int *value, bool *error, int memo_v[][MODEL_COLS], char memo_s[][MODEL_COLS]) {
+    if (memo_s[r][c]) {
+        *value = memo_v[r][c];
+        *error = memo_s[r][c] == 2;
+        return;
+    }
+    ModelCell *m = &model[r][c];
+    int v = 0;
+    bool err = false;
+    switch (m->kind) {
+    case 'C':
+        v = m->value;
+        break;
+    case 'R':
+        model_eval(m->ref[0][0], m->ref[0][1], &v, &err, memo_v, memo_s);
+        break;
+    case 'A': {
+        int lv = m->constant, rv = m->constant;
+        bool le = false, re = false;
+        if (m->ref[0][0] >= 0) model_eval(m->ref[0][0], m->ref[0][1], &lv, &le, memo_v, memo_s);
+        if (m->ref[1][0] >= 0) model_eval(m->ref[1][0], m->ref[1][1], &rv, &re, memo_v, memo_s);
+        if (le || re) { err = true; break; }
+        if (m->op == '+') v = lv + rv;
+        else if (m->op == '-') v = lv - rv;
+        else if (rv == 0) err = true;
+        else v = lv / rv;
+        break; }
+    case 'F': {
+        int sum = 0, count = 0, mn = INT_MAX, mx = INT_MIN, sq = 0;
+        for (int i = m->rect[0]; i <= m->rect[2] && !err; i++)
+            for (int j = m->rect[1]; j <= m->rect[3] && !err; j++) {
+                int dv; bool de;
+                model_eval(i, j, &dv, &de, memo_v, memo_s);
+                if (de) { err = true; break; }
+                sum += dv; sq += dv * dv; count++;
+                if (dv < mn) mn = dv;
+                if (dv > mx) mx = dv;
+            }
+        if (err) break;
+        if (m->func == 'A') v = mn;
+        else if (m->func == 'B') v = mx;
+        else if (m->func == 'C') v = sum / count;
+        else if (m->func == 'D') v = sum;
+        else if (count <= 1) v = 0;
+        else {
+            int mean = sum / count;
+            double variance = (double)((sq) - 2*sum*mean + (mean * mean)*count) / count;
+            v = (int)round(sqrt(variance));
+        }
+        break; }
+    }
+    memo_v[r][c] = v;
+    memo_s[r][c] = err ? 2 : 1;
+    *value = v;
+    *error = err;
+}
+
+int test_random_model_check() {
+    printf("Starting random model check...\n");
+
+    Spreadsheet* sheet = setup_with_size(MODEL_ROWS, MODEL_COLS);
+    if (!sheet) return 0;
+    memset(model, 0, sizeof(model));
+    for (int r = 0; r < MODEL_ROWS; r++)
+        for (int c = 0; c < MODEL_COLS; c++)
+            model[r][c].kind = 'C';
+
+    srand(290);
+    const char funcs[] = "ABCDE";
+    const char *func_names[] = {"MIN", "MAX", "AVG", "SUM", "STDEV"};
+    char cmd[256], a[16], b[16], col[4];
+
+    for (int step = 0; step < 4000; step++) {
+        int r = rand() % MODEL_ROWS, c = rand() % MODEL_COLS;
+        ModelCell next;
+        memset(&next, 0, sizeof(next));
+        colNumberToName(c, col);
+        int len = sprintf(cmd, "%s%d=", col, r + 1);
+
+        int kind = rand() % 10;
+        if (kind < 3) {
+            next.kind = 'C';
+            next.value = rand() % 19 - 9;
+            sprintf(cmd + len, "%d", next.value);
+        } else if (kind < 5) {
+            next.kind = 'R';
+            next.ref[0][0] = rand() % MODEL_ROWS; next.ref[0][1] = rand() % MODEL_COLS;
+            colNumberToName(next.ref[0][1], a);
+            sprintf(cmd + len, "%s%d", a, next.ref[0][0] + 1);
+        } else if (kind < 8) {
+            next.kind = 'A';
+            next.op = "+-/"[rand() % 3];
+            int shape = rand() % 3; // ref op ref, ref op const, const op ref
+            for (int k = 0; k < 2; k++) {
+                bool is_ref = shape == 0 || (shape == 1 && k == 0) || (shape == 2 && k == 1);
+                char *dst = k == 0 ? a : b;
+                if (is_ref) {
+                    next.ref[k][0] = rand() % MODEL_ROWS; next.ref[k][1] = rand() % MODEL_COLS;
+                    colNumberToName(next.ref[k][1], col);
+                    sprintf(dst, "%s%d", col, next.ref[k][0] + 1);
+                } else {
+                    next.ref[k][0] = -1;
+                    next.constant = rand() % 7 - 3;
+                    sprintf(dst, "%d", next.constant);
+                }
+            }
+            sprintf(cmd + len, "%s%c%s", a, next.op, b);
+        } else {
+            next.kind = 'F';
+            int f = rand() % 5;
+            next.func = funcs[f];
+            next.rect[0] = rand() % MODEL_ROWS; next.rect[2] = next.rect[0] + rand() % (MODEL_ROWS - next.rect[0]);
+            next.rect[1] = rand() % MODEL_COLS; next.rect[3] = next.rect[1] + rand() % (MODEL_COLS - next.rect[1]);
+            colNumberToName(next.rect[1], a);
+            colNumberToName(next.rect[3], b);
+            sprintf(cmd + len, "%s(%s%d:%s%d)", func_names[f], a, next.rect[0] + 1, b, next.rect[2] + 1);
+        }
+
+        process_command(sheet, cmd);
+        if (sheet->last_status == STATUS_OK)
+            model[r][c] = next;
+        else
+            ASSERT_STATUS(sheet, ERR_CIRCULAR_REFERENCE, "Generated commands are valid except for cycles");
+
+        int memo_v[MODEL_ROWS][MODEL_COLS];
+        char memo_s[MODEL_ROWS][MODEL_COLS];
+        memset(memo_s, 0, sizeof(memo_s));
+        for (int i = 0; i < MODEL_ROWS; i++) {
+            for (int j = 0; j < MODEL_COLS; j++) {
+                int v; bool e;
+                model_eval(i, j, &v, &e, memo_v, memo_s);
+                int got_v = get_cell_value(sheet, i, j);
+                bool got_e = get_cell_error(sheet, i, j);
+                if (got_e != e || (!e && got_v != v)) {
+                    printf("Step %d (%s): cell [%d,%d] expected %d/%d got %d/%d\n",
+                           step, cmd, i, j, v, e, got_v, got_e);
+                    ASSERT(0, "Sheet should match the model");
+                }
+            }
+        }
+
+        // Persistent order: positions consistent, precedents before readers
+        for (size_t k = 0; k < sheet->calc_order.size; k++) {
+            Pair p = sheet->calc_order.data[k];
+            if (p.i < 0)
+                continue;   // hole left by a cell that went back to a constant
+            ASSERT_EQ(get_topo_order(sheet, p.i, p.j), (int)k, "Order position should round-trip");
+        }
+        for (int i = 0; i < MODEL_ROWS; i++) {
+            for (int j = 0; j < MODEL_COLS; j++) {
+                ModelCell *m = &model[i][j];
+                int pos = get_topo_order(sheet, i, j);
+                ASSERT((m->kind == 'C') == (get_formula(sheet, i, j) == NULL), "Only formula cells should own a formula slot");
+                ASSERT(m->kind == 'C' || pos >= 0, "Every formula should have an order position");
+                for (int pi = 0; pi < MODEL_ROWS; pi++) {
+                    for (int pj = 0; pj < MODEL_COLS; pj++) {
+                        bool reads = (m->kind == 'F' && m->rect[0] <= pi && pi <= m->rect[2] && m->rect[1] <= pj && pj <= m->rect[3]) ||
+                                     ((m->kind == 'R' || m->kind == 'A') && m->ref[0][0] == pi && m->ref[0][1] == pj) ||
+                                     (m->kind == 'A' && m->ref[1][0] == pi && m->ref[1][1] == pj);
+                        int ppos = get_topo_order(sheet, pi, pj);
+                        if (reads && ppos >= 0)
+                            ASSERT(pos > ppos, "Precedent should come before its reader");
+                    }
+                }
+            }
+        }
+    }
+
+    teardown(sheet);
+    return 1;
+}
+
+
+
 int main() {
     printf("Starting tests...\n\n");
     
@@ -908,6 +2820,31 @@ int main() {
         {"Range Operations", test_range_operations},
         {"Combined Operations", test_combined_operations},
         {"Edge Cases", test_edge_cases},
+        {"Range Dependency Index", test_range_dependency_index},
+        {"Node Pool", test_node_pool},
+        {"Dependents Set", test_dependents_set},
+        {"Long Chain Cycle Check", test_long_chain_cycle_check},
+        {"Random Model Check", test_random_model_check},
+        {"Diamond Recalculation", test_diamond_recalc},
+        {"Calc Chain Sweep", test_calc_chain_sweep},
+        {"Parallel Recalculation", test_parallel_recalc},
+        {"Range Aggregates", test_range_aggregates},
+        {"Range Extrema", test_range_extrema},
+        {"Range Sums", test_range_sums},
+        {"Aggregation Kernels", test_aggregation_kernels},
+        {"Value Planes", test_value_planes},
+        {"Compact Cells", test_compact_cells},
+        {"Sparse Tiles", test_sparse_tiles},
+        {"Flat Grid", test_flat_grid},
+        {"Snapshots", test_snapshots},
+        {"CSV Import", test_csv_import},
+        {"Batches", test_batches},
+        {"Parser Edge Cases", test_parser_edges},
+        {"Compiled Expressions", test_expressions},
+        {"Formula Templates", test_templates},
+        {"Fill", test_fill},
+        {"Sleep Scheduling", test_sleep_scheduling},
+        {"Viewport Rendering", test_viewport_rendering},
 
 
 